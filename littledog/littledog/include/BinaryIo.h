@@ -0,0 +1,42 @@
+#ifndef BINARY_IO_H
+#define BINARY_IO_H
+
+#include <istream>
+#include <ostream>
+#include <vector>
+#include <stdint.h>
+#include <cv.h>
+
+//=================================================================================================
+// Building blocks of the binary cache files (.key, .col, .wrd, .dic, .voc):
+//   header   four character tag, format version and a byte order mark
+//   section  byte count (uint64), the bytes, CRC-32 of the bytes (uint32)
+//   matrix   a section holding rows, cols and type followed by a section with the elements
+// Every section is read and written with a single stream call. A read fails (rather than
+// returning garbage) when the file is truncated, has another tag or version, was written with
+// the other byte order or a checksum does not match, so callers can regenerate the file.
+//=================================================================================================
+class CBinaryIo
+{
+  public:
+    // CRC-32 (zip/PNG polynomial) of Bytes bytes. Pass the previous result as Crc to continue a
+    // checksum over several buffers.
+    static uint32_t Crc32(const void* pData, size_t Bytes, uint32_t Crc = 0);
+
+    static bool WriteHeader(std::ostream& Os, const char* pTag, uint32_t Version);
+    static bool ReadHeader(std::istream& Is, const char* pTag, uint32_t Version);
+
+    static bool WriteSection(std::ostream& Os, const void* pData, uint64_t Bytes);
+
+    // Read a section of exactly Bytes bytes into pData
+    static bool ReadSection(std::istream& Is, void* pData, uint64_t Bytes);
+
+    // Read a section of any size
+    static bool ReadSection(std::istream& Is, std::vector<char>& Data);
+
+    static bool WriteMat(std::ostream& Os, const cv::Mat& Matrix);
+
+    // Fails unless the stored matrix is of Type (and has Cols columns when Cols >= 0)
+    static bool ReadMat(std::istream& Is, cv::Mat& Matrix, int Type, int Cols = -1);
+};
+#endif //end #ifndef BINARY_IO_H
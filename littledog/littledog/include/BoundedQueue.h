@@ -0,0 +1,161 @@
+#ifndef BOUNDED_QUEUE_H
+#define BOUNDED_QUEUE_H
+
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+//=================================================================================================
+// First in first out queue between the threads of two pipeline stages. Push blocks while the
+// queue holds Capacity items and Pop blocks while it is empty, so a fast stage cannot run ahead
+// of a slow one by more than Capacity items (bounding memory).
+//
+// Close is called once every producer is done: consumers drain the remaining items and then Pop
+// returns false. Abort also drops the queued items and wakes everybody (used on errors).
+//
+// The time threads spend blocked in Push (output stalls) and Pop (input stalls) is accumulated,
+// as is the occupancy seen by every Push, to show which stage limits the pipeline.
+//=================================================================================================
+template <class T>
+class CBoundedQueue
+{
+  public:
+    CBoundedQueue(size_t Capacity)
+     : mCapacity((Capacity > 0) ? Capacity : 1),
+       mClosed(false),
+       mPushCount(0),
+       mOccupancySum(0),
+       mMaxOccupancy(0),
+       mPushStall(0),
+       mPopStall(0)
+    {
+    }
+
+    // Returns false (dropping Item) when the queue was closed or aborted
+    bool Push(const T& Item)
+    {
+      std::unique_lock<std::mutex> Lock(mMutex);
+
+      if (!mClosed && (mItems.size() >= mCapacity))
+      {
+        const std::chrono::steady_clock::time_point Start = std::chrono::steady_clock::now();
+        while (!mClosed && (mItems.size() >= mCapacity))
+        {
+          mNotFull.wait(Lock);
+        }
+        mPushStall += GetSecondsSince(Start);
+      }
+
+      if (mClosed) return false;
+
+      mItems.push_back(Item);
+      mPushCount++;
+      mOccupancySum += mItems.size();
+      if (mItems.size() > mMaxOccupancy) mMaxOccupancy = mItems.size();
+
+      mNotEmpty.notify_one();
+      return true;
+    }
+
+    // Returns false once the queue is closed and empty (or aborted)
+    bool Pop(T& Item)
+    {
+      std::unique_lock<std::mutex> Lock(mMutex);
+
+      if (!mClosed && mItems.empty())
+      {
+        const std::chrono::steady_clock::time_point Start = std::chrono::steady_clock::now();
+        while (!mClosed && mItems.empty())
+        {
+          mNotEmpty.wait(Lock);
+        }
+        mPopStall += GetSecondsSince(Start);
+      }
+
+      if (mItems.empty()) return false;
+
+      Item = mItems.front();
+      mItems.pop_front();
+
+      mNotFull.notify_one();
+      return true;
+    }
+
+    // No more items will be pushed
+    void Close()
+    {
+      std::lock_guard<std::mutex> Lock(mMutex);
+      mClosed = true;
+      mNotEmpty.notify_all();
+      mNotFull.notify_all();
+    }
+
+    // Close and drop whatever has not been popped yet
+    void Abort()
+    {
+      std::lock_guard<std::mutex> Lock(mMutex);
+      mClosed = true;
+      mItems.clear();
+      mNotEmpty.notify_all();
+      mNotFull.notify_all();
+    }
+
+    size_t GetCapacity() const
+    {
+      return mCapacity;
+    }
+
+    size_t GetPushCount() const
+    {
+      std::lock_guard<std::mutex> Lock(mMutex);
+      return mPushCount;
+    }
+
+    // Mean and largest number of queued items right after a push
+    double GetMeanOccupancy() const
+    {
+      std::lock_guard<std::mutex> Lock(mMutex);
+      return (mPushCount > 0) ? (double)mOccupancySum/mPushCount : 0.0;
+    }
+
+    size_t GetMaxOccupancy() const
+    {
+      std::lock_guard<std::mutex> Lock(mMutex);
+      return mMaxOccupancy;
+    }
+
+    // Seconds spent blocked in Push and Pop (summed over all threads)
+    double GetPushStall() const
+    {
+      std::lock_guard<std::mutex> Lock(mMutex);
+      return mPushStall;
+    }
+
+    double GetPopStall() const
+    {
+      std::lock_guard<std::mutex> Lock(mMutex);
+      return mPopStall;
+    }
+
+  private:
+    static double GetSecondsSince(const std::chrono::steady_clock::time_point& Start)
+    {
+      return std::chrono::duration<double>(std::chrono::steady_clock::now() - Start).count();
+    }
+
+    mutable std::mutex mMutex;
+    std::condition_variable mNotEmpty;
+    std::condition_variable mNotFull;
+    std::deque<T> mItems;
+
+    size_t mCapacity;
+    bool mClosed;
+
+    size_t mPushCount;
+    size_t mOccupancySum;
+    size_t mMaxOccupancy;
+    double mPushStall;
+    double mPopStall;
+};
+#endif //end #ifndef BOUNDED_QUEUE_H
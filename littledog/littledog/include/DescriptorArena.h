@@ -0,0 +1,56 @@
+#ifndef DESCRIPTOR_ARENA_H
+#define DESCRIPTOR_ARENA_H
+
+#include <vector>
+#include <cv.h>
+
+//=================================================================================================
+// One contiguous block of descriptors shared by many owners (e.g. every entry in a database).
+//
+// The descriptors are a single continuous matrix whose first row starts on an Alignment byte
+// boundary. Block i is a row range of that matrix; GetBlock returns a view (no copy) that keeps
+// the memory alive through the usual cv::Mat reference counting, so views stay valid after the
+// arena is released or reallocated.
+//=================================================================================================
+class CDescriptorArena
+{
+  public:
+    enum
+    {
+      Alignment = 64 // Bytes (cache line and widest SIMD load)
+    };
+
+    CDescriptorArena();
+    ~CDescriptorArena();
+
+    // Allocate one block per element of BlockRows (rows in each block) of Cols x Type
+    // descriptors. Previous contents are released. The memory is not initialized.
+    bool Allocate(const std::vector<int>& BlockRows, int Cols, int Type);
+
+    // Use Descriptors (continuous, e.g. a memory mapped CFeatureStore block) as the arena
+    // without copying. Descriptors must hold exactly the rows of BlockRows; memory that is not
+    // reference counted must outlive the arena and its views.
+    bool Adopt(const cv::Mat& Descriptors, const std::vector<int>& BlockRows);
+
+    void Release();
+
+    bool IsEmpty() const;
+    int GetBlockCount() const;
+    int GetRowCount() const;
+
+    // First row of block i (GetBlockOffset(GetBlockCount()) is the row count)
+    int GetBlockOffset(int i) const;
+
+    // View of the rows of block i
+    cv::Mat GetBlock(int i) const;
+
+    // Every descriptor (continuous, Alignment aligned)
+    const cv::Mat& GetDescriptors() const;
+
+  private:
+    cv::Mat mDescriptors;
+
+    // Row offset of each block plus the total row count at the end
+    std::vector<int> mOffsets;
+};
+#endif //end #ifndef DESCRIPTOR_ARENA_H
@@ -0,0 +1,37 @@
+#ifndef DESCRIPTOR_CODEC_H
+#define DESCRIPTOR_CODEC_H
+
+#include <stdint.h>
+#include <cv.h>
+
+//=================================================================================================
+// Conversion between fp32 descriptors and the compact storage formats:
+//   CV_32F  plain floats
+//   CV_16U  IEEE half precision floats (raw bits, OpenCV 2.4 has no half type)
+//   CV_8S   int8 with a per dimension scale (value = code*Scale[k]); Scale is 1 x cols CV_32F
+// Compact descriptors are decoded one row (or block of rows) at a time into fp32 so that
+// distance computations always accumulate in fp32.
+//=================================================================================================
+class CDescriptorCodec
+{
+  public:
+    // Encode fp32 descriptors (Des32) as Type. Scale is only filled in for CV_8S.
+    static bool Encode(const cv::Mat& Des32, int Type, cv::Mat& Des, cv::Mat& Scale);
+
+    // Decode a whole matrix into fp32
+    static void Decode(const cv::Mat& Des, const cv::Mat& Scale, cv::Mat& Des32);
+
+    // Decode row Row into pOut (Des.cols floats)
+    static void DecodeRow(const cv::Mat& Des, const cv::Mat& Scale, int Row, float* pOut);
+
+    // Returns a pointer to row Row as fp32: the row itself for CV_32F, otherwise the row is
+    // decoded into pBuffer (Des.cols floats) and pBuffer is returned
+    static const float* GetRow(const cv::Mat& Des, const cv::Mat& Scale, int Row, float* pBuffer);
+
+    // True when Des is in one of the supported formats (with a valid Scale for CV_8S)
+    static bool IsSupported(const cv::Mat& Des, const cv::Mat& Scale);
+
+    static float HalfToFloat(uint16_t Half);
+    static uint16_t FloatToHalf(float Value);
+};
+#endif //end #ifndef DESCRIPTOR_CODEC_H
@@ -0,0 +1,331 @@
+#ifndef DISTANCE_KERNELS_H
+#define DISTANCE_KERNELS_H
+
+#include <cfloat>
+#include <stdint.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+//=================================================================================================
+// Squared Euclidean distance kernels and the exact nearest word search, shared by
+// WordQuantizer.cpp (baseline instruction set) and WordQuantizerAvx2.cpp (built with -mavx2
+// -mfma, used when the processor supports it, see CAvx2Kernels).
+//
+// Everything here is static, so each file gets its own copy compiled for its instruction set.
+// The code must not call inline functions with external linkage (e.g. std::min or cv::Mat
+// members): the linker keeps a single copy of those, which could be the AVX2 one.
+//=================================================================================================
+
+//=================================================================================================
+// Description:
+//  Distance kernels. Length is a compile time constant for the SURF descriptor sizes so the
+//  loops are fully unrolled; the generic version handles any other descriptor length.
+//=================================================================================================
+#if defined(__AVX2__)
+
+static inline float HorizontalSum(__m256 Sum)
+{
+  __m128 Lo = _mm256_castps256_ps128(Sum);
+  __m128 Hi = _mm256_extractf128_ps(Sum, 1);
+  Lo = _mm_add_ps(Lo, Hi);
+  Lo = _mm_add_ps(Lo, _mm_movehl_ps(Lo, Lo));
+  Lo = _mm_add_ss(Lo, _mm_shuffle_ps(Lo, Lo, 0x55));
+  return _mm_cvtss_f32(Lo);
+}
+
+static inline __m256 AccumulateSquare(__m256 Sum, __m256 Diff)
+{
+#if defined(__FMA__)
+  return _mm256_fmadd_ps(Diff, Diff, Sum);
+#else
+  return _mm256_add_ps(Sum, _mm256_mul_ps(Diff, Diff));
+#endif
+}
+
+template <int Length>
+static inline float SquaredDistanceFixed(const float* pA, const float* pB)
+{
+  // Two accumulators hide the add latency
+  __m256 Sum0 = _mm256_setzero_ps();
+  __m256 Sum1 = _mm256_setzero_ps();
+
+  for (int i = 0; i < Length; i += 16)
+  {
+    __m256 Diff0 = _mm256_sub_ps(_mm256_loadu_ps(pA+i),   _mm256_loadu_ps(pB+i));
+    __m256 Diff1 = _mm256_sub_ps(_mm256_loadu_ps(pA+i+8), _mm256_loadu_ps(pB+i+8));
+    Sum0 = AccumulateSquare(Sum0, Diff0);
+    Sum1 = AccumulateSquare(Sum1, Diff1);
+  }
+  return HorizontalSum(_mm256_add_ps(Sum0, Sum1));
+}
+
+static inline float SquaredDistanceGeneric(const float* pA, const float* pB, int Length)
+{
+  __m256 Sum = _mm256_setzero_ps();
+  int i = 0;
+
+  for (; i + 8 <= Length; i += 8)
+  {
+    Sum = AccumulateSquare(Sum, _mm256_sub_ps(_mm256_loadu_ps(pA+i), _mm256_loadu_ps(pB+i)));
+  }
+
+  float Dist = HorizontalSum(Sum);
+  for (; i < Length; i++)
+  {
+    const float Diff = pA[i] - pB[i];
+    Dist += Diff*Diff;
+  }
+  return Dist;
+}
+
+#elif defined(__SSE2__)
+
+static inline float HorizontalSum(__m128 Sum)
+{
+  Sum = _mm_add_ps(Sum, _mm_movehl_ps(Sum, Sum));
+  Sum = _mm_add_ss(Sum, _mm_shuffle_ps(Sum, Sum, 0x55));
+  return _mm_cvtss_f32(Sum);
+}
+
+template <int Length>
+static inline float SquaredDistanceFixed(const float* pA, const float* pB)
+{
+  __m128 Sum0 = _mm_setzero_ps();
+  __m128 Sum1 = _mm_setzero_ps();
+
+  for (int i = 0; i < Length; i += 8)
+  {
+    __m128 Diff0 = _mm_sub_ps(_mm_loadu_ps(pA+i),   _mm_loadu_ps(pB+i));
+    __m128 Diff1 = _mm_sub_ps(_mm_loadu_ps(pA+i+4), _mm_loadu_ps(pB+i+4));
+    Sum0 = _mm_add_ps(Sum0, _mm_mul_ps(Diff0, Diff0));
+    Sum1 = _mm_add_ps(Sum1, _mm_mul_ps(Diff1, Diff1));
+  }
+  return HorizontalSum(_mm_add_ps(Sum0, Sum1));
+}
+
+static inline float SquaredDistanceGeneric(const float* pA, const float* pB, int Length)
+{
+  __m128 Sum = _mm_setzero_ps();
+  int i = 0;
+
+  for (; i + 4 <= Length; i += 4)
+  {
+    __m128 Diff = _mm_sub_ps(_mm_loadu_ps(pA+i), _mm_loadu_ps(pB+i));
+    Sum = _mm_add_ps(Sum, _mm_mul_ps(Diff, Diff));
+  }
+
+  float Dist = HorizontalSum(Sum);
+  for (; i < Length; i++)
+  {
+    const float Diff = pA[i] - pB[i];
+    Dist += Diff*Diff;
+  }
+  return Dist;
+}
+
+#else
+
+static inline float SquaredDistanceGeneric(const float* pA, const float* pB, int Length)
+{
+  // Four independent partial sums so the compiler can pipeline the loop
+  float Sum0 = 0;
+  float Sum1 = 0;
+  float Sum2 = 0;
+  float Sum3 = 0;
+  int i = 0;
+
+  for (; i + 4 <= Length; i += 4)
+  {
+    const float Diff0 = pA[i]   - pB[i];
+    const float Diff1 = pA[i+1] - pB[i+1];
+    const float Diff2 = pA[i+2] - pB[i+2];
+    const float Diff3 = pA[i+3] - pB[i+3];
+    Sum0 += Diff0*Diff0;
+    Sum1 += Diff1*Diff1;
+    Sum2 += Diff2*Diff2;
+    Sum3 += Diff3*Diff3;
+  }
+
+  for (; i < Length; i++)
+  {
+    const float Diff = pA[i] - pB[i];
+    Sum0 += Diff*Diff;
+  }
+  return (Sum0 + Sum1) + (Sum2 + Sum3);
+}
+
+template <int Length>
+static inline float SquaredDistanceFixed(const float* pA, const float* pB)
+{
+  return SquaredDistanceGeneric(pA, pB, Length);
+}
+
+#endif
+
+//=================================================================================================
+// Description:
+//  Partial distance search. Distances are accumulated in blocks of 16 dimensions and a word is
+//  abandoned as soon as its partial sum reaches the best distance found so far. Length is the
+//  compile time descriptor length (0 = use RuntimeLength). Dims receives the number of
+//  dimensions that were evaluated.
+//
+//  The SURF lengths (64 and 128) use the unrolled kernel over the whole descriptor instead: the
+//  horizontal sum and branch of every block cost more than abandoning words saves (word search
+//  over 1000 words, AVX2 and SSE2 builds: about 1.5x to 3x faster for uniform descriptors, equal
+//  or faster for descriptors close to a word).
+//=================================================================================================
+const int PartialDistanceBlock = 16;
+
+template <int Length>
+static inline float BoundedDistance(
+  const float* pA, const float* pB, int RuntimeLength, float Bound, int& Dims)
+{
+  Dims = Length;
+  return SquaredDistanceFixed<Length>(pA, pB);
+}
+
+template <>
+inline float BoundedDistance<0>(
+  const float* pA, const float* pB, int RuntimeLength, float Bound, int& Dims)
+{
+  const int DesLength = RuntimeLength;
+  float Sum = 0;
+
+  for (int i = 0; i < DesLength; i += PartialDistanceBlock)
+  {
+    const int End = (i + PartialDistanceBlock < DesLength) ? i + PartialDistanceBlock : DesLength;
+    Sum += SquaredDistanceGeneric(pA+i, pB+i, End - i);
+
+    if (Sum >= Bound)
+    {
+      Dims = End;
+      return Sum;
+    }
+  }
+
+  Dims = DesLength;
+  return Sum;
+}
+
+//=================================================================================================
+// Everything an exact word search needs. The centroid tables are 0 when they are not available.
+//=================================================================================================
+struct SWordSearch
+{
+  const float* mpWords;
+  int mWordCount;
+  int mLength;
+
+  // Squared distance between every pair of words (mWordCount x mWordCount)
+  const float* mpPairDist;
+
+  // Squared half distance from each word to its closest other word
+  const float* mpHalfMinDist;
+};
+
+//=================================================================================================
+// Description:
+//  Nearest word using partial distances and triangle inequality bounds. The Hint word (e.g. the
+//  word of the previous descriptor, neighboring key points often share a word) is evaluated
+//  first so the bounds are tight from the start. With b the best word so far and x the
+//  descriptor:
+//   - if d(x,b) <= d(b,c)/2 for the closest other word c then b is the nearest word (Hamerly)
+//   - a word j with d(b,j) >= 2*d(x,b) cannot be closer than b (Elkan)
+//  Both tests are done on squared distances, so they are exact up to the float rounding of the
+//  distances: a word that would win only by a rounding error may be skipped. DimsEvaluated is
+//  incremented by the dimensions actually evaluated.
+//=================================================================================================
+template <int Length>
+static int FindNearestPruned(
+  const float* pDes,
+  const SWordSearch& Search,
+  int Hint,
+  uint64_t& DimsEvaluated)
+{
+  const int DesLength = Length ? Length : Search.mLength;
+  const int WordCount = Search.mWordCount;
+  const float* pWords = Search.mpWords;
+  const int First = ((Hint >= 0) && (Hint < WordCount)) ? Hint : 0;
+  int Dims = 0;
+
+  float SmallestNorm =
+    BoundedDistance<Length>(pDes, pWords + First*DesLength, DesLength, FLT_MAX, Dims);
+  int SmallestNormIndex = First;
+  DimsEvaluated += Dims;
+
+  if (Search.mpHalfMinDist && (SmallestNorm <= Search.mpHalfMinDist[First]))
+  {
+    return First;
+  }
+
+  const float* pPairDist = Search.mpPairDist ? Search.mpPairDist + First*WordCount : 0;
+
+  for (int j = 0; j < WordCount; j++)
+  {
+    if (j == First) continue;
+
+    if (pPairDist && (pPairDist[j] >= 4.0f*SmallestNorm)) continue;
+
+    const float Norm =
+      BoundedDistance<Length>(pDes, pWords + j*DesLength, DesLength, SmallestNorm, Dims);
+    DimsEvaluated += Dims;
+
+    if (Norm < SmallestNorm)
+    {
+      SmallestNorm = Norm;
+      SmallestNormIndex = j;
+
+      if (Search.mpPairDist) pPairDist = Search.mpPairDist + j*WordCount;
+    }
+  }
+  return SmallestNormIndex;
+}
+
+//=================================================================================================
+//=================================================================================================
+static inline float SquaredDistanceKernel(const float* pA, const float* pB, int Length)
+{
+  switch (Length)
+  {
+    case 64:  return SquaredDistanceFixed<64>(pA, pB);
+    case 128: return SquaredDistanceFixed<128>(pA, pB);
+    default:  return SquaredDistanceGeneric(pA, pB, Length);
+  }
+}
+
+//=================================================================================================
+//=================================================================================================
+static inline int FindNearestPrunedKernel(
+  const float* pDes,
+  const SWordSearch& Search,
+  int Hint,
+  uint64_t& DimsEvaluated)
+{
+  switch (Search.mLength)
+  {
+    case 64:  return FindNearestPruned<64>(pDes, Search, Hint, DimsEvaluated);
+    case 128: return FindNearestPruned<128>(pDes, Search, Hint, DimsEvaluated);
+    default:  return FindNearestPruned<0>(pDes, Search, Hint, DimsEvaluated);
+  }
+}
+
+//=================================================================================================
+// The kernels above compiled for AVX2 and FMA (WordQuantizerAvx2.cpp)
+//=================================================================================================
+class CAvx2Kernels
+{
+  public:
+    // True when the kernels were built for AVX2 and the processor supports AVX2 and FMA
+    static bool IsAvailable();
+
+    static float SquaredDistance(const float* pA, const float* pB, int Length);
+
+    static int FindNearestWord(
+      const float* pDes,
+      const SWordSearch& Search,
+      int Hint,
+      uint64_t& DimsEvaluated);
+};
+#endif //end #ifndef DISTANCE_KERNELS_H
@@ -0,0 +1,97 @@
+#ifndef FEATURE_STORE_H
+#define FEATURE_STORE_H
+
+#include <vector>
+#include <string>
+#include <map>
+#include <stdint.h>
+#include <cv.h>
+
+class CRecognitionEntry;
+
+//=================================================================================================
+// Features of every entry of a database in a single file, read through a memory mapping.
+//
+// Layout (native byte order, every section starts on an Alignment byte boundary):
+//   header       magic, version, descriptor format, section offsets, checksums
+//   entries      first descriptor row, row count, image size and name of every entry
+//   names        entry names (not terminated)
+//   key points   structure of arrays: x, y, size, angle, response (float) then octave and
+//                class id (int32), RowCount values each
+//   scales       per dimension scale of every entry (int8 descriptors only)
+//   descriptors  RowCount x Cols descriptors in one continuous block, entries in order
+//
+// Opening the store maps the file, checks the section sizes and the CRC-32 of the header and of
+// the tables (entries up to the scales), and reads the entry table, so loading is bounded by page
+// faults rather than stream reads. The descriptor checksum would read the whole block, so it is
+// only checked on request (VerifyDescriptors). Descriptors are handed out as views of the
+// mapping (no copy); the mapping is private, so writing to a view never changes the file. Views
+// are only valid until Close (or the store is destroyed).
+//=================================================================================================
+class CFeatureStore
+{
+  public:
+    enum
+    {
+      Alignment = 64, // Bytes (same as CDescriptorArena)
+      Version = 2
+    };
+
+    CFeatureStore();
+    ~CFeatureStore();
+
+    // Map FileName. Fails (leaving the store closed) when the file is missing or is not a
+    // complete store of Type descriptors.
+    bool Open(const std::string& FileName, int Type);
+    void Close();
+    bool IsOpen() const;
+
+    // Check the CRC-32 of the descriptor block (reads every descriptor page)
+    bool VerifyDescriptors() const;
+
+    int GetEntryCount() const;
+
+    // Index of the entry called Name, -1 when it is not in the store
+    int Find(const std::string& Name) const;
+    std::string GetName(int k) const;
+
+    // Features of entry k: the key points are copied out of the arrays, Des is a view of the
+    // mapping and Scale (int8 only, otherwise empty) is a copy
+    bool GetEntry(
+      int k,
+      std::vector<cv::KeyPoint>& KeyPoints,
+      cv::Mat& Des,
+      cv::Mat& Scale,
+      int& ImageHeight,
+      int& ImageWidth) const;
+
+    // First descriptor row of entry k (GetFirstRow(GetEntryCount()) is the row count)
+    int GetFirstRow(int k) const;
+
+    // View of every descriptor (continuous and Alignment aligned)
+    cv::Mat GetDescriptors() const;
+
+    // Write the features of Entries to FileName, entry k under the name Names[k]. The file is
+    // written under a temporary name (unique to the process) and renamed over FileName, so an
+    // existing mapping of the old store stays valid. Fails when the entries have no descriptors
+    // or disagree on the descriptor format.
+    static bool Write(
+      const std::string& FileName,
+      const std::vector<CRecognitionEntry>& Entries,
+      const std::vector<std::string>& Names);
+
+  private:
+    struct SHeader;
+    struct SEntry;
+
+    const SEntry& GetEntryRecord(int k) const;
+
+    unsigned char* mpData;
+    size_t mSize;
+
+    const SHeader* mpHeader;
+    const SEntry* mpEntries;
+
+    std::map<std::string, int> mNames;
+};
+#endif //end #ifndef FEATURE_STORE_H
@@ -0,0 +1,51 @@
+#ifndef KMAJORITY_H
+#define KMAJORITY_H
+
+#include <vector>
+#include <cv.h>
+#include "KMeans.h"
+
+//=================================================================================================
+// Clustering of binary descriptors (e.g. ORB) for dictionary generation: k-majority (Grana et
+// al. 2013). Distances are Hamming distances between the bit strings and every center is the
+// bitwise majority vote of the descriptors assigned to it, so the words stay binary and can be
+// compared with popcounts just like the descriptors.
+//
+// Descriptors and centers are CV_8U, one per row with 8 bits per byte; labels are a rows x 1
+// CV_32S matrix (the cv::kmeans layout). The seed and iteration count come from SKMeansParams
+// and all work is split into fixed blocks like CKMeans, so the result only depends on the data
+// and the seed.
+//=================================================================================================
+class CKMajority
+{
+  public:
+    CKMajority(const SKMeansParams& Params);
+    ~CKMajority();
+
+    // Seed K centers with k-means++ over Hamming distances, then alternate assignment and
+    // majority voting until no label changes or mIterations is reached. A center that loses
+    // all of its descriptors is moved to the descriptor farthest from its own center.
+    bool Run(const cv::Mat& Data, int K, cv::Mat& Centers, cv::Mat& Labels);
+
+    // Sum of the Hamming distances from every descriptor to its center after the last run
+    double GetCompactness() const;
+
+    // Number of iterations performed by the last run
+    int GetIterationsRun() const;
+
+    // Assign every row of Data to its nearest center (in parallel). Dists receives the Hamming
+    // distance to that center. Returns the sum of the distances.
+    static double Assign(
+      const cv::Mat& Data,
+      const cv::Mat& Centers,
+      std::vector<int>& Labels,
+      std::vector<int>* pDists = 0);
+
+  private:
+    bool InitCenters(const cv::Mat& Data, int K, cv::Mat& Centers) const;
+
+    SKMeansParams mParams;
+    double mCompactness;
+    int mIterationsRun;
+};
+#endif //end #ifndef KMAJORITY_H
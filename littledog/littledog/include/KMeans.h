@@ -0,0 +1,166 @@
+#ifndef KMEANS_H
+#define KMEANS_H
+
+#include <vector>
+#include <stdint.h>
+#include <cv.h>
+
+//=================================================================================================
+// K-means settings shared by the in-house clustering methods
+//=================================================================================================
+struct SKMeansParams
+{
+  enum EInit
+  {
+    eInitKMeansPP = 0, // k-means++ (one pass over the data per center)
+    eInitKMeansParallel // k-means|| (a few oversampling passes, then k-means++ on the candidates)
+  };
+
+  SKMeansParams()
+   : mIterations(100),
+     mBatchSize(1000),
+     mSampleSize(100000),
+     mPasses(2),
+     mTolerance(1e-4),
+     mEpsilon(0),
+     mRestarts(1),
+     mSeed(0),
+     mInit(eInitKMeansParallel)
+  {
+  }
+
+  int mIterations; // Maximum number of iterations (mini-batches for mini-batch k-means)
+  int mBatchSize; // Descriptors per mini-batch
+  int mSampleSize; // Reservoir size used to seed streaming k-means
+  int mPasses; // Streaming passes over the data (after the sampling pass), incremental passes
+  double mTolerance; // Stop once the mean squared center shift is below mTolerance*variance
+  double mEpsilon; // Exact k-means stops once no center moves more than mEpsilon (0 = off)
+  int mRestarts; // Independently seeded runs, the most compact one is kept
+  uint64_t mSeed; // Every random choice derives from this seed (same seed = same dictionary)
+  EInit mInit;
+};
+
+//=================================================================================================
+// Descriptors for out-of-core k-means, read one block (e.g. one database entry) at a time so
+// they never all have to be in memory at once
+//=================================================================================================
+class CDescriptorSource
+{
+  public:
+    virtual ~CDescriptorSource() {}
+
+    virtual int GetBlockCount() const = 0;
+
+    // Read block i as fp32 descriptors, one per row (an empty Des is allowed)
+    virtual bool ReadBlock(int i, cv::Mat& Des) = 0;
+};
+
+//=================================================================================================
+// Multithreaded k-means for dictionary generation.
+//
+// All work is split into fixed size blocks of rows processed with cv::parallel_for_ and every
+// reduction sums the per block results in block order, so the result only depends on the data
+// and the seed (never on the number of threads or scheduling).
+//
+// Centers are returned one per row (CV_32F) and labels as a rows x 1 CV_32S matrix, the same
+// layout as cv::kmeans.
+//=================================================================================================
+class CKMeans
+{
+  public:
+    enum EMethod
+    {
+      eMethodOpenCV = 0, // cv::kmeans with k-means++ centers
+      eMethodMiniBatch,
+      eMethodHamerly
+    };
+
+    CKMeans(const SKMeansParams& Params);
+    ~CKMeans();
+
+    // Mini-batch k-means (Sculley 2010). Each iteration assigns a random batch of descriptors to
+    // the nearest centers and moves every center towards the mean of the descriptors it has
+    // received so far. Labels are from a final full assignment.
+    bool RunMiniBatch(const cv::Mat& Data, int K, cv::Mat& Centers, cv::Mat& Labels);
+
+    // Out-of-core k-means. A first pass over Source keeps a reservoir sample of mSampleSize
+    // descriptors that seeds the centers; each of the mPasses following passes reads the blocks
+    // in a shuffled order and applies mini-batch updates to every chunk of mBatchSize rows.
+    // Memory is bounded by the sample, the centers and one block. The compactness is measured
+    // during the last pass (no labels are produced).
+    bool RunStreaming(CDescriptorSource& Source, int K, cv::Mat& Centers);
+
+    // Exact Lloyd k-means accelerated with Hamerly's bounds (Hamerly 2010). Every descriptor
+    // keeps an upper bound on the distance to its center and a lower bound on the distance to
+    // any other center; the distances are only computed when the bounds overlap, so after the
+    // first few iterations most descriptors skip the scan entirely. Stops after mIterations,
+    // when no label changes, or when no center moves more than mEpsilon.
+    bool RunHamerly(const cv::Mat& Data, int K, cv::Mat& Centers, cv::Mat& Labels);
+
+    // Same as above starting from the given Centers (e.g. a previous dictionary)
+    bool RefineHamerly(const cv::Mat& Data, cv::Mat& Centers, cv::Mat& Labels);
+
+    // Change the number of centers to K starting from the current Centers (a solution for
+    // another K), then refine with RefineHamerly. Centers are added where the squared error is
+    // largest (k-means++ sampling continued from the current centers, which splits the worst
+    // clusters) and removed by merging the pairs of centers that increase the squared error the
+    // least (Ward). Empty Centers are initialized as in RunHamerly.
+    bool Resize(const cv::Mat& Data, int K, cv::Mat& Centers, cv::Mat& Labels);
+
+    // Warm start update of existing Centers with new descriptors. OldSample is a uniform sample
+    // of the descriptors the centers were built from and every sampled row counts OldWeight
+    // times (rows in the old data / rows sampled). Runs at most mPasses weighted Lloyd
+    // iterations over NewData + OldSample, so the cost depends on the size of the update only.
+    bool UpdateIncremental(
+      const cv::Mat& NewData,
+      const cv::Mat& OldSample,
+      double OldWeight,
+      cv::Mat& Centers);
+
+    // Run Method once with the current settings
+    bool Run(EMethod Method, const cv::Mat& Data, int K, cv::Mat& Centers, cv::Mat& Labels);
+
+    // Run mRestarts instances of Method in parallel (restart r is seeded with mSeed + r) and
+    // keep the one with the lowest compactness (the first one on ties). Compactness receives
+    // the compactness of every restart.
+    bool RunRestarts(
+      EMethod Method,
+      const cv::Mat& Data,
+      int K,
+      cv::Mat& Centers,
+      cv::Mat& Labels,
+      std::vector<double>& Compactness);
+
+    // Pick K initial centers from Data using the configured initialization
+    bool InitCenters(const cv::Mat& Data, int K, cv::Mat& Centers) const;
+
+    // Sum of squared distances from every descriptor to its center after the last run
+    double GetCompactness() const;
+
+    // Number of iterations performed by the last run (0 when unknown, i.e. for eMethodOpenCV)
+    int GetIterationsRun() const;
+
+    // Fraction of the row assignments of the last exact run that needed a scan of every center
+    double GetScanFraction() const;
+
+    // Assign every row of Data to its nearest center (in parallel). Dists receives the squared
+    // distance to that center (may be 0). Returns the sum of the squared distances.
+    static double Assign(
+      const cv::Mat& Data,
+      const cv::Mat& Centers,
+      std::vector<int>& Labels,
+      std::vector<float>* pDists = 0);
+
+    // Deterministic uniform number in [0,1) for (Seed, Stream, Index)
+    static double HashUniform(uint64_t Seed, uint64_t Stream, uint64_t Index);
+
+  private:
+    bool InitKMeansPP(const cv::Mat& Data, int K, cv::Mat& Centers) const;
+    bool InitKMeansParallel(const cv::Mat& Data, int K, cv::Mat& Centers) const;
+
+    SKMeansParams mParams;
+    double mCompactness;
+    int mIterationsRun;
+    double mScanFraction;
+};
+#endif //end #ifndef KMEANS_H
@@ -31,15 +31,21 @@
 
 #include <string>
 #include <map>
+#include <set>
 #include <cv.h>
 
 // wxWidgets
 #include <wx/filename.h>
 #include "RecognitionEntry.h"
+#include "KMeans.h"
+#include "DescriptorArena.h"
+#include "FeatureStore.h"
 
 class TiXmlNode;
 class TiXmlElement;
 class CvSVM;
+class CWordQuantizer;
+class CVocabularyTree;
 struct CvSVMParams;
 struct CvSURFParams;
 class wxTimeSpan;
@@ -56,12 +62,24 @@ class CRecognitionDb
       wxFileName mImageDir;
       wxFileName mDatabaseDir;
       wxFileName mLogDir;
+      wxFileName mFeatureCacheDir; // Shared by databases (mDatabaseDir/FeatureCache/ if unset)
     };
 
     enum EFeatureType
     {
       eSIFT = 0,
-      eSURF
+      eSURF,
+      eORB, // Binary descriptors (Hamming distance, k-majority dictionary)
+      eDense // SURF descriptors on a regular lattice (no key point detection)
+    };
+
+    enum EDictionaryType
+    {
+      eKMeans = 0,
+      eVocabTree,
+      eMiniBatch,
+      eStreaming,
+      eHamerly
     };
 
     CRecognitionDb();
@@ -75,6 +93,10 @@ class CRecognitionDb
     bool PopulateDictionary();
     bool PopulateDictionary(wxTimeSpan& DictionaryTime, wxTimeSpan& WordTime);
 
+    // Rebuild the dictionary with WordCount words warm-started from the current dictionary (or
+    // from scratch when there is none) and refill the word histograms
+    bool ResizeDictionary(unsigned WordCount, wxTimeSpan& DictionaryTime, wxTimeSpan& WordTime);
+
     bool PopulateColorHistograms();
     bool PopulateColorHistograms(wxTimeSpan& Time);
 
@@ -126,6 +148,11 @@ class CRecognitionDb
     static void GenImageXml(
       const wxFileName& TextListofImages);
 
+    // Read the dictionary word count of a setup file without initializing a database (no
+    // directories or logs are created). Returns false if the file has no valid <words> element.
+    static bool ReadSetupWordCount(
+      const wxFileName& SetupDir, const std::string& SetupFileName, unsigned& WordCount);
+
     // Generates a brief summary of database classification using comma separated value format
     void GenClassifyDbSummaryCsv(
       std::ofstream& Os,
@@ -153,6 +180,7 @@ class CRecognitionDb
     std::string GetLogDirName() const;
     std::string GetLabel(unsigned Id) const;
     unsigned GetEntryCount() const;
+    unsigned GetWordCount() const;
     wxFileName GetImageFileName(unsigned i) const;
 
     // Given a binary input stream load a stored dictionary
@@ -183,10 +211,49 @@ class CRecognitionDb
     // Array of entries in the database (one entry per image)
     std::vector<CRecognitionEntry> mEntries;
 
+    // Descriptors of every entry in one block (block i belongs to entry i once packed)
+    CDescriptorArena mDescriptorArena;
+
+    // Mapped feature cache of the whole database (entries may view its descriptors)
+    CFeatureStore mFeatureStore;
+
+    // Size and modification time of an image file when its content hash was computed
+    struct SImageStamp
+    {
+      SImageStamp()
+       : mSize(0),
+         mTime(0)
+      {
+      }
+
+      uint64_t mSize;
+      int64_t mTime;
+      std::string mKey; // Hex hash of the file bytes, empty until hashed
+    };
+
+    // Image hash of every entry and the stamps of the last run, indexed by image path, that let
+    // unchanged images skip hashing
+    std::vector<SImageStamp> mImageStamps;
+    std::map<std::string, SImageStamp> mKnownImageStamps;
+
+    // Stamp of the feature store once its descriptors were verified or written (saved with the
+    // image stamps, so an unchanged store is not verified again), empty key otherwise
+    SImageStamp mFeatureStoreStamp;
+
+    // Feature cache key of every entry (see SetShardFeatureKeys), empty when not cached
+    std::vector<std::string> mFeatureKeys;
+    uint64_t mFeatureParamsHash; // Hash of every setting that changes the features
+
     // Contains each cluster centroid from kmeans dictionary generation
     cv::Mat* mpDictionary;
     cv::Mat* mpLabels;
 
+    // Nearest word lookup for the current dictionary (shared by every word assignment path)
+    CWordQuantizer* mpWordQuantizer;
+
+    // Hierarchical dictionary (only used when mDictionaryType is eVocabTree)
+    CVocabularyTree* mpVocabularyTree;
+
     // General Feature settings
     EFeatureType mFeatureType;
     bool mAdjusterOn; // Adjuster only works for SURF currently
@@ -195,13 +262,21 @@ class CRecognitionDb
     unsigned mAdjusterIter;
     bool mAdjusterMemory;
     double mAdjusterLearnRate;
+    bool mAdjusterSelect; // Select key points by response from one detection (no re-detection)
     bool mGridOn;
     int mGridStep;
+    double mFeatureScale; // Images are shrunk by this factor before feature generation
     bool mGenFeatureLog;
     bool mAutoLevels;
     bool mCacheFeatures;
-
-    // Feature detector and extractor (SIFT and SURF)
+    bool mFeatureStoreOn; // Cache features in one mapped store instead of one file per entry
+    CRecognitionEntry::EDescriptorStorage mDescriptorStorage; // Descriptor format (memory/cache)
+    unsigned mFeatureThreads; // PopulateFeatures compute threads (0 = one per core)
+    unsigned mFeatureReadThreads; // PopulateFeatures image decode / cache read threads
+    unsigned mFeatureWriteThreads; // PopulateFeatures cache / log write threads
+    unsigned mFeatureQueueDepth; // Items between two pipeline stages (0 = 2 per compute thread)
+
+    // Feature detector and extractor (SIFT, SURF, ORB and dense)
     cv::FeatureDetector* mpFeatureDetector;
     cv::DescriptorExtractor* mpDescriptorExtractor;
 
@@ -216,10 +291,63 @@ class CRecognitionDb
     CvSURFParams* mpSurfParams;
     bool mSurfExtended;
 
+    // ORB features options
+    int mOrbFeatures; // Maximum number of key points kept per image
+    double mOrbScaleFactor; // Pyramid decimation ratio
+    int mOrbLevels; // Pyramid levels
+    int mOrbEdgeThreshold; // Border (in pixels) where no key point is detected
+
+    // Dense features options (sizes are in full size image pixels)
+    int mDenseStep; // Lattice spacing at the first level
+    double mDenseSize; // Key point size at the first level
+    int mDenseLevels; // Number of lattice scales
+    double mDenseScaleMul; // Key point size (and spacing) ratio between consecutive levels
+    int mDenseBound; // Border without key points
+    bool mDenseUpright; // Skip the orientation assignment (descriptors are not rotation invariant)
+
     // Dictionary generation parameters
+    EDictionaryType mDictionaryType;
     unsigned mWordCount; // Number of words in the dictionary
     unsigned mWordKMeansIter; // Number of kmeans clustering iterations
+    unsigned mVocabTreeBranching; // Children per node (vocabulary tree only)
+    unsigned mVocabTreeDepth; // Levels below the root (mWordCount = branching^depth)
+    SKMeansParams mKMeansParams; // In-house k-means settings (mini-batch, streaming, hamerly)
+    std::vector<double> mRestartCompactness; // Compactness of each k-means restart (last build)
+
+    // Counters of one PopulateFeatures pipeline stage (last run)
+    struct SFeatureStageStats
+    {
+      SFeatureStageStats()
+       : mThreads(0),
+         mItems(0),
+         mBusyMs(0),
+         mStallInMs(0),
+         mStallOutMs(0),
+         mOccupancy(0),
+         mMeanQueue(0),
+         mMaxQueue(0),
+         mQueueCapacity(0)
+      {
+      }
+
+      std::string mName;
+      unsigned mThreads;
+      unsigned mItems; // Entries processed
+      double mBusyMs; // Time spent working (summed over the threads)
+      double mStallInMs; // Time spent waiting for input (summed over the threads)
+      double mStallOutMs; // Time spent waiting for room in the output queue
+      double mOccupancy; // Busy fraction of the stage's thread time
+      double mMeanQueue; // Mean output queue occupancy (items)
+      unsigned mMaxQueue;
+      unsigned mQueueCapacity; // 0 when the stage has no output queue
+    };
+    std::vector<SFeatureStageStats> mFeatureStageStats;
+    bool mWordIndexOn; // Approximate nearest word index (k-means dictionary only)
+    unsigned mWordIndexTrees; // Number of randomized KD-trees in the index
+    unsigned mWordIndexChecks; // Leaves visited per search (higher = better recall, slower)
     bool mCacheDictionary;
+    bool mCacheWordLabels; // Per entry word labels (.wrd) tagged with dictionary and features
+    bool mIncrementalDictionary; // Update a cached dictionary with entries it was not built from
     bool mGenWordLog;
 
     // Feature word classifier options
@@ -232,6 +360,7 @@ class CRecognitionDb
     // Color classifier options
     bool mGenColorHistogramLog;
     unsigned mColorHistogramBins;
+    double mHistogramScale; // Images are shrunk by this factor before histogram generation
     bool mCacheColorHistogram;
     bool mGenColorClassifierLog;
     CvSVMParams* mpColorClassifierParams;
@@ -242,7 +371,7 @@ class CRecognitionDb
     std::vector<cv::Scalar> mLabelColors;
 
     bool CreateWordHist(const CRecognitionEntry& Entry, cv::Mat& WordHist);
-    bool CreateWordHist(const cv::Mat& Des, cv::Mat& WordHist);
+    bool CreateWordHist(const cv::Mat& Des, const cv::Mat& Scale, cv::Mat& WordHist);
 
     bool CreateWordHistMask(
       const CRecognitionEntry& Entry,
@@ -264,6 +393,135 @@ class CRecognitionDb
 
     bool FillWordHist(CRecognitionEntry& Entry);
 
+    // Fill in the word histograms of all entries using batch word assignment
+    bool FillWordHists();
+
+    // Every descriptor as fp32, or as bytes for binary descriptors (a view of mDescriptorArena
+    // when possible)
+    void GetAllDescriptors(cv::Mat& AllDescriptors) const;
+
+    // k-majority dictionary for binary descriptors (called by PopulateDictionary)
+    bool PopulateDictionaryBinary(
+      const wxFileName& CachedDictionaryFileName,
+      const wxDateTime& StartDictionaryTime,
+      wxTimeSpan& DictionaryTime,
+      wxTimeSpan& WordHistTime);
+
+    // Word histograms and labels of every entry from the k-means labels in mpLabels
+    void SetWordHistsFromLabels(bool CacheLabels);
+
+    // Assign the descriptors of entries Indices to words in one batch; Labels[k] receives the
+    // words of entry Indices[k]. Packed fp32 descriptors are quantized in place as one matrix.
+    bool QuantizeEntries(
+      const CWordQuantizer& Quantizer,
+      const std::vector<unsigned>& Indices,
+      std::vector<std::vector<int> >& Labels) const;
+
+    // Warm start update of a cached dictionary with the entries that are not in its member list
+    // (see CKMeans::UpdateIncremental), then fills in the word histograms of every entry (in
+    // place of FillWordHists)
+    bool UpdateDictionaryIncremental(wxTimeSpan& DictionaryTime, wxTimeSpan& WordHistTime);
+
+    // Names of the images a cached dictionary was built from (stored next to it as .mem)
+    wxFileName GetDictionaryMembersFileName() const;
+    bool LoadDictionaryMembers(std::set<std::string>& Members) const;
+    bool SaveDictionaryMembers() const;
+
+    // PopulateFeatures pipeline stages (see PopulateFeatures)
+    struct SFeatureShard;
+    struct SFeatureOutput;
+    struct SFeatureJob;
+    void PopulateFeaturesReader(SFeatureJob* pJob, unsigned Thread);
+    void PopulateFeaturesComputer(SFeatureJob* pJob, unsigned Thread);
+    void PopulateFeaturesWriter(SFeatureJob* pJob, unsigned Thread);
+    bool LoadEntryFeatures(unsigned i, bool& FromStore);
+    bool GenerateEntryFeatures(
+      unsigned i,
+      cv::Mat& Image,
+      const cv::Size& FullSize,
+      double& HessianThreshold,
+      cv::Mat& ImageRef,
+      wxTimeSpan& GenTime);
+    void SaveEntryFeatures(unsigned i, const cv::Mat& ImageRef, wxTimeSpan& GenTime);
+
+    // Move the descriptors of every entry into mDescriptorArena (entries keep views into it)
+    bool PackDescriptors();
+
+    // True when every entry's descriptors are its block of mDescriptorArena
+    bool IsPacked() const;
+
+    // Use the descriptor block of mFeatureStore as mDescriptorArena (no copy). Only possible
+    // when the store holds exactly the entries of this database in the same order.
+    bool AdoptFeatureStore();
+
+    // Rewrite the feature store from the entries in memory (the entries must not view the
+    // store's mapping since it is closed)
+    bool WriteFeatureStore();
+
+    // Word label cache for entry i (see mCacheWordLabels)
+    bool LoadWordLabels(unsigned i);
+    bool SaveWordLabels(unsigned i);
+
+    // Fingerprint the word labels of entry i are tagged with: the dictionary fingerprint and
+    // the features of the entry (its feature cache key and settings, or a CRC of its descriptors
+    // when it has no key)
+    uint64_t GetWordLabelsFingerprint(unsigned i) const;
+
+    // Rebuild the word quantizer after the dictionary changes
+    bool UpdateWordQuantizer();
+
+    // Streams the descriptors of each entry to out-of-core k-means (see ReadEntryDescriptors)
+    class CEntryDescriptorSource;
+
+    // Hash of the feature type, its settings, the image scale, auto levels and the descriptor
+    // storage: cached features are only reused when all of them match
+    uint64_t HashFeatureParams() const;
+
+    // Size and modification time of a file, with Key as the key
+    static SImageStamp GetFileStamp(const wxFileName& FileName, const std::string& Key);
+
+    // Fill in mImageStamps[i] (hashing the image bytes unless the image is unchanged since the
+    // last run). Only touches slot i, so read threads can hash in parallel.
+    bool HashEntryImage(unsigned i);
+
+    // Cache keys of entries Begin to End (one shard). With Chained (the adjuster threshold
+    // carries over within the shard) the key of an entry is the hash of the image hashes of the
+    // shard up to and including it, since its features depend on all of them. Fails (leaving
+    // the keys empty) when an image cannot be hashed.
+    bool SetShardFeatureKeys(unsigned Begin, unsigned End, bool Chained);
+
+    // Check the descriptors of the open feature store unless the store file is unchanged since
+    // a previous run verified or wrote it
+    bool VerifyFeatureStore();
+
+    // Image stamps of the last run (<database>.hsh in the database directory)
+    void LoadImageStamps();
+    void SaveImageStamps() const;
+
+    // Name of the feature cache file of entry i in the shared cache directory, named by its key
+    // in mFeatureKeys and mFeatureParamsHash (the extension depends on mDescriptorStorage).
+    // Empty when the entry has no key.
+    wxFileName GetFeatureCacheFileName(unsigned i) const;
+
+    // Name of the feature store in the shared cache directory, named by the hash of the image
+    // paths and mFeatureParamsHash (databases with the same images and settings share it)
+    wxFileName GetFeatureStoreFileName() const;
+
+    // fp32 descriptors of entry i, read from the feature cache when they are not in memory
+    bool ReadEntryDescriptors(unsigned i, cv::Mat& Des) const;
+
+    // Vocabulary tree cache (stored next to the dictionary with the .voc extension)
+    bool LoadVocabularyTree(std::ifstream& Is);
+    bool SaveVocabularyTree(std::ofstream& Os);
+
+    // Approximate nearest word index (stored in the dictionary cache after the words)
+    bool LoadWordIndex(std::ifstream& Is);
+    bool SaveWordIndex(std::ofstream& Os);
+    void LogWordIndexRecall();
+
+    // Print the partial distance search counters of the word quantizer
+    void LogWordPruning();
+
     void WriteHistogramImage(wxFileName& SaveFile, const cv::Mat& Values);
 
     void CreateMask(cv::Mat& Mask, int MinX, int MaxX, int MinY, int MaxY);
@@ -276,6 +534,9 @@ class CRecognitionDb
     void ReadFeaturesElement(TiXmlElement* pFeatures);
     void ReadSiftAttributes(TiXmlElement* pSift);
     void ReadSurfAttributes(TiXmlElement* pSurf);
+    void ReadOrbAttributes(TiXmlElement* pOrb);
+    void ReadDenseAttributes(TiXmlElement* pDense);
+    bool ReadCommonFeatureParam(TiXmlElement* pElement);
     void ReadHistogramsElement(TiXmlElement* pElement);
     void ReadDictionaryElement(TiXmlElement* pElement);
     void ReadClassifierElement(TiXmlElement* pElement);
@@ -286,6 +547,7 @@ class CRecognitionDb
     std::string ReadTypeAttribute(TiXmlElement* pElement);
     std::string ReadInputAttribute(TiXmlElement* pElement);
     std::string ReadValueAttribute(TiXmlElement* pElement);
+    void ReadScaleAttribute(TiXmlElement* pElement, double* pVal);
 
     void ReadDoubleValueAttribute(TiXmlElement* pElement, double *pVal);
     void ReadIntValueAttribute(TiXmlElement* pElement, int *pVal);
@@ -2,11 +2,23 @@
 #define RECOGNITION_ENTRY_H
 
 #include <string>
+#include <stdint.h>
 #include <cv.h>
 
 class CRecognitionEntry
 {
   public:
+
+    // In memory (and cache) format of the descriptors, see CDescriptorCodec. Binary descriptors
+    // (e.g. ORB, CV_8U) are bit strings compared by Hamming distance and never converted.
+    enum EDescriptorStorage
+    {
+      eFloat32 = 0,
+      eFloat16,
+      eInt8,
+      eBinary
+    };
+
     CRecognitionEntry(std::string UniqueName, unsigned LabelId, std::string Comment = std::string());
     ~CRecognitionEntry();
 
@@ -25,6 +37,20 @@ class CRecognitionEntry
       const CvSURFParams* mpSurfParams,
       const cv::DescriptorExtractor& DescriptorExtractor);
 
+    // Same result as the adjuster from a single detection: SURF is run once at a floor below
+    // Threshold and the key points are selected on their Hessian response (a detection at
+    // threshold T keeps exactly the key points whose response exceeds T). The floor is only
+    // lowered (redetecting, at most AdjusterIter times) when it finds fewer than AdjusterMin.
+    // Descriptors are computed for the selected key points only.
+    bool GenerateFeaturesSurfSelect(
+      const cv::Mat& Image,
+      unsigned AdjusterMin,
+      unsigned AdjusterMax,
+      unsigned AdjusterIter,
+      double& Threshold,
+      const CvSURFParams* mpSurfParams,
+      const cv::DescriptorExtractor& DescriptorExtractor);
+
     bool GenerateFeaturesGrid(
       const cv::Mat& Image,
       unsigned AdjusterMin,
@@ -34,15 +60,47 @@ class CRecognitionEntry
       double& Threshold,
       const CvSURFParams* mpSurfParams,
       int GridStep,
-      const cv::DescriptorExtractor& DescriptorExtractor);
+      const cv::DescriptorExtractor& DescriptorExtractor,
+      bool AdjusterSelect = false);
 
-    void GenerateColorHist(const cv::Mat& ImageBGR, unsigned Bins);
+    // CountScale multiplies every bin (e.g. the area ratio of a downscaled ImageBGR so that the
+    // counts match those of the full size image)
+    void GenerateColorHist(const cv::Mat& ImageBGR, unsigned Bins, double CountScale = 1.0);
 
     void ShiftKeyPoints(double ShiftX, double ShiftY);
 
+    // Map the key points of features generated on a resized copy of the image to the image as
+    // stored (Height x Width) and keep that as the image size
+    void MapToImageSize(int Height, int Width);
+
     unsigned GetKeyPointCount() const;
     const std::vector<cv::KeyPoint>& GetKeyPoints() const;
     const cv::Mat& GetDescriptors() const;
+
+    // Share Des as the descriptors (not copied, e.g. a block of a CDescriptorArena). Des must be
+    // in the current storage format since the scale is kept.
+    void SetDescriptors(const cv::Mat& Des);
+
+    // Replace all features at once (e.g. read from a CFeatureStore). The key points are swapped
+    // in and Des is shared like SetDescriptors; Scale is the int8 scale (empty otherwise).
+    void SetFeatures(
+      std::vector<cv::KeyPoint>& KeyPoints,
+      const cv::Mat& Des,
+      const cv::Mat& Scale,
+      int ImageHeight,
+      int ImageWidth);
+
+    // Per dimension scale of int8 descriptors (empty for the other formats)
+    const cv::Mat& GetDescriptorScale() const;
+
+    // Descriptors decoded to fp32 (no copy when they are already fp32)
+    void GetDescriptorsFloat(cv::Mat& Des) const;
+
+    // Convert the descriptors to the given storage format
+    void SetDescriptorStorage(EDescriptorStorage Storage);
+    EDescriptorStorage GetDescriptorStorage() const;
+
+    static int GetDescriptorType(EDescriptorStorage Storage);
     unsigned GetLabelId() const;
     const std::string& GetName() const;
     int GetImageHeight() const;
@@ -52,16 +110,47 @@ class CRecognitionEntry
     const cv::Mat& GetWordHist() const;
     const cv::Mat& GetColorHist() const;
 
+    // Word assigned to each key point (empty until set)
+    const std::vector<int>& GetWordLabels() const;
+    void SetWordLabels(std::vector<int>& Labels);
+
     void IncrementWordHist(unsigned Index);
     void InitWordHist(unsigned Size);
     void NormalizeWordHist(unsigned MaxValue);
 
-    bool LoadFeatures(std::ifstream& Is);
+    // Descriptors are read/written in their storage format (Storage must match the file)
+    bool LoadFeatures(std::ifstream& Is, EDescriptorStorage Storage = eFloat32);
     bool SaveFeatures(std::ofstream& Os);
 
     bool SaveColorHistogram(std::ofstream& Os);
     bool LoadColorHistogram(std::ifstream& Is, int ExpectedCols);
 
+    // Word labels are tagged with the fingerprint of the dictionary and features that produced
+    // them
+    bool SaveWordLabels(std::ofstream& Os, uint64_t Fingerprint);
+    bool LoadWordLabels(std::ifstream& Is, uint64_t ExpectedFingerprint, int WordCount);
+
+    // Detection step of GenerateFeaturesSurfAdjuster and GenerateFeaturesSurfSelect (no
+    // descriptors), safe to call from several threads at once
+    static bool DetectSurfAdjuster(
+      const cv::Mat& Image,
+      unsigned AdjusterMin,
+      unsigned AdjusterMax,
+      unsigned AdjusterIter,
+      double AdjusterLearnRate,
+      double& Threshold,
+      const CvSURFParams* pSurfParams,
+      std::vector<cv::KeyPoint>& KeyPoints);
+
+    static bool DetectSurfSelect(
+      const cv::Mat& Image,
+      unsigned AdjusterMin,
+      unsigned AdjusterMax,
+      unsigned AdjusterIter,
+      double& Threshold,
+      const CvSURFParams* pSurfParams,
+      std::vector<cv::KeyPoint>& KeyPoints);
+
   private:
     std::string mName;
     std::string mComment;
@@ -72,8 +161,10 @@ class CRecognitionEntry
 
     std::vector<cv::KeyPoint> mKeyPoints;
     cv::Mat mDescriptors;
+    cv::Mat mDescriptorScale;
     cv::Mat mWordHist;
     cv::Mat mColorHist;
+    std::vector<int> mWordLabels;
 
 };
 #endif //end #ifndef RECOGNITION_ENTRY_H
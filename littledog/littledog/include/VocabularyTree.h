@@ -0,0 +1,65 @@
+#ifndef VOCABULARY_TREE_H
+#define VOCABULARY_TREE_H
+
+#include <vector>
+#include <fstream>
+#include <stdint.h>
+#include <cv.h>
+
+//=================================================================================================
+// Hierarchical k-means dictionary (vocabulary tree). Every node is split into Branching children
+// using k-means on the descriptors assigned to it, down to Depth levels, so the dictionary has
+// Branching^Depth words (the leaves). Looking up a word only compares the descriptor against the
+// children of one node per level: O(Branching*Depth) instead of O(words).
+//
+// Nodes are stored as a complete tree in breadth first order: the children of node n are
+// n*Branching+1 ... n*Branching+Branching. A node with fewer descriptors than Branching is not
+// split; it is passed down to its first child and the remaining children are marked invalid.
+//=================================================================================================
+class CVocabularyTree
+{
+  public:
+    CVocabularyTree();
+    ~CVocabularyTree();
+
+    // Build the tree from Descriptors (one descriptor per row, CV_32F). Iterations is the k-means
+    // iteration count used for every node.
+    bool Build(const cv::Mat& Descriptors, int Branching, int Depth, int Iterations);
+
+    int GetBranching() const;
+    int GetDepth() const;
+    int GetWordCount() const;
+    int GetDescriptorLength() const;
+
+    // Walk down the tree and return the index of the leaf (word) closest to pDes
+    int FindNearestWord(const float* pDes) const;
+
+    // Copy the leaf centroids into Words (one row per word). Invalid leaves get the centroid of
+    // their closest valid ancestor.
+    void GetWords(cv::Mat& Words) const;
+
+    // Hash of the tree shape and every node (see CWordQuantizer::GetFingerprint)
+    uint64_t GetFingerprint() const;
+
+    // Binary serialization (cached next to the dictionary)
+    bool Load(std::ifstream& Is);
+    bool Save(std::ofstream& Os) const;
+
+  private:
+    int GetNodeCount() const;
+
+    int mBranching;
+    int mDepth;
+    int mWordCount;
+    int mDescriptorLength;
+
+    // Index of the first leaf node
+    int mFirstLeaf;
+
+    // Each row is the centroid of a node (the root holds the mean of all descriptors)
+    cv::Mat mCentroids;
+
+    // Non-zero for nodes that hold descriptors
+    std::vector<unsigned char> mValid;
+};
+#endif //end #ifndef VOCABULARY_TREE_H
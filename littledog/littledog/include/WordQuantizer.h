@@ -0,0 +1,165 @@
+#ifndef WORD_QUANTIZER_H
+#define WORD_QUANTIZER_H
+
+#include <vector>
+#include <string>
+#include <stdint.h>
+#include <atomic>
+#include <cv.h>
+
+class CVocabularyTree;
+
+namespace cv
+{
+  namespace flann
+  {
+    class Index;
+  }
+}
+
+//=================================================================================================
+// Assigns descriptors to the nearest visual word of a dictionary (squared Euclidean distance).
+//
+// The distance kernels (DistanceKernels.h) are specialized at compile time for the 64 and 128
+// float SURF descriptor lengths (see mSurfExtended). They are also built for AVX2 and FMA in a
+// file of their own (WordQuantizerAvx2.cpp) and those are used when the processor supports
+// them, otherwise the SSE kernel on x86 and a scalar kernel everywhere else.
+//
+// When a vocabulary tree is set, lookups walk the tree instead of scanning every word. When an
+// approximate index is built, lookups search a randomized KD-forest over the words; Checks is
+// the number of leaves visited per search and trades recall for speed.
+//
+// Exact single descriptor lookups (FindNearestWord, Quantize) of descriptors other than 64 or
+// 128 floats use a partial distance search: a word is abandoned once its partial squared
+// distance exceeds the best distance so far (the unrolled SURF kernels are faster without). For
+// dictionaries of up to 5000 words, inter-word distances are precomputed so words that provably
+// cannot win (triangle inequality) are skipped without computing any distance.
+//
+// A CV_8U dictionary holds binary words (e.g. ORB, 8 bits per byte, see CKMajority). Lookups
+// then compare CV_8U descriptors by Hamming distance (popcounts) with a linear scan; the tree,
+// the index and compact descriptor formats do not apply to binary words.
+//=================================================================================================
+class CWordQuantizer
+{
+  public:
+    CWordQuantizer();
+    ~CWordQuantizer();
+
+    // Copy the dictionary (one word per row, CV_32F or binary CV_8U) used for all subsequent
+    // lookups
+    bool SetDictionary(const cv::Mat& Dictionary);
+
+    // Use the tree for all subsequent lookups. The tree is not copied so it must outlive the
+    // quantizer (or the next call to SetDictionary).
+    bool SetVocabularyTree(const CVocabularyTree* pTree);
+
+    // Approximate nearest word index over the current dictionary (not used with a tree)
+    bool BuildIndex(int Trees, int Checks);
+    bool LoadIndex(const std::string& FileName, int Trees, int Checks);
+    bool SaveIndex(const std::string& FileName) const;
+    void ReleaseIndex();
+    bool HasIndex() const;
+    int GetIndexTrees() const;
+
+    // Fraction of the rows of Des for which the index finds the exact nearest word
+    double MeasureIndexRecall(const cv::Mat& Des) const;
+
+    // Identifies the dictionary and lookup method; word labels produced by two quantizers with
+    // the same fingerprint are interchangeable (used to validate cached labels)
+    uint64_t GetFingerprint() const;
+
+    // True when the inter-word distances are precomputed, so a lookup with a good Hint is mostly
+    // resolved without scanning the dictionary
+    bool HasCentroidTables() const;
+
+    // Number of descriptor dimensions evaluated by the partial distance search versus the
+    // number a full scan would have evaluated (accumulated since the last reset)
+    void GetPruningStats(uint64_t& DimsEvaluated, uint64_t& DimsTotal) const;
+    void ResetPruningStats();
+
+    // 64 bit FNV-1a hash of Bytes bytes, continuing from Hash
+    static uint64_t HashBytes(
+      const void* pData, size_t Bytes, uint64_t Hash = 14695981039346656037ULL);
+
+    int GetWordCount() const;
+    int GetDescriptorLength() const;
+
+    // True when the words are binary (descriptor length is then in bytes)
+    bool IsBinary() const;
+
+    // Returns the index of the word closest to pDes (GetDescriptorLength() floats long). Hint is
+    // a word likely to be close (e.g. the word of a neighboring key point), -1 if unknown.
+    int FindNearestWord(const float* pDes, int Hint = -1) const;
+
+    // Returns the index of the binary word closest to pDes (GetDescriptorLength() bytes long)
+    int FindNearestWordBinary(const unsigned char* pDes) const;
+
+    // Fill in Labels with the index of the nearest word for each row (descriptor) in Des
+    bool Quantize(const cv::Mat& Des, std::vector<int>& Labels) const;
+
+    // Same as above for compact descriptors (see CDescriptorCodec); Scale is only used for CV_8S
+    bool Quantize(const cv::Mat& Des, const cv::Mat& Scale, std::vector<int>& Labels) const;
+
+    // Batch version of Quantize for many descriptors at once. Distances are expanded as
+    // ||d||^2 - 2*d.c + ||c||^2 so the cross term of a whole block of descriptors is a single
+    // matrix multiply against the dictionary. Blocks are processed in parallel.
+    bool QuantizeBatch(const cv::Mat& Des, std::vector<int>& Labels) const;
+
+    // Same as above but for a list of descriptor matrices (e.g. every entry in a database);
+    // Labels[i] receives the words for DesList[i]
+    bool QuantizeBatch(
+      const std::vector<const cv::Mat*>& DesList,
+      std::vector<std::vector<int> >& Labels) const;
+
+    // Same as above for compact descriptors. ScaleList[i] is the scale of DesList[i] (an empty
+    // ScaleList means every matrix is CV_32F). Blocks are decoded to fp32 before the multiply.
+    bool QuantizeBatch(
+      const std::vector<const cv::Mat*>& DesList,
+      const std::vector<const cv::Mat*>& ScaleList,
+      std::vector<std::vector<int> >& Labels) const;
+
+    // Squared Euclidean distance between two vectors of the given length
+    static float SquaredDistance(const float* pA, const float* pB, int Length);
+
+    // Number of differing bits between two bit strings of the given length in bytes
+    static int HammingDistance(const unsigned char* pA, const unsigned char* pB, int Bytes);
+
+  private:
+    // Number of descriptors multiplied against the dictionary at once in batch mode
+    int GetBatchBlockRows() const;
+
+    // Precompute the inter-word distances used to prune exact lookups
+    void UpdateCentroidTables();
+
+    // Each row is a word (always continuous so rows can be walked with a single pointer)
+    cv::Mat mWords;
+
+    // Squared norm of each word (1 x mWordCount), precomputed for batch assignment
+    cv::Mat mWordNorms;
+
+    // Squared distance between every pair of words (mWordCount x mWordCount) and squared half
+    // distance from each word to its closest other word (1 x mWordCount). Empty when the
+    // dictionary is too large.
+    cv::Mat mPairDist;
+    cv::Mat mHalfMinDist;
+
+    // Hierarchical dictionary (not owned), 0 when lookups scan mWords
+    const CVocabularyTree* mpTree;
+
+    // Approximate nearest word index, 0 when lookups are exact
+    cv::flann::Index* mpIndex;
+    int mIndexTrees;
+    int mIndexChecks;
+
+    // Fingerprint of the words (or tree) before the index settings are mixed in
+    uint64_t mDictionaryFingerprint;
+
+    // Partial distance search counters (updated by const lookups, possibly from many threads)
+    mutable std::atomic<uint64_t> mDimsEvaluated;
+    mutable std::atomic<uint64_t> mDimsTotal;
+
+    int mWordCount;
+    int mDescriptorLength;
+    bool mBinary;
+};
+#endif //end #ifndef WORD_QUANTIZER_H
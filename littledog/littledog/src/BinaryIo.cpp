@@ -0,0 +1,243 @@
+#include "BinaryIo.h"
+
+#include <cstring>
+
+using namespace cv;
+using namespace std;
+
+// Reads back as a different value when the file was written with the other byte order
+const uint32_t ByteOrderMark = 0x01020304;
+
+// Reflected CRC-32 polynomial
+const uint32_t CrcPolynomial = 0xEDB88320;
+
+//=================================================================================================
+// Description:
+//  Lookup tables of the slice by 4 CRC: Table[0] is the classic byte table and Table[k] advances
+//  a byte k more positions, so four input bytes are folded in per step.
+//=================================================================================================
+struct SCrcTables
+{
+  uint32_t mTable[4][256];
+
+  SCrcTables()
+  {
+    for (uint32_t i = 0; i < 256; i++)
+    {
+      uint32_t Crc = i;
+      for (int Bit = 0; Bit < 8; Bit++)
+      {
+        Crc = (Crc & 1) ? (Crc >> 1) ^ CrcPolynomial : (Crc >> 1);
+      }
+      mTable[0][i] = Crc;
+    }
+
+    for (uint32_t i = 0; i < 256; i++)
+    {
+      for (int k = 1; k < 4; k++)
+      {
+        const uint32_t Previous = mTable[k - 1][i];
+        mTable[k][i] = (Previous >> 8) ^ mTable[0][Previous & 0xFF];
+      }
+    }
+  }
+};
+
+//=================================================================================================
+//=================================================================================================
+struct SFileHeader
+{
+  char mTag[4];
+  uint32_t mVersion;
+  uint32_t mByteOrder;
+};
+
+//=================================================================================================
+// Description:
+//  Matrix shape as stored ahead of the elements
+//=================================================================================================
+struct SMatShape
+{
+  int32_t mRows;
+  int32_t mCols;
+  int32_t mType;
+};
+
+//=================================================================================================
+// Description:
+//  Bytes left in Is after the current position (0 if the stream cannot seek)
+//=================================================================================================
+static uint64_t GetRemaining(istream& Is)
+{
+  const streampos Position = Is.tellg();
+  if (Position < 0) return 0;
+
+  Is.seekg(0, ios::end);
+  const streampos End = Is.tellg();
+  Is.seekg(Position);
+
+  return (End > Position) ? (uint64_t)(End - Position) : 0;
+}
+
+//=================================================================================================
+// Description:
+//  Reads the byte count of a section and checks that the section fits in the rest of the file
+//  (a corrupt count must not turn into a huge allocation)
+//=================================================================================================
+static bool ReadSectionSize(istream& Is, uint64_t& Bytes)
+{
+  Bytes = 0;
+  Is.read(reinterpret_cast<char*>(&Bytes), sizeof(Bytes));
+
+  return Is && (Bytes + sizeof(uint32_t) <= GetRemaining(Is));
+}
+
+//=================================================================================================
+// Description:
+//  Reads the CRC that ends a section and compares it with the CRC of pData
+//=================================================================================================
+static bool ReadSectionCrc(istream& Is, const void* pData, uint64_t Bytes)
+{
+  uint32_t Crc = 0;
+  Is.read(reinterpret_cast<char*>(&Crc), sizeof(Crc));
+
+  return Is && (Crc == CBinaryIo::Crc32(pData, (size_t)Bytes));
+}
+
+//=================================================================================================
+// Description:
+//  The bytes are combined into words one at a time, so the result does not depend on the byte
+//  order of the machine.
+//=================================================================================================
+uint32_t CBinaryIo::Crc32(const void* pData, size_t Bytes, uint32_t Crc)
+{
+  static const SCrcTables Tables;
+  const uint32_t (&Table)[4][256] = Tables.mTable;
+
+  const unsigned char* p = static_cast<const unsigned char*>(pData);
+  Crc = ~Crc;
+
+  for (; Bytes >= 4; Bytes -= 4, p += 4)
+  {
+    Crc ^= (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) |
+      ((uint32_t)p[3] << 24);
+    Crc =
+      Table[3][Crc & 0xFF] ^ Table[2][(Crc >> 8) & 0xFF] ^
+      Table[1][(Crc >> 16) & 0xFF] ^ Table[0][Crc >> 24];
+  }
+
+  for (; Bytes > 0; Bytes--, p++)
+  {
+    Crc = (Crc >> 8) ^ Table[0][(Crc ^ *p) & 0xFF];
+  }
+
+  return ~Crc;
+}
+
+//=================================================================================================
+//=================================================================================================
+bool CBinaryIo::WriteHeader(ostream& Os, const char* pTag, uint32_t Version)
+{
+  SFileHeader Header;
+  memcpy(Header.mTag, pTag, sizeof(Header.mTag));
+  Header.mVersion = Version;
+  Header.mByteOrder = ByteOrderMark;
+
+  Os.write(reinterpret_cast<const char*>(&Header), sizeof(Header));
+  return Os.good();
+}
+
+//=================================================================================================
+//=================================================================================================
+bool CBinaryIo::ReadHeader(istream& Is, const char* pTag, uint32_t Version)
+{
+  SFileHeader Header;
+  Is.read(reinterpret_cast<char*>(&Header), sizeof(Header));
+
+  return Is &&
+    (memcmp(Header.mTag, pTag, sizeof(Header.mTag)) == 0) &&
+    (Header.mVersion == Version) &&
+    (Header.mByteOrder == ByteOrderMark);
+}
+
+//=================================================================================================
+//=================================================================================================
+bool CBinaryIo::WriteSection(ostream& Os, const void* pData, uint64_t Bytes)
+{
+  const uint32_t Crc = Crc32(pData, (size_t)Bytes);
+
+  Os.write(reinterpret_cast<const char*>(&Bytes), sizeof(Bytes));
+  if (Bytes > 0) Os.write(static_cast<const char*>(pData), (streamsize)Bytes);
+  Os.write(reinterpret_cast<const char*>(&Crc), sizeof(Crc));
+
+  return Os.good();
+}
+
+//=================================================================================================
+//=================================================================================================
+bool CBinaryIo::ReadSection(istream& Is, void* pData, uint64_t Bytes)
+{
+  uint64_t StoredBytes = 0;
+  if (!ReadSectionSize(Is, StoredBytes) || (StoredBytes != Bytes)) return false;
+
+  if (Bytes > 0) Is.read(static_cast<char*>(pData), (streamsize)Bytes);
+
+  return ReadSectionCrc(Is, pData, Bytes);
+}
+
+//=================================================================================================
+//=================================================================================================
+bool CBinaryIo::ReadSection(istream& Is, vector<char>& Data)
+{
+  uint64_t Bytes = 0;
+  if (!ReadSectionSize(Is, Bytes)) return false;
+
+  Data.resize((size_t)Bytes);
+  if (Bytes > 0) Is.read(&Data[0], (streamsize)Bytes);
+
+  return ReadSectionCrc(Is, Data.empty() ? 0 : &Data[0], Bytes);
+}
+
+//=================================================================================================
+// Description:
+//  Rows that are not continuous (e.g. a view of a larger matrix) are copied into one block first
+//=================================================================================================
+bool CBinaryIo::WriteMat(ostream& Os, const Mat& Matrix)
+{
+  SMatShape Shape;
+  Shape.mRows = Matrix.rows;
+  Shape.mCols = Matrix.cols;
+  Shape.mType = Matrix.type();
+
+  if (!WriteSection(Os, &Shape, sizeof(Shape))) return false;
+
+  const Mat Continuous = Matrix.isContinuous() ? Matrix : Matrix.clone();
+  const uint64_t Bytes = (uint64_t)Continuous.total()*Continuous.elemSize();
+
+  return WriteSection(Os, Continuous.data, Bytes);
+}
+
+//=================================================================================================
+//=================================================================================================
+bool CBinaryIo::ReadMat(istream& Is, Mat& Matrix, int Type, int Cols)
+{
+  SMatShape Shape;
+  if (!ReadSection(Is, &Shape, sizeof(Shape))) return false;
+
+  if ((Shape.mType != Type) || (Shape.mRows < 0) || (Shape.mCols < 0) ||
+      ((Cols >= 0) && (Shape.mCols != Cols)))
+  {
+    return false;
+  }
+
+  const uint64_t Bytes = (uint64_t)Shape.mRows*Shape.mCols*CV_ELEM_SIZE(Type);
+
+  // Check the size before allocating
+  if (Bytes + sizeof(uint64_t) + sizeof(uint32_t) > GetRemaining(Is)) return false;
+
+  Mat Read(Shape.mRows, Shape.mCols, Type);
+  if (!ReadSection(Is, Read.data, Bytes)) return false;
+
+  Matrix = Read;
+  return true;
+}
@@ -0,0 +1,133 @@
+#include "DescriptorArena.h"
+
+#include <stdint.h>
+
+using namespace cv;
+using namespace std;
+
+//=================================================================================================
+//=================================================================================================
+CDescriptorArena::CDescriptorArena()
+{
+  mOffsets.push_back(0);
+}
+
+//=================================================================================================
+//=================================================================================================
+CDescriptorArena::~CDescriptorArena()
+{
+}
+
+//=================================================================================================
+// Description:
+//  cv::Mat only guarantees 16 byte alignment, so a flat buffer is allocated with room to spare
+//  and the descriptors start at the first aligned element. The sub matrix is a single row (so it
+//  is continuous) and is reshaped to the final size, which keeps the buffer reference counted.
+//=================================================================================================
+bool CDescriptorArena::Allocate(const vector<int>& BlockRows, int Cols, int Type)
+{
+  Release();
+
+  if ((Cols <= 0) || (CV_MAT_CN(Type) != 1)) return false;
+
+  vector<int> Offsets(1, 0);
+  int Rows = 0;
+  for (unsigned i = 0; i < BlockRows.size(); i++)
+  {
+    if (BlockRows[i] < 0) return false;
+    Rows += BlockRows[i];
+    Offsets.push_back(Rows);
+  }
+
+  mOffsets.swap(Offsets);
+
+  if (Rows == 0)
+  {
+    mDescriptors = Mat(0, Cols, Type);
+    return true;
+  }
+
+  const int ElemSize = (int)CV_ELEM_SIZE(Type);
+  const int Pad = Alignment/ElemSize;
+  Mat Buffer(1, Rows*Cols + Pad, Type);
+
+  const uintptr_t Address = reinterpret_cast<uintptr_t>(Buffer.data);
+  const int Skip = (int)(((Alignment - Address % Alignment) % Alignment)/ElemSize);
+
+  mDescriptors = Buffer.colRange(Skip, Skip + Rows*Cols).reshape(1, Rows);
+  return true;
+}
+
+//=================================================================================================
+//=================================================================================================
+bool CDescriptorArena::Adopt(const Mat& Descriptors, const vector<int>& BlockRows)
+{
+  Release();
+
+  if ((Descriptors.data == 0) || !Descriptors.isContinuous()) return false;
+
+  vector<int> Offsets(1, 0);
+  int Rows = 0;
+  for (unsigned i = 0; i < BlockRows.size(); i++)
+  {
+    if (BlockRows[i] < 0) return false;
+    Rows += BlockRows[i];
+    Offsets.push_back(Rows);
+  }
+
+  if (Rows != Descriptors.rows) return false;
+
+  mOffsets.swap(Offsets);
+  mDescriptors = Descriptors;
+  return true;
+}
+
+//=================================================================================================
+//=================================================================================================
+void CDescriptorArena::Release()
+{
+  mDescriptors.release();
+  mOffsets.assign(1, 0);
+}
+
+//=================================================================================================
+//=================================================================================================
+bool CDescriptorArena::IsEmpty() const
+{
+  return mDescriptors.data == 0;
+}
+
+//=================================================================================================
+//=================================================================================================
+int CDescriptorArena::GetBlockCount() const
+{
+  return (int)mOffsets.size() - 1;
+}
+
+//=================================================================================================
+//=================================================================================================
+int CDescriptorArena::GetRowCount() const
+{
+  return mOffsets.back();
+}
+
+//=================================================================================================
+//=================================================================================================
+int CDescriptorArena::GetBlockOffset(int i) const
+{
+  return mOffsets.at(i);
+}
+
+//=================================================================================================
+//=================================================================================================
+Mat CDescriptorArena::GetBlock(int i) const
+{
+  return mDescriptors.rowRange(mOffsets.at(i), mOffsets.at(i + 1));
+}
+
+//=================================================================================================
+//=================================================================================================
+const Mat& CDescriptorArena::GetDescriptors() const
+{
+  return mDescriptors;
+}
@@ -0,0 +1,244 @@
+#include "DescriptorCodec.h"
+
+#include <cstring>
+
+#if defined(__F16C__)
+#include <immintrin.h>
+#endif
+
+using namespace cv;
+using namespace std;
+
+//=================================================================================================
+//=================================================================================================
+bool CDescriptorCodec::Encode(const Mat& Des32, int Type, Mat& Des, Mat& Scale)
+{
+  if (Des32.type() != CV_32F) return false;
+
+  const int Rows = Des32.rows;
+  const int Cols = Des32.cols;
+
+  Scale.release();
+
+  if (Type == CV_32F)
+  {
+    Des = Des32.clone();
+    return true;
+  }
+
+  if (Type == CV_16U)
+  {
+    Des = Mat(Rows, Cols, CV_16U);
+    for (int i = 0; i < Rows; i++)
+    {
+      const float* pIn = Des32.ptr<float>(i);
+      uint16_t* pOut = Des.ptr<uint16_t>(i);
+      for (int k = 0; k < Cols; k++)
+      {
+        pOut[k] = FloatToHalf(pIn[k]);
+      }
+    }
+    return true;
+  }
+
+  if (Type == CV_8S)
+  {
+    // Per dimension scale so that the largest magnitude in each dimension maps to 127
+    Scale = Mat(1, Cols, CV_32F, Scalar(0));
+    float* pScale = Scale.ptr<float>(0);
+
+    for (int i = 0; i < Rows; i++)
+    {
+      const float* pIn = Des32.ptr<float>(i);
+      for (int k = 0; k < Cols; k++)
+      {
+        pScale[k] = max(pScale[k], fabs(pIn[k]));
+      }
+    }
+
+    for (int k = 0; k < Cols; k++)
+    {
+      pScale[k] = (pScale[k] > 0) ? pScale[k]/127.0f : 1.0f;
+    }
+
+    Des = Mat(Rows, Cols, CV_8S);
+    for (int i = 0; i < Rows; i++)
+    {
+      const float* pIn = Des32.ptr<float>(i);
+      signed char* pOut = Des.ptr<signed char>(i);
+      for (int k = 0; k < Cols; k++)
+      {
+        const int Code = cvRound(pIn[k]/pScale[k]);
+        pOut[k] = (signed char)min(127, max(-127, Code));
+      }
+    }
+    return true;
+  }
+
+  return false;
+}
+
+//=================================================================================================
+//=================================================================================================
+void CDescriptorCodec::Decode(const Mat& Des, const Mat& Scale, Mat& Des32)
+{
+  if (Des.type() == CV_32F)
+  {
+    Des32 = Des;
+    return;
+  }
+
+  Des32 = Mat(Des.rows, Des.cols, CV_32F);
+  for (int i = 0; i < Des.rows; i++)
+  {
+    DecodeRow(Des, Scale, i, Des32.ptr<float>(i));
+  }
+}
+
+//=================================================================================================
+//=================================================================================================
+void CDescriptorCodec::DecodeRow(const Mat& Des, const Mat& Scale, int Row, float* pOut)
+{
+  const int Cols = Des.cols;
+
+  switch (Des.type())
+  {
+    case CV_32F:
+      memcpy(pOut, Des.ptr<float>(Row), Cols*sizeof(float));
+    break;
+
+    case CV_16U:
+    {
+      const uint16_t* pIn = Des.ptr<uint16_t>(Row);
+      int k = 0;
+#if defined(__F16C__)
+      for (; k + 8 <= Cols; k += 8)
+      {
+        __m128i Half = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pIn + k));
+        _mm256_storeu_ps(pOut + k, _mm256_cvtph_ps(Half));
+      }
+#endif
+      for (; k < Cols; k++)
+      {
+        pOut[k] = HalfToFloat(pIn[k]);
+      }
+    }
+    break;
+
+    case CV_8S:
+    {
+      const signed char* pIn = Des.ptr<signed char>(Row);
+      const float* pScale = Scale.ptr<float>(0);
+      for (int k = 0; k < Cols; k++)
+      {
+        pOut[k] = (float)pIn[k]*pScale[k];
+      }
+    }
+    break;
+  }
+}
+
+//=================================================================================================
+//=================================================================================================
+const float* CDescriptorCodec::GetRow(const Mat& Des, const Mat& Scale, int Row, float* pBuffer)
+{
+  if (Des.type() == CV_32F) return Des.ptr<float>(Row);
+
+  DecodeRow(Des, Scale, Row, pBuffer);
+  return pBuffer;
+}
+
+//=================================================================================================
+//=================================================================================================
+bool CDescriptorCodec::IsSupported(const Mat& Des, const Mat& Scale)
+{
+  switch (Des.type())
+  {
+    case CV_32F:
+    case CV_16U:
+      return true;
+    case CV_8S:
+      return (Scale.type() == CV_32F) && (Scale.rows == 1) && (Scale.cols == Des.cols);
+    default:
+      return false;
+  }
+}
+
+//=================================================================================================
+//=================================================================================================
+float CDescriptorCodec::HalfToFloat(uint16_t Half)
+{
+#if defined(__F16C__)
+  return _cvtsh_ss(Half);
+#else
+  const uint32_t Sign = (uint32_t)(Half & 0x8000) << 16;
+  const uint32_t Exp = (Half >> 10) & 0x1F;
+  const uint32_t Mant = Half & 0x3FF;
+  uint32_t Bits;
+
+  if (Exp == 0)
+  {
+    // Zero or subnormal (Mant*2^-24)
+    const float Value = (float)Mant*(1.0f/16777216.0f);
+    return Sign ? -Value : Value;
+  }
+  else if (Exp == 31)
+  {
+    // Inf or NaN
+    Bits = Sign | 0x7F800000 | (Mant << 13);
+  }
+  else
+  {
+    Bits = Sign | ((Exp + 112) << 23) | (Mant << 13);
+  }
+
+  float Value;
+  memcpy(&Value, &Bits, sizeof(Value));
+  return Value;
+#endif
+}
+
+//=================================================================================================
+// Round to nearest even
+//=================================================================================================
+uint16_t CDescriptorCodec::FloatToHalf(float Value)
+{
+#if defined(__F16C__)
+  return _cvtss_sh(Value, 0);
+#else
+  uint32_t Bits;
+  memcpy(&Bits, &Value, sizeof(Bits));
+
+  const uint32_t Sign = (Bits >> 16) & 0x8000;
+  const uint32_t Abs = Bits & 0x7FFFFFFF;
+
+  // Inf or NaN
+  if (Abs >= 0x7F800000) return (uint16_t)(Sign | ((Abs > 0x7F800000) ? 0x7E00 : 0x7C00));
+
+  // Rounds to infinity (65520 and above)
+  if (Abs >= 0x477FF000) return (uint16_t)(Sign | 0x7C00);
+
+  // Subnormal half (below 2^-14)
+  if (Abs < 0x38800000)
+  {
+    // Less than half of the smallest subnormal
+    if (Abs < 0x33000000) return (uint16_t)Sign;
+
+    const uint32_t Mant = (Abs & 0x007FFFFF) | 0x00800000;
+    const int Shift = 126 - (int)(Abs >> 23);
+    uint32_t Half = Mant >> Shift;
+    const uint32_t Rem = Mant & ((1u << Shift) - 1);
+    const uint32_t HalfWay = 1u << (Shift - 1);
+
+    if ((Rem > HalfWay) || ((Rem == HalfWay) && (Half & 1))) Half++;
+    return (uint16_t)(Sign | Half);
+  }
+
+  // Normal, rebias the exponent (127 -> 15) and round the mantissa
+  uint32_t Half = (Abs - 0x38000000) >> 13;
+  const uint32_t Rem = Abs & 0x1FFF;
+
+  if ((Rem > 0x1000) || ((Rem == 0x1000) && (Half & 1))) Half++;
+  return (uint16_t)(Sign | Half);
+#endif
+}
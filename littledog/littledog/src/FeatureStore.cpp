@@ -0,0 +1,518 @@
+#include "FeatureStore.h"
+#include "RecognitionEntry.h"
+#include "BinaryIo.h"
+
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <cstring>
+#include <cstddef>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace cv;
+using namespace std;
+
+// Identifies a feature store file
+static const char StoreMagic[8] = {'L', 'D', 'F', 'S', 'T', 'O', 'R', 'E'};
+
+// Reads back as a different value when the store was written with the other byte order
+const uint32_t StoreByteOrder = 0x01020304;
+
+// Number of key point arrays (x, y, size, angle, response, octave, class id)
+const int KeyPointFields = 7;
+
+//=================================================================================================
+//=================================================================================================
+struct CFeatureStore::SHeader
+{
+  char mMagic[8];
+  uint32_t mVersion;
+  uint32_t mEntryCount;
+  int32_t mType;
+  int32_t mCols;
+  uint64_t mRowCount;
+  uint64_t mEntriesOffset;
+  uint64_t mNamesOffset;
+  uint64_t mNamesSize;
+  uint64_t mKeyPointsOffset; // First array, the others follow every KeyPointStride bytes
+  uint64_t mKeyPointStride;
+  uint64_t mScalesOffset; // 0 without scales
+  uint64_t mDescriptorsOffset;
+  uint64_t mFileSize;
+  uint32_t mByteOrder;
+  uint32_t mTableCrc; // Everything from the entries up to the descriptors
+  uint32_t mDescriptorsCrc;
+  uint32_t mHeaderCrc; // Every field above
+};
+
+//=================================================================================================
+//=================================================================================================
+struct CFeatureStore::SEntry
+{
+  uint64_t mFirstRow;
+  uint32_t mRows;
+  int32_t mImageHeight;
+  int32_t mImageWidth;
+  uint32_t mNameOffset; // In the names section
+  uint32_t mNameLength;
+  uint32_t mReserved;
+};
+
+//=================================================================================================
+// Description:
+//  Round Offset up to the next multiple of CFeatureStore::Alignment
+//=================================================================================================
+static uint64_t AlignOffset(uint64_t Offset)
+{
+  const uint64_t Alignment = CFeatureStore::Alignment;
+  return (Offset + Alignment - 1)/Alignment*Alignment;
+}
+
+//=================================================================================================
+// Description:
+//  Write Bytes bytes and add them to the running checksum Crc
+//=================================================================================================
+static void WriteChecked(ofstream& Os, const void* pData, uint64_t Bytes, uint32_t& Crc)
+{
+  if (Bytes == 0) return;
+
+  Os.write(static_cast<const char*>(pData), (streamsize)Bytes);
+  Crc = CBinaryIo::Crc32(pData, (size_t)Bytes, Crc);
+}
+
+//=================================================================================================
+// Description:
+//  Write zeros up to Offset (sections are aligned)
+//=================================================================================================
+static void WritePadding(ofstream& Os, uint64_t Offset, uint32_t& Crc)
+{
+  static const char Zeros[CFeatureStore::Alignment] = {0};
+
+  const uint64_t Position = (uint64_t)Os.tellp();
+  if (Offset > Position) WriteChecked(Os, Zeros, Offset - Position, Crc);
+}
+
+//=================================================================================================
+//=================================================================================================
+CFeatureStore::CFeatureStore()
+ : mpData(0),
+   mSize(0),
+   mpHeader(0),
+   mpEntries(0)
+{
+}
+
+//=================================================================================================
+//=================================================================================================
+CFeatureStore::~CFeatureStore()
+{
+  Close();
+}
+
+//=================================================================================================
+// Description:
+//  Every section is checked against the file size, and the header and tables against their
+//  checksums, before anything is handed out, so a truncated or foreign file is rejected instead
+//  of faulting later. The descriptor block is left to VerifyDescriptors: checksumming it would
+//  fault in every page of the mapping on every open.
+//=================================================================================================
+bool CFeatureStore::Open(const string& FileName, int Type)
+{
+  Close();
+
+  const int Fd = open(FileName.c_str(), O_RDONLY);
+  if (Fd < 0) return false;
+
+  struct stat Status;
+  if ((fstat(Fd, &Status) != 0) || (Status.st_size < (off_t)sizeof(SHeader)))
+  {
+    close(Fd);
+    return false;
+  }
+
+  mSize = (size_t)Status.st_size;
+
+  // Private so that views of the descriptors can never write through to the file
+  void* pMap = mmap(0, mSize, PROT_READ|PROT_WRITE, MAP_PRIVATE, Fd, 0);
+  close(Fd);
+
+  if (pMap == MAP_FAILED)
+  {
+    mSize = 0;
+    return false;
+  }
+
+  mpData = static_cast<unsigned char*>(pMap);
+  mpHeader = reinterpret_cast<const SHeader*>(mpData);
+
+  const SHeader& Header = *mpHeader;
+
+  const uint64_t ElemSize = CV_ELEM_SIZE(Type);
+  const uint64_t Rows = Header.mRowCount;
+  const uint64_t EntriesEnd = Header.mEntriesOffset + Header.mEntryCount*sizeof(SEntry);
+  const uint64_t KeyPointsEnd = Header.mKeyPointsOffset + KeyPointFields*Header.mKeyPointStride;
+  const uint64_t DescriptorsEnd = Header.mDescriptorsOffset + Rows*Header.mCols*ElemSize;
+
+  bool Valid =
+    (memcmp(Header.mMagic, StoreMagic, sizeof(StoreMagic)) == 0) &&
+    (Header.mVersion == Version) &&
+    (Header.mByteOrder == StoreByteOrder) &&
+    (Header.mHeaderCrc == CBinaryIo::Crc32(&Header, offsetof(SHeader, mHeaderCrc))) &&
+    (Header.mType == Type) &&
+    (Header.mCols > 0) &&
+    (Header.mFileSize == mSize) &&
+    (EntriesEnd <= mSize) &&
+    (Header.mNamesOffset + Header.mNamesSize <= mSize) &&
+    (Header.mKeyPointStride >= Rows*sizeof(float)) &&
+    (KeyPointsEnd <= mSize) &&
+    (Header.mDescriptorsOffset % Alignment == 0) &&
+    (DescriptorsEnd <= mSize) &&
+    ((Type != CV_8S) ||
+     ((Header.mScalesOffset > 0) &&
+      (Header.mScalesOffset + Header.mEntryCount*Header.mCols*sizeof(float) <= mSize))) &&
+    (Header.mEntriesOffset <= Header.mDescriptorsOffset);
+
+  Valid = Valid &&
+    (Header.mTableCrc == CBinaryIo::Crc32(
+      mpData + Header.mEntriesOffset, Header.mDescriptorsOffset - Header.mEntriesOffset));
+
+  if (Valid)
+  {
+    mpEntries = reinterpret_cast<const SEntry*>(mpData + Header.mEntriesOffset);
+
+    // Entries must tile the descriptor rows in order
+    uint64_t Row = 0;
+    for (uint32_t k = 0; Valid && (k < Header.mEntryCount); k++)
+    {
+      const SEntry& Entry = mpEntries[k];
+      Valid = (Entry.mFirstRow == Row) &&
+        ((uint64_t)Entry.mNameOffset + Entry.mNameLength <= Header.mNamesSize);
+      Row += Entry.mRows;
+
+      if (Valid) mNames[GetName(k)] = (int)k;
+    }
+    Valid = Valid && (Row == Rows);
+  }
+
+  if (!Valid)
+  {
+    Close();
+    return false;
+  }
+
+  return true;
+}
+
+//=================================================================================================
+//=================================================================================================
+void CFeatureStore::Close()
+{
+  if (mpData) munmap(mpData, mSize);
+
+  mpData = 0;
+  mSize = 0;
+  mpHeader = 0;
+  mpEntries = 0;
+  mNames.clear();
+}
+
+//=================================================================================================
+//=================================================================================================
+bool CFeatureStore::IsOpen() const
+{
+  return (mpData != 0);
+}
+
+//=================================================================================================
+//=================================================================================================
+bool CFeatureStore::VerifyDescriptors() const
+{
+  if (!mpHeader) return false;
+
+  return (mpHeader->mDescriptorsCrc == CBinaryIo::Crc32(
+    mpData + mpHeader->mDescriptorsOffset, mSize - mpHeader->mDescriptorsOffset));
+}
+
+//=================================================================================================
+//=================================================================================================
+int CFeatureStore::GetEntryCount() const
+{
+  return mpHeader ? (int)mpHeader->mEntryCount : 0;
+}
+
+//=================================================================================================
+//=================================================================================================
+int CFeatureStore::Find(const string& Name) const
+{
+  map<string, int>::const_iterator it = mNames.find(Name);
+  return (it == mNames.end()) ? -1 : it->second;
+}
+
+//=================================================================================================
+//=================================================================================================
+const CFeatureStore::SEntry& CFeatureStore::GetEntryRecord(int k) const
+{
+  return mpEntries[k];
+}
+
+//=================================================================================================
+//=================================================================================================
+string CFeatureStore::GetName(int k) const
+{
+  const SEntry& Entry = GetEntryRecord(k);
+  const char* pNames = reinterpret_cast<const char*>(mpData + mpHeader->mNamesOffset);
+
+  return string(pNames + Entry.mNameOffset, Entry.mNameLength);
+}
+
+//=================================================================================================
+//=================================================================================================
+int CFeatureStore::GetFirstRow(int k) const
+{
+  if (k == GetEntryCount()) return (int)mpHeader->mRowCount;
+
+  return (int)GetEntryRecord(k).mFirstRow;
+}
+
+//=================================================================================================
+//=================================================================================================
+bool CFeatureStore::GetEntry(
+  int k,
+  vector<KeyPoint>& KeyPoints,
+  Mat& Des,
+  Mat& Scale,
+  int& ImageHeight,
+  int& ImageWidth) const
+{
+  if (!IsOpen() || (k < 0) || (k >= GetEntryCount())) return false;
+
+  const SHeader& Header = *mpHeader;
+  const SEntry& Entry = GetEntryRecord(k);
+  const int Rows = (int)Entry.mRows;
+  const uint64_t First = Entry.mFirstRow;
+
+  // Key point arrays of this entry
+  const unsigned char* pArrays = mpData + Header.mKeyPointsOffset + First*sizeof(float);
+  const uint64_t Stride = Header.mKeyPointStride;
+
+  const float* pX        = reinterpret_cast<const float*>(pArrays);
+  const float* pY        = reinterpret_cast<const float*>(pArrays + Stride);
+  const float* pSize     = reinterpret_cast<const float*>(pArrays + 2*Stride);
+  const float* pAngle    = reinterpret_cast<const float*>(pArrays + 3*Stride);
+  const float* pResponse = reinterpret_cast<const float*>(pArrays + 4*Stride);
+  const int32_t* pOctave  = reinterpret_cast<const int32_t*>(pArrays + 5*Stride);
+  const int32_t* pClassId = reinterpret_cast<const int32_t*>(pArrays + 6*Stride);
+
+  KeyPoints.resize(Rows);
+  for (int i = 0; i < Rows; i++)
+  {
+    KeyPoints[i] =
+      KeyPoint(pX[i], pY[i], pSize[i], pAngle[i], pResponse[i], pOctave[i], pClassId[i]);
+  }
+
+  const size_t RowSize = Header.mCols*CV_ELEM_SIZE(Header.mType);
+  Des = Mat(Rows, Header.mCols, Header.mType, mpData + Header.mDescriptorsOffset + First*RowSize);
+
+  Scale.release();
+  if (Header.mScalesOffset > 0)
+  {
+    const float* pScale = reinterpret_cast<const float*>(mpData + Header.mScalesOffset) +
+      (size_t)k*Header.mCols;
+    Scale = Mat(1, Header.mCols, CV_32F, const_cast<float*>(pScale)).clone();
+  }
+
+  ImageHeight = Entry.mImageHeight;
+  ImageWidth = Entry.mImageWidth;
+
+  return true;
+}
+
+//=================================================================================================
+//=================================================================================================
+Mat CFeatureStore::GetDescriptors() const
+{
+  if (!IsOpen()) return Mat();
+
+  return Mat(
+    (int)mpHeader->mRowCount, mpHeader->mCols, mpHeader->mType,
+    mpData + mpHeader->mDescriptorsOffset);
+}
+
+//=================================================================================================
+//=================================================================================================
+bool CFeatureStore::Write(
+  const string& FileName,
+  const vector<CRecognitionEntry>& Entries,
+  const vector<string>& Names)
+{
+  if (Names.size() != Entries.size()) return false;
+
+  SHeader Header;
+  memset(&Header, 0, sizeof(Header));
+  memcpy(Header.mMagic, StoreMagic, sizeof(StoreMagic));
+  Header.mVersion = Version;
+  Header.mByteOrder = StoreByteOrder;
+  Header.mEntryCount = (uint32_t)Entries.size();
+  Header.mType = -1;
+
+  // Entry table and names
+  vector<SEntry> Records(Entries.size());
+  string AllNames;
+
+  for (unsigned k = 0; k < Entries.size(); k++)
+  {
+    const Mat& Des = Entries[k].GetDescriptors();
+
+    if (Des.rows > 0)
+    {
+      if (Header.mType < 0)
+      {
+        Header.mType = Des.type();
+        Header.mCols = Des.cols;
+      }
+      else if ((Des.type() != Header.mType) || (Des.cols != Header.mCols))
+      {
+        return false;
+      }
+    }
+
+    SEntry& Record = Records[k];
+    memset(&Record, 0, sizeof(Record));
+    Record.mFirstRow = Header.mRowCount;
+    Record.mRows = (uint32_t)Des.rows;
+    Record.mImageHeight = Entries[k].GetImageHeight();
+    Record.mImageWidth = Entries[k].GetImageWidth();
+    Record.mNameOffset = (uint32_t)AllNames.size();
+    Record.mNameLength = (uint32_t)Names[k].size();
+
+    AllNames += Names[k];
+    Header.mRowCount += Des.rows;
+  }
+
+  if ((Header.mType < 0) || (Header.mCols <= 0)) return false;
+
+  const uint64_t Rows = Header.mRowCount;
+  const uint64_t RowSize = Header.mCols*CV_ELEM_SIZE(Header.mType);
+
+  // Section offsets
+  Header.mEntriesOffset = AlignOffset(sizeof(SHeader));
+  Header.mNamesOffset = AlignOffset(Header.mEntriesOffset + Records.size()*sizeof(SEntry));
+  Header.mNamesSize = AllNames.size();
+  Header.mKeyPointsOffset = AlignOffset(Header.mNamesOffset + Header.mNamesSize);
+  Header.mKeyPointStride = AlignOffset(Rows*sizeof(float));
+
+  uint64_t Offset = Header.mKeyPointsOffset + KeyPointFields*Header.mKeyPointStride;
+  if (Header.mType == CV_8S)
+  {
+    Header.mScalesOffset = AlignOffset(Offset);
+    Offset = Header.mScalesOffset + Entries.size()*Header.mCols*sizeof(float);
+  }
+  Header.mDescriptorsOffset = AlignOffset(Offset);
+  Header.mFileSize = Header.mDescriptorsOffset + Rows*RowSize;
+
+  // Other processes may write the same (shared) store at the same time
+  ostringstream TempName;
+  TempName << FileName << "." << getpid() << ".tmp";
+  const string TempFileName = TempName.str();
+  ofstream Os(TempFileName.c_str(), ios::out|ios::binary|ios::trunc);
+  if (!Os) return false;
+
+  // The header is rewritten with the checksums once everything else is out
+  Os.write(reinterpret_cast<const char*>(&Header), sizeof(Header));
+
+  uint32_t Crc = 0;
+  WritePadding(Os, Header.mEntriesOffset, Crc);
+
+  Crc = 0;
+  if (!Records.empty())
+  {
+    WriteChecked(Os, &Records[0], Records.size()*sizeof(SEntry), Crc);
+  }
+
+  WritePadding(Os, Header.mNamesOffset, Crc);
+  WriteChecked(Os, AllNames.data(), AllNames.size(), Crc);
+
+  // Key points, one field at a time
+  vector<float> Values(Rows);
+  for (int Field = 0; Field < KeyPointFields; Field++)
+  {
+    WritePadding(Os, Header.mKeyPointsOffset + Field*Header.mKeyPointStride, Crc);
+
+    uint64_t i = 0;
+    for (unsigned k = 0; k < Entries.size(); k++)
+    {
+      const vector<KeyPoint>& KeyPoints = Entries[k].GetKeyPoints();
+      for (int j = 0; j < Entries[k].GetDescriptors().rows; j++, i++)
+      {
+        const KeyPoint& Point = KeyPoints.at(j);
+        switch (Field)
+        {
+          case 0: Values[i] = Point.pt.x; break;
+          case 1: Values[i] = Point.pt.y; break;
+          case 2: Values[i] = Point.size; break;
+          case 3: Values[i] = Point.angle; break;
+          case 4: Values[i] = Point.response; break;
+          case 5: memcpy(&Values[i], &Point.octave, sizeof(float)); break;
+          default: memcpy(&Values[i], &Point.class_id, sizeof(float)); break;
+        }
+      }
+    }
+
+    if (Rows > 0) WriteChecked(Os, &Values[0], Rows*sizeof(float), Crc);
+  }
+
+  if (Header.mScalesOffset > 0)
+  {
+    WritePadding(Os, Header.mScalesOffset, Crc);
+
+    vector<float> Unit(Header.mCols, 1.0f);
+    for (unsigned k = 0; k < Entries.size(); k++)
+    {
+      const Mat& Scale = Entries[k].GetDescriptorScale();
+      const float* pScale = (Scale.cols == Header.mCols) ? Scale.ptr<float>(0) : &Unit[0];
+      WriteChecked(Os, pScale, Header.mCols*sizeof(float), Crc);
+    }
+  }
+
+  // Descriptors, a whole entry per write when its rows are continuous
+  WritePadding(Os, Header.mDescriptorsOffset, Crc);
+  Header.mTableCrc = Crc;
+
+  Crc = 0;
+  for (unsigned k = 0; k < Entries.size(); k++)
+  {
+    const Mat& Des = Entries[k].GetDescriptors();
+    if (Des.rows == 0) continue;
+
+    if (Des.isContinuous())
+    {
+      WriteChecked(Os, Des.ptr(0), Des.rows*RowSize, Crc);
+    }
+    else
+    {
+      for (int j = 0; j < Des.rows; j++)
+      {
+        WriteChecked(Os, Des.ptr(j), RowSize, Crc);
+      }
+    }
+  }
+
+  Header.mDescriptorsCrc = Crc;
+  Header.mHeaderCrc = CBinaryIo::Crc32(&Header, offsetof(SHeader, mHeaderCrc));
+
+  Os.seekp(0);
+  Os.write(reinterpret_cast<const char*>(&Header), sizeof(Header));
+
+  Os.close();
+  if (!Os)
+  {
+    remove(TempFileName.c_str());
+    return false;
+  }
+
+  return (rename(TempFileName.c_str(), FileName.c_str()) == 0);
+}
@@ -0,0 +1,327 @@
+#include "KMajority.h"
+#include "WordQuantizer.h"
+
+#include <algorithm>
+#include <climits>
+#include <cstring>
+
+using namespace cv;
+using namespace std;
+
+// Hash stream of the k-means++ seeding (see CKMeans::HashUniform)
+const uint64_t InitStream = 0;
+
+// Rows per block of the parallel loops
+const int BlockRows = 1024;
+
+//=================================================================================================
+// Description:
+//  Parallel body that updates the nearest center of every row of Data with the rows of Centers
+//  (labels start at FirstLabel). A row takes a center when it is strictly closer than MinDist.
+//  The block's sum of the updated squared MinDist goes to BlockSums (D^2 sampling weights).
+//=================================================================================================
+class CNearestBinaryBody : public ParallelLoopBody
+{
+  public:
+    CNearestBinaryBody(
+      const Mat& Data,
+      const Mat& Centers,
+      int FirstLabel,
+      vector<int>& Nearest,
+      vector<int>& MinDist,
+      vector<double>& BlockSums)
+     : mData(Data),
+       mCenters(Centers),
+       mFirstLabel(FirstLabel),
+       mNearest(Nearest),
+       mMinDist(MinDist),
+       mBlockSums(BlockSums)
+    {
+    }
+
+    void operator()(const Range& Blocks) const
+    {
+      const int Bytes = mData.cols;
+
+      for (int b = Blocks.start; b < Blocks.end; b++)
+      {
+        const int Start = b*BlockRows;
+        const int End = min(mData.rows, Start + BlockRows);
+        double Sum = 0;
+
+        for (int i = Start; i < End; i++)
+        {
+          const unsigned char* pRow = mData.ptr<unsigned char>(i);
+          int& MinDist = mMinDist[i];
+          int& Nearest = mNearest[i];
+
+          for (int c = 0; c < mCenters.rows && MinDist > 0; c++)
+          {
+            const int Dist =
+              CWordQuantizer::HammingDistance(pRow, mCenters.ptr<unsigned char>(c), Bytes);
+            if (Dist < MinDist)
+            {
+              MinDist = Dist;
+              Nearest = mFirstLabel + c;
+            }
+          }
+          Sum += (double)MinDist*MinDist;
+        }
+        mBlockSums[b] = Sum;
+      }
+    }
+
+  private:
+    const Mat& mData;
+    const Mat& mCenters;
+    const int mFirstLabel;
+    vector<int>& mNearest;
+    vector<int>& mMinDist;
+    vector<double>& mBlockSums;
+};
+
+//=================================================================================================
+// Description:
+//  Parallel body that counts, for every center and bit, how many of the rows assigned to the
+//  center have the bit set. Every task owns a range of bytes (columns) so no two tasks write
+//  the same counter and the counts do not depend on the scheduling.
+//=================================================================================================
+class CBitVoteBody : public ParallelLoopBody
+{
+  public:
+    CBitVoteBody(const Mat& Data, const vector<int>& Labels, vector<int>& Votes)
+     : mData(Data),
+       mLabels(Labels),
+       mVotes(Votes)
+    {
+    }
+
+    void operator()(const Range& Bytes) const
+    {
+      const int Bits = 8*mData.cols;
+
+      for (int i = 0; i < mData.rows; i++)
+      {
+        const unsigned char* pRow = mData.ptr<unsigned char>(i);
+        int* pVotes = &mVotes[mLabels[i]*Bits];
+
+        for (int k = Bytes.start; k < Bytes.end; k++)
+        {
+          const unsigned char Byte = pRow[k];
+          for (int Bit = 0; Bit < 8; Bit++)
+          {
+            pVotes[8*k + Bit] += (Byte >> Bit) & 1;
+          }
+        }
+      }
+    }
+
+  private:
+    const Mat& mData;
+    const vector<int>& mLabels;
+    vector<int>& mVotes;
+};
+
+//=================================================================================================
+//=================================================================================================
+CKMajority::CKMajority(const SKMeansParams& Params)
+ : mParams(Params),
+   mCompactness(0),
+   mIterationsRun(0)
+{
+}
+
+//=================================================================================================
+//=================================================================================================
+CKMajority::~CKMajority()
+{
+}
+
+//=================================================================================================
+//=================================================================================================
+double CKMajority::GetCompactness() const
+{
+  return mCompactness;
+}
+
+//=================================================================================================
+//=================================================================================================
+int CKMajority::GetIterationsRun() const
+{
+  return mIterationsRun;
+}
+
+//=================================================================================================
+//=================================================================================================
+double CKMajority::Assign(
+  const Mat& Data,
+  const Mat& Centers,
+  vector<int>& Labels,
+  vector<int>* pDists)
+{
+  const int BlockCount = (Data.rows + BlockRows - 1)/BlockRows;
+  vector<int> Dists(Data.rows, INT_MAX);
+  vector<double> BlockSums(BlockCount, 0.0);
+
+  Labels.assign(Data.rows, 0);
+
+  parallel_for_(
+    Range(0, BlockCount), CNearestBinaryBody(Data, Centers, 0, Labels, Dists, BlockSums));
+
+  double Sum = 0;
+  for (int i = 0; i < Data.rows; i++)
+  {
+    Sum += Dists[i];
+  }
+
+  if (pDists) pDists->swap(Dists);
+  return Sum;
+}
+
+//=================================================================================================
+// Description:
+//  k-means++ seeding with Hamming distances: every center after the first is a row drawn with
+//  probability proportional to its squared distance to the nearest center so far
+//=================================================================================================
+bool CKMajority::InitCenters(const Mat& Data, int K, Mat& Centers) const
+{
+  const int Rows = Data.rows;
+  const int BlockCount = (Rows + BlockRows - 1)/BlockRows;
+
+  Centers = Mat(K, Data.cols, CV_8U);
+
+  vector<int> Nearest(Rows, 0);
+  vector<int> MinDist(Rows, INT_MAX);
+  vector<double> BlockSums(BlockCount, 0.0);
+
+  int Row = min(Rows - 1, (int)(CKMeans::HashUniform(mParams.mSeed, InitStream, 0)*Rows));
+
+  for (int c = 0; c < K; c++)
+  {
+    memcpy(Centers.ptr<unsigned char>(c), Data.ptr<unsigned char>(Row), Data.cols);
+
+    if (c == K - 1) break;
+
+    parallel_for_(
+      Range(0, BlockCount),
+      CNearestBinaryBody(Data, Centers.rowRange(c, c + 1), c, Nearest, MinDist, BlockSums));
+
+    double Phi = 0;
+    for (int b = 0; b < BlockCount; b++)
+    {
+      Phi += BlockSums[b];
+    }
+
+    double Target = CKMeans::HashUniform(mParams.mSeed, InitStream, c + 1)*Phi;
+
+    if (Phi <= 0)
+    {
+      // Every row coincides with a center already, any row will do
+      Row = min(Rows - 1, (int)(Target/max(Phi, 1.0)*Rows));
+      continue;
+    }
+
+    // Locate the block, then the row whose cumulative weight first exceeds Target
+    int b = 0;
+    while ((b < BlockCount - 1) && (Target >= BlockSums[b]))
+    {
+      Target -= BlockSums[b];
+      b++;
+    }
+
+    const int End = min(Rows, (b + 1)*BlockRows);
+    for (int i = b*BlockRows; i < End; i++)
+    {
+      if (MinDist[i] <= 0) continue;
+
+      Row = i;
+      Target -= (double)MinDist[i]*MinDist[i];
+      if (Target < 0) break;
+    }
+  }
+
+  return true;
+}
+
+//=================================================================================================
+// Description:
+//  A bit of a center is set when more than half of its descriptors have it set; exact ties keep
+//  the current bit so a stable cluster never flips.
+//=================================================================================================
+bool CKMajority::Run(const Mat& Data, int K, Mat& Centers, Mat& Labels)
+{
+  mCompactness = 0;
+  mIterationsRun = 0;
+
+  if ((Data.type() != CV_8U) || (K <= 0) || (Data.rows < K) || (Data.cols <= 0)) return false;
+
+  if (!InitCenters(Data, K, Centers)) return false;
+
+  const int Bytes = Data.cols;
+  const int Bits = 8*Bytes;
+
+  vector<int> Assigned;
+  vector<int> Previous;
+  vector<int> Dists;
+  vector<int> Votes;
+  vector<int> Sizes;
+  bool Converged = false;
+
+  for (int Iter = 0; Iter < max(1, mParams.mIterations); Iter++)
+  {
+    mCompactness = Assign(Data, Centers, Assigned, &Dists);
+    mIterationsRun = Iter + 1;
+
+    Converged = (Assigned == Previous);
+    if (Converged) break;
+    Previous = Assigned;
+
+    // Majority vote of every bit
+    Votes.assign(K*Bits, 0);
+    Sizes.assign(K, 0);
+    for (int i = 0; i < Data.rows; i++)
+    {
+      Sizes[Assigned[i]]++;
+    }
+
+    parallel_for_(Range(0, Bytes), CBitVoteBody(Data, Assigned, Votes));
+
+    for (int c = 0; c < K; c++)
+    {
+      unsigned char* pCenter = Centers.ptr<unsigned char>(c);
+
+      if (Sizes[c] == 0)
+      {
+        // Move an empty center to the worst fitting descriptor (first one on ties)
+        const int Worst = (int)(max_element(Dists.begin(), Dists.end()) - Dists.begin());
+        memcpy(pCenter, Data.ptr<unsigned char>(Worst), Bytes);
+        Dists[Worst] = 0;
+        continue;
+      }
+
+      const int* pVotes = &Votes[c*Bits];
+      for (int k = 0; k < Bytes; k++)
+      {
+        unsigned char Byte = pCenter[k];
+        for (int Bit = 0; Bit < 8; Bit++)
+        {
+          const int Twice = 2*pVotes[8*k + Bit];
+          if (Twice > Sizes[c]) Byte |= (unsigned char)(1 << Bit);
+          else if (Twice < Sizes[c]) Byte &= (unsigned char)~(1 << Bit);
+        }
+        pCenter[k] = Byte;
+      }
+    }
+  }
+
+  // Stopped on the iteration limit: the labels and compactness belong to the previous centers
+  if (!Converged) mCompactness = Assign(Data, Centers, Assigned);
+
+  Labels = Mat(Data.rows, 1, CV_32S);
+  for (int i = 0; i < Data.rows; i++)
+  {
+    Labels.at<int>(i,0) = Assigned[i];
+  }
+
+  return true;
+}
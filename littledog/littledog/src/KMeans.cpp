@@ -0,0 +1,1494 @@
+#include "KMeans.h"
+#include "WordQuantizer.h"
+
+#include <algorithm>
+#include <cstring>
+
+using namespace cv;
+using namespace std;
+
+// Hash streams (see CKMeans::HashUniform) so that every stage makes independent random choices
+const uint64_t InitStream = 0; // Initialization uses InitStream ... InitStream + 7
+const uint64_t BatchStream = 1000;
+const uint64_t ReservoirStream = 2000;
+const uint64_t OrderStream = 3000;
+const uint64_t ResizeStream = 5000;
+
+//=================================================================================================
+// Keep the block of cross terms (rows x centers) at roughly 4 MB so it stays cache friendly, and
+// split a small input (e.g. one mini-batch) into at least MinBlockCount blocks so that it still
+// spreads over the threads. The split does not depend on the number of threads, so neither do
+// the per block sums.
+//=================================================================================================
+static int GetBlockRows(int CenterCount, int Rows)
+{
+  const int MaxCrossTerms = 1 << 20;
+  const int MinBlockCount = 32;
+  const int MinBlockRows = 16;
+
+  const int BlockRows = max(64, min(4096, MaxCrossTerms/max(CenterCount, 1)));
+  return max(MinBlockRows, min(BlockRows, (Rows + MinBlockCount - 1)/MinBlockCount));
+}
+
+//=================================================================================================
+//=================================================================================================
+static uint64_t SplitMix64(uint64_t X)
+{
+  X += 0x9E3779B97F4A7C15ULL;
+  X = (X ^ (X >> 30))*0xBF58476D1CE4E5B9ULL;
+  X = (X ^ (X >> 27))*0x94D049BB133111EBULL;
+  return X ^ (X >> 31);
+}
+
+//=================================================================================================
+// Description:
+//  Parallel body that updates the nearest center of every row of Data with the rows of Centers.
+//  A row takes center c (reported as FirstLabel + c) when it is strictly closer than MinDist.
+//  Each block of rows is multiplied against the centers in one gemm call (distances expanded as
+//  ||x||^2 - 2*x.c + ||c||^2) and the block's sum of the updated MinDist goes to BlockSums.
+//=================================================================================================
+class CNearestCenterBody : public ParallelLoopBody
+{
+  public:
+    CNearestCenterBody(
+      const Mat& Data,
+      const Mat& Centers,
+      const Mat& CenterNorms,
+      int FirstLabel,
+      int BlockRows,
+      vector<int>& Nearest,
+      vector<float>& MinDist,
+      vector<double>& BlockSums)
+     : mData(Data),
+       mCenters(Centers),
+       mCenterNorms(CenterNorms),
+       mFirstLabel(FirstLabel),
+       mBlockRows(BlockRows),
+       mNearest(Nearest),
+       mMinDist(MinDist),
+       mBlockSums(BlockSums)
+    {
+    }
+
+    void operator()(const Range& Blocks) const
+    {
+      const int CenterCount = mCenters.rows;
+      const int Length = mData.cols;
+      const float* pNorms = mCenterNorms.ptr<float>(0);
+      Mat Cross;
+
+      for (int b = Blocks.start; b < Blocks.end; b++)
+      {
+        const int Start = b*mBlockRows;
+        const int Rows = min(mBlockRows, mData.rows - Start);
+        const Mat Block = mData.rowRange(Start, Start + Rows);
+
+        // Cross = -2 * Block * Centers^T
+        gemm(Block, mCenters, -2.0, Mat(), 0.0, Cross, GEMM_2_T);
+
+        double Sum = 0;
+
+        for (int i = 0; i < Rows; i++)
+        {
+          const float* pRow = Block.ptr<float>(i);
+          const float* pCross = Cross.ptr<float>(i);
+
+          float RowNorm = 0;
+          for (int k = 0; k < Length; k++)
+          {
+            RowNorm += pRow[k]*pRow[k];
+          }
+
+          float& MinDist = mMinDist[Start + i];
+          int& Nearest = mNearest[Start + i];
+
+          for (int c = 0; c < CenterCount; c++)
+          {
+            const float Dist = max(0.0f, RowNorm + pCross[c] + pNorms[c]);
+            if (Dist < MinDist)
+            {
+              MinDist = Dist;
+              Nearest = mFirstLabel + c;
+            }
+          }
+          Sum += MinDist;
+        }
+        mBlockSums[b] = Sum;
+      }
+    }
+
+  private:
+    const Mat& mData;
+    const Mat& mCenters;
+    const Mat& mCenterNorms;
+    const int mFirstLabel;
+    const int mBlockRows;
+    vector<int>& mNearest;
+    vector<float>& mMinDist;
+    vector<double>& mBlockSums;
+};
+
+//=================================================================================================
+// Description:
+//  Update Nearest/MinDist of every row of Data with Centers (labels start at FirstLabel) and
+//  return the sum of MinDist. Per block sums are added in block order so the result does not
+//  depend on the number of threads. BlockSums receives the per block sums.
+//=================================================================================================
+static double UpdateNearestCenter(
+  const Mat& Data,
+  const Mat& Centers,
+  int FirstLabel,
+  vector<int>& Nearest,
+  vector<float>& MinDist,
+  vector<double>& BlockSums,
+  int& BlockRows)
+{
+  BlockRows = GetBlockRows(Centers.rows, Data.rows);
+  const int BlockCount = (Data.rows + BlockRows - 1)/BlockRows;
+
+  Mat CenterNorms(1, Centers.rows, CV_32F);
+  for (int c = 0; c < Centers.rows; c++)
+  {
+    const float* pCenter = Centers.ptr<float>(c);
+    float Norm = 0;
+    for (int k = 0; k < Centers.cols; k++)
+    {
+      Norm += pCenter[k]*pCenter[k];
+    }
+    CenterNorms.at<float>(0,c) = Norm;
+  }
+
+  BlockSums.assign(BlockCount, 0.0);
+
+  parallel_for_(
+    Range(0, BlockCount),
+    CNearestCenterBody(
+      Data, Centers, CenterNorms, FirstLabel, BlockRows, Nearest, MinDist, BlockSums));
+
+  double Sum = 0;
+  for (int b = 0; b < BlockCount; b++)
+  {
+    Sum += BlockSums[b];
+  }
+  return Sum;
+}
+
+//=================================================================================================
+// Description:
+//  Pick the row whose cumulative MinDist first exceeds Target (D^2 sampling). The block sums
+//  locate the block so only one block is scanned.
+//=================================================================================================
+static int SampleByDistance(
+  const vector<float>& MinDist,
+  const vector<double>& BlockSums,
+  int BlockRows,
+  double Target)
+{
+  const int Rows = (int)MinDist.size();
+  int b = 0;
+
+  while ((b < (int)BlockSums.size() - 1) && (Target >= BlockSums[b]))
+  {
+    Target -= BlockSums[b];
+    b++;
+  }
+
+  const int End = min(Rows, (b + 1)*BlockRows);
+  int Last = b*BlockRows;
+
+  for (int i = b*BlockRows; i < End; i++)
+  {
+    if (MinDist[i] <= 0) continue;
+
+    Last = i;
+    Target -= MinDist[i];
+    if (Target < 0) break;
+  }
+  return Last;
+}
+
+//=================================================================================================
+// Description:
+//  Parallel body for the mini-batch center update. The rows of the batch come grouped by center
+//  (the rows of center c are Order[First[c]] ... Order[First[c + 1] - 1], in batch order) and
+//  the shift of every center goes to Shifts.
+//=================================================================================================
+class CUpdateCentersBody : public ParallelLoopBody
+{
+  public:
+    CUpdateCentersBody(
+      const Mat& Batch,
+      const vector<int>& First,
+      const vector<int>& Order,
+      Mat& Centers,
+      vector<double>& Counts,
+      vector<double>& Shifts)
+     : mBatch(Batch),
+       mFirst(First),
+       mOrder(Order),
+       mCenters(Centers),
+       mCounts(Counts),
+       mShifts(Shifts)
+    {
+    }
+
+    void operator()(const Range& CenterRange) const
+    {
+      const int Length = mBatch.cols;
+      vector<double> Sum(Length);
+
+      for (int c = CenterRange.start; c < CenterRange.end; c++)
+      {
+        const int BatchCount = mFirst[c + 1] - mFirst[c];
+        mShifts[c] = 0;
+        if (BatchCount == 0) continue;
+
+        Sum.assign(Length, 0.0);
+        for (int j = mFirst[c]; j < mFirst[c + 1]; j++)
+        {
+          const float* pRow = mBatch.ptr<float>(mOrder[j]);
+          for (int k = 0; k < Length; k++)
+          {
+            Sum[k] += pRow[k];
+          }
+        }
+
+        mCounts[c] += BatchCount;
+
+        float* pCenter = mCenters.ptr<float>(c);
+        double Shift = 0;
+        for (int k = 0; k < Length; k++)
+        {
+          const double Delta = (Sum[k] - BatchCount*(double)pCenter[k])/mCounts[c];
+          pCenter[k] += (float)Delta;
+          Shift += Delta*Delta;
+        }
+        mShifts[c] = Shift;
+      }
+    }
+
+  private:
+    const Mat& mBatch;
+    const vector<int>& mFirst;
+    const vector<int>& mOrder;
+    Mat& mCenters;
+    vector<double>& mCounts;
+    vector<double>& mShifts;
+};
+
+//=================================================================================================
+// Description:
+//  Mini-batch update: every center moves to the running mean of all the rows it has been
+//  assigned so far (Counts). Applying the batch at once gives the same result as the 1/count
+//  updates applied one row at a time. The rows are grouped by center with a counting sort and
+//  the centers are updated in parallel; the shifts are added in center order so the result does
+//  not depend on the number of threads. Returns the sum of squared center shifts.
+//=================================================================================================
+static double UpdateCenters(
+  const Mat& Batch,
+  const vector<int>& Labels,
+  Mat& Centers,
+  vector<double>& Counts)
+{
+  const int K = Centers.rows;
+
+  vector<int> First(K + 1, 0);
+  for (int i = 0; i < Batch.rows; i++)
+  {
+    First[Labels[i] + 1]++;
+  }
+  for (int c = 0; c < K; c++)
+  {
+    First[c + 1] += First[c];
+  }
+
+  vector<int> Next(First.begin(), First.end() - 1);
+  vector<int> Order(Batch.rows);
+  for (int i = 0; i < Batch.rows; i++)
+  {
+    Order[Next[Labels[i]]++] = i;
+  }
+
+  vector<double> Shifts(K, 0.0);
+  parallel_for_(Range(0, K), CUpdateCentersBody(Batch, First, Order, Centers, Counts, Shifts));
+
+  double Shift = 0;
+  for (int c = 0; c < K; c++)
+  {
+    Shift += Shifts[c];
+  }
+  return Shift;
+}
+
+//=================================================================================================
+// Description:
+//  Weighted Lloyd iterations starting from Centers; row i of Data counts Weights[i] times.
+//  Centers that lose all their rows stay where they are. Stops after Iterations or once no label
+//  changes. Compactness is the weighted sum of squared distances of the last assignment. Returns
+//  the number of iterations run.
+//=================================================================================================
+static int RefineWeighted(
+  const Mat& Data,
+  const vector<double>& Weights,
+  int Iterations,
+  Mat& Centers,
+  double& Compactness)
+{
+  const int K = Centers.rows;
+  const int Length = Data.cols;
+
+  Mat Sums(K, Length, CV_64F);
+  vector<double> Counts(K);
+  vector<int> Labels;
+  vector<int> PrevLabels;
+  vector<float> Dists;
+  int It = 0;
+
+  Compactness = 0;
+
+  while (It < Iterations)
+  {
+    CKMeans::Assign(Data, Centers, Labels, &Dists);
+    It++;
+
+    Compactness = 0;
+    for (int i = 0; i < Data.rows; i++)
+    {
+      Compactness += Weights[i]*Dists[i];
+    }
+
+    if (Labels == PrevLabels) break;
+
+    Sums.setTo(Scalar(0));
+    Counts.assign(K, 0.0);
+
+    for (int i = 0; i < Data.rows; i++)
+    {
+      const float* pRow = Data.ptr<float>(i);
+      double* pSum = Sums.ptr<double>(Labels[i]);
+      for (int k = 0; k < Length; k++)
+      {
+        pSum[k] += Weights[i]*pRow[k];
+      }
+      Counts[Labels[i]] += Weights[i];
+    }
+
+    for (int c = 0; c < K; c++)
+    {
+      if (Counts[c] <= 0) continue;
+
+      const double* pSum = Sums.ptr<double>(c);
+      float* pCenter = Centers.ptr<float>(c);
+      for (int k = 0; k < Length; k++)
+      {
+        pCenter[k] = (float)(pSum[k]/Counts[c]);
+      }
+    }
+
+    PrevLabels.swap(Labels);
+  }
+
+  return It;
+}
+
+//=================================================================================================
+// Description:
+//  Parallel body for Hamerly's assignment step. A row is only rescanned when its upper bound
+//  (distance to its center) exceeds both its lower bound (distance to the second closest
+//  center) and half the distance from its center to the closest other center. Rows whose label
+//  changes are appended to Moved[block] as (row, previous label).
+//=================================================================================================
+class CHamerlyAssignBody : public ParallelLoopBody
+{
+  public:
+    CHamerlyAssignBody(
+      const Mat& Data,
+      const Mat& Centers,
+      const vector<float>& HalfMinDist,
+      int BlockRows,
+      bool FullScan,
+      vector<int>& Labels,
+      vector<float>& Upper,
+      vector<float>& Lower,
+      vector<vector<pair<int, int> > >& Moved,
+      vector<int>& BlockScans)
+     : mData(Data),
+       mCenters(Centers),
+       mHalfMinDist(HalfMinDist),
+       mBlockRows(BlockRows),
+       mFullScan(FullScan),
+       mLabels(Labels),
+       mUpper(Upper),
+       mLower(Lower),
+       mMoved(Moved),
+       mBlockScans(BlockScans)
+    {
+    }
+
+    void operator()(const Range& Blocks) const
+    {
+      const int Length = mData.cols;
+      const int CenterCount = mCenters.rows;
+
+      for (int b = Blocks.start; b < Blocks.end; b++)
+      {
+        const int Start = b*mBlockRows;
+        const int End = min(mData.rows, Start + mBlockRows);
+        int Scans = 0;
+
+        mMoved[b].clear();
+
+        for (int i = Start; i < End; i++)
+        {
+          const float* pRow = mData.ptr<float>(i);
+          const int Label = mLabels[i];
+
+          if (!mFullScan)
+          {
+            const float Bound = max(mHalfMinDist[Label], mLower[i]);
+            if (mUpper[i] <= Bound) continue;
+
+            // Tighten the upper bound and test again
+            mUpper[i] = sqrt(
+              CWordQuantizer::SquaredDistance(pRow, mCenters.ptr<float>(Label), Length));
+            if (mUpper[i] <= Bound) continue;
+          }
+
+          // Find the two closest centers
+          float Smallest = FLT_MAX;
+          float SecondSmallest = FLT_MAX;
+          int SmallestIndex = 0;
+
+          for (int c = 0; c < CenterCount; c++)
+          {
+            const float Dist =
+              CWordQuantizer::SquaredDistance(pRow, mCenters.ptr<float>(c), Length);
+
+            if (Dist < Smallest)
+            {
+              SecondSmallest = Smallest;
+              Smallest = Dist;
+              SmallestIndex = c;
+            }
+            else if (Dist < SecondSmallest)
+            {
+              SecondSmallest = Dist;
+            }
+          }
+          Scans++;
+
+          if (SmallestIndex != Label) mMoved[b].push_back(make_pair(i, Label));
+
+          mLabels[i] = SmallestIndex;
+          mUpper[i] = sqrt(Smallest);
+          mLower[i] = sqrt(SecondSmallest);
+        }
+        mBlockScans[b] = Scans;
+      }
+    }
+
+  private:
+    const Mat& mData;
+    const Mat& mCenters;
+    const vector<float>& mHalfMinDist;
+    const int mBlockRows;
+    const bool mFullScan;
+    vector<int>& mLabels;
+    vector<float>& mUpper;
+    vector<float>& mLower;
+    vector<vector<pair<int, int> > >& mMoved;
+    vector<int>& mBlockScans;
+};
+
+//=================================================================================================
+// Description:
+//  Parallel body for half the distance from every center to its closest other center
+//=================================================================================================
+class CHalfMinDistBody : public ParallelLoopBody
+{
+  public:
+    CHalfMinDistBody(const Mat& Centers, vector<float>& HalfMinDist)
+     : mCenters(Centers),
+       mHalfMinDist(HalfMinDist)
+    {
+    }
+
+    void operator()(const Range& Rows) const
+    {
+      const int Length = mCenters.cols;
+
+      for (int j = Rows.start; j < Rows.end; j++)
+      {
+        float Smallest = FLT_MAX;
+        for (int c = 0; c < mCenters.rows; c++)
+        {
+          if (c == j) continue;
+          const float Dist = CWordQuantizer::SquaredDistance(
+            mCenters.ptr<float>(j), mCenters.ptr<float>(c), Length);
+          Smallest = min(Smallest, Dist);
+        }
+        mHalfMinDist[j] = 0.5f*sqrt(Smallest);
+      }
+    }
+
+  private:
+    const Mat& mCenters;
+    vector<float>& mHalfMinDist;
+};
+
+//=================================================================================================
+// Description:
+//  Parallel body for k-means restarts. Every restart is a complete run with its own seed; runs
+//  that use parallel_for_ themselves simply nest.
+//=================================================================================================
+class CRestartBody : public ParallelLoopBody
+{
+  public:
+    CRestartBody(
+      CKMeans::EMethod Method,
+      const SKMeansParams& Params,
+      const Mat& Data,
+      int K,
+      vector<Mat>& Centers,
+      vector<Mat>& Labels,
+      vector<double>& Compactness,
+      vector<int>& Iterations,
+      vector<unsigned char>& Success)
+     : mMethod(Method),
+       mParams(Params),
+       mData(Data),
+       mK(K),
+       mCenters(Centers),
+       mLabels(Labels),
+       mCompactness(Compactness),
+       mIterations(Iterations),
+       mSuccess(Success)
+    {
+    }
+
+    void operator()(const Range& Restarts) const
+    {
+      for (int r = Restarts.start; r < Restarts.end; r++)
+      {
+        SKMeansParams Params = mParams;
+        Params.mSeed = mParams.mSeed + r;
+        Params.mRestarts = 1;
+
+        CKMeans KMeans(Params);
+        mSuccess[r] = KMeans.Run(mMethod, mData, mK, mCenters[r], mLabels[r]) ? 1 : 0;
+        mCompactness[r] = KMeans.GetCompactness();
+        mIterations[r] = KMeans.GetIterationsRun();
+      }
+    }
+
+  private:
+    const CKMeans::EMethod mMethod;
+    const SKMeansParams& mParams;
+    const Mat& mData;
+    const int mK;
+    vector<Mat>& mCenters;
+    vector<Mat>& mLabels;
+    vector<double>& mCompactness;
+    vector<int>& mIterations;
+    vector<unsigned char>& mSuccess;
+};
+
+//=================================================================================================
+//=================================================================================================
+CKMeans::CKMeans(const SKMeansParams& Params)
+ : mParams(Params),
+   mCompactness(0),
+   mIterationsRun(0),
+   mScanFraction(0)
+{
+}
+
+//=================================================================================================
+//=================================================================================================
+CKMeans::~CKMeans()
+{
+}
+
+//=================================================================================================
+//=================================================================================================
+double CKMeans::GetCompactness() const
+{
+  return mCompactness;
+}
+
+//=================================================================================================
+//=================================================================================================
+int CKMeans::GetIterationsRun() const
+{
+  return mIterationsRun;
+}
+
+//=================================================================================================
+//=================================================================================================
+double CKMeans::GetScanFraction() const
+{
+  return mScanFraction;
+}
+
+//=================================================================================================
+//=================================================================================================
+double CKMeans::HashUniform(uint64_t Seed, uint64_t Stream, uint64_t Index)
+{
+  const uint64_t Hash = SplitMix64(SplitMix64(SplitMix64(Seed) ^ Stream) ^ Index);
+
+  // Top 53 bits as a double in [0,1)
+  return (double)(Hash >> 11)*(1.0/9007199254740992.0);
+}
+
+//=================================================================================================
+//=================================================================================================
+double CKMeans::Assign(
+  const Mat& Data,
+  const Mat& Centers,
+  vector<int>& Labels,
+  vector<float>* pDists)
+{
+  vector<float> Dists(Data.rows, FLT_MAX);
+  vector<double> BlockSums;
+  int BlockRows = 0;
+
+  Labels.assign(Data.rows, 0);
+
+  if ((Data.rows == 0) || (Centers.rows == 0)) return 0;
+
+  const double Sum =
+    UpdateNearestCenter(Data, Centers, 0, Labels, Dists, BlockSums, BlockRows);
+
+  if (pDists) pDists->swap(Dists);
+  return Sum;
+}
+
+//=================================================================================================
+//=================================================================================================
+bool CKMeans::InitCenters(const Mat& Data, int K, Mat& Centers) const
+{
+  if ((Data.type() != CV_32F) || (K < 1) || (Data.rows < K)) return false;
+
+  if (mParams.mInit == SKMeansParams::eInitKMeansPP)
+  {
+    return InitKMeansPP(Data, K, Centers);
+  }
+  return InitKMeansParallel(Data, K, Centers);
+}
+
+//=================================================================================================
+// Description:
+//  k-means++: every new center is a row sampled with probability proportional to its squared
+//  distance to the closest center chosen so far.
+//=================================================================================================
+bool CKMeans::InitKMeansPP(const Mat& Data, int K, Mat& Centers) const
+{
+  const int Rows = Data.rows;
+  const size_t RowSize = Data.cols*sizeof(float);
+
+  Centers = Mat(K, Data.cols, CV_32F);
+
+  vector<int> Nearest(Rows, 0);
+  vector<float> MinDist(Rows, FLT_MAX);
+  vector<double> BlockSums;
+  int BlockRows = 0;
+
+  int Row = min(Rows - 1, (int)(HashUniform(mParams.mSeed, InitStream, 0)*Rows));
+
+  for (int c = 0; c < K; c++)
+  {
+    memcpy(Centers.ptr<float>(c), Data.ptr<float>(Row), RowSize);
+
+    if (c == K - 1) break;
+
+    const double Phi = UpdateNearestCenter(
+      Data, Centers.rowRange(c, c + 1), c, Nearest, MinDist, BlockSums, BlockRows);
+
+    if (Phi > 0)
+    {
+      const double Target = HashUniform(mParams.mSeed, InitStream, c + 1)*Phi;
+      Row = SampleByDistance(MinDist, BlockSums, BlockRows, Target);
+    }
+    else
+    {
+      // Every row coincides with a center already, any row will do
+      Row = min(Rows - 1, (int)(HashUniform(mParams.mSeed, InitStream, c + 1)*Rows));
+    }
+  }
+
+  return true;
+}
+
+//=================================================================================================
+// Description:
+//  k-means|| (Bahmani et al. 2012): a few rounds each sample about 2*K rows with probability
+//  proportional to their squared distance to the candidates so far. Every candidate is weighted
+//  by the number of rows closest to it, and weighted k-means++ followed by a few weighted Lloyd
+//  iterations reduce the candidates to K centers.
+//=================================================================================================
+bool CKMeans::InitKMeansParallel(const Mat& Data, int K, Mat& Centers) const
+{
+  const int Rows = Data.rows;
+  const int Length = Data.cols;
+  const size_t RowSize = Length*sizeof(float);
+  const int Rounds = 5;
+  const double Oversampling = 2.0*K;
+  const int RefineIterations = 10;
+
+  vector<int> Nearest(Rows, 0);
+  vector<float> MinDist(Rows, FLT_MAX);
+  vector<double> BlockSums;
+  int BlockRows = 0;
+
+  const int FirstRow = min(Rows - 1, (int)(HashUniform(mParams.mSeed, InitStream, 0)*Rows));
+  Mat Candidates = Data.row(FirstRow).clone();
+
+  double Phi =
+    UpdateNearestCenter(Data, Candidates, 0, Nearest, MinDist, BlockSums, BlockRows);
+
+  for (int r = 1; (r <= Rounds) && (Phi > 0); r++)
+  {
+    vector<int> NewRows;
+
+    for (int i = 0; i < Rows; i++)
+    {
+      if (HashUniform(mParams.mSeed, InitStream + r, i) < Oversampling*MinDist[i]/Phi)
+      {
+        NewRows.push_back(i);
+      }
+    }
+
+    if (NewRows.empty()) continue;
+
+    Mat NewCandidates((int)NewRows.size(), Length, CV_32F);
+    for (int i = 0; i < NewCandidates.rows; i++)
+    {
+      memcpy(NewCandidates.ptr<float>(i), Data.ptr<float>(NewRows[i]), RowSize);
+    }
+
+    Phi = UpdateNearestCenter(
+      Data, NewCandidates, Candidates.rows, Nearest, MinDist, BlockSums, BlockRows);
+
+    Candidates.push_back(NewCandidates);
+  }
+
+  // Too few candidates (e.g. many duplicate rows), top up with uniformly sampled rows
+  for (int i = 0; Candidates.rows < K; i++)
+  {
+    const double Uniform = HashUniform(mParams.mSeed, InitStream + Rounds + 1, i);
+    const int Row = min(Rows - 1, (int)(Uniform*Rows));
+    Candidates.push_back(Data.row(Row));
+  }
+
+  if (Candidates.rows == K)
+  {
+    Centers = Candidates;
+    return true;
+  }
+
+  // Weight of each candidate = number of rows closest to it
+  vector<double> Weights(Candidates.rows, 0.0);
+  for (int i = 0; i < Rows; i++)
+  {
+    Weights[Nearest[i]] += 1.0;
+  }
+
+  // Weighted k-means++ on the candidates
+  const int CandidateCount = Candidates.rows;
+  vector<double> CandidateDist(CandidateCount, DBL_MAX);
+
+  Centers = Mat(K, Length, CV_32F);
+
+  double TotalWeight = 0;
+  for (int i = 0; i < CandidateCount; i++)
+  {
+    TotalWeight += Weights[i];
+  }
+
+  int Pick = 0;
+  double Target = HashUniform(mParams.mSeed, InitStream + Rounds + 2, 0)*TotalWeight;
+  for (Pick = 0; Pick < CandidateCount - 1; Pick++)
+  {
+    Target -= Weights[Pick];
+    if (Target < 0) break;
+  }
+
+  for (int c = 0; c < K; c++)
+  {
+    memcpy(Centers.ptr<float>(c), Candidates.ptr<float>(Pick), RowSize);
+
+    double Phi = 0;
+    for (int i = 0; i < CandidateCount; i++)
+    {
+      const double Dist = CWordQuantizer::SquaredDistance(
+        Candidates.ptr<float>(i), Centers.ptr<float>(c), Length);
+      CandidateDist[i] = min(CandidateDist[i], Dist);
+      Phi += Weights[i]*CandidateDist[i];
+    }
+
+    Target = HashUniform(mParams.mSeed, InitStream + Rounds + 2, c + 1)*Phi;
+    for (Pick = 0; Pick < CandidateCount - 1; Pick++)
+    {
+      Target -= Weights[Pick]*CandidateDist[Pick];
+      if (Target < 0) break;
+    }
+  }
+
+  // Weighted Lloyd refinement on the candidates
+  double Compactness = 0;
+  RefineWeighted(Candidates, Weights, RefineIterations, Centers, Compactness);
+
+  return true;
+}
+
+//=================================================================================================
+// Description:
+//  Each iteration samples mBatchSize rows (with replacement), assigns them to the nearest
+//  centers and updates every touched center with a per center learning rate of 1/count, which
+//  keeps each center at the running mean of all the rows it has been assigned so far.
+//=================================================================================================
+bool CKMeans::RunMiniBatch(const Mat& Data, int K, Mat& Centers, Mat& Labels)
+{
+  mCompactness = 0;
+  mIterationsRun = 0;
+
+  if (!InitCenters(Data, K, Centers)) return false;
+
+  const int Rows = Data.rows;
+  const int Length = Data.cols;
+  const size_t RowSize = Length*sizeof(float);
+  const int BatchSize = max(1, min(mParams.mBatchSize, Rows));
+
+  // Variance of the data (mean squared distance to the mean), the tolerance is relative to it
+  vector<double> Mean(Length, 0.0);
+  double SquaredNorm = 0;
+  for (int i = 0; i < Rows; i++)
+  {
+    const float* pRow = Data.ptr<float>(i);
+    for (int k = 0; k < Length; k++)
+    {
+      Mean[k] += pRow[k];
+      SquaredNorm += (double)pRow[k]*pRow[k];
+    }
+  }
+  double Variance = SquaredNorm/Rows;
+  for (int k = 0; k < Length; k++)
+  {
+    Mean[k] /= Rows;
+    Variance -= Mean[k]*Mean[k];
+  }
+
+  Mat Batch(BatchSize, Length, CV_32F);
+  vector<double> Counts(K, 0.0);
+  vector<int> BatchLabels;
+
+  for (int It = 0; It < mParams.mIterations; It++)
+  {
+    for (int i = 0; i < BatchSize; i++)
+    {
+      const double Uniform = HashUniform(mParams.mSeed, BatchStream + It, i);
+      const int Row = min(Rows - 1, (int)(Uniform*Rows));
+      memcpy(Batch.ptr<float>(i), Data.ptr<float>(Row), RowSize);
+    }
+
+    Assign(Batch, Centers, BatchLabels);
+
+    const double Shift = UpdateCenters(Batch, BatchLabels, Centers, Counts);
+
+    mIterationsRun = It + 1;
+
+    if ((mParams.mTolerance > 0) && (Shift/K <= mParams.mTolerance*Variance)) break;
+  }
+
+  vector<int> AllLabels;
+  mCompactness = Assign(Data, Centers, AllLabels);
+
+  Labels = Mat(Rows, 1, CV_32S);
+  for (int i = 0; i < Rows; i++)
+  {
+    Labels.at<int>(i,0) = AllLabels[i];
+  }
+
+  return true;
+}
+
+//=================================================================================================
+//=================================================================================================
+bool CKMeans::RunStreaming(CDescriptorSource& Source, int K, Mat& Centers)
+{
+  mCompactness = 0;
+  mIterationsRun = 0;
+
+  if (K < 1) return false;
+
+  const int BlockCount = Source.GetBlockCount();
+  const int SampleSize = max(K, mParams.mSampleSize);
+  const int BatchSize = max(1, mParams.mBatchSize);
+
+  Mat Sample;
+  Mat Des;
+  uint64_t Seen = 0;
+  int Length = 0;
+  vector<double> Mean;
+  double SquaredNorm = 0;
+
+  // Sampling pass: reservoir sample (algorithm R) and the statistics for the tolerance
+  for (int b = 0; b < BlockCount; b++)
+  {
+    if (!Source.ReadBlock(b, Des)) return false;
+    if (Des.rows == 0) continue;
+
+    if (Sample.empty())
+    {
+      Length = Des.cols;
+      Sample = Mat(SampleSize, Length, CV_32F);
+      Mean.assign(Length, 0.0);
+    }
+
+    if ((Des.type() != CV_32F) || (Des.cols != Length)) return false;
+
+    for (int i = 0; i < Des.rows; i++, Seen++)
+    {
+      const float* pRow = Des.ptr<float>(i);
+      for (int k = 0; k < Length; k++)
+      {
+        Mean[k] += pRow[k];
+        SquaredNorm += (double)pRow[k]*pRow[k];
+      }
+
+      uint64_t Slot = Seen;
+      if (Seen >= (uint64_t)SampleSize)
+      {
+        Slot = (uint64_t)(HashUniform(mParams.mSeed, ReservoirStream, Seen)*(double)(Seen + 1));
+      }
+      if (Slot < (uint64_t)SampleSize)
+      {
+        memcpy(Sample.ptr<float>((int)Slot), pRow, Length*sizeof(float));
+      }
+    }
+  }
+
+  if (Seen < (uint64_t)K) return false;
+
+  if (Seen < (uint64_t)SampleSize) Sample = Sample.rowRange(0, (int)Seen);
+
+  if (!InitCenters(Sample, K, Centers)) return false;
+  Sample.release();
+
+  double Variance = SquaredNorm/(double)Seen;
+  for (int k = 0; k < Length; k++)
+  {
+    Mean[k] /= (double)Seen;
+    Variance -= Mean[k]*Mean[k];
+  }
+
+  vector<double> Counts(K, 0.0);
+  vector<int> Labels;
+  vector<pair<double, int> > Order(BlockCount);
+
+  for (int p = 0; p < mParams.mPasses; p++)
+  {
+    // Blocks are often grouped by class, shuffle them so the centers do not drift
+    for (int b = 0; b < BlockCount; b++)
+    {
+      Order[b] = make_pair(HashUniform(mParams.mSeed, OrderStream + p, b), b);
+    }
+    sort(Order.begin(), Order.end());
+
+    double Shift = 0;
+    mCompactness = 0;
+
+    for (int o = 0; o < BlockCount; o++)
+    {
+      if (!Source.ReadBlock(Order[o].second, Des)) return false;
+
+      for (int Start = 0; Start < Des.rows; Start += BatchSize)
+      {
+        const Mat Batch = Des.rowRange(Start, min(Des.rows, Start + BatchSize));
+
+        mCompactness += Assign(Batch, Centers, Labels);
+        Shift += UpdateCenters(Batch, Labels, Centers, Counts);
+      }
+    }
+
+    mIterationsRun = p + 1;
+
+    if ((mParams.mTolerance > 0) && (Shift/K <= mParams.mTolerance*Variance)) break;
+  }
+
+  return true;
+}
+
+//=================================================================================================
+//=================================================================================================
+bool CKMeans::RunHamerly(const Mat& Data, int K, Mat& Centers, Mat& Labels)
+{
+  mCompactness = 0;
+  mIterationsRun = 0;
+
+  if (!InitCenters(Data, K, Centers)) return false;
+
+  return RefineHamerly(Data, Centers, Labels);
+}
+
+//=================================================================================================
+// Description:
+//  Center sums are kept in double and only updated for the rows that change label (applied in
+//  row order, so the result does not depend on the number of threads). Bounds are updated with
+//  the distance each center moved: the upper bound grows by the move of the row's own center
+//  and the lower bound shrinks by the largest move of any other center.
+//=================================================================================================
+bool CKMeans::RefineHamerly(const Mat& Data, Mat& Centers, Mat& Labels)
+{
+  mCompactness = 0;
+  mIterationsRun = 0;
+  mScanFraction = 0;
+
+  const int K = Centers.rows;
+  const int Rows = Data.rows;
+  const int Length = Data.cols;
+
+  if ((Data.type() != CV_32F) || (Centers.type() != CV_32F) || (K < 1) || (Rows < K) ||
+      (Centers.cols != Length))
+  {
+    return false;
+  }
+
+  const int BlockRows = 1024;
+  const int BlockCount = (Rows + BlockRows - 1)/BlockRows;
+
+  vector<int> AllLabels(Rows, 0);
+  vector<float> Upper(Rows, FLT_MAX);
+  vector<float> Lower(Rows, 0.0f);
+  vector<float> HalfMinDist(K, 0.0f);
+  vector<vector<pair<int, int> > > Moved(BlockCount);
+  vector<int> BlockScans(BlockCount, 0);
+
+  Mat Sums(K, Length, CV_64F, Scalar(0));
+  vector<int> Counts(K, 0);
+  Mat OldCenters;
+  vector<float> Shift(K, 0.0f);
+  bool CentersMoved = false;
+  double Scans = 0;
+  double Assignments = 0;
+
+  for (int It = 0; It < mParams.mIterations; It++)
+  {
+    const bool FullScan = (It == 0);
+
+    if (!FullScan)
+    {
+      parallel_for_(Range(0, K), CHalfMinDistBody(Centers, HalfMinDist));
+    }
+
+    parallel_for_(
+      Range(0, BlockCount),
+      CHamerlyAssignBody(
+        Data, Centers, HalfMinDist, BlockRows, FullScan, AllLabels, Upper, Lower, Moved,
+        BlockScans));
+
+    mIterationsRun = It + 1;
+
+    for (int b = 0; b < BlockCount; b++)
+    {
+      Scans += BlockScans[b];
+    }
+    Assignments += Rows;
+
+    // Update the center sums with the rows that changed center
+    int MovedCount = 0;
+    for (int b = 0; b < BlockCount; b++)
+    {
+      for (unsigned m = 0; m < Moved[b].size(); m++)
+      {
+        const int Row = Moved[b][m].first;
+        const float* pRow = Data.ptr<float>(Row);
+        const int NewLabel = AllLabels[Row];
+        double* pNewSum = Sums.ptr<double>(NewLabel);
+
+        if (!FullScan)
+        {
+          const int OldLabel = Moved[b][m].second;
+          double* pOldSum = Sums.ptr<double>(OldLabel);
+          for (int k = 0; k < Length; k++)
+          {
+            pOldSum[k] -= pRow[k];
+          }
+          Counts[OldLabel]--;
+        }
+
+        for (int k = 0; k < Length; k++)
+        {
+          pNewSum[k] += pRow[k];
+        }
+        Counts[NewLabel]++;
+      }
+      MovedCount += (int)Moved[b].size();
+    }
+
+    if (FullScan)
+    {
+      // Rows that kept label 0 are not reported as moved
+      for (int i = 0; i < Rows; i++)
+      {
+        if (AllLabels[i] != 0) continue;
+
+        const float* pRow = Data.ptr<float>(i);
+        double* pSum = Sums.ptr<double>(0);
+        for (int k = 0; k < Length; k++)
+        {
+          pSum[k] += pRow[k];
+        }
+        Counts[0]++;
+      }
+    }
+    else if (MovedCount == 0)
+    {
+      // Converged, the centers would not move
+      CentersMoved = false;
+      break;
+    }
+
+    // Move the centers to the mean of their rows (empty clusters keep their center)
+    Centers.copyTo(OldCenters);
+
+    float LargestShift = 0;
+    float SecondLargestShift = 0;
+    int LargestShiftIndex = 0;
+
+    for (int c = 0; c < K; c++)
+    {
+      Shift[c] = 0;
+      if (Counts[c] == 0) continue;
+
+      const double* pSum = Sums.ptr<double>(c);
+      float* pCenter = Centers.ptr<float>(c);
+      for (int k = 0; k < Length; k++)
+      {
+        pCenter[k] = (float)(pSum[k]/Counts[c]);
+      }
+
+      Shift[c] = sqrt(
+        CWordQuantizer::SquaredDistance(pCenter, OldCenters.ptr<float>(c), Length));
+
+      if (Shift[c] > LargestShift)
+      {
+        SecondLargestShift = LargestShift;
+        LargestShift = Shift[c];
+        LargestShiftIndex = c;
+      }
+      else if (Shift[c] > SecondLargestShift)
+      {
+        SecondLargestShift = Shift[c];
+      }
+    }
+
+    for (int i = 0; i < Rows; i++)
+    {
+      const int Label = AllLabels[i];
+      Upper[i] += Shift[Label];
+      Lower[i] -= (Label == LargestShiftIndex) ? SecondLargestShift : LargestShift;
+    }
+
+    CentersMoved = true;
+
+    if (LargestShift <= mParams.mEpsilon) break;
+  }
+
+  // Assign the rows to the final centers (the same bounds make this cheap)
+  if (CentersMoved)
+  {
+    parallel_for_(Range(0, K), CHalfMinDistBody(Centers, HalfMinDist));
+    parallel_for_(
+      Range(0, BlockCount),
+      CHamerlyAssignBody(
+        Data, Centers, HalfMinDist, BlockRows, false, AllLabels, Upper, Lower, Moved,
+        BlockScans));
+
+    for (int b = 0; b < BlockCount; b++)
+    {
+      Scans += BlockScans[b];
+    }
+    Assignments += Rows;
+  }
+
+  mScanFraction = (Assignments > 0) ? Scans/Assignments : 0;
+
+  // Exact compactness of the final assignment
+  Labels = Mat(Rows, 1, CV_32S);
+  mCompactness = 0;
+  for (int i = 0; i < Rows; i++)
+  {
+    Labels.at<int>(i,0) = AllLabels[i];
+    mCompactness += CWordQuantizer::SquaredDistance(
+      Data.ptr<float>(i), Centers.ptr<float>(AllLabels[i]), Length);
+  }
+
+  return true;
+}
+
+//=================================================================================================
+// Description:
+//  New centers are drawn as in k-means++ continued from the current centers: a row is picked
+//  with probability proportional to its squared distance to the nearest center, so the clusters
+//  with the largest squared error are the ones that get split. Merging keeps the Ward cost of
+//  every pair of centers (n1*n2/(n1 + n2)*|c1 - c2|^2, the squared error the merge adds) and is
+//  quadratic in the number of centers per merge.
+//=================================================================================================
+bool CKMeans::Resize(const Mat& Data, int K, Mat& Centers, Mat& Labels)
+{
+  mCompactness = 0;
+  mIterationsRun = 0;
+
+  if ((Centers.rows == 0) || (Centers.cols != Data.cols))
+  {
+    return RunHamerly(Data, K, Centers, Labels);
+  }
+
+  if ((K <= 0) || (Data.rows < K) || (Data.type() != CV_32F)) return false;
+
+  const int Length = Data.cols;
+
+  if (Centers.rows < K)
+  {
+    const int Current = Centers.rows;
+    Mat Grown(K, Length, CV_32F);
+    Mat Kept = Grown.rowRange(0, Current);
+    Centers.copyTo(Kept);
+
+    vector<int> Nearest(Data.rows, 0);
+    vector<float> MinDist(Data.rows, FLT_MAX);
+    vector<double> BlockSums;
+    int BlockRows = 0;
+
+    double Phi = UpdateNearestCenter(
+      Data, Kept, 0, Nearest, MinDist, BlockSums, BlockRows);
+
+    for (int c = Current; c < K; c++)
+    {
+      const double Uniform = HashUniform(mParams.mSeed, ResizeStream, c);
+      const int Row = (Phi > 0) ?
+        SampleByDistance(MinDist, BlockSums, BlockRows, Uniform*Phi) :
+        min(Data.rows - 1, (int)(Uniform*Data.rows));
+
+      memcpy(Grown.ptr<float>(c), Data.ptr<float>(Row), Length*sizeof(float));
+
+      if (c == K - 1) break;
+
+      Phi = UpdateNearestCenter(
+        Data, Grown.rowRange(c, c + 1), c, Nearest, MinDist, BlockSums, BlockRows);
+    }
+    Centers = Grown;
+  }
+
+  if (Centers.rows > K)
+  {
+    vector<int> Nearest;
+    Assign(Data, Centers, Nearest);
+
+    const int Current = Centers.rows;
+    vector<double> Counts(Current, 0.0);
+    for (int i = 0; i < Data.rows; i++)
+    {
+      Counts[Nearest[i]] += 1.0;
+    }
+
+    Mat Work;
+    Centers.convertTo(Work, CV_64F);
+    vector<bool> Alive(Current, true);
+
+    // Ward cost of merging a and b (upper triangle, a < b)
+    Mat Cost(Current, Current, CV_64F, Scalar(0));
+    for (int a = 0; a < Current; a++)
+    {
+      for (int b = a + 1; b < Current; b++)
+      {
+        const double Total = Counts[a] + Counts[b];
+        const double Dist = CWordQuantizer::SquaredDistance(
+          Centers.ptr<float>(a), Centers.ptr<float>(b), Length);
+        Cost.at<double>(a, b) = (Total > 0) ? Counts[a]*Counts[b]/Total*Dist : 0.0;
+      }
+    }
+
+    for (int m = Current; m > K; m--)
+    {
+      int BestA = -1;
+      int BestB = -1;
+      for (int a = 0; a < Current; a++)
+      {
+        if (!Alive[a]) continue;
+        const double* pCost = Cost.ptr<double>(a);
+        for (int b = a + 1; b < Current; b++)
+        {
+          if (!Alive[b]) continue;
+          if ((BestA < 0) || (pCost[b] < Cost.at<double>(BestA, BestB)))
+          {
+            BestA = a;
+            BestB = b;
+          }
+        }
+      }
+
+      // Merge BestB into BestA (weighted mean, plain mean of two empty clusters)
+      const double Total = Counts[BestA] + Counts[BestB];
+      const double WeightA = (Total > 0) ? Counts[BestA]/Total : 0.5;
+      double* pA = Work.ptr<double>(BestA);
+      const double* pB = Work.ptr<double>(BestB);
+      for (int k = 0; k < Length; k++)
+      {
+        pA[k] = WeightA*pA[k] + (1.0 - WeightA)*pB[k];
+      }
+      Counts[BestA] = Total;
+      Alive[BestB] = false;
+
+      for (int c = 0; c < Current; c++)
+      {
+        if (!Alive[c] || (c == BestA)) continue;
+
+        const double* pC = Work.ptr<double>(c);
+        double Dist = 0;
+        for (int k = 0; k < Length; k++)
+        {
+          const double Diff = pA[k] - pC[k];
+          Dist += Diff*Diff;
+        }
+        const double Sum = Counts[BestA] + Counts[c];
+        const double Ward = (Sum > 0) ? Counts[BestA]*Counts[c]/Sum*Dist : 0.0;
+        Cost.at<double>(min(c, BestA), max(c, BestA)) = Ward;
+      }
+    }
+
+    Mat Merged(K, Length, CV_32F);
+    int Row = 0;
+    for (int c = 0; c < Current; c++)
+    {
+      if (!Alive[c]) continue;
+      float* pOut = Merged.ptr<float>(Row++);
+      const double* pIn = Work.ptr<double>(c);
+      for (int k = 0; k < Length; k++)
+      {
+        pOut[k] = (float)pIn[k];
+      }
+    }
+    Centers = Merged;
+  }
+
+  return RefineHamerly(Data, Centers, Labels);
+}
+
+//=================================================================================================
+// Description:
+//  The old sample stands in for all the old descriptors: each sampled row is weighted by
+//  OldWeight (the inverse of the sampling rate) so the centers move by the share of the new
+//  descriptors in the whole database instead of being pulled entirely towards them.
+//=================================================================================================
+bool CKMeans::UpdateIncremental(
+  const Mat& NewData,
+  const Mat& OldSample,
+  double OldWeight,
+  Mat& Centers)
+{
+  mCompactness = 0;
+  mIterationsRun = 0;
+  mScanFraction = 1.0;
+
+  if ((Centers.rows == 0) || (Centers.type() != CV_32F)) return false;
+  if ((NewData.type() != CV_32F) || (NewData.cols != Centers.cols)) return false;
+  if (!OldSample.empty() && ((OldSample.type() != CV_32F) || (OldSample.cols != Centers.cols)))
+  {
+    return false;
+  }
+
+  Mat Data(NewData.rows + OldSample.rows, Centers.cols, CV_32F);
+  Mat NewRows = Data.rowRange(0, NewData.rows);
+  Mat OldRows = Data.rowRange(NewData.rows, Data.rows);
+  if (NewData.rows > 0) NewData.copyTo(NewRows);
+  if (OldSample.rows > 0) OldSample.copyTo(OldRows);
+
+  vector<double> Weights(Data.rows, 1.0);
+  for (int i = NewData.rows; i < Data.rows; i++)
+  {
+    Weights[i] = OldWeight;
+  }
+
+  if (Data.rows == 0) return true;
+
+  mIterationsRun = RefineWeighted(Data, Weights, mParams.mPasses, Centers, mCompactness);
+  return true;
+}
+
+//=================================================================================================
+//=================================================================================================
+bool CKMeans::Run(EMethod Method, const Mat& Data, int K, Mat& Centers, Mat& Labels)
+{
+  switch (Method)
+  {
+    case eMethodMiniBatch:
+      return RunMiniBatch(Data, K, Centers, Labels);
+
+    case eMethodHamerly:
+      return RunHamerly(Data, K, Centers, Labels);
+
+    default:
+    {
+      if ((Data.type() != CV_32F) || (K < 1) || (Data.rows < K)) return false;
+
+      int Type = TermCriteria::MAX_ITER;
+      if (mParams.mEpsilon > 0) Type += TermCriteria::EPS;
+
+      // cv::kmeans draws from the calling thread's generator
+      theRNG() = RNG(mParams.mSeed);
+
+      mCompactness = cv::kmeans(
+        Data,
+        K,
+        Labels,
+        TermCriteria(Type, mParams.mIterations, mParams.mEpsilon),
+        1,
+        KMEANS_PP_CENTERS,
+        Centers);
+
+      // cv::kmeans does not report how many iterations it ran
+      mIterationsRun = 0;
+      return true;
+    }
+  }
+}
+
+//=================================================================================================
+//=================================================================================================
+bool CKMeans::RunRestarts(
+  EMethod Method,
+  const Mat& Data,
+  int K,
+  Mat& Centers,
+  Mat& Labels,
+  vector<double>& Compactness)
+{
+  const int Restarts = max(1, mParams.mRestarts);
+
+  vector<Mat> AllCenters(Restarts);
+  vector<Mat> AllLabels(Restarts);
+  vector<int> Iterations(Restarts, 0);
+  vector<unsigned char> Success(Restarts, 0);
+
+  Compactness.assign(Restarts, 0.0);
+
+  parallel_for_(
+    Range(0, Restarts),
+    CRestartBody(
+      Method, mParams, Data, K, AllCenters, AllLabels, Compactness, Iterations, Success));
+
+  int Best = -1;
+  for (int r = 0; r < Restarts; r++)
+  {
+    if (!Success[r]) return false;
+    if ((Best < 0) || (Compactness[r] < Compactness[Best])) Best = r;
+  }
+
+  Centers = AllCenters[Best];
+  Labels = AllLabels[Best];
+  mCompactness = Compactness[Best];
+  mIterationsRun = Iterations[Best];
+  return true;
+}
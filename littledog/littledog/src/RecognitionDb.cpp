@@ -27,6 +27,12 @@
 // POSSIBILITY OF SUCH DAMAGE.
 //=================================================================================================
 #include "RecognitionDb.h"
+#include "WordQuantizer.h"
+#include "VocabularyTree.h"
+#include "DescriptorCodec.h"
+#include "BoundedQueue.h"
+#include "KMajority.h"
+#include "BinaryIo.h"
 
 //OpenCV
 #include <highgui.h>
@@ -41,14 +47,54 @@
 #include <iostream>
 #include <fstream>
 #include <sstream>
+#include <atomic>
+#include <thread>
+#include <cstring>
 
 //wxWidgets
 #include <wx/filename.h>
 #include <wx/dir.h>
+#include <wx/utils.h>
 
 using namespace std;
 using namespace cv;
 
+// Tag and version of the dictionary files (.dic and .dicb)
+static const char DictionaryFileTag[4] = {'L', 'D', 'D', 'C'};
+const uint32_t DictionaryFileVersion = 2;
+
+// Key of the feature store line in the image stamps file (image keys are hex hashes)
+static const char FeatureStoreStampKey[] = "store";
+
+//=================================================================================================
+// Description:
+//  Decode an image and shrink it by Scale (no change when Scale is 1) with area interpolation.
+//  FullSize receives the size of the image as stored so that results can be mapped back.
+//  OpenCV 2.4 cannot decode a JPEG at reduced resolution, so the decode itself is full size and
+//  only the work done on the image afterwards scales with Scale^2.
+//=================================================================================================
+static Mat ReadImageScaled(const wxFileName& FileName, double Scale, Size* pFullSize = 0)
+{
+  Mat Image = cv::imread(FileName.GetFullPath().ToStdString());
+
+  if (pFullSize != 0) *pFullSize = Image.size();
+
+  if ((Scale >= 1.0) || (Image.data == 0)) return Image;
+
+  Mat Scaled;
+  resize(Image, Scaled, Size(), Scale, Scale, INTER_AREA);
+  return Scaled;
+}
+
+//=================================================================================================
+// Cache file name tag of data generated from images shrunk by Scale (empty at full size)
+//=================================================================================================
+static wxString GetScaleSuffix(double Scale)
+{
+  if (Scale >= 1.0) return wxString();
+  return wxString::Format(".s%d", cvRound(100.0*Scale));
+}
+
 //=================================================================================================
 //=================================================================================================
 CRecognitionDb::CRecognitionDb()
@@ -56,14 +102,23 @@ CRecognitionDb::CRecognitionDb()
    mAutoLevels(true),
    mFeatureType(eSURF),
    mCacheFeatures(false),
+   mFeatureStoreOn(true),
+   mFeatureParamsHash(0),
+   mDescriptorStorage(CRecognitionEntry::eFloat32),
+   mFeatureThreads(0),
+   mFeatureReadThreads(1),
+   mFeatureWriteThreads(1),
+   mFeatureQueueDepth(0),
    mAdjusterOn(false),
    mAdjusterMin(400),
    mAdjusterMax(600),
    mAdjusterIter(10),
    mAdjusterMemory(false),
    mAdjusterLearnRate(0.75),
+   mAdjusterSelect(false),
    mGridOn(false),
    mGridStep(512),
+   mFeatureScale(1.0),
    mpFeatureDetector(0),
    mpDescriptorExtractor(0),
 /*
@@ -73,13 +128,34 @@ CRecognitionDb::CRecognitionDb()
 */
    mpSurfParams(0),
    mSurfExtended(false),
+   mOrbFeatures(500),
+   mOrbScaleFactor(1.2),
+   mOrbLevels(8),
+   mOrbEdgeThreshold(31),
+   mDenseStep(16),
+   mDenseSize(20.0),
+   mDenseLevels(1),
+   mDenseScaleMul(2.0),
+   mDenseBound(0),
+   mDenseUpright(true),
    mpDictionary(0),
    mpLabels(0),
+   mpWordQuantizer(0),
+   mpVocabularyTree(0),
+   mDictionaryType(eKMeans),
    mWordCount(40),
    mWordKMeansIter(1000),
+   mVocabTreeBranching(10),
+   mVocabTreeDepth(4),
+   mWordIndexOn(false),
+   mWordIndexTrees(4),
+   mWordIndexChecks(64),
    mGenWordLog(false),
    mCacheDictionary(false),
+   mCacheWordLabels(false),
+   mIncrementalDictionary(false),
    mColorHistogramBins(256),
+   mHistogramScale(1.0),
    mCacheColorHistogram(true),
    mGenColorHistogramLog(false),
    mGenWordClassifierLog(false),
@@ -98,6 +174,8 @@ CRecognitionDb::~CRecognitionDb()
   // Noticing some very weird behavior: seems like the destructor gets before the object is
   // destroyed and other functions fail as a result
   if (mpFeatureDetector) delete mpFeatureDetector;
+  if (mpWordQuantizer) delete mpWordQuantizer;
+  if (mpVocabularyTree) delete mpVocabularyTree;
   //if (mpSiftCommonParams) delete mpSiftCommonParams;
   //if (mpSiftDetectorParams) delete mpSiftDetectorParams;
 }
@@ -106,6 +184,12 @@ CRecognitionDb::~CRecognitionDb()
 //=================================================================================================
 bool CRecognitionDb::OnInit(SDirs Dirs, string SetupFileName)
 {
+  // Cached features are shared by every database under the top level database directory
+  if (!Dirs.mFeatureCacheDir.IsOk())
+  {
+    Dirs.mFeatureCacheDir = Dirs.mDatabaseDir;
+    Dirs.mFeatureCacheDir.AppendDir("FeatureCache");
+  }
 
   mTopLevelDirs = Dirs;
   // Generate top level directories (log folder, database folder)
@@ -162,10 +246,18 @@ bool CRecognitionDb::OnInit(SDirs Dirs, string SetupFileName)
 
   // Init variables to a known state
   mEntries.clear();
+  mDescriptorArena.Release();
+  mFeatureStore.Close();
+  mImageStamps.clear();
+  mKnownImageStamps.clear();
+  mFeatureStoreStamp = SImageStamp();
+  mFeatureKeys.clear();
   mLabelColors.clear();
 
   delete mpDictionary;
   delete mpLabels;
+  delete mpWordQuantizer;
+  delete mpVocabularyTree;
   delete mpFeatureDetector;
     /*
   delete mpSiftCommonParams;
@@ -180,6 +272,8 @@ bool CRecognitionDb::OnInit(SDirs Dirs, string SetupFileName)
   //TODO: change dictionary to vocabulary
   mpDictionary = 0;
   mpLabels = 0;
+  mpWordQuantizer = 0;
+  mpVocabularyTree = 0;
   mpFeatureDetector = 0;
 //  mpSiftCommonParams = 0;
 //  mpSiftDetectorParams = 0;
@@ -274,6 +368,40 @@ bool CRecognitionDb::OnInit(SDirs Dirs, string SetupFileName)
   return true;
 }
 
+//=================================================================================================
+//=================================================================================================
+bool CRecognitionDb::ReadSetupWordCount(
+  const wxFileName& SetupDir, const string& SetupFileName, unsigned& WordCount)
+{
+  wxFileName SetupFilePath = SetupDir;
+  SetupFilePath.SetFullName(SetupFileName);
+
+  wxString FullPath = SetupFilePath.GetFullPath();
+
+  TiXmlDocument Doc(FullPath.c_str());
+
+  if (!SetupFilePath.FileExists() || !Doc.LoadFile())
+  {
+    cerr << "ERROR: could not load the setup file: " << FullPath << "\n";
+    return false;
+  }
+
+  TiXmlElement* pWords = Doc.FirstChildElement("database");
+  if (pWords != 0) pWords = pWords->FirstChildElement("dictionary");
+  if (pWords != 0) pWords = pWords->FirstChildElement("words");
+
+  int Words = 0;
+  if ((pWords == 0) || (pWords->QueryIntAttribute("value", &Words) != TIXML_SUCCESS) ||
+      (Words <= 0) || (Words > 1000000))
+  {
+    cerr << "ERROR: no valid word count in the setup file: " << FullPath << "\n";
+    return false;
+  }
+
+  WordCount = Words;
+  return true;
+}
+
 //=================================================================================================
 //=================================================================================================
 bool CRecognitionDb::GenerateTopLevelDirs()
@@ -315,6 +443,18 @@ bool CRecognitionDb::GenerateTopLevelDirs()
     }
   }
 
+  // Generate the shared feature cache directory if needed
+  const wxString FeatureCacheDir = mTopLevelDirs.mFeatureCacheDir.GetFullPath();
+
+  if (!wxDirExists(FeatureCacheDir))
+  {
+    if (!::wxMkdir(FeatureCacheDir))
+    {
+      cerr << "ERROR: Could not create: " << FeatureCacheDir << "\n";
+      return false;
+    }
+  }
+
   // Everything was successful
   return true;
 }
@@ -360,6 +500,17 @@ void CRecognitionDb::ReadFeaturesElement(TiXmlElement* pFeatures)
 
   FeatureType = ReadTypeAttribute(pFeatures);
 
+  double Scale = mFeatureScale;
+  ReadScaleAttribute(pFeatures, &Scale);
+  if ((Scale > 0.0) && (Scale <= 1.0))
+  {
+    mFeatureScale = Scale;
+  }
+  else
+  {
+    cout << "WARNING: Feature scale must be in (0, 1], using full size\n";
+  }
+
     /*
   if (FeatureType == "SIFT")
   {
@@ -394,6 +545,49 @@ void CRecognitionDb::ReadFeaturesElement(TiXmlElement* pFeatures)
       mpSurfParams->nOctaveLayers,
       mSurfExtended);
   }
+  else if (FeatureType == "ORB")
+  {
+    mFeatureType = eORB;
+
+    ReadOrbAttributes(pFeatures);
+
+    mpFeatureDetector = new OrbFeatureDetector(
+      mOrbFeatures,
+      (float)mOrbScaleFactor,
+      mOrbLevels,
+      mOrbEdgeThreshold);
+
+    mpDescriptorExtractor = new OrbDescriptorExtractor(
+      mOrbFeatures,
+      (float)mOrbScaleFactor,
+      mOrbLevels,
+      mOrbEdgeThreshold);
+  }
+  else if (FeatureType == "dense")
+  {
+    mFeatureType = eDense;
+
+    ReadDenseAttributes(pFeatures);
+
+    // The lattice is placed on the (possibly shrunk) image features are generated from. Coarser
+    // levels use a proportionally coarser lattice.
+    mpFeatureDetector = new DenseFeatureDetector(
+      (float)(mDenseSize*mFeatureScale),
+      mDenseLevels,
+      (float)mDenseScaleMul,
+      max(1, cvRound(mDenseStep*mFeatureScale)),
+      cvRound(mDenseBound*mFeatureScale),
+      true,
+      false);
+
+    // SURF builds the integral image once per image and samples it for every lattice point
+    mpDescriptorExtractor = new SurfDescriptorExtractor(
+      0.0,
+      4,
+      2,
+      mSurfExtended,
+      mDenseUpright);
+  }
 }
 
 //=================================================================================================
@@ -483,6 +677,113 @@ void CRecognitionDb::ReadSiftAttributes(TiXmlElement* pSift)
 }
  */
 
+//=================================================================================================
+// Description:
+//  Reads a parameter shared by every feature type (caching, logging, storage and threading).
+//  Returns false when pElement is not one of them.
+//=================================================================================================
+bool CRecognitionDb::ReadCommonFeatureParam(TiXmlElement* pElement)
+{
+  string Param = pElement->Value();
+
+  int Threads = mFeatureThreads;
+  int ReadThreads = mFeatureReadThreads;
+  int WriteThreads = mFeatureWriteThreads;
+  int QueueDepth = mFeatureQueueDepth;
+
+  if (Param == "autoLevels")
+  {
+    ReadBoolValueAttribute(pElement, &mAutoLevels);
+  }
+  else if (Param == "generateLog")
+  {
+    ReadBoolValueAttribute(pElement, &mGenFeatureLog);
+  }
+  else if (Param == "cache")
+  {
+    ReadBoolValueAttribute(pElement, &mCacheFeatures);
+  }
+  else if (Param == "store")
+  {
+    ReadBoolValueAttribute(pElement, &mFeatureStoreOn);
+  }
+  else if (Param == "storage")
+  {
+    string Storage = ReadValueAttribute(pElement);
+    if (Storage == "float32")
+    {
+      mDescriptorStorage = CRecognitionEntry::eFloat32;
+    }
+    else if (Storage == "float16")
+    {
+      mDescriptorStorage = CRecognitionEntry::eFloat16;
+    }
+    else if (Storage == "int8")
+    {
+      mDescriptorStorage = CRecognitionEntry::eInt8;
+    }
+    else
+    {
+      cout << "WARNING: Unknown descriptor storage " << Storage << ", using float32\n";
+      mDescriptorStorage = CRecognitionEntry::eFloat32;
+    }
+  }
+  else if (Param == "threads")
+  {
+    ReadIntValueAttribute(pElement, &Threads);
+    if ((Threads >= 0) && (Threads <= 256))
+    {
+      mFeatureThreads = Threads;
+    }
+    else
+    {
+      cout << "WARNING: Feature thread count is invalid, using one per core\n";
+    }
+  }
+  else if (Param == "readThreads")
+  {
+    ReadIntValueAttribute(pElement, &ReadThreads);
+    if ((ReadThreads > 0) && (ReadThreads <= 64))
+    {
+      mFeatureReadThreads = ReadThreads;
+    }
+    else
+    {
+      cout << "WARNING: Feature read thread count is invalid, using default value\n";
+    }
+  }
+  else if (Param == "writeThreads")
+  {
+    ReadIntValueAttribute(pElement, &WriteThreads);
+    if ((WriteThreads > 0) && (WriteThreads <= 64))
+    {
+      mFeatureWriteThreads = WriteThreads;
+    }
+    else
+    {
+      cout << "WARNING: Feature write thread count is invalid, using default value\n";
+    }
+  }
+  else if (Param == "queueDepth")
+  {
+    ReadIntValueAttribute(pElement, &QueueDepth);
+    if ((QueueDepth >= 0) && (QueueDepth <= 1024))
+    {
+      mFeatureQueueDepth = QueueDepth;
+    }
+    else
+    {
+      cout << "WARNING: Feature queue depth is invalid, using default value\n";
+    }
+  }
+  else
+  {
+    return false;
+  }
+
+  return true;
+}
+
 //=================================================================================================
 //=================================================================================================
 void CRecognitionDb::ReadSurfAttributes(TiXmlElement* pSurf)
@@ -498,6 +799,7 @@ void CRecognitionDb::ReadSurfAttributes(TiXmlElement* pSurf)
   int AdjusterIter = mAdjusterIter;
   bool AdjusterMemory = mAdjusterMemory;
   double AdjusterLearnRate = mAdjusterLearnRate;
+  bool AdjusterSelect = mAdjusterSelect;
   bool GridOn = mGridOn;
   int GridStep = mGridStep;
 
@@ -548,6 +850,10 @@ void CRecognitionDb::ReadSurfAttributes(TiXmlElement* pSurf)
     {
       ReadDoubleValueAttribute(pElement, &AdjusterLearnRate);
     }
+    else if (Param == "adjusterSelect")
+    {
+      ReadBoolValueAttribute(pElement, &AdjusterSelect);
+    }
     else if (Param == "gridOn")
     {
       ReadBoolValueAttribute(pElement, &GridOn);
@@ -556,17 +862,9 @@ void CRecognitionDb::ReadSurfAttributes(TiXmlElement* pSurf)
     {
       ReadIntValueAttribute(pElement, &GridStep);
     }
-    else if (Param == "autoLevels")
-    {
-      ReadBoolValueAttribute(pElement, &mAutoLevels);
-    }
-    else if (Param == "generateLog")
-    {
-      ReadBoolValueAttribute(pElement, &mGenFeatureLog);
-    }
-    else if (Param == "cache")
+    else
     {
-      ReadBoolValueAttribute(pElement, &mCacheFeatures);
+      ReadCommonFeatureParam(pElement);
     }
   }
 
@@ -581,6 +879,7 @@ void CRecognitionDb::ReadSurfAttributes(TiXmlElement* pSurf)
   mAdjusterIter = AdjusterIter;
   mAdjusterMemory = AdjusterMemory;
   mAdjusterLearnRate = AdjusterLearnRate;
+  mAdjusterSelect = AdjusterSelect;
 
   mGridOn = GridOn;
   mGridStep = GridStep;
@@ -588,225 +887,1658 @@ void CRecognitionDb::ReadSurfAttributes(TiXmlElement* pSurf)
 
 //=================================================================================================
 //=================================================================================================
-bool CRecognitionDb::PopulateFeatures()
-{
-  wxTimeSpan PopulateTime(0);
-  return PopulateFeatures(PopulateTime);
-}
-
-//=================================================================================================
-//=================================================================================================
-bool CRecognitionDb::PopulateFeatures(wxTimeSpan& PopulateTime)
+void CRecognitionDb::ReadOrbAttributes(TiXmlElement* pOrb)
 {
-  double HessianThreshold = mpSurfParams->hessianThreshold;
-  int AdjusterSuccessCount = 0;
-  int AdjusterTotalCount = 0;
+  int Features = mOrbFeatures;
+  double ScaleFactor = mOrbScaleFactor;
+  int Levels = mOrbLevels;
+  int EdgeThreshold = mOrbEdgeThreshold;
 
-  // For every filename in the database
-  for (unsigned i = 0; i < mImageFileNames.size(); i++)
+  for (
+    TiXmlElement* pElement = pOrb->FirstChildElement();
+    pElement != 0;
+    pElement = pElement->NextSiblingElement())
   {
-    // Construct cached entry name
-    wxFileName CachedEntryFileName = mDbDirs.mDatabaseDir;
-    CachedEntryFileName.SetName(mImageFileNames.at(i).GetName());
-    CachedEntryFileName.SetExt("key");
+    string Param = pElement->Value();
 
-    // Check to see if there is a cached entry
-    if (mCacheFeatures && CachedEntryFileName.IsFileReadable())
+    if (Param == "nfeatures")
     {
-      wxDateTime StartTime = wxDateTime::UNow();
-
-      // Read the cached entry as a binary file
-      ifstream EntryIs(CachedEntryFileName.GetFullPath().c_str(), ios::in|ios::binary);
-      if (EntryIs)
-      {
-        mEntries.at(i).LoadFeatures(EntryIs);
-        EntryIs.close();
-        wxTimeSpan Duration = wxDateTime::UNow() - StartTime;
-
-        PopulateTime.Add(Duration);
-        //cout << "Loaded    " << CachedEntryFileName.GetName();
-        //cout << " with " << mEntries.at(i).GetKeyPointCount();
-        //cout << " in " << Duration.Format("%M:%S:%l") << "\n";
-      }
+      ReadIntValueAttribute(pElement, &Features);
+    }
+    else if (Param == "scaleFactor")
+    {
+      ReadDoubleValueAttribute(pElement, &ScaleFactor);
+    }
+    else if (Param == "levels")
+    {
+      ReadIntValueAttribute(pElement, &Levels);
+    }
+    else if (Param == "edgeThreshold")
+    {
+      ReadIntValueAttribute(pElement, &EdgeThreshold);
     }
     else
     {
-      // If we have to generate descriptors then make sure we can
-      if ((mpFeatureDetector == 0) || (mpDescriptorExtractor == 0))
-      {
-        cout << "ERROR: Need to generate descriptors, but no detector or extractor was found!\n";
-        return false;
-      }
-
-      CRecognitionEntry& Entry = mEntries.at(i);
-      Mat Image = cv::imread(mImageFileNames.at(i).GetFullPath().ToStdString());
-      Mat ImageNorm;
-      Mat& ImageRef = Image;
-      int imageHeight = Image.size().height;
-      int imageWidth = Image.size().width;
-
-      // Time feature generation
-      wxDateTime StartTimer = wxDateTime::UNow();
-
-      if (mAutoLevels)
-      {
-        // Normalize the image histogram
-        NormalizeClipImageBGR(Image, ImageNorm, 1.5);
-        // Set the reference as the normalized image
-        ImageRef = ImageNorm;
-      }
-
-      // Generate the features (keypoints + descriptors)
-      if (mAdjusterOn && !mGridOn)
-      {
-        if (!mAdjusterMemory) HessianThreshold = mpSurfParams->hessianThreshold;
-
-        if (mEntries.at(i).GenerateFeaturesSurfAdjuster(
-          ImageRef,
-          mAdjusterMin,
-          mAdjusterMax,
-          mAdjusterIter,
-          mAdjusterLearnRate,
-          HessianThreshold,
-          mpSurfParams,
-          *mpDescriptorExtractor))
-        {
-          AdjusterSuccessCount++;
-        }
-        AdjusterTotalCount++;
-      }
-      else if (mAdjusterOn && mGridOn)
-      {
-        mEntries.at(i).GenerateFeaturesGrid(
-          ImageRef,
-          mAdjusterMin,
-          mAdjusterMax,
-          mAdjusterIter,
-          mAdjusterLearnRate,
-          HessianThreshold,
-          mpSurfParams,
-          mGridStep,
-          *mpDescriptorExtractor);
-      }
-      else
-      {
-        mEntries.at(i).GenerateFeatures(
-          ImageRef,
-          *mpFeatureDetector,
-          *mpDescriptorExtractor);
-      }
+      ReadCommonFeatureParam(pElement);
+    }
+  }
 
-      wxDateTime EndTimer = wxDateTime::UNow();
-      wxTimeSpan GenTime = EndTimer - StartTimer;
+  if (Features > 0)
+  {
+    mOrbFeatures = Features;
+  }
+  else
+  {
+    cout << "WARNING: ORB feature count is invalid, using default value\n";
+  }
 
-      PopulateTime.Add(GenTime);
+  if (ScaleFactor > 1.0)
+  {
+    mOrbScaleFactor = ScaleFactor;
+  }
+  else
+  {
+    cout << "WARNING: ORB scale factor must be greater than 1, using default value\n";
+  }
 
-      //cout << "Generated " << CachedEntryFileName.GetName();
-      //cout << " with " << Entry.GetKeyPointCount();
-      //cout << " in " << GenTime.Format("%M:%S:%l") << "\n";
+  if ((Levels > 0) && (Levels <= 32))
+  {
+    mOrbLevels = Levels;
+  }
+  else
+  {
+    cout << "WARNING: ORB level count is invalid, using default value\n";
+  }
 
-      // Generate HTML log entry and image for this entry (if enabled)
-      if (mGenFeatureLog)
-      {
-        GenFeatureLogImage(ImageRef, Entry);
-        GenFeatureLogHtml(Entry, GenTime);
-      }
+  if (EdgeThreshold >= 0)
+  {
+    mOrbEdgeThreshold = EdgeThreshold;
+  }
+  else
+  {
+    cout << "WARNING: ORB edge threshold is invalid, using default value\n";
+  }
 
-      // Cache features (if enabled)
-      if (mCacheFeatures)
-      {
-        ofstream EntryOs(CachedEntryFileName.GetFullPath().c_str(), ios::out|ios::binary);
-        if (EntryOs) Entry.SaveFeatures(EntryOs);
-      }
+  // ORB descriptors are bit strings, they have no float, half or int8 form
+  if (mDescriptorStorage != CRecognitionEntry::eBinary)
+  {
+    if (mDescriptorStorage != CRecognitionEntry::eFloat32)
+    {
+      cout << "WARNING: ORB descriptors are always stored as binary\n";
     }
+    mDescriptorStorage = CRecognitionEntry::eBinary;
   }
 
-  //cout << "Populated " << mEntries.size() << " entries in: ";
-  //cout << PopulateTime.Format("%M:%S:%l") << "\n";
-
-  //if (mAdjusterOn && (AdjusterTotalCount != 0))
-  //{
-  //  cout << "Adjuster success rate = ";
-  //  cout << 100.0*(double)AdjusterSuccessCount/(double)AdjusterTotalCount << "\n";
-  //}
-
-  return true;
+  // The SURF threshold adjuster and grid detection do not apply
+  mAdjusterOn = false;
+  mGridOn = false;
 }
 
 //=================================================================================================
-// Overloaded function that ignores timing the operation
 //=================================================================================================
-bool CRecognitionDb::PopulateDictionary()
+void CRecognitionDb::ReadDenseAttributes(TiXmlElement* pDense)
 {
-  wxTimeSpan DictionaryTime(0);
-  wxTimeSpan WordHistTime(0);
+  int Step = mDenseStep;
+  double Size = mDenseSize;
+  int Levels = mDenseLevels;
+  double ScaleMul = mDenseScaleMul;
+  int Bound = mDenseBound;
 
-  return PopulateDictionary(DictionaryTime, WordHistTime);
-}
+  for (
+    TiXmlElement* pElement = pDense->FirstChildElement();
+    pElement != 0;
+    pElement = pElement->NextSiblingElement())
+  {
+    string Param = pElement->Value();
 
-//=================================================================================================
-// Create the dictionary for this database or if one exists (caching enabled) read it from disk
-//=================================================================================================
-bool CRecognitionDb::PopulateDictionary(wxTimeSpan& DictionaryTime, wxTimeSpan& WordHistTime)
-{
-  // Time this operation
-  wxDateTime StartDictionaryTime = wxDateTime::UNow();
+    if (Param == "step")
+    {
+      ReadIntValueAttribute(pElement, &Step);
+    }
+    else if (Param == "size")
+    {
+      ReadDoubleValueAttribute(pElement, &Size);
+    }
+    else if (Param == "levels")
+    {
+      ReadIntValueAttribute(pElement, &Levels);
+    }
+    else if (Param == "scaleMul")
+    {
+      ReadDoubleValueAttribute(pElement, &ScaleMul);
+    }
+    else if (Param == "bound")
+    {
+      ReadIntValueAttribute(pElement, &Bound);
+    }
+    else if (Param == "extended")
+    {
+      ReadBoolValueAttribute(pElement, &mSurfExtended);
+    }
+    else if (Param == "upright")
+    {
+      ReadBoolValueAttribute(pElement, &mDenseUpright);
+    }
+    else
+    {
+      ReadCommonFeatureParam(pElement);
+    }
+  }
 
-  // Cached dictionary name
-  wxFileName CachedDictionaryFileName = mDbDirs.mDatabaseDir;
-  CachedDictionaryFileName.SetName(mDbName);
-  CachedDictionaryFileName.SetExt("dic");
+  if (Step > 0)
+  {
+    mDenseStep = Step;
+  }
+  else
+  {
+    cout << "WARNING: Dense feature step is invalid, using default value\n";
+  }
 
-  // If caching is enabled and the cached file is readable
-  if (mCacheDictionary && CachedDictionaryFileName.IsFileReadable())
+  if (Size > 0.0)
   {
-    // Read/load the cached dictionary
-    ifstream DictionaryIs(CachedDictionaryFileName.GetFullPath().c_str(), ios::in|ios::binary);
-    if (DictionaryIs && LoadDictionary(DictionaryIs))
+    mDenseSize = Size;
+  }
+  else
+  {
+    cout << "WARNING: Dense feature size is invalid, using default value\n";
+  }
+
+  if ((Levels > 0) && (Levels <= 16))
+  {
+    mDenseLevels = Levels;
+  }
+  else
+  {
+    cout << "WARNING: Dense feature level count is invalid, using default value\n";
+  }
+
+  if (ScaleMul > 0.0)
+  {
+    mDenseScaleMul = ScaleMul;
+  }
+  else
+  {
+    cout << "WARNING: Dense feature scale multiplier is invalid, using default value\n";
+  }
+
+  if (Bound >= 0)
+  {
+    mDenseBound = Bound;
+  }
+  else
+  {
+    cout << "WARNING: Dense feature bound is invalid, using default value\n";
+  }
+
+  // Every key point is placed, there is no detection threshold to adjust
+  mAdjusterOn = false;
+  mGridOn = false;
+}
+
+//=================================================================================================
+//=================================================================================================
+bool CRecognitionDb::PopulateFeatures()
+{
+  wxTimeSpan PopulateTime(0);
+  return PopulateFeatures(PopulateTime);
+}
+
+//=================================================================================================
+// Consecutive entries that share the carried over adjuster threshold, decoded by one read thread
+// and computed by one compute thread in order
+//=================================================================================================
+struct CRecognitionDb::SFeatureShard
+{
+  vector<unsigned> mIndices; // Entries of the shard that were not loaded from cache
+  vector<Mat> mImages; // Decoded at mFeatureScale
+  vector<Size> mFullSizes; // Size of each image as stored
+};
+
+//=================================================================================================
+// Generated features of one entry waiting to be logged and cached
+//=================================================================================================
+struct CRecognitionDb::SFeatureOutput
+{
+  unsigned mIndex;
+  Mat mImage; // Image the features were generated from (only kept for the feature log)
+  wxTimeSpan mGenTime;
+};
+
+//=================================================================================================
+// Work shared by the PopulateFeatures pipeline threads
+//=================================================================================================
+struct CRecognitionDb::SFeatureJob
+{
+  SFeatureJob(size_t ShardCapacity, size_t OutputCapacity)
+   : mShards(ShardCapacity),
+     mOutputs(OutputCapacity)
+  {
+  }
+
+  unsigned mShardSize;
+  unsigned mShardCount;
+  bool mCarryThreshold; // Entries of a shard are generated (or cached) together
+  bool mWriteOutputs; // False when nothing is logged or cached (the compute stage is the last)
+  std::atomic<unsigned> mNextShard;
+  std::atomic<unsigned> mReadersLeft;
+  std::atomic<unsigned> mComputersLeft;
+  std::atomic<unsigned> mCachedCount;
+  std::atomic<unsigned> mStoreCount; // Cached entries that came from mFeatureStore
+  std::atomic<bool> mFailed;
+
+  CBoundedQueue<SFeatureShard> mShards; // Read -> compute
+  CBoundedQueue<SFeatureOutput> mOutputs; // Compute -> write
+
+  // Milliseconds each thread of each stage spent working (one slot per thread)
+  vector<double> mReadBusy;
+  vector<double> mComputeBusy;
+  vector<double> mWriteBusy;
+};
+
+//=================================================================================================
+// Description:
+//  Features are populated by a three stage pipeline connected by bounded queues so that disk
+//  and CPU work overlap:
+//    read     mFeatureReadThreads threads load cached features or decode the images (imread)
+//    compute  mFeatureThreads threads (one per core when 0) normalize the images and generate
+//             the key points and descriptors
+//    write    mFeatureWriteThreads threads write the feature cache files and the feature log
+//  A queue holds at most mFeatureQueueDepth items (twice the compute threads when 0), which
+//  bounds the number of decoded images in memory.
+//
+//  The entries are split into fixed shards of consecutive entries that read threads claim in
+//  order. The SURF adjuster threshold carries over from one entry to the next (adjusterMemory,
+//  and always in grid mode) within a shard only; every shard starts from the configured
+//  threshold and is computed by a single thread, so the result does not depend on the number of
+//  threads or on which thread ran what. Each entry only writes its own slot and cache file.
+//
+//  The busy and stall times of every stage are kept in mFeatureStageStats.
+//
+//  With the feature store (mFeatureStoreOn), cached features are read from a single mapped file
+//  instead of one file per entry. When every entry comes from the store its descriptor block
+//  becomes mDescriptorArena as is; otherwise the store is rewritten once all entries are done.
+//
+//  Cached features are content addressed: an entry is found by the hash of its image bytes and
+//  the hash of the feature settings (HashFeatureParams), in a cache directory shared by all
+//  databases. Changing a setting or an image therefore never reuses stale features, and setups
+//  with the same images and feature settings reuse each other's features. The read threads hash
+//  the images; an image whose size and modification time match the last run is not reread.
+//  When the adjuster threshold carries over, the features of an entry also depend on the entries
+//  before it in its shard: the key then covers those images too (SetShardFeatureKeys) and a
+//  shard is only taken from the cache when all of its entries are, otherwise the whole shard is
+//  regenerated so the threshold chain is the same as in an uncached run.
+//=================================================================================================
+bool CRecognitionDb::PopulateFeatures(wxTimeSpan& PopulateTime)
+{
+  // Consecutive entries that share the carried over adjuster threshold
+  const unsigned AdjusterShardSize = 8;
+
+  wxDateTime StartTime = wxDateTime::UNow();
+
+  const unsigned EntryCount = mImageFileNames.size();
+  const bool CarryThreshold = mAdjusterOn && (mAdjusterMemory || mGridOn);
+
+  unsigned ComputeThreads = mFeatureThreads;
+  if (ComputeThreads == 0) ComputeThreads = std::thread::hardware_concurrency();
+  ComputeThreads = max(1u, ComputeThreads);
+
+  unsigned QueueDepth = mFeatureQueueDepth;
+  if (QueueDepth == 0) QueueDepth = 2*ComputeThreads;
+
+  const bool UseStore = mCacheFeatures && mFeatureStoreOn;
+
+  mFeatureParamsHash = HashFeatureParams();
+  mImageStamps.assign(EntryCount, SImageStamp());
+  mFeatureKeys.assign(EntryCount, string());
+  mFeatureStoreStamp = SImageStamp();
+  if (mCacheFeatures) LoadImageStamps();
+
+  // Entries may still view the previous mapping, they are all replaced below
+  mDescriptorArena.Release();
+  mFeatureStore.Close();
+  if (UseStore)
+  {
+    mFeatureStore.Open(
+      GetFeatureStoreFileName().GetFullPath().ToStdString(),
+      CRecognitionEntry::GetDescriptorType(mDescriptorStorage));
+
+    if (mFeatureStore.IsOpen() && !VerifyFeatureStore())
+    {
+      cout << "WARNING: Regenerating the feature store (descriptor checksum mismatch)\n";
+      mFeatureStore.Close();
+    }
+  }
+
+  SFeatureJob Job(QueueDepth, QueueDepth);
+  Job.mShardSize = CarryThreshold ? AdjusterShardSize : 1;
+  Job.mCarryThreshold = CarryThreshold;
+  Job.mShardCount = (EntryCount + Job.mShardSize - 1)/Job.mShardSize;
+  Job.mWriteOutputs = (mCacheFeatures && !UseStore) || mGenFeatureLog;
+  Job.mNextShard = 0;
+  Job.mCachedCount = 0;
+  Job.mStoreCount = 0;
+  Job.mFailed = false;
+
+  const unsigned ReadThreads = max(1u, min(mFeatureReadThreads, Job.mShardCount));
+  ComputeThreads = max(1u, min(ComputeThreads, Job.mShardCount));
+  const unsigned WriteThreads = Job.mWriteOutputs ? max(1u, mFeatureWriteThreads) : 0;
+
+  Job.mReadersLeft = ReadThreads;
+  Job.mComputersLeft = ComputeThreads;
+  Job.mReadBusy.assign(ReadThreads, 0.0);
+  Job.mComputeBusy.assign(ComputeThreads, 0.0);
+  Job.mWriteBusy.assign(WriteThreads, 0.0);
+
+  vector<std::thread> Workers;
+  for (unsigned t = 0; t < ReadThreads; t++)
+  {
+    Workers.push_back(std::thread(&CRecognitionDb::PopulateFeaturesReader, this, &Job, t));
+  }
+  for (unsigned t = 0; t < ComputeThreads; t++)
+  {
+    Workers.push_back(std::thread(&CRecognitionDb::PopulateFeaturesComputer, this, &Job, t));
+  }
+  for (unsigned t = 0; t < WriteThreads; t++)
+  {
+    Workers.push_back(std::thread(&CRecognitionDb::PopulateFeaturesWriter, this, &Job, t));
+  }
+
+  for (unsigned t = 0; t < Workers.size(); t++)
+  {
+    Workers[t].join();
+  }
+
+  // Wall clock time of the whole stage (not the sum over entries)
+  wxTimeSpan WallTime = wxDateTime::UNow() - StartTime;
+  PopulateTime.Add(WallTime);
+
+  //cout << "Populated " << mEntries.size() << " entries in: ";
+  //cout << PopulateTime.Format("%M:%S:%l") << "\n";
+
+  const double WallMs = max(1.0, WallTime.GetMilliseconds().ToDouble());
+  const unsigned GeneratedCount = EntryCount - Job.mCachedCount;
+
+  mFeatureStageStats.assign(3, SFeatureStageStats());
+
+  mFeatureStageStats[0].mName = "Read";
+  mFeatureStageStats[0].mThreads = ReadThreads;
+  mFeatureStageStats[0].mItems = EntryCount;
+  mFeatureStageStats[0].mStallOutMs = 1000.0*Job.mShards.GetPushStall();
+  mFeatureStageStats[0].mMeanQueue = Job.mShards.GetMeanOccupancy();
+  mFeatureStageStats[0].mMaxQueue = Job.mShards.GetMaxOccupancy();
+  mFeatureStageStats[0].mQueueCapacity = Job.mShards.GetCapacity();
+
+  mFeatureStageStats[1].mName = "Compute";
+  mFeatureStageStats[1].mThreads = ComputeThreads;
+  mFeatureStageStats[1].mItems = GeneratedCount;
+  mFeatureStageStats[1].mStallInMs = 1000.0*Job.mShards.GetPopStall();
+  mFeatureStageStats[1].mStallOutMs = 1000.0*Job.mOutputs.GetPushStall();
+  mFeatureStageStats[1].mMeanQueue = Job.mOutputs.GetMeanOccupancy();
+  mFeatureStageStats[1].mMaxQueue = Job.mOutputs.GetMaxOccupancy();
+  mFeatureStageStats[1].mQueueCapacity = Job.mWriteOutputs ? Job.mOutputs.GetCapacity() : 0;
+
+  mFeatureStageStats[2].mName = "Write";
+  mFeatureStageStats[2].mThreads = WriteThreads;
+  mFeatureStageStats[2].mItems = Job.mWriteOutputs ? GeneratedCount : 0;
+  mFeatureStageStats[2].mStallInMs = 1000.0*Job.mOutputs.GetPopStall();
+
+  const vector<double>* pBusy[3] = {&Job.mReadBusy, &Job.mComputeBusy, &Job.mWriteBusy};
+
+  for (unsigned s = 0; s < mFeatureStageStats.size(); s++)
+  {
+    SFeatureStageStats& Stats = mFeatureStageStats[s];
+    for (unsigned t = 0; t < pBusy[s]->size(); t++)
+    {
+      Stats.mBusyMs += pBusy[s]->at(t);
+    }
+    if (Stats.mThreads > 0) Stats.mOccupancy = Stats.mBusyMs/(WallMs*Stats.mThreads);
+
+    cout << "Feature " << Stats.mName << " stage: " << Stats.mThreads << " threads, ";
+    cout << Stats.mItems << " entries, " << (int)(100.0*Stats.mOccupancy) << "% busy, ";
+    cout << "stalled " << (int)Stats.mStallInMs << " ms on input and ";
+    cout << (int)Stats.mStallOutMs << " ms on output\n";
+  }
+
+  // Add the stage counters to the setup summary
+  GenSetupSummaryLog();
+
+  if (mCacheFeatures) SaveImageStamps();
+
+  if (Job.mFailed) return false;
+
+  // Warm start: the stored block is already laid out like the arena
+  if (UseStore && (Job.mStoreCount == EntryCount) && AdoptFeatureStore()) return true;
+
+  // Keep every descriptor in one block so k-means and batch quantization can use it directly
+  if (!PackDescriptors() && mFeatureStore.IsOpen())
+  {
+    // The entries must not view the mapping once it is closed
+    for (unsigned i = 0; i < mEntries.size(); i++)
+    {
+      mEntries.at(i).SetDescriptors(mEntries.at(i).GetDescriptors().clone());
+    }
+  }
+
+  if (UseStore && (EntryCount > 0))
+  {
+    if (WriteFeatureStore())
+    {
+      // Written by this run, so the next run need not verify it
+      SaveImageStamps();
+    }
+    else
+    {
+      cout << "WARNING: Failed to write the feature store\n";
+    }
+  }
+
+  return true;
+}
+
+//=================================================================================================
+// Read stage: claim shards in order, load the cached entries and decode the images of the rest
+//=================================================================================================
+void CRecognitionDb::PopulateFeaturesReader(SFeatureJob* pJob, unsigned Thread)
+{
+  while (!pJob->mFailed)
+  {
+    const unsigned Shard = pJob->mNextShard++;
+    if (Shard >= pJob->mShardCount) break;
+
+    wxDateTime StartTimer = wxDateTime::UNow();
+
+    const unsigned Begin = Shard*pJob->mShardSize;
+    const unsigned End = min(Begin + pJob->mShardSize, (unsigned)mImageFileNames.size());
+
+    if (mCacheFeatures) SetShardFeatureKeys(Begin, End, pJob->mCarryThreshold);
+
+    vector<unsigned> Missing;
+    unsigned CachedCount = 0;
+    unsigned StoreCount = 0;
+    for (unsigned i = Begin; i < End; i++)
+    {
+      bool FromStore = false;
+      if (LoadEntryFeatures(i, FromStore))
+      {
+        CachedCount++;
+        if (FromStore) StoreCount++;
+      }
+      else
+      {
+        Missing.push_back(i);
+      }
+    }
+
+    // A chained shard is regenerated as a whole (the loaded entries are overwritten)
+    if (pJob->mCarryThreshold && !Missing.empty() && (CachedCount > 0))
+    {
+      Missing.clear();
+      for (unsigned i = Begin; i < End; i++)
+      {
+        Missing.push_back(i);
+      }
+      CachedCount = 0;
+      StoreCount = 0;
+    }
+
+    pJob->mCachedCount += CachedCount;
+    pJob->mStoreCount += StoreCount;
+
+    SFeatureShard Item;
+    for (unsigned k = 0; k < Missing.size(); k++)
+    {
+      Size FullSize;
+      Item.mIndices.push_back(Missing[k]);
+      Item.mImages.push_back(
+        ReadImageScaled(mImageFileNames.at(Missing[k]), mFeatureScale, &FullSize));
+      Item.mFullSizes.push_back(FullSize);
+    }
+
+    pJob->mReadBusy[Thread] += (wxDateTime::UNow() - StartTimer).GetMilliseconds().ToDouble();
+
+    if (Item.mIndices.empty()) continue;
+
+    if (!pJob->mShards.Push(Item)) break;
+  }
+
+  // The last reader out lets the compute threads drain the queue and stop
+  if (--pJob->mReadersLeft == 0) pJob->mShards.Close();
+}
+
+//=================================================================================================
+// Compute stage: generate the features of a whole shard in order
+//=================================================================================================
+void CRecognitionDb::PopulateFeaturesComputer(SFeatureJob* pJob, unsigned Thread)
+{
+  SFeatureShard Item;
+  while (pJob->mShards.Pop(Item))
+  {
+    wxDateTime StartTimer = wxDateTime::UNow();
+
+    // Only the SURF adjuster uses (and adapts) the threshold
+    double HessianThreshold = mpSurfParams ? mpSurfParams->hessianThreshold : 0.0;
+
+    for (unsigned k = 0; k < Item.mIndices.size(); k++)
+    {
+      SFeatureOutput Output;
+      Output.mIndex = Item.mIndices[k];
+
+      if (!GenerateEntryFeatures(
+        Output.mIndex, Item.mImages[k], Item.mFullSizes[k], HessianThreshold,
+        Output.mImage, Output.mGenTime))
+      {
+        pJob->mFailed = true;
+        pJob->mShards.Abort();
+        pJob->mOutputs.Abort();
+        break;
+      }
+
+      // Release the decoded image as soon as possible
+      Item.mImages[k].release();
+      if (!mGenFeatureLog) Output.mImage.release();
+
+      if (pJob->mWriteOutputs)
+      {
+        // Stalls are accounted for by the queue
+        pJob->mComputeBusy[Thread] +=
+          (wxDateTime::UNow() - StartTimer).GetMilliseconds().ToDouble();
+        if (!pJob->mOutputs.Push(Output)) break;
+        StartTimer = wxDateTime::UNow();
+      }
+    }
+
+    pJob->mComputeBusy[Thread] += (wxDateTime::UNow() - StartTimer).GetMilliseconds().ToDouble();
+  }
+
+  if (--pJob->mComputersLeft == 0) pJob->mOutputs.Close();
+}
+
+//=================================================================================================
+// Write stage: feature log and cache files
+//=================================================================================================
+void CRecognitionDb::PopulateFeaturesWriter(SFeatureJob* pJob, unsigned Thread)
+{
+  SFeatureOutput Output;
+  while (pJob->mOutputs.Pop(Output))
+  {
+    wxDateTime StartTimer = wxDateTime::UNow();
+
+    SaveEntryFeatures(Output.mIndex, Output.mImage, Output.mGenTime);
+    Output.mImage.release();
+
+    pJob->mWriteBusy[Thread] += (wxDateTime::UNow() - StartTimer).GetMilliseconds().ToDouble();
+  }
+}
+
+//=================================================================================================
+// Description:
+//  Load the features of entry i from the feature store or its cache file. Returns false when the
+//  features have to be generated. Called from several threads at once: only touches entry i and
+//  its own files (the store is only read).
+//=================================================================================================
+bool CRecognitionDb::LoadEntryFeatures(unsigned i, bool& FromStore)
+{
+  FromStore = false;
+
+  if (!mCacheFeatures || mFeatureKeys.at(i).empty()) return false;
+
+  CRecognitionEntry& Entry = mEntries.at(i);
+
+  const int k = mFeatureStore.Find(mFeatureKeys.at(i));
+  if (k >= 0)
+  {
+    vector<KeyPoint> KeyPoints;
+    Mat Des;
+    Mat Scale;
+    int ImageHeight = 0;
+    int ImageWidth = 0;
+
+    if (mFeatureStore.GetEntry(k, KeyPoints, Des, Scale, ImageHeight, ImageWidth))
+    {
+      Entry.SetFeatures(KeyPoints, Des, Scale, ImageHeight, ImageWidth);
+      FromStore = true;
+      return true;
+    }
+  }
+
+  // Construct cached entry name
+  wxFileName CachedEntryFileName = GetFeatureCacheFileName(i);
+
+  // Check to see if there is a cached entry (per entry files also migrate into the store, and
+  // may have been written by another database)
+  if (!CachedEntryFileName.IsFileReadable()) return false;
+
+  // Read the cached entry as a binary file
+  ifstream EntryIs(CachedEntryFileName.GetFullPath().c_str(), ios::in|ios::binary);
+  if (!EntryIs) return false;
+
+  if (!Entry.LoadFeatures(EntryIs, mDescriptorStorage))
+  {
+    // Old, truncated or corrupt files are regenerated (and rewritten)
+    cout << "WARNING: Regenerating features of " << Entry.GetName() << " (unreadable cache file "
+         << CachedEntryFileName.GetFullName() << ")\n";
+    return false;
+  }
+  return true;
+}
+
+//=================================================================================================
+// Description:
+//  Generate the features of entry i from its decoded Image. HessianThreshold is the adjuster
+//  threshold of the previous entry of the shard and is updated for the next. ImageRef receives
+//  the (normalized) image the features were generated from. When Image was shrunk (its size is
+//  not FullSize) the key points are mapped back to FullSize coordinates.
+//=================================================================================================
+bool CRecognitionDb::GenerateEntryFeatures(
+  unsigned i,
+  Mat& Image,
+  const Size& FullSize,
+  double& HessianThreshold,
+  Mat& ImageRef,
+  wxTimeSpan& GenTime)
+{
+  // If we have to generate descriptors then make sure we can
+  if ((mpFeatureDetector == 0) || (mpDescriptorExtractor == 0))
+  {
+    cout << "ERROR: Need to generate descriptors, but no detector or extractor was found!\n";
+    return false;
+  }
+
+  CRecognitionEntry& Entry = mEntries.at(i);
+  ImageRef = Image;
+
+  // Time feature generation
+  wxDateTime StartTimer = wxDateTime::UNow();
+
+  if (mAutoLevels)
+  {
+    // Normalize the image histogram
+    Mat ImageNorm;
+    NormalizeClipImageBGR(Image, ImageNorm, 1.5);
+    // Set the reference as the normalized image
+    ImageRef = ImageNorm;
+  }
+
+  // Generate the features (keypoints + descriptors)
+  if (mAdjusterOn && mAdjusterSelect && !mGridOn)
+  {
+    if (!mAdjusterMemory) HessianThreshold = mpSurfParams->hessianThreshold;
+
+    Entry.GenerateFeaturesSurfSelect(
+      ImageRef,
+      mAdjusterMin,
+      mAdjusterMax,
+      mAdjusterIter,
+      HessianThreshold,
+      mpSurfParams,
+      *mpDescriptorExtractor);
+  }
+  else if (mAdjusterOn && !mGridOn)
+  {
+    if (!mAdjusterMemory) HessianThreshold = mpSurfParams->hessianThreshold;
+
+    Entry.GenerateFeaturesSurfAdjuster(
+      ImageRef,
+      mAdjusterMin,
+      mAdjusterMax,
+      mAdjusterIter,
+      mAdjusterLearnRate,
+      HessianThreshold,
+      mpSurfParams,
+      *mpDescriptorExtractor);
+  }
+  else if (mAdjusterOn && mGridOn)
+  {
+    Entry.GenerateFeaturesGrid(
+      ImageRef,
+      mAdjusterMin,
+      mAdjusterMax,
+      mAdjusterIter,
+      mAdjusterLearnRate,
+      HessianThreshold,
+      mpSurfParams,
+      max(1, cvRound(mGridStep*mFeatureScale)), // Grid step is in full size pixels
+      *mpDescriptorExtractor,
+      mAdjusterSelect);
+  }
+  else
+  {
+    Entry.GenerateFeatures(
+      ImageRef,
+      *mpFeatureDetector,
+      *mpDescriptorExtractor);
+  }
+
+  // Downstream geometry (windows, logs) is always in full size image coordinates
+  if ((Image.cols != FullSize.width) || (Image.rows != FullSize.height))
+  {
+    Entry.MapToImageSize(FullSize.height, FullSize.width);
+  }
+
+  // Convert to the compact format (if enabled) as part of generation
+  Entry.SetDescriptorStorage(mDescriptorStorage);
+
+  GenTime = wxDateTime::UNow() - StartTimer;
+
+  //cout << "Generated " << Entry.GetName();
+  //cout << " with " << Entry.GetKeyPointCount();
+  //cout << " in " << GenTime.Format("%M:%S:%l") << "\n";
+
+  return true;
+}
+
+//=================================================================================================
+// Generate the HTML log entry and image (if enabled) and cache the features (if enabled)
+//=================================================================================================
+void CRecognitionDb::SaveEntryFeatures(unsigned i, const Mat& ImageRef, wxTimeSpan& GenTime)
+{
+  CRecognitionEntry& Entry = mEntries.at(i);
+
+  if (mGenFeatureLog)
+  {
+    GenFeatureLogImage(ImageRef, Entry);
+    GenFeatureLogHtml(Entry, GenTime);
+  }
+
+  // With the store on, every entry is written at once by WriteFeatureStore
+  if (mCacheFeatures && !mFeatureStoreOn && !mFeatureKeys.at(i).empty())
+  {
+    // The cache is shared, so the file only appears under its name once it is complete. The
+    // temporary name includes the entry, as duplicate images of a database share the key.
+    const wxString CachedEntryPath = GetFeatureCacheFileName(i).GetFullPath();
+    const wxString TempPath =
+      CachedEntryPath + wxString::Format(".%lu.%u.tmp", wxGetProcessId(), i);
+
+    ofstream EntryOs(TempPath.c_str(), ios::out|ios::binary);
+    bool Saved = EntryOs && Entry.SaveFeatures(EntryOs);
+    EntryOs.close();
+
+    Saved = Saved && EntryOs && wxRenameFile(TempPath, CachedEntryPath, true);
+    if (!Saved) wxRemoveFile(TempPath);
+  }
+}
+
+//=================================================================================================
+// Description:
+//  Copies the descriptors of every entry into a newly allocated arena and points each entry at
+//  its block. Fails (leaving the entries as they are) when entries disagree on the descriptor
+//  length or storage format.
+//=================================================================================================
+bool CRecognitionDb::PackDescriptors()
+{
+  vector<int> BlockRows(mEntries.size(), 0);
+  int Cols = 0;
+  int Type = -1;
+
+  for (unsigned i = 0; i < mEntries.size(); i++)
+  {
+    const Mat& Des = mEntries.at(i).GetDescriptors();
+    if (Des.rows == 0) continue;
+
+    if (Type < 0)
+    {
+      Cols = Des.cols;
+      Type = Des.type();
+    }
+    else if ((Des.cols != Cols) || (Des.type() != Type))
+    {
+      cout << "WARNING: Entry descriptors differ in format, descriptors are not packed\n";
+      mDescriptorArena.Release();
+      return false;
+    }
+    BlockRows[i] = Des.rows;
+  }
+
+  if ((Type < 0) || !mDescriptorArena.Allocate(BlockRows, Cols, Type))
+  {
+    mDescriptorArena.Release();
+    return false;
+  }
+
+  for (unsigned i = 0; i < mEntries.size(); i++)
+  {
+    if (BlockRows[i] == 0) continue;
+
+    // The block has the same size and type so copyTo writes into the arena
+    Mat Block = mDescriptorArena.GetBlock(i);
+    mEntries.at(i).GetDescriptors().copyTo(Block);
+    mEntries.at(i).SetDescriptors(Block);
+  }
+
+  return true;
+}
+
+//=================================================================================================
+//=================================================================================================
+bool CRecognitionDb::AdoptFeatureStore()
+{
+  if (!mFeatureStore.IsOpen() || (mFeatureStore.GetEntryCount() != (int)mEntries.size()))
+  {
+    return false;
+  }
+
+  vector<int> BlockRows(mEntries.size(), 0);
+  for (unsigned i = 0; i < mEntries.size(); i++)
+  {
+    if (mFeatureStore.GetName(i) != mFeatureKeys.at(i)) return false;
+
+    BlockRows[i] = mFeatureStore.GetFirstRow(i + 1) - mFeatureStore.GetFirstRow(i);
+  }
+
+  return mDescriptorArena.Adopt(mFeatureStore.GetDescriptors(), BlockRows) && IsPacked();
+}
+
+//=================================================================================================
+//=================================================================================================
+bool CRecognitionDb::WriteFeatureStore()
+{
+  mFeatureStore.Close();
+
+  // Entries are stored under their cache key
+  vector<string> Keys(mEntries.size());
+  for (unsigned i = 0; i < mEntries.size(); i++)
+  {
+    Keys[i] = mFeatureKeys.at(i);
+    if (Keys[i].empty()) return false;
+  }
+
+  const wxFileName StoreFileName = GetFeatureStoreFileName();
+  if (!CFeatureStore::Write(StoreFileName.GetFullPath().ToStdString(), mEntries, Keys))
+  {
+    return false;
+  }
+
+  mFeatureStoreStamp = GetFileStamp(StoreFileName, FeatureStoreStampKey);
+  return true;
+}
+
+//=================================================================================================
+//=================================================================================================
+bool CRecognitionDb::IsPacked() const
+{
+  if (mDescriptorArena.IsEmpty()) return false;
+  if (mDescriptorArena.GetBlockCount() != (int)mEntries.size()) return false;
+
+  const Mat& All = mDescriptorArena.GetDescriptors();
+
+  for (unsigned i = 0; i < mEntries.size(); i++)
+  {
+    const Mat& Des = mEntries.at(i).GetDescriptors();
+    const int Offset = mDescriptorArena.GetBlockOffset(i);
+
+    if (Des.rows != mDescriptorArena.GetBlockOffset(i + 1) - Offset) return false;
+    if ((Des.rows > 0) && (Des.data != All.ptr(Offset))) return false;
+  }
+  return true;
+}
+
+//=================================================================================================
+// Description:
+//  Settings are hashed field by field (no padding bytes). FeatureCacheVersion changes whenever
+//  the feature generation itself changes.
+//=================================================================================================
+uint64_t CRecognitionDb::HashFeatureParams() const
+{
+  const uint32_t FeatureCacheVersion = 1;
+  const int FeatureType = mFeatureType;
+  const int Storage = mDescriptorStorage;
+
+  uint64_t Hash = CWordQuantizer::HashBytes(&FeatureCacheVersion, sizeof(FeatureCacheVersion));
+  Hash = CWordQuantizer::HashBytes(&FeatureType, sizeof(FeatureType), Hash);
+  Hash = CWordQuantizer::HashBytes(&Storage, sizeof(Storage), Hash);
+  Hash = CWordQuantizer::HashBytes(&mFeatureScale, sizeof(mFeatureScale), Hash);
+  Hash = CWordQuantizer::HashBytes(&mAutoLevels, sizeof(mAutoLevels), Hash);
+
+  // Adjuster and grid
+  Hash = CWordQuantizer::HashBytes(&mAdjusterOn, sizeof(mAdjusterOn), Hash);
+  Hash = CWordQuantizer::HashBytes(&mAdjusterMin, sizeof(mAdjusterMin), Hash);
+  Hash = CWordQuantizer::HashBytes(&mAdjusterMax, sizeof(mAdjusterMax), Hash);
+  Hash = CWordQuantizer::HashBytes(&mAdjusterIter, sizeof(mAdjusterIter), Hash);
+  Hash = CWordQuantizer::HashBytes(&mAdjusterMemory, sizeof(mAdjusterMemory), Hash);
+  Hash = CWordQuantizer::HashBytes(&mAdjusterLearnRate, sizeof(mAdjusterLearnRate), Hash);
+  Hash = CWordQuantizer::HashBytes(&mAdjusterSelect, sizeof(mAdjusterSelect), Hash);
+  Hash = CWordQuantizer::HashBytes(&mGridOn, sizeof(mGridOn), Hash);
+  Hash = CWordQuantizer::HashBytes(&mGridStep, sizeof(mGridStep), Hash);
+
+  switch (mFeatureType)
+  {
+    case eORB:
+      Hash = CWordQuantizer::HashBytes(&mOrbFeatures, sizeof(mOrbFeatures), Hash);
+      Hash = CWordQuantizer::HashBytes(&mOrbScaleFactor, sizeof(mOrbScaleFactor), Hash);
+      Hash = CWordQuantizer::HashBytes(&mOrbLevels, sizeof(mOrbLevels), Hash);
+      Hash = CWordQuantizer::HashBytes(&mOrbEdgeThreshold, sizeof(mOrbEdgeThreshold), Hash);
+    break;
+    case eDense:
+      Hash = CWordQuantizer::HashBytes(&mDenseStep, sizeof(mDenseStep), Hash);
+      Hash = CWordQuantizer::HashBytes(&mDenseSize, sizeof(mDenseSize), Hash);
+      Hash = CWordQuantizer::HashBytes(&mDenseLevels, sizeof(mDenseLevels), Hash);
+      Hash = CWordQuantizer::HashBytes(&mDenseScaleMul, sizeof(mDenseScaleMul), Hash);
+      Hash = CWordQuantizer::HashBytes(&mDenseBound, sizeof(mDenseBound), Hash);
+      Hash = CWordQuantizer::HashBytes(&mDenseUpright, sizeof(mDenseUpright), Hash);
+      Hash = CWordQuantizer::HashBytes(&mSurfExtended, sizeof(mSurfExtended), Hash);
+    break;
+    default:
+      Hash = CWordQuantizer::HashBytes(&mSurfExtended, sizeof(mSurfExtended), Hash);
+      if (mpSurfParams != 0)
+      {
+        const CvSURFParams& Surf = *mpSurfParams;
+        Hash = CWordQuantizer::HashBytes(&Surf.extended, sizeof(Surf.extended), Hash);
+        Hash = CWordQuantizer::HashBytes(&Surf.upright, sizeof(Surf.upright), Hash);
+        Hash = CWordQuantizer::HashBytes(
+          &Surf.hessianThreshold, sizeof(Surf.hessianThreshold), Hash);
+        Hash = CWordQuantizer::HashBytes(&Surf.nOctaves, sizeof(Surf.nOctaves), Hash);
+        Hash = CWordQuantizer::HashBytes(&Surf.nOctaveLayers, sizeof(Surf.nOctaveLayers), Hash);
+      }
+    break;
+  }
+  return Hash;
+}
+
+//=================================================================================================
+//=================================================================================================
+CRecognitionDb::SImageStamp CRecognitionDb::GetFileStamp(
+  const wxFileName& FileName,
+  const string& Key)
+{
+  SImageStamp Stamp;
+  Stamp.mSize = FileName.GetSize().GetValue();
+  Stamp.mTime = (int64_t)FileName.GetModificationTime().GetTicks();
+  Stamp.mKey = Key;
+  return Stamp;
+}
+
+//=================================================================================================
+// Description:
+//  The image bytes are only read when the file's size or modification time differs from the
+//  stamp of the last run
+//=================================================================================================
+bool CRecognitionDb::HashEntryImage(unsigned i)
+{
+  SImageStamp& Stamp = mImageStamps.at(i);
+  if (!Stamp.mKey.empty()) return true;
+
+  const wxFileName& ImageFileName = mImageFileNames.at(i);
+  const string Path = ImageFileName.GetFullPath().ToStdString();
+
+  if (!ImageFileName.FileExists()) return false;
+
+  SImageStamp Current = GetFileStamp(ImageFileName, "");
+
+  map<string, SImageStamp>::const_iterator it = mKnownImageStamps.find(Path);
+  if ((it != mKnownImageStamps.end()) &&
+      (it->second.mSize == Current.mSize) &&
+      (it->second.mTime == Current.mTime))
+  {
+    Stamp = it->second;
+    return true;
+  }
+
+  ifstream ImageIs(Path.c_str(), ios::in|ios::binary);
+  vector<char> Bytes((size_t)Current.mSize);
+
+  if (!ImageIs || (!Bytes.empty() && !ImageIs.read(&Bytes[0], Bytes.size()))) return false;
+
+  const uint64_t Hash = CWordQuantizer::HashBytes(Bytes.empty() ? 0 : &Bytes[0], Bytes.size());
+  Current.mKey = wxString::Format("%016llx", (unsigned long long)Hash).ToStdString();
+
+  Stamp = Current;
+  return true;
+}
+
+//=================================================================================================
+//=================================================================================================
+bool CRecognitionDb::SetShardFeatureKeys(unsigned Begin, unsigned End, bool Chained)
+{
+  for (unsigned i = Begin; i < End; i++)
+  {
+    if (!HashEntryImage(i)) return false;
+  }
+
+  uint64_t Chain = CWordQuantizer::HashBytes(0, 0);
+  for (unsigned i = Begin; i < End; i++)
+  {
+    const string& ImageKey = mImageStamps[i].mKey;
+
+    if (!Chained)
+    {
+      mFeatureKeys[i] = ImageKey;
+      continue;
+    }
+
+    Chain = CWordQuantizer::HashBytes(ImageKey.c_str(), ImageKey.size(), Chain);
+    mFeatureKeys[i] =
+      ImageKey + wxString::Format("-c%016llx", (unsigned long long)Chain).ToStdString();
+  }
+  return true;
+}
+
+//=================================================================================================
+//=================================================================================================
+bool CRecognitionDb::VerifyFeatureStore()
+{
+  const wxFileName StoreFileName = GetFeatureStoreFileName();
+  const SImageStamp Current = GetFileStamp(StoreFileName, FeatureStoreStampKey);
+
+  map<string, SImageStamp>::const_iterator it =
+    mKnownImageStamps.find(StoreFileName.GetFullPath().ToStdString());
+
+  const bool Unchanged =
+    (it != mKnownImageStamps.end()) &&
+    (it->second.mKey == Current.mKey) &&
+    (it->second.mSize == Current.mSize) &&
+    (it->second.mTime == Current.mTime);
+
+  if (!Unchanged && !mFeatureStore.VerifyDescriptors()) return false;
+
+  mFeatureStoreStamp = Current;
+  return true;
+}
+
+//=================================================================================================
+// Description:
+//  One line per image: key, size, modification time and path (the rest of the line). The
+//  feature store gets a line of its own with FeatureStoreStampKey as the key.
+//=================================================================================================
+void CRecognitionDb::LoadImageStamps()
+{
+  mKnownImageStamps.clear();
+
+  wxFileName StampsFileName = mDbDirs.mDatabaseDir;
+  StampsFileName.SetName(mDbName);
+  StampsFileName.SetExt("hsh");
+
+  ifstream Is(StampsFileName.GetFullPath().c_str());
+
+  SImageStamp Stamp;
+  string Path;
+  while (Is >> Stamp.mKey >> Stamp.mSize >> Stamp.mTime && getline(Is >> ws, Path))
+  {
+    mKnownImageStamps[Path] = Stamp;
+  }
+}
+
+//=================================================================================================
+//=================================================================================================
+void CRecognitionDb::SaveImageStamps() const
+{
+  wxFileName StampsFileName = mDbDirs.mDatabaseDir;
+  StampsFileName.SetName(mDbName);
+  StampsFileName.SetExt("hsh");
+
+  ofstream Os(StampsFileName.GetFullPath().c_str());
+
+  for (unsigned i = 0; i < mImageStamps.size(); i++)
+  {
+    const SImageStamp& Stamp = mImageStamps[i];
+    if (Stamp.mKey.empty()) continue;
+
+    Os << Stamp.mKey << " " << Stamp.mSize << " " << Stamp.mTime << " "
+       << mImageFileNames.at(i).GetFullPath() << "\n";
+  }
+
+  if (!mFeatureStoreStamp.mKey.empty())
+  {
+    Os << mFeatureStoreStamp.mKey << " " << mFeatureStoreStamp.mSize << " "
+       << mFeatureStoreStamp.mTime << " " << GetFeatureStoreFileName().GetFullPath() << "\n";
+  }
+}
+
+//=================================================================================================
+//=================================================================================================
+wxFileName CRecognitionDb::GetFeatureCacheFileName(unsigned i) const
+{
+  const string& Key = mFeatureKeys.at(i);
+  if (Key.empty()) return wxFileName();
+
+  wxFileName CachedEntryFileName = mDbDirs.mFeatureCacheDir;
+  CachedEntryFileName.SetName(
+    Key + wxString::Format("-%016llx", (unsigned long long)mFeatureParamsHash));
+
+  // Compact descriptors are cached separately so switching formats never misreads a cache
+  switch (mDescriptorStorage)
+  {
+    case CRecognitionEntry::eFloat16:
+      CachedEntryFileName.SetExt("k16");
+    break;
+    case CRecognitionEntry::eInt8:
+      CachedEntryFileName.SetExt("k8");
+    break;
+    case CRecognitionEntry::eBinary:
+      CachedEntryFileName.SetExt("kb");
+    break;
+    default:
+      CachedEntryFileName.SetExt("key");
+    break;
+  }
+  return CachedEntryFileName;
+}
+
+//=================================================================================================
+// Description:
+//  The entries inside the store are looked up by their image hash, so an image that changes
+//  under the same path is regenerated (and the store rewritten)
+//=================================================================================================
+wxFileName CRecognitionDb::GetFeatureStoreFileName() const
+{
+  uint64_t Hash = CWordQuantizer::HashBytes(&mFeatureParamsHash, sizeof(mFeatureParamsHash));
+  for (unsigned i = 0; i < mImageFileNames.size(); i++)
+  {
+    // Paths include the terminating zero so that consecutive paths cannot run together
+    const string Path = mImageFileNames[i].GetFullPath().ToStdString();
+    Hash = CWordQuantizer::HashBytes(Path.c_str(), Path.size() + 1, Hash);
+  }
+
+  wxFileName StoreFileName = mDbDirs.mFeatureCacheDir;
+  StoreFileName.SetName(wxString::Format("%016llx", (unsigned long long)Hash));
+  switch (mDescriptorStorage)
+  {
+    case CRecognitionEntry::eFloat16:
+      StoreFileName.SetExt("fst16");
+    break;
+    case CRecognitionEntry::eInt8:
+      StoreFileName.SetExt("fst8");
+    break;
+    case CRecognitionEntry::eBinary:
+      StoreFileName.SetExt("fstb");
+    break;
+    default:
+      StoreFileName.SetExt("fst");
+    break;
+  }
+  return StoreFileName;
+}
+
+//=================================================================================================
+//=================================================================================================
+bool CRecognitionDb::ReadEntryDescriptors(unsigned i, Mat& Des) const
+{
+  const CRecognitionEntry& Entry = mEntries.at(i);
+
+  if (!Entry.GetDescriptors().empty())
+  {
+    Entry.GetDescriptorsFloat(Des);
+    return true;
+  }
+
+  // Not in memory, use the cached features (an entry without either has no descriptors)
+  Des.release();
+
+  if ((i >= mFeatureKeys.size()) || mFeatureKeys[i].empty()) return true;
+
+  const int k = mFeatureStore.Find(mFeatureKeys[i]);
+  if (k >= 0)
+  {
+    vector<KeyPoint> KeyPoints;
+    Mat Stored;
+    Mat Scale;
+    int ImageHeight = 0;
+    int ImageWidth = 0;
+
+    if (!mFeatureStore.GetEntry(k, KeyPoints, Stored, Scale, ImageHeight, ImageWidth))
+    {
+      return false;
+    }
+
+    // fp32 descriptors stay a view of the mapping
+    CDescriptorCodec::Decode(Stored, Scale, Des);
+    return true;
+  }
+
+  wxFileName CachedEntryFileName = GetFeatureCacheFileName(i);
+  if (!CachedEntryFileName.IsFileReadable()) return true;
+
+  ifstream EntryIs(CachedEntryFileName.GetFullPath().c_str(), ios::in|ios::binary);
+  if (!EntryIs) return false;
+
+  CRecognitionEntry Cached(Entry.GetName(), Entry.GetLabelId());
+  if (!Cached.LoadFeatures(EntryIs, mDescriptorStorage)) return false;
+
+  Cached.GetDescriptorsFloat(Des);
+  return true;
+}
+
+//=================================================================================================
+// Description:
+//  Descriptor source for CKMeans::RunStreaming, one block per entry
+//=================================================================================================
+class CRecognitionDb::CEntryDescriptorSource : public CDescriptorSource
+{
+  public:
+    CEntryDescriptorSource(const CRecognitionDb& Db)
+     : mDb(Db)
+    {
+    }
+
+    int GetBlockCount() const
+    {
+      return (int)mDb.mEntries.size();
+    }
+
+    bool ReadBlock(int i, Mat& Des)
+    {
+      return mDb.ReadEntryDescriptors((unsigned)i, Des);
+    }
+
+  private:
+    const CRecognitionDb& mDb;
+};
+
+//=================================================================================================
+// Overloaded function that ignores timing the operation
+//=================================================================================================
+bool CRecognitionDb::PopulateDictionary()
+{
+  wxTimeSpan DictionaryTime(0);
+  wxTimeSpan WordHistTime(0);
+
+  return PopulateDictionary(DictionaryTime, WordHistTime);
+}
+
+//=================================================================================================
+// Create the dictionary for this database or if one exists (caching enabled) read it from disk
+//=================================================================================================
+bool CRecognitionDb::PopulateDictionary(wxTimeSpan& DictionaryTime, wxTimeSpan& WordHistTime)
+{
+  // Time this operation
+  wxDateTime StartDictionaryTime = wxDateTime::UNow();
+
+  // Binary descriptors always use a flat k-majority dictionary of binary words
+  const bool Binary = (mFeatureType == eORB);
+  const bool Tree = (mDictionaryType == eVocabTree) && !Binary;
+
+  // Cached dictionary name
+  wxFileName CachedDictionaryFileName = mDbDirs.mDatabaseDir;
+  CachedDictionaryFileName.SetName(mDbName);
+  CachedDictionaryFileName.SetExt(Tree ? "voc" : (Binary ? "dicb" : "dic"));
+
+  // If caching is enabled and the cached file is readable
+  if (mCacheDictionary && CachedDictionaryFileName.IsFileReadable())
+  {
+    // Read/load the cached dictionary
+    ifstream DictionaryIs(CachedDictionaryFileName.GetFullPath().c_str(), ios::in|ios::binary);
+
+    bool Loaded = false;
+    if (DictionaryIs)
+    {
+      if (Tree)
+      {
+        Loaded = LoadVocabularyTree(DictionaryIs);
+      }
+      else
+      {
+        Loaded = LoadDictionary(DictionaryIs);
+      }
+    }
+
+    if (!Loaded)
+    {
+      cout << "WARNING: Rebuilding the dictionary (unreadable or out of date cache file "
+           << CachedDictionaryFileName.GetFullName() << ")\n";
+    }
+    else
+    {
+      DictionaryIs.close();
+
+      // Make sure the cached entry has the correct number of words
+      if (mpDictionary->rows == mWordCount)
+      {
+        // Cached dictionary loaded successfully so end dictionary timer
+        DictionaryTime.Add(wxDateTime::UNow() - StartDictionaryTime);
+
+        // Fold entries added since the dictionary was built into it before any word is
+        // assigned, so descriptors are only quantized against the updated dictionary
+        if (mIncrementalDictionary && Binary)
+        {
+          cout << "WARNING: Incremental dictionaries are not supported for binary features\n";
+        }
+        else if (mIncrementalDictionary && (mDictionaryType != eVocabTree))
+        {
+          return UpdateDictionaryIncremental(DictionaryTime, WordHistTime);
+        }
+
+        // Start word histogram timer
+        wxDateTime StartWordHistTime = wxDateTime::UNow();
+
+        // Populate the word histograms of all entries in one batch
+        if (!FillWordHists())
+        {
+          return false;
+        }
+
+        // End word histogram timer
+        WordHistTime.Add(wxDateTime::UNow() - StartWordHistTime);
+
+        LogWordIndexRecall();
+
+        // We loaded the dictionary from cache and populated word historgrams successfully
+        return true;
+      }
+    }
+  }
+
+  // If caching is turned off, there is no cached dictionary, or the cached
+  // dictionary is out of date then generate a new dictionary and fill in
+  // the word histograms in this database
+
+  // Check to make sure we have entries
+  if (mEntries.size() == 0)
+  {
+    cout << "ERROR: No entries in database!\n";
+    return false;
+  }
+
+  if (Binary)
+  {
+    return PopulateDictionaryBinary(
+      CachedDictionaryFileName, StartDictionaryTime, DictionaryTime, WordHistTime);
+  }
+
+  if (mDictionaryType == eStreaming)
+  {
+    // Out-of-core k-means, the descriptors are read one entry at a time
+    CEntryDescriptorSource Source(*this);
+    CKMeans KMeans(mKMeansParams);
+
+    delete mpDictionary;
+    mpDictionary = new Mat();
+
+    if (!KMeans.RunStreaming(Source, mWordCount, *mpDictionary))
+    {
+      cout << "ERROR: Streaming k-means failed (fewer descriptors than words?)\n";
+      return false;
+    }
+    cout << "Streaming k-means: " << KMeans.GetIterationsRun() << " passes, ";
+    cout << "compactness " << KMeans.GetCompactness() << "\n";
+
+    UpdateWordQuantizer();
+
+    // End dictionary timer
+    DictionaryTime.Add(wxDateTime::UNow() - StartDictionaryTime);
+
+    // Start word histogram timer
+    wxDateTime StartWordHistTime = wxDateTime::UNow();
+
+    // No labels are kept for the whole database, every entry is assigned with the quantizer
+    if (!FillWordHists())
+    {
+      return false;
+    }
+
+    // End word histogram timer
+    WordHistTime.Add(wxDateTime::UNow() - StartWordHistTime);
+
+    // Save the dictionary into cache
+    if (mCacheDictionary)
+    {
+      ofstream DictionaryOs(CachedDictionaryFileName.GetFullPath().c_str(), ios::out|ios::binary);
+      if (DictionaryOs)
+      {
+        SaveDictionary(DictionaryOs);
+        DictionaryOs.close();
+        SaveDictionaryMembers();
+      }
+    }
+
+    return true;
+  }
+
+  // Matrix of descriptors for K-means clustering, each row is a descriptor entry
+  Mat AllDescriptors;
+  GetAllDescriptors(AllDescriptors);
+
+  if (mDictionaryType == eVocabTree)
+  {
+    // Hierarchical k-means, the words are the leaves of the tree
+    delete mpVocabularyTree;
+    mpVocabularyTree = new CVocabularyTree();
+
+    if (!mpVocabularyTree->Build(
+      AllDescriptors, mVocabTreeBranching, mVocabTreeDepth, mWordKMeansIter))
+    {
+      cout << "ERROR: Failed to build the vocabulary tree\n";
+      return false;
+    }
+
+    delete mpDictionary;
+    mpDictionary = new Mat();
+    mpVocabularyTree->GetWords(*mpDictionary);
+
+    UpdateWordQuantizer();
+
+    // End dictionary timer
+    DictionaryTime.Add(wxDateTime::UNow() - StartDictionaryTime);
+
+    // Start word histogram timer
+    wxDateTime StartWordHistTime = wxDateTime::UNow();
+
+    // Training descriptors are assigned by walking the tree (the same path used for lookups)
+    if (!FillWordHists())
+    {
+      return false;
+    }
+
+    // End word histogram timer
+    WordHistTime.Add(wxDateTime::UNow() - StartWordHistTime);
+
+    // Save the tree into cache
+    if (mCacheDictionary)
+    {
+      ofstream TreeOs(CachedDictionaryFileName.GetFullPath().c_str(), ios::out|ios::binary);
+      if (TreeOs)
+      {
+        SaveVocabularyTree(TreeOs);
+        TreeOs.close();
+      }
+    }
+
+    return true;
+  }
+
+  int Attempts = 1;
+  mpLabels = new Mat(AllDescriptors.rows, 1, CV_32S);
+  mpDictionary = new Mat(AllDescriptors.cols, mWordCount, CV_32F);
+  TermCriteria TermCrit = TermCriteria(TermCriteria::MAX_ITER, mWordKMeansIter, 0.0f);
+
+  if (mKMeansParams.mRestarts > 1)
+  {
+    // Independently seeded runs in parallel, the most compact dictionary is kept
+    SKMeansParams Params = mKMeansParams;
+    Params.mIterations = mWordKMeansIter;
+
+    CKMeans::EMethod Method = CKMeans::eMethodOpenCV;
+    if (mDictionaryType == eMiniBatch)
+    {
+      Method = CKMeans::eMethodMiniBatch;
+    }
+    else if (mDictionaryType == eHamerly)
+    {
+      Method = CKMeans::eMethodHamerly;
+    }
+
+    CKMeans KMeans(Params);
+    if (!KMeans.RunRestarts(
+      Method, AllDescriptors, mWordCount, *mpDictionary, *mpLabels, mRestartCompactness))
     {
-      DictionaryIs.close();
+      cout << "ERROR: K-means restarts failed (fewer descriptors than words?)\n";
+      return false;
+    }
 
-      // Make sure the cached entry has the correct number of words
-      if (mpDictionary->rows == mWordCount)
-      {
-        // Cached dictionary loaded successfully so end dictionary timer
-        DictionaryTime.Add(wxDateTime::UNow() - StartDictionaryTime);
+    for (unsigned r = 0; r < mRestartCompactness.size(); r++)
+    {
+      cout << "K-means restart " << r << ": compactness " << mRestartCompactness[r] << "\n";
+    }
 
-        // Start word histogram timer
-        wxDateTime StartWordHistTime = wxDateTime::UNow();
+    // Add the compactness of every restart to the setup summary
+    GenSetupSummaryLog();
+  }
+  else if (mDictionaryType == eMiniBatch)
+  {
+    // Multithreaded mini-batch k-means (same dictionary/label layout as cv::kmeans)
+    SKMeansParams Params = mKMeansParams;
+    Params.mIterations = mWordKMeansIter;
 
-        // Populate the word histograms
-        for (unsigned i = 0; i < mEntries.size(); i++)
-        {
-          // Store the word histogram in the entry
-          if (!FillWordHist(mEntries.at(i)))
-          {
-            cout << "ERROR: Failed to generate word histogram for entry ";
-            cout << mEntries.at(i).GetName() << " (" << i << ")\n";
-            return false;
-          }
-        }
+    CKMeans KMeans(Params);
+    if (!KMeans.RunMiniBatch(AllDescriptors, mWordCount, *mpDictionary, *mpLabels))
+    {
+      cout << "ERROR: Mini-batch k-means failed (fewer descriptors than words?)\n";
+      return false;
+    }
+    cout << "Mini-batch k-means: " << KMeans.GetIterationsRun() << " iterations, ";
+    cout << "compactness " << KMeans.GetCompactness() << "\n";
+  }
+  else if (mDictionaryType == eHamerly)
+  {
+    // Exact k-means with bounds that skip most distance computations
+    SKMeansParams Params = mKMeansParams;
+    Params.mIterations = mWordKMeansIter;
 
-        // End word histogram timer
-        WordHistTime.Add(wxDateTime::UNow() - StartWordHistTime);
+    CKMeans KMeans(Params);
+    if (!KMeans.RunHamerly(AllDescriptors, mWordCount, *mpDictionary, *mpLabels))
+    {
+      cout << "ERROR: Exact k-means failed (fewer descriptors than words?)\n";
+      return false;
+    }
+    cout << "Exact k-means: " << KMeans.GetIterationsRun() << " iterations, ";
+    cout << "compactness " << KMeans.GetCompactness() << ", ";
+    cout << 100.0*KMeans.GetScanFraction() << "% full scans\n";
+  }
+  else
+  {
+    // Create the dictionary (k-means clustering)
+    cv::kmeans(
+      AllDescriptors,
+      mWordCount,
+      *mpLabels,
+      TermCrit,
+      Attempts,
+      KMEANS_PP_CENTERS,
+      *mpDictionary);
+  }
 
-        // We loaded the dictionary from cache and populated word historgrams successfully
-        return true;
-      }
+  UpdateWordQuantizer();
+
+  // End dictionary timer
+  DictionaryTime.Add(wxDateTime::UNow() - StartDictionaryTime);
+
+  // Start word histogram timer
+  wxDateTime StartWordHistTime = wxDateTime::UNow();
+
+  SetWordHistsFromLabels(mCacheWordLabels);
+
+  // End word histogram timer
+  DictionaryTime.Add(wxDateTime::UNow() - StartWordHistTime);
+
+  // Save the dictionary into cache
+  if (mCacheDictionary)
+  {
+    ofstream DictionaryOs(CachedDictionaryFileName.GetFullPath().c_str(), ios::out|ios::binary);
+    if (DictionaryOs)
+    {
+      SaveDictionary(DictionaryOs);
+      DictionaryOs.close();
+      SaveDictionaryMembers();
     }
   }
 
-  // If caching is turned off, there is no cached dictionary, or the cached
-  // dictionary is out of date then generate a new dictionary and fill in
-  // the word histograms in this database
+  LogWordIndexRecall();
 
-  // Check to make sure we have entries
-  if (mEntries.size() == 0)
+  //Delta = wxDateTime::UNow()-StartTime;
+  //cout << "Generated Dictionary in ";
+  //cout << Delta.Format("%M:%S:%l") << "\n";
+
+  return true;
+}
+
+//=================================================================================================
+// Description:
+//  Dictionary of binary words for binary descriptors (k-majority clustering, see CKMajority).
+//  The Euclidean dictionary options (method, restarts, streaming, tree) do not apply.
+//=================================================================================================
+bool CRecognitionDb::PopulateDictionaryBinary(
+  const wxFileName& CachedDictionaryFileName,
+  const wxDateTime& StartDictionaryTime,
+  wxTimeSpan& DictionaryTime,
+  wxTimeSpan& WordHistTime)
+{
+  if (mDictionaryType != eKMeans)
   {
-    cout << "ERROR: No entries in database!\n";
+    cout << "WARNING: Binary features always use a k-majority dictionary\n";
+  }
+  if (mKMeansParams.mRestarts > 1)
+  {
+    cout << "WARNING: K-means restarts are not supported for binary features\n";
+  }
+
+  // Binary descriptors, each row is a descriptor entry
+  Mat AllDescriptors;
+  GetAllDescriptors(AllDescriptors);
+
+  SKMeansParams Params = mKMeansParams;
+  Params.mIterations = mWordKMeansIter;
+
+  delete mpDictionary;
+  delete mpLabels;
+  mpDictionary = new Mat();
+  mpLabels = new Mat();
+
+  CKMajority KMajority(Params);
+  if (!KMajority.Run(AllDescriptors, mWordCount, *mpDictionary, *mpLabels))
+  {
+    cout << "ERROR: K-majority clustering failed (fewer descriptors than words?)\n";
+    return false;
+  }
+  cout << "K-majority: " << KMajority.GetIterationsRun() << " iterations, ";
+  cout << "compactness " << KMajority.GetCompactness() << "\n";
+
+  if (!UpdateWordQuantizer())
+  {
+    cout << "ERROR: Failed to update the word quantizer\n";
     return false;
   }
 
+  // End dictionary timer
+  DictionaryTime.Add(wxDateTime::UNow() - StartDictionaryTime);
+
+  // Start word histogram timer
+  wxDateTime StartWordHistTime = wxDateTime::UNow();
+
+  SetWordHistsFromLabels(mCacheWordLabels);
+
+  // End word histogram timer
+  WordHistTime.Add(wxDateTime::UNow() - StartWordHistTime);
+
+  // Save the dictionary into cache
+  if (mCacheDictionary)
+  {
+    ofstream DictionaryOs(CachedDictionaryFileName.GetFullPath().c_str(), ios::out|ios::binary);
+    if (DictionaryOs)
+    {
+      SaveDictionary(DictionaryOs);
+      DictionaryOs.close();
+      SaveDictionaryMembers();
+    }
+  }
+
+  return true;
+}
+
+//=================================================================================================
+// Description:
+//  Every descriptor of every entry, one per row in entry order: fp32 (decoded from the storage
+//  format) or, for binary descriptors, the raw bytes. Packed descriptors of the right type are
+//  used as they are (no copy), anything else is gathered into a new matrix.
+//=================================================================================================
+void CRecognitionDb::GetAllDescriptors(Mat& AllDescriptors) const
+{
+  const bool Binary = (mDescriptorStorage == CRecognitionEntry::eBinary);
+  const int Type = Binary ? CV_8U : CV_32F;
+
+  if (IsPacked() && (mDescriptorArena.GetDescriptors().type() == Type))
+  {
+    AllDescriptors = mDescriptorArena.GetDescriptors();
+    return;
+  }
+
   const unsigned DescriptorLength = mEntries.at(0).GetDescriptors().cols;
 
   // Iterate through descriptors and count them
@@ -816,86 +2548,393 @@ bool CRecognitionDb::PopulateDictionary(wxTimeSpan& DictionaryTime, wxTimeSpan&
     KeyPointCount += mEntries.at(i).GetKeyPointCount();
   }
 
-  // Create matrix of descriptors for K-means clustering
-  // Each row is a descriptor entry
-  Mat AllDescriptors = Mat(KeyPointCount, DescriptorLength, CV_32FC1, Scalar(0));
+  AllDescriptors = Mat(KeyPointCount, DescriptorLength, Type, Scalar(0));
 
   unsigned l = 0;
 
   for (unsigned i = 0; i < mEntries.size(); i++)
   {
     const Mat& Des = mEntries.at(i).GetDescriptors();
+    const Mat& Scale = mEntries.at(i).GetDescriptorScale();
     for (unsigned j = 0; j < (unsigned)Des.rows; j++)
     {
-      // Copy each row
-      for (int k = 0; k < Des.cols; k++)
+      if (Binary)
+      {
+        memcpy(AllDescriptors.ptr(l), Des.ptr(j), DescriptorLength);
+      }
+      else
       {
-        AllDescriptors.at<float>(l,k) = Des.at<float>(j,k);
+        // Copy each row (decoded to fp32, k-means only works on floats)
+        CDescriptorCodec::DecodeRow(Des, Scale, j, AllDescriptors.ptr<float>(l));
       }
       l++;
     }
   }
+}
 
-  int Attempts = 1;
-  mpLabels = new Mat(KeyPointCount, 1, CV_32S);
-  mpDictionary = new Mat(DescriptorLength, mWordCount, CV_32F);
-  TermCriteria TermCrit = TermCriteria(TermCriteria::MAX_ITER, mWordKMeansIter, 0.0f);
+//=================================================================================================
+// Description:
+//  Word histograms (and word labels) of every entry from mpLabels, the k-means labels of the
+//  rows of GetAllDescriptors
+//=================================================================================================
+void CRecognitionDb::SetWordHistsFromLabels(bool CacheLabels)
+{
+  const unsigned RowDim = mEntries.size();
+  unsigned idx = 0;
+
+  for (int i = 0; i < (int)RowDim; i++)
+  {
+    CRecognitionEntry& Entry = mEntries.at(i);
+    Entry.InitWordHist(mWordCount);
 
-  // Create the dictionary (k-means clustering)
-  cv::kmeans(
-    AllDescriptors,
-    mWordCount,
-    *mpLabels,
-    TermCrit,
-    Attempts,
-    KMEANS_PP_CENTERS,
-    *mpDictionary);
+    vector<int> Labels(Entry.GetKeyPointCount());
+
+    // For each key point descriptor update the word histogram
+    for (unsigned j = 0; j < Entry.GetKeyPointCount(); j++)
+    {
+      unsigned ClusterIndex = mpLabels->at<unsigned>(idx, 0);
+      Entry.IncrementWordHist(ClusterIndex);
+      Labels[j] = ClusterIndex;
+      idx++;
+    }
+
+    // Keep the labels so that a warm start reproduces these histograms exactly
+    Entry.SetWordLabels(Labels);
+    if (CacheLabels) SaveWordLabels(i);
+  }
+}
+
+//=================================================================================================
+// Description:
+//  Used to sweep vocabulary sizes over the same features: the new dictionary is seeded from the
+//  current one (CKMeans::Resize) so each size only pays for the refinement. Nothing is cached
+//  since the cache holds the dictionary of the configured word count.
+//=================================================================================================
+bool CRecognitionDb::ResizeDictionary(
+  unsigned WordCount,
+  wxTimeSpan& DictionaryTime,
+  wxTimeSpan& WordHistTime)
+{
+  wxDateTime StartDictionaryTime = wxDateTime::UNow();
+
+  if (mDictionaryType == eVocabTree)
+  {
+    cout << "ERROR: The size of a vocabulary tree is set by its branching and depth\n";
+    return false;
+  }
+
+  if (mFeatureType == eORB)
+  {
+    cout << "ERROR: Binary dictionaries cannot be resized\n";
+    return false;
+  }
+
+  if (mEntries.size() == 0)
+  {
+    cout << "ERROR: No entries in database!\n";
+    return false;
+  }
+
+  Mat AllDescriptors;
+  GetAllDescriptors(AllDescriptors);
+
+  if (mpDictionary == 0) mpDictionary = new Mat();
+  if (mpLabels == 0) mpLabels = new Mat();
+
+  SKMeansParams Params = mKMeansParams;
+  Params.mIterations = mWordKMeansIter;
+
+  CKMeans KMeans(Params);
+  if (!KMeans.Resize(AllDescriptors, WordCount, *mpDictionary, *mpLabels))
+  {
+    cout << "ERROR: Failed to resize the dictionary to " << WordCount << " words\n";
+    return false;
+  }
+
+  cout << "Resized dictionary to " << WordCount << " words: ";
+  cout << KMeans.GetIterationsRun() << " iterations, ";
+  cout << "compactness " << KMeans.GetCompactness() << "\n";
+
+  mWordCount = WordCount;
+
+  if (!UpdateWordQuantizer())
+  {
+    cout << "ERROR: Failed to update the word quantizer\n";
+    return false;
+  }
+
+  DictionaryTime.Add(wxDateTime::UNow() - StartDictionaryTime);
+
+  wxDateTime StartWordHistTime = wxDateTime::UNow();
+  SetWordHistsFromLabels(false);
+  WordHistTime.Add(wxDateTime::UNow() - StartWordHistTime);
+
+  return true;
+}
+
+//=================================================================================================
+// Description:
+//  The centers are refined with the descriptors of the new entries plus a uniform sample of at
+//  most sampleSize descriptors of the old ones. Old entries whose labels are in the label cache
+//  are then relabeled using their previous word as the search hint, which for words that barely
+//  moved is resolved by the triangle inequality bound without scanning the dictionary (only
+//  when the quantizer has its centroid tables). Every other entry is quantized once, in a batch,
+//  against the updated dictionary.
+//=================================================================================================
+bool CRecognitionDb::UpdateDictionaryIncremental(
+  wxTimeSpan& DictionaryTime,
+  wxTimeSpan& WordHistTime)
+{
+  // Sample stream of CKMeans::HashUniform (distinct from the k-means streams)
+  const uint64_t SampleStream = 4000;
+
+  set<string> Members;
+  const bool HasMembers = LoadDictionaryMembers(Members);
+
+  // Dictionary cached without a member list, assume it was built from the current entries
+  if (!HasMembers && mCacheDictionary) SaveDictionaryMembers();
+
+  vector<bool> IsNew(mEntries.size(), false);
+  unsigned NewCount = 0;
+  unsigned NewRows = 0;
+  unsigned OldRows = 0;
+
+  for (unsigned i = 0; i < mEntries.size(); i++)
+  {
+    const unsigned Rows = mEntries.at(i).GetDescriptors().rows;
+    if (!HasMembers || Members.count(mImageFileNames.at(i).GetName().ToStdString()))
+    {
+      OldRows += Rows;
+    }
+    else
+    {
+      IsNew[i] = true;
+      NewCount++;
+      NewRows += Rows;
+    }
+  }
+
+  if (NewCount == 0)
+  {
+    wxDateTime StartWordHistTime = wxDateTime::UNow();
+    if (!FillWordHists()) return false;
+    WordHistTime.Add(wxDateTime::UNow() - StartWordHistTime);
+
+    LogWordIndexRecall();
+    return true;
+  }
+
+  // Labels of the old entries against the cached dictionary (before its fingerprint changes)
+  vector<bool> HasLabels(mEntries.size(), false);
+  for (unsigned i = 0; i < mEntries.size(); i++)
+  {
+    HasLabels[i] = mCacheWordLabels && !IsNew[i] && LoadWordLabels(i);
+  }
+
+  wxDateTime StartDictionaryTime = wxDateTime::UNow();
+
+  const int Length = mpDictionary->cols;
+  const double Rate = (OldRows > (unsigned)mKMeansParams.mSampleSize) ?
+    (double)mKMeansParams.mSampleSize/OldRows : 1.0;
+
+  // Decide which old rows are sampled (by their index among the old rows)
+  vector<bool> Sampled(OldRows, false);
+  unsigned SampleRows = 0;
+  for (unsigned j = 0; j < OldRows; j++)
+  {
+    Sampled[j] = (CKMeans::HashUniform(mKMeansParams.mSeed, SampleStream, j) < Rate);
+    if (Sampled[j]) SampleRows++;
+  }
+
+  Mat NewData(NewRows, Length, CV_32F);
+  Mat OldSample(SampleRows, Length, CV_32F);
+  unsigned NewIdx = 0;
+  unsigned OldIdx = 0;
+  unsigned SampleIdx = 0;
+
+  for (unsigned i = 0; i < mEntries.size(); i++)
+  {
+    const Mat& Des = mEntries.at(i).GetDescriptors();
+    const Mat& Scale = mEntries.at(i).GetDescriptorScale();
+
+    for (int j = 0; j < Des.rows; j++)
+    {
+      if (IsNew[i])
+      {
+        CDescriptorCodec::DecodeRow(Des, Scale, j, NewData.ptr<float>(NewIdx++));
+      }
+      else if (Sampled[OldIdx++])
+      {
+        CDescriptorCodec::DecodeRow(Des, Scale, j, OldSample.ptr<float>(SampleIdx++));
+      }
+    }
+  }
+
+  CKMeans KMeans(mKMeansParams);
+  if (!KMeans.UpdateIncremental(NewData, OldSample, 1.0/Rate, *mpDictionary))
+  {
+    cout << "ERROR: Incremental dictionary update failed\n";
+    return false;
+  }
+
+  if (!UpdateWordQuantizer())
+  {
+    cout << "ERROR: Failed to update the word quantizer\n";
+    return false;
+  }
 
-  // End dictionary timer
   DictionaryTime.Add(wxDateTime::UNow() - StartDictionaryTime);
 
-  // Start word histogram timer
   wxDateTime StartWordHistTime = wxDateTime::UNow();
 
-  const unsigned RowDim = mEntries.size();
-  const unsigned ColDim = mWordCount;
-  unsigned idx = 0;
+  // Without the centroid tables a hinted lookup is a scan of every word, slower than a batch
+  const bool Hinted = mpWordQuantizer->HasCentroidTables();
+
+  vector<float> Buffer(Length);
+  vector<unsigned> Pending;
+  unsigned RelabeledCount = 0;
+  unsigned ChangedCount = 0;
+
+  for (unsigned i = 0; i < mEntries.size(); i++)
+  {
+    CRecognitionEntry& Entry = mEntries.at(i);
+    const Mat& Des = Entry.GetDescriptors();
+    const Mat& Scale = Entry.GetDescriptorScale();
+
+    if (Des.rows == 0)
+    {
+      cout << "ERROR: Failed to generate word histogram for entry ";
+      cout << Entry.GetName() << " (" << i << ")\n";
+      return false;
+    }
+
+    if (!HasLabels[i] || !Hinted)
+    {
+      Pending.push_back(i);
+      continue;
+    }
+
+    vector<int> Labels = Entry.GetWordLabels();
+    for (int j = 0; j < Des.rows; j++)
+    {
+      const float* pRow = CDescriptorCodec::GetRow(Des, Scale, j, &Buffer[0]);
+      const int Word = mpWordQuantizer->FindNearestWord(pRow, Labels[j]);
+
+      if (Word != Labels[j])
+      {
+        Labels[j] = Word;
+        ChangedCount++;
+      }
+    }
+    Entry.SetWordLabels(Labels);
+    RelabeledCount++;
+  }
+
+  if (!Pending.empty())
+  {
+    vector<vector<int> > WordLabels;
+
+    if (!QuantizeEntries(*mpWordQuantizer, Pending, WordLabels))
+    {
+      cout << "ERROR: Failed to assign descriptors to words\n";
+      return false;
+    }
+
+    for (unsigned k = 0; k < Pending.size(); k++)
+    {
+      mEntries.at(Pending[k]).SetWordLabels(WordLabels[k]);
+    }
+  }
 
-  for (int i = 0; i < (int)RowDim; i++)
+  for (unsigned i = 0; i < mEntries.size(); i++)
   {
     CRecognitionEntry& Entry = mEntries.at(i);
-    Entry.InitWordHist(mWordCount);
+    const vector<int>& Labels = Entry.GetWordLabels();
 
-    // For each key point descriptor update the word histogram
-    for (unsigned j = 0; j < Entry.GetKeyPointCount(); j++)
+    Entry.InitWordHist(mWordCount);
+    for (unsigned j = 0; j < Labels.size(); j++)
     {
-      unsigned ClusterIndex = mpLabels->at<unsigned>(idx, 0);
-      Entry.IncrementWordHist(ClusterIndex);
-      idx++;
+      Entry.IncrementWordHist(Labels[j]);
     }
+
+    // The dictionary fingerprint changed so every label file is rewritten
+    if (mCacheWordLabels) SaveWordLabels(i);
   }
 
-  // End word histogram timer
-  DictionaryTime.Add(wxDateTime::UNow() - StartWordHistTime);
+  WordHistTime.Add(wxDateTime::UNow() - StartWordHistTime);
+
+  LogWordIndexRecall();
+
+  cout << "Incremental dictionary update: " << NewCount << " new entries (" << NewRows;
+  cout << " descriptors, " << SampleRows << " old descriptors sampled), " << RelabeledCount;
+  cout << " entries relabeled from cached labels (" << ChangedCount << " labels changed), ";
+  cout << Pending.size() << " entries quantized\n";
 
-  // Save the dictionary into cache
   if (mCacheDictionary)
   {
+    wxFileName CachedDictionaryFileName = mDbDirs.mDatabaseDir;
+    CachedDictionaryFileName.SetName(mDbName);
+    CachedDictionaryFileName.SetExt("dic");
+
     ofstream DictionaryOs(CachedDictionaryFileName.GetFullPath().c_str(), ios::out|ios::binary);
     if (DictionaryOs)
     {
       SaveDictionary(DictionaryOs);
       DictionaryOs.close();
+      SaveDictionaryMembers();
     }
   }
 
-  //Delta = wxDateTime::UNow()-StartTime;
-  //cout << "Generated Dictionary in ";
-  //cout << Delta.Format("%M:%S:%l") << "\n";
+  return true;
+}
+
+//=================================================================================================
+//=================================================================================================
+wxFileName CRecognitionDb::GetDictionaryMembersFileName() const
+{
+  wxFileName MembersFileName = mDbDirs.mDatabaseDir;
+  MembersFileName.SetName(mDbName);
+  MembersFileName.SetExt("mem");
+  return MembersFileName;
+}
+
+//=================================================================================================
+//=================================================================================================
+bool CRecognitionDb::LoadDictionaryMembers(set<string>& Members) const
+{
+  Members.clear();
+
+  wxFileName MembersFileName = GetDictionaryMembersFileName();
+  if (!MembersFileName.IsFileReadable()) return false;
+
+  ifstream Is(MembersFileName.GetFullPath().c_str());
+  if (!Is) return false;
 
+  string Name;
+  while (getline(Is, Name))
+  {
+    if (!Name.empty()) Members.insert(Name);
+  }
   return true;
 }
 
+//=================================================================================================
+// One image name per line, in entry order
+//=================================================================================================
+bool CRecognitionDb::SaveDictionaryMembers() const
+{
+  wxFileName MembersFileName = GetDictionaryMembersFileName();
+
+  ofstream Os(MembersFileName.GetFullPath().c_str());
+  if (!Os) return false;
+
+  for (unsigned i = 0; i < mImageFileNames.size(); i++)
+  {
+    Os << mImageFileNames.at(i).GetName().ToStdString() << "\n";
+  }
+  return Os.good();
+}
+
 //=================================================================================================
 // Overloaded function that ignores timing the operation
 //=================================================================================================
@@ -919,9 +2958,12 @@ bool CRecognitionDb::PopulateColorHistograms(wxTimeSpan& Time)
     CRecognitionEntry& Entry = mEntries.at(i);
 
     wxFileName CachedColorHistogramFileName = mDbDirs.mDatabaseDir;
-    CachedColorHistogramFileName.SetName(mImageFileNames.at(i).GetName());
+    CachedColorHistogramFileName.SetName(
+      mImageFileNames.at(i).GetName() + GetScaleSuffix(mHistogramScale));
     CachedColorHistogramFileName.SetExt("col");
 
+    bool Loaded = false;
+
     // If caching is enabled and the cached file is readable
     if (mCacheColorHistogram && CachedColorHistogramFileName.IsFileReadable())
     {
@@ -930,15 +2972,24 @@ bool CRecognitionDb::PopulateColorHistograms(wxTimeSpan& Time)
         CachedColorHistogramFileName.GetFullPath().c_str(), ios::in|ios::binary);
 
       const int ExpectedCols = 3*mColorHistogramBins;
-      if (ColorHistogramIs.is_open() && Entry.LoadColorHistogram(ColorHistogramIs, ExpectedCols))
+      Loaded =
+        ColorHistogramIs.is_open() && Entry.LoadColorHistogram(ColorHistogramIs, ExpectedCols);
+
+      if (!Loaded)
       {
-        ColorHistogramIs.close();
+        cout << "WARNING: Regenerating color histogram of " << Entry.GetName()
+             << " (unreadable cache file " << CachedColorHistogramFileName.GetFullName() << ")\n";
       }
     }
-    else
+
+    if (!Loaded)
     {
-      Mat Image = cv::imread(mImageFileNames.at(i).GetFullPath().ToStdString());
-      Entry.GenerateColorHist(Image, mColorHistogramBins);
+      Size FullSize;
+      Mat Image = ReadImageScaled(mImageFileNames.at(i), mHistogramScale, &FullSize);
+
+      // Bin counts as if the full size image had been used
+      const double CountScale = (double)FullSize.area()/(double)max(1, Image.rows*Image.cols);
+      Entry.GenerateColorHist(Image, mColorHistogramBins, CountScale);
 
        // Logging
       if (mGenColorHistogramLog)
@@ -1039,7 +3090,8 @@ bool CRecognitionDb::TrainWordClassifier(wxTimeSpan& TrainWordTime)
     WordLabel.at<float>(i,0) = (float)mEntries.at(i).GetLabelId();
   }
 
-  // SVM Classifier
+  // SVM Classifier (retraining replaces the previous one, e.g. in a vocabulary sweep)
+  delete mpWordClassifier;
   mpWordClassifier = new CvSVM();
   mpWordClassifier->train(AllWordHist, WordLabel, Mat(), Mat(), *mpWordClassifierParams);
 
@@ -1155,15 +3207,23 @@ bool CRecognitionDb::ClassifyImage(const Mat& Image, double& HessianThreshold ,
 
   CRecognitionEntry Entry("Name", 0);
 
-  Entry.GenerateFeaturesSurfAdjuster(
-    Image,
-    mAdjusterMin,
-    mAdjusterMax,
-    mAdjusterIter,
-    mAdjusterLearnRate,
-    HessianThreshold,
-    mpSurfParams,
-    *mpDescriptorExtractor);
+  if (mpSurfParams)
+  {
+    Entry.GenerateFeaturesSurfAdjuster(
+      Image,
+      mAdjusterMin,
+      mAdjusterMax,
+      mAdjusterIter,
+      mAdjusterLearnRate,
+      HessianThreshold,
+      mpSurfParams,
+      *mpDescriptorExtractor);
+  }
+  else
+  {
+    // ORB and dense features have no threshold to adjust
+    Entry.GenerateFeatures(Image, *mpFeatureDetector, *mpDescriptorExtractor);
+  }
 
   if (Entry.GetDescriptors().data == 0)
   {
@@ -1269,6 +3329,32 @@ bool CRecognitionDb::ClassifyDbWords(
   Truth.resize(EntryCount);
   vector<wxTimeSpan> Times(EntryCount);
 
+  if (mpWordQuantizer == 0)
+  {
+    cout << "ERROR: Source database does not have a dictionary!\n";
+    return false;
+  }
+
+  // Assign the descriptors of every entry to words in one batch
+  wxDateTime StartQuantize = wxDateTime::UNow();
+
+  vector<unsigned> Indices(EntryCount);
+  for (int i = 0; i < EntryCount; i++)
+  {
+    Indices[i] = i;
+  }
+
+  vector<vector<int> > WordLabels;
+  if (!Db.QuantizeEntries(*mpWordQuantizer, Indices, WordLabels))
+  {
+    cout << "ERROR: Failed to assign descriptors to words!\n";
+    return false;
+  }
+
+  // Each entry is charged an equal share of the batch assignment time
+  const wxTimeSpan QuantizeTime =
+    wxTimeSpan::Milliseconds((wxDateTime::UNow()-StartQuantize).GetMilliseconds()/EntryCount);
+
   //unsigned MatchCount = 0;
   for (int i = 0; i < EntryCount; i++)
   {
@@ -1279,13 +3365,16 @@ bool CRecognitionDb::ClassifyDbWords(
 
     const CRecognitionEntry& Entry = Db.GetEntry(i);
 
-    CreateWordHist(Entry, WordHist);
+    for (unsigned j = 0; j < WordLabels[i].size(); j++)
+    {
+      WordHist.at<float>(0,WordLabels[i][j])++;
+    }
 
     unsigned LabelIndex = (unsigned)mpWordClassifier->predict(WordHist);
 
     Classify[i] = GetLabel(LabelIndex);
     Truth[i] = Db.GetLabel(Entry.GetLabelId());
-    Times[i] = wxDateTime::UNow()-Start;
+    Times[i] = QuantizeTime + (wxDateTime::UNow()-Start);
 
     // Keep track of match statistics
     if (Classify[i] == Truth[i])
@@ -1559,7 +3648,7 @@ bool CRecognitionDb::ClassifyEntrySlidingWindow(
   int Step)
 {
 
-  if (mpDictionary->data == 0)
+  if ((mpDictionary == 0) || (mpDictionary->data == 0) || (mpWordQuantizer == 0))
   {
     cout << "ERROR: Classification database has no dictionary!\n";
     return false;
@@ -1571,11 +3660,14 @@ bool CRecognitionDb::ClassifyEntrySlidingWindow(
     return false;
   }
 
-  Mat Image;
-    Image = cv::imread(ImageFileName.GetFullPath().ToStdString());
+  // Votes are accumulated at the feature scale, windows are placed in full size coordinates
+  // (those of the key points)
+  Size FullSize;
+  Mat Image = ReadImageScaled(ImageFileName, mFeatureScale, &FullSize);
 
   const int Rows = Image.rows;
   const int Cols = Image.cols;
+  const double ToImage = (FullSize.width > 0) ? (double)Cols/(double)FullSize.width : 1.0;
 
     vector<Mat> Votes(mLabelToId.size());
   // Do not initialize in the vector class constructor because
@@ -1588,41 +3680,25 @@ bool CRecognitionDb::ClassifyEntrySlidingWindow(
 
   const vector<KeyPoint>& KeyPoints = Entry.GetKeyPoints();
   const Mat& Des = Entry.GetDescriptors();
-  vector<int> WordLabels(KeyPoints.size());
-  const int WordCount = mpDictionary->rows; //This is also equal to mWordCount
+  vector<int> WordLabels;
 
-  for (int i = 0; i < Des.rows; i++)
+  // Assign every descriptor to its nearest word
+  mpWordQuantizer->ResetPruningStats();
+  if (!mpWordQuantizer->Quantize(Des, Entry.GetDescriptorScale(), WordLabels))
   {
-    float SmallestNorm = FLT_MAX;
-    int SmallestNormIndex = 0;
-
-    for (int j = 0; j < WordCount; j++)
-    {
-      float Norm = 0;
-      // Get the distance between each dictionary word and the current descriptor
-      for (int k = 0; k < mpDictionary->cols; k++)
-      {
-        //Quick and dirty (almost) Euclidean norm is used for comparison
-        Norm += pow(mpDictionary->at<float>(j,k) - Des.at<float>(i,k), 2);
-      }
-
-      if (Norm < SmallestNorm)
-      {
-        SmallestNorm = Norm;
-        SmallestNormIndex = j;
-      }
-    }
-    WordLabels.at(i) = SmallestNormIndex;
+    cout << "ERROR: Could not assign words to the entry descriptors!\n";
+    return false;
   }
+  LogWordPruning();
 
   const int EntryWidth = mEntries.at(0).GetImageWidth();
   const int EntryHeight = mEntries.at(0).GetImageHeight();
 
   double Radius = (double)EntryWidth/2;
 
-  for (int i = 0; i <= Rows; i+=Step)
+  for (int i = 0; i <= FullSize.height; i+=Step)
   {
-    for (int j = 0; j <= Cols; j+=Step)
+    for (int j = 0; j <= FullSize.width; j+=Step)
     {
 
       // Word classification
@@ -1634,7 +3710,9 @@ bool CRecognitionDb::ClassifyEntrySlidingWindow(
       unsigned WordPredictedLabel = (unsigned)mpWordClassifier->predict(WordHist);
 
       Mat Mask = Mat(Rows, Cols, CV_8U, Scalar(0));
-      circle(Mask, Point(i,j), Radius, Scalar(0xFF), -1);
+      circle(
+        Mask, Point(cvRound(i*ToImage), cvRound(j*ToImage)), cvRound(Radius*ToImage),
+        Scalar(0xFF), -1);
       VoteForClass(Votes, WordPredictedLabel, Mask);
 
       /*
@@ -2022,37 +4100,22 @@ bool CRecognitionDb::CreateWordHist(const CRecognitionEntry& Entry, Mat& WordHis
   // Each row in this matrix is a descriptor
   const Mat& Des = Entry.GetDescriptors();
 
-  return CreateWordHist(Des, WordHist);
+  return CreateWordHist(Des, Entry.GetDescriptorScale(), WordHist);
 }
 
 //=================================================================================================
 //=================================================================================================
-bool CRecognitionDb::CreateWordHist(const Mat& Des, Mat& WordHist)
+bool CRecognitionDb::CreateWordHist(const Mat& Des, const Mat& Scale, Mat& WordHist)
 {
-  const int WordCount = mpDictionary->rows; //This is also equal to mWordCount
+  if (mpWordQuantizer == 0) return false;
 
-  for (int i = 0; i < Des.rows; i++)
-  {
-    float SmallestNorm = FLT_MAX;
-    int SmallestNormIndex = 0;
+  vector<int> WordLabels;
 
-    for (int j = 0; j < WordCount; j++)
-    {
-      float Norm = 0;
-      // Get the distance between each dictionary word and the current descriptor
-      for (int k = 0; k < mpDictionary->cols; k++)
-      {
-        //Quick and dirty (almost) Euclidean norm is used for comparison
-        Norm += pow(mpDictionary->at<float>(j,k) - Des.at<float>(i,k), 2);
-      }
+  if (!mpWordQuantizer->Quantize(Des, Scale, WordLabels)) return false;
 
-      if (Norm < SmallestNorm)
-      {
-        SmallestNorm = Norm;
-        SmallestNormIndex = j;
-      }
-    }
-    WordHist.at<float>(0,SmallestNormIndex)++;
+  for (int i = 0; i < (int)WordLabels.size(); i++)
+  {
+    WordHist.at<float>(0,WordLabels[i])++;
   }
 
   return true;
@@ -2065,22 +4128,29 @@ bool CRecognitionDb::CreateWordHistMask(
 {
 
   // Make sure input parameters are valid
-  if ((mpDictionary == 0) || (WordHist.type() != CV_32F) || (Mask.type() != CV_8U) ||
+  if ((mpWordQuantizer == 0) || (WordHist.type() != CV_32F) || (Mask.type() != CV_8U) ||
     (Entry.GetImageHeight() != Mask.rows) || (Entry.GetImageWidth() != Mask.cols) ) return false;
 
-  // Each row in this matrix is a word
-  const int WordCount = mpDictionary->rows; //This is also equal to mWordCount
-
-  // The word descriptors run along the columns
-  const int DesSize = mpDictionary->cols;
+  // Each row in the dictionary is a word
+  const int WordCount = mpWordQuantizer->GetWordCount(); //This is also equal to mWordCount
 
   if (WordHist.cols != WordCount) return false;
 
   // Each row in this matrix is a descriptor
   const Mat& Des = Entry.GetDescriptors();
+  const Mat& Scale = Entry.GetDescriptorScale();
+
+  const bool Binary = mpWordQuantizer->IsBinary();
+
+  if ((Binary ? (Des.type() != CV_8U) : !CDescriptorCodec::IsSupported(Des, Scale)) ||
+      (Des.cols != mpWordQuantizer->GetDescriptorLength())) return false;
 
   const vector<KeyPoint>& KeyPoints = Entry.GetKeyPoints();
 
+  // The previous word is usually a good first guess for the partial distance search
+  int Word = -1;
+  vector<float> Buffer(Des.cols);
+
   for (int i = 0; i < Des.rows; i++)
   {
     int x = (int)KeyPoints.at(i).pt.x;
@@ -2089,26 +4159,16 @@ bool CRecognitionDb::CreateWordHistMask(
     // Make sure the keypoint is not masked
     if (Mask.at<unsigned char>(x,y) != 0)
     {
-      float SmallestNorm = FLT_MAX;
-      int SmallestNormIndex = 0;
-
-      for (int j = 0; j < WordCount; j++)
+      if (Binary)
       {
-        float Norm = 0;
-        // Get the distance between each dictionary word and the current descriptor
-        for (int k = 0; k < mpDictionary->cols; k++)
-        {
-          //Quick and dirty (almost) Euclidean norm is used for comparison
-          Norm += pow(mpDictionary->at<float>(j,k) - Des.at<float>(i,k), 2);
-        }
-
-        if (Norm < SmallestNorm)
-        {
-          SmallestNorm = Norm;
-          SmallestNormIndex = j;
-        }
+        Word = mpWordQuantizer->FindNearestWordBinary(Des.ptr<unsigned char>(i));
+      }
+      else
+      {
+        Word = mpWordQuantizer->FindNearestWord(
+          CDescriptorCodec::GetRow(Des, Scale, i, &Buffer[0]), Word);
       }
-      WordHist.at<float>(0,SmallestNormIndex)++;
+      WordHist.at<float>(0,Word)++;
     }
   }
 
@@ -2167,14 +4227,11 @@ void CRecognitionDb::CreateColorHist(
 bool CRecognitionDb::FillWordHist(CRecognitionEntry& Entry)
 {
 
-  if (mpDictionary == 0) return false;
+  if ((mpDictionary == 0) || (mpWordQuantizer == 0)) return false;
 
  // Each row in this matrix is a word
   const int WordCount = mpDictionary->rows; //This is also equal to mWordCount
 
-  // The word descriptors run along the columns
-  const int DesSize = mpDictionary->cols;
-
   Entry.InitWordHist(WordCount);
 
   // Each row in this matrix is a descriptor
@@ -2182,31 +4239,284 @@ bool CRecognitionDb::FillWordHist(CRecognitionEntry& Entry)
 
   if (Des.rows == 0) return false;
 
-  for (int i = 0; i < Des.rows; i++)
+  vector<int> WordLabels;
+
+  if (!mpWordQuantizer->Quantize(Des, Entry.GetDescriptorScale(), WordLabels)) return false;
+
+  for (int i = 0; i < (int)WordLabels.size(); i++)
+  {
+    Entry.IncrementWordHist(WordLabels[i]);
+  }
+
+  return true;
+}
+
+//=================================================================================================
+// Fill in the BOVW histogram of every entry in this database. All descriptors are assigned to
+// words in one batch (see CWordQuantizer::QuantizeBatch).
+//=================================================================================================
+bool CRecognitionDb::FillWordHists()
+{
+  if ((mpDictionary == 0) || (mpWordQuantizer == 0)) return false;
+
+  const int WordCount = mpDictionary->rows; //This is also equal to mWordCount
+
+  // Entries whose labels are not cached
+  vector<unsigned> Pending;
+
+  for (unsigned i = 0; i < mEntries.size(); i++)
   {
-    float SmallestNorm = FLT_MAX;
-    int SmallestNormIndex = 0;
+    const Mat& Des = mEntries.at(i).GetDescriptors();
 
-    for (int j = 0; j < WordCount; j++)
+    if (Des.rows == 0)
     {
-      float Norm = 0;
-      // Get the "Euclidean" norm between each dictionary word and the current descriptor
-      for (int k = 0; k < mpDictionary->cols; k++)
-      {
-        //Quick and dirty (almost) Euclidean norm is used for comparison
-        Norm += pow(mpDictionary->at<float>(j,k) - Des.at<float>(i,k), 2);
-      }
+      cout << "ERROR: Failed to generate word histogram for entry ";
+      cout << mEntries.at(i).GetName() << " (" << i << ")\n";
+      return false;
+    }
+
+    if (mCacheWordLabels && LoadWordLabels(i)) continue;
+
+    Pending.push_back(i);
+  }
+
+  if (!Pending.empty())
+  {
+    vector<vector<int> > WordLabels;
+
+    if (!QuantizeEntries(*mpWordQuantizer, Pending, WordLabels))
+    {
+      cout << "ERROR: Failed to assign descriptors to words\n";
+      return false;
+    }
+
+    for (unsigned k = 0; k < Pending.size(); k++)
+    {
+      mEntries.at(Pending[k]).SetWordLabels(WordLabels[k]);
+
+      if (mCacheWordLabels) SaveWordLabels(Pending[k]);
+    }
+  }
+
+  for (unsigned i = 0; i < mEntries.size(); i++)
+  {
+    const vector<int>& Labels = mEntries.at(i).GetWordLabels();
+
+    mEntries.at(i).InitWordHist(WordCount);
+
+    for (unsigned j = 0; j < Labels.size(); j++)
+    {
+      mEntries.at(i).IncrementWordHist(Labels[j]);
+    }
+  }
+
+  return true;
+}
+
+//=================================================================================================
+//=================================================================================================
+bool CRecognitionDb::QuantizeEntries(
+  const CWordQuantizer& Quantizer,
+  const vector<unsigned>& Indices,
+  vector<vector<int> >& Labels) const
+{
+  // Every entry of a packed fp32 (or binary) database is a single matrix, quantized without
+  // gathering rows
+  const int PackedType = Quantizer.IsBinary() ? CV_8U : CV_32F;
+  if ((Indices.size() == mEntries.size()) && IsPacked() &&
+      (mDescriptorArena.GetDescriptors().type() == PackedType))
+  {
+    vector<int> AllLabels;
+    if (!Quantizer.QuantizeBatch(mDescriptorArena.GetDescriptors(), AllLabels)) return false;
+
+    Labels.resize(Indices.size());
+    for (unsigned k = 0; k < Indices.size(); k++)
+    {
+      const vector<int>::const_iterator Begin =
+        AllLabels.begin() + mDescriptorArena.GetBlockOffset(Indices[k]);
+      const vector<int>::const_iterator End =
+        AllLabels.begin() + mDescriptorArena.GetBlockOffset(Indices[k] + 1);
+
+      Labels[k].assign(Begin, End);
+    }
+    return true;
+  }
+
+  vector<const Mat*> DesList(Indices.size());
+  vector<const Mat*> ScaleList(Indices.size());
+  for (unsigned k = 0; k < Indices.size(); k++)
+  {
+    DesList[k] = &mEntries.at(Indices[k]).GetDescriptors();
+    ScaleList[k] = &mEntries.at(Indices[k]).GetDescriptorScale();
+  }
+
+  return Quantizer.QuantizeBatch(DesList, ScaleList, Labels);
+}
+
+//=================================================================================================
+// Read the cached word labels of entry i. Fails if the labels were generated with a different
+// dictionary (or lookup method) or from different features (see GetWordLabelsFingerprint).
+//=================================================================================================
+bool CRecognitionDb::LoadWordLabels(unsigned i)
+{
+  if (mpWordQuantizer == 0) return false;
+
+  wxFileName CachedLabelsFileName = mDbDirs.mDatabaseDir;
+  CachedLabelsFileName.SetName(mImageFileNames.at(i).GetName());
+  CachedLabelsFileName.SetExt("wrd");
+
+  if (!CachedLabelsFileName.IsFileReadable()) return false;
 
-      if (Norm < SmallestNorm)
+  ifstream LabelsIs(CachedLabelsFileName.GetFullPath().c_str(), ios::in|ios::binary);
+
+  return LabelsIs.is_open() && mEntries.at(i).LoadWordLabels(
+    LabelsIs, GetWordLabelsFingerprint(i), mpWordQuantizer->GetWordCount());
+}
+
+//=================================================================================================
+// Description:
+//  The file is written under a temporary name and renamed, so an interrupted write never leaves
+//  a partial file under the cache name
+//=================================================================================================
+bool CRecognitionDb::SaveWordLabels(unsigned i)
+{
+  if (mpWordQuantizer == 0) return false;
+
+  wxFileName CachedLabelsFileName = mDbDirs.mDatabaseDir;
+  CachedLabelsFileName.SetName(mImageFileNames.at(i).GetName());
+  CachedLabelsFileName.SetExt("wrd");
+
+  const wxString CachedLabelsPath = CachedLabelsFileName.GetFullPath();
+  const wxString TempPath =
+    CachedLabelsPath + wxString::Format(".%lu.%u.tmp", wxGetProcessId(), i);
+
+  ofstream LabelsOs(TempPath.c_str(), ios::out|ios::binary);
+  bool Saved =
+    LabelsOs.is_open() && mEntries.at(i).SaveWordLabels(LabelsOs, GetWordLabelsFingerprint(i));
+  LabelsOs.close();
+
+  Saved = Saved && LabelsOs && wxRenameFile(TempPath, CachedLabelsPath, true);
+  if (!Saved) wxRemoveFile(TempPath);
+
+  return Saved;
+}
+
+//=================================================================================================
+// Description:
+//  Labels are only valid for the features they were computed from: the file is named after the
+//  image, so a replaced image or changed feature settings (e.g. dense features, whose key point
+//  count only depends on the image size) must not reuse them.
+//=================================================================================================
+uint64_t CRecognitionDb::GetWordLabelsFingerprint(unsigned i) const
+{
+  uint64_t Fingerprint = mpWordQuantizer->GetFingerprint();
+
+  if ((i < mFeatureKeys.size()) && !mFeatureKeys[i].empty())
+  {
+    const string& Key = mFeatureKeys[i];
+    Fingerprint = CWordQuantizer::HashBytes(Key.c_str(), Key.size(), Fingerprint);
+    return CWordQuantizer::HashBytes(&mFeatureParamsHash, sizeof(mFeatureParamsHash), Fingerprint);
+  }
+
+  const Mat& Des = mEntries.at(i).GetDescriptors();
+  uint32_t Crc = 0;
+  for (int r = 0; r < Des.rows; r++)
+  {
+    Crc = CBinaryIo::Crc32(Des.ptr(r), Des.cols*Des.elemSize(), Crc);
+  }
+
+  const Mat& Scale = mEntries.at(i).GetDescriptorScale();
+  if (!Scale.empty()) Crc = CBinaryIo::Crc32(Scale.ptr(0), Scale.total()*Scale.elemSize(), Crc);
+
+  return CWordQuantizer::HashBytes(&Crc, sizeof(Crc), Fingerprint);
+}
+
+//=================================================================================================
+// Point the word quantizer at the current dictionary. Must be called whenever mpDictionary is
+// created or replaced.
+//=================================================================================================
+bool CRecognitionDb::UpdateWordQuantizer()
+{
+  if (mpDictionary == 0) return false;
+
+  if (mpWordQuantizer == 0) mpWordQuantizer = new CWordQuantizer();
+
+  if ((mDictionaryType == eVocabTree) && (mpVocabularyTree != 0) && (mFeatureType != eORB))
+  {
+    return mpWordQuantizer->SetVocabularyTree(mpVocabularyTree);
+  }
+
+  if (!mpWordQuantizer->SetDictionary(*mpDictionary)) return false;
+
+  // The approximate index only handles Euclidean words
+  if (mWordIndexOn && !mpWordQuantizer->IsBinary())
+  {
+    return mpWordQuantizer->BuildIndex(mWordIndexTrees, mWordIndexChecks);
+  }
+
+  return true;
+}
+
+//=================================================================================================
+// Print how much work the partial distance search saved since the last reset
+//=================================================================================================
+void CRecognitionDb::LogWordPruning()
+{
+  if (mpWordQuantizer == 0) return;
+
+  uint64_t DimsEvaluated = 0;
+  uint64_t DimsTotal = 0;
+  mpWordQuantizer->GetPruningStats(DimsEvaluated, DimsTotal);
+
+  if (DimsTotal == 0) return;
+
+  cout << "Exact word search evaluated " << DimsEvaluated << " of " << DimsTotal;
+  cout << " dimensions (" << 100.0*(double)DimsEvaluated/(double)DimsTotal << "%)\n";
+}
+
+//=================================================================================================
+// Print how often the approximate index finds the exact nearest word (sampled evenly over the
+// descriptors in this database)
+//=================================================================================================
+void CRecognitionDb::LogWordIndexRecall()
+{
+  if ((mpWordQuantizer == 0) || !mpWordQuantizer->HasIndex()) return;
+
+  const unsigned MaxSamples = 1000;
+
+  unsigned DescriptorCount = 0;
+  for (unsigned i = 0; i < mEntries.size(); i++)
+  {
+    DescriptorCount += mEntries.at(i).GetDescriptors().rows;
+  }
+
+  if (DescriptorCount == 0) return;
+
+  const unsigned Stride = max(1u, DescriptorCount/MaxSamples);
+  const int Length = mpWordQuantizer->GetDescriptorLength();
+
+  Mat Samples(0, Length, CV_32F);
+  Mat Sample(1, Length, CV_32F);
+  unsigned Global = 0;
+
+  for (unsigned i = 0; i < mEntries.size(); i++)
+  {
+    const Mat& Des = mEntries.at(i).GetDescriptors();
+    const Mat& Scale = mEntries.at(i).GetDescriptorScale();
+    for (int j = 0; j < Des.rows; j++, Global++)
+    {
+      if ((Global % Stride == 0) && (Samples.rows < (int)MaxSamples))
       {
-        SmallestNorm = Norm;
-        SmallestNormIndex = j;
+        CDescriptorCodec::DecodeRow(Des, Scale, j, Sample.ptr<float>(0));
+        Samples.push_back(Sample);
       }
     }
-    Entry.IncrementWordHist(SmallestNormIndex);
   }
 
-  return true;
+  const double Recall = mpWordQuantizer->MeasureIndexRecall(Samples);
+
+  cout << "Approximate word index recall: " << 100.0*Recall << "% (";
+  cout << Samples.rows << " descriptors, " << mWordIndexChecks << " checks)\n";
 }
 
 //=================================================================================================
@@ -2215,7 +4525,7 @@ bool CRecognitionDb::FillWordHist(CRecognitionEntry& Entry)
 //=================================================================================================
 void CRecognitionDb::GetContours(unsigned ImageIndex)
 {
-  Mat Image = cv::imread(mImageFileNames.at(ImageIndex).GetFullPath().ToStdString());
+  Mat Image = ReadImageScaled(mImageFileNames.at(ImageIndex), mFeatureScale);
   Mat Edges;
 
   cvtColor(Image, Edges, CV_BGR2GRAY);
@@ -2227,8 +4537,8 @@ void CRecognitionDb::GetContours(unsigned ImageIndex)
   cv::imwrite(EdgesName.ToStdString(), Edges);
 
  // The dimensions of the sliding window
-  const int WindowHeight = 64;
-  const int WindowWidth = 64;
+  const int WindowHeight = max(1, cvRound(64*mFeatureScale));
+  const int WindowWidth = WindowHeight;
   const int ImageHeight = Image.rows;
   const int ImageWidth = Image.cols;
 
@@ -2288,6 +4598,13 @@ const CRecognitionEntry& CRecognitionDb::GetEntry(unsigned i) const
   return (const CRecognitionEntry&)mEntries.at(i);
 }
 
+//=================================================================================================
+//=================================================================================================
+unsigned CRecognitionDb::GetWordCount() const
+{
+  return mWordCount;
+}
+
 //=================================================================================================
 //=================================================================================================
 unsigned CRecognitionDb::GetEntryCount() const
@@ -2386,6 +4703,7 @@ void CRecognitionDb::GenSetupSummaryLog()
   Os << "<b>Image: </b>" << mTopLevelDirs.mImageDir.GetFullPath() << "\n";
   Os << "<b>Log: </b>" << mTopLevelDirs.mLogDir.GetFullPath() << "\n";
   Os << "<b>Setup: </b>" << mTopLevelDirs.mSetupDir.GetFullPath() << "\n";
+  Os << "<b>Feature cache: </b>" << mTopLevelDirs.mFeatureCacheDir.GetFullPath() << "\n";
 
   Os << "<h3>Database directories</h3>";
   Os << "<b>Database: </b>" << mDbDirs.mDatabaseDir.GetFullPath() << "<br>\n";
@@ -2419,7 +4737,31 @@ void CRecognitionDb::GenSetupSummaryLog()
   GenHtmlTableHeader(Os, 1, 3, 2);
   GenHtmlTableLine(Os, "<b>Generate Feature Log</b>", mGenFeatureLog, 3);
   GenHtmlTableLine(Os, "<b>Perform image auto levels</b>", mAutoLevels, 3);
+  GenHtmlTableLine(Os, "<b>Image scale</b>", mFeatureScale, 3);
   GenHtmlTableLine(Os, "<b>Cache features</b>", mCacheFeatures, 3);
+  GenHtmlTableLine(Os, "<b>Feature store</b>", mFeatureStoreOn, 3);
+  GenHtmlTableLine(
+    Os, "<b>Feature settings hash</b>",
+    wxString::Format("%016llx", (unsigned long long)HashFeatureParams()).ToStdString(), 3);
+  GenHtmlTableLine(Os, "<b>Feature threads (0 = per core)</b>", mFeatureThreads, 3);
+  GenHtmlTableLine(Os, "<b>Feature read threads</b>", mFeatureReadThreads, 3);
+  GenHtmlTableLine(Os, "<b>Feature write threads</b>", mFeatureWriteThreads, 3);
+  GenHtmlTableLine(Os, "<b>Feature queue depth (0 = 2 per thread)</b>", mFeatureQueueDepth, 3);
+  switch (mDescriptorStorage)
+  {
+    case CRecognitionEntry::eFloat16:
+      GenHtmlTableLine(Os, "<b>Descriptor storage</b>", string("float16"), 3);
+    break;
+    case CRecognitionEntry::eInt8:
+      GenHtmlTableLine(Os, "<b>Descriptor storage</b>", string("int8"), 3);
+    break;
+    case CRecognitionEntry::eBinary:
+      GenHtmlTableLine(Os, "<b>Descriptor storage</b>", string("binary"), 3);
+    break;
+    default:
+      GenHtmlTableLine(Os, "<b>Descriptor storage</b>", string("float32"), 3);
+    break;
+  }
   GenHtmlTableFooter(Os);
 
   GenHtmlTableHeader(Os, 1, 3, 2);
@@ -2488,8 +4830,27 @@ void CRecognitionDb::GenSetupSummaryLog()
         GenHtmlTableLine(Os, "<b>Auto adjust maximum iterations</b>", mAdjusterIter, 3);
         GenHtmlTableLine(Os, "<b>Auto adjust memory</b>", mAdjusterMemory, 3);
         GenHtmlTableLine(Os, "<b>Auto adjust learn rate</b>", mAdjusterLearnRate, 3);
+        GenHtmlTableLine(Os, "<b>Auto adjust by response selection</b>", mAdjusterSelect, 3);
       }
     break;
+    case eORB:
+      GenHtmlTableLine(Os, "<b>Feature Type</b>", string("ORB"), 3);
+      GenHtmlTableLine(Os, "<b>Maximum features</b>", (unsigned)mOrbFeatures, 3);
+      GenHtmlTableLine(Os, "<b>Scale factor</b>", mOrbScaleFactor, 3);
+      GenHtmlTableLine(Os, "<b>Levels</b>", (unsigned)mOrbLevels, 3);
+      GenHtmlTableLine(Os, "<b>Edge threshold</b>", (unsigned)mOrbEdgeThreshold, 3);
+      GenHtmlTableLine(Os, "<b>Dictionary</b>", string("k-majority (Hamming)"), 3);
+    break;
+    case eDense:
+      GenHtmlTableLine(Os, "<b>Feature Type</b>", string("Dense (SURF descriptors)"), 3);
+      GenHtmlTableLine(Os, "<b>Step</b>", (unsigned)mDenseStep, 3);
+      GenHtmlTableLine(Os, "<b>Size</b>", mDenseSize, 3);
+      GenHtmlTableLine(Os, "<b>Levels</b>", (unsigned)mDenseLevels, 3);
+      GenHtmlTableLine(Os, "<b>Scale multiplier</b>", mDenseScaleMul, 3);
+      GenHtmlTableLine(Os, "<b>Bound</b>", (unsigned)mDenseBound, 3);
+      GenHtmlTableLine(Os, "<b>Extended</b>", mSurfExtended, 3);
+      GenHtmlTableLine(Os, "<b>Upright</b>", mDenseUpright, 3);
+    break;
   }
   GenHtmlTableFooter(Os);
 
@@ -2501,6 +4862,7 @@ void CRecognitionDb::GenSetupSummaryLog()
   Os << "<h3>Color Histogram Parameters</h3>\n";
   GenHtmlTableHeader(Os, 1, 3, 2);
   GenHtmlTableLine(Os, "<b>Bins</b>", mColorHistogramBins, 3);
+  GenHtmlTableLine(Os, "<b>Image scale</b>", mHistogramScale, 3);
   GenHtmlTableLine(Os, "<b>Log</b>", mGenColorHistogramLog, 3);
   GenHtmlTableFooter(Os);
 
@@ -2527,12 +4889,119 @@ void CRecognitionDb::GenSetupSummaryLog()
   //</dictionary>
   Os << "<h3>Dictionary parameters</h3>\n";
   GenHtmlTableHeader(Os, 1, 3, 2);
+  switch (mDictionaryType)
+  {
+    case eVocabTree:
+      GenHtmlTableLine(Os, "<b>Type</b>", string("vocabtree"), 3);
+    break;
+    case eMiniBatch:
+      GenHtmlTableLine(Os, "<b>Type</b>", string("minibatch"), 3);
+    break;
+    case eStreaming:
+      GenHtmlTableLine(Os, "<b>Type</b>", string("streaming"), 3);
+    break;
+    case eHamerly:
+      GenHtmlTableLine(Os, "<b>Type</b>", string("hamerly"), 3);
+    break;
+    default:
+      GenHtmlTableLine(Os, "<b>Type</b>", string("kmeans"), 3);
+    break;
+  }
   GenHtmlTableLine(Os, "<b>Words</b>", mWordCount, 3);
   GenHtmlTableLine(Os, "<b>K-means iterations</b>", mWordKMeansIter, 3);
+  if (mDictionaryType == eVocabTree)
+  {
+    GenHtmlTableLine(Os, "<b>Tree branching</b>", mVocabTreeBranching, 3);
+    GenHtmlTableLine(Os, "<b>Tree depth</b>", mVocabTreeDepth, 3);
+  }
+  if ((mDictionaryType == eMiniBatch) || (mDictionaryType == eStreaming))
+  {
+    GenHtmlTableLine(Os, "<b>Batch size</b>", (unsigned)mKMeansParams.mBatchSize, 3);
+    GenHtmlTableLine(Os, "<b>Tolerance</b>", mKMeansParams.mTolerance, 3);
+  }
+  if (mDictionaryType == eHamerly)
+  {
+    GenHtmlTableLine(Os, "<b>Epsilon</b>", mKMeansParams.mEpsilon, 3);
+  }
+  if ((mDictionaryType == eMiniBatch) || (mDictionaryType == eStreaming) ||
+      (mDictionaryType == eHamerly))
+  {
+    GenHtmlTableLine(Os, "<b>Seed</b>", (unsigned)mKMeansParams.mSeed, 3);
+    GenHtmlTableLine(Os, "<b>Initialization</b>",
+      string((mKMeansParams.mInit == SKMeansParams::eInitKMeansPP) ? "kmeans++" : "kmeans||"), 3);
+  }
+  if (mDictionaryType == eStreaming)
+  {
+    GenHtmlTableLine(Os, "<b>Sample size</b>", (unsigned)mKMeansParams.mSampleSize, 3);
+    GenHtmlTableLine(Os, "<b>Passes</b>", (unsigned)mKMeansParams.mPasses, 3);
+  }
+  if ((mDictionaryType != eVocabTree) && (mDictionaryType != eStreaming))
+  {
+    GenHtmlTableLine(Os, "<b>Restarts</b>", (unsigned)mKMeansParams.mRestarts, 3);
+  }
+  if (mDictionaryType != eVocabTree)
+  {
+    GenHtmlTableLine(Os, "<b>Incremental update</b>", mIncrementalDictionary, 3);
+  }
+  GenHtmlTableLine(Os, "<b>Approximate index</b>", mWordIndexOn, 3);
+  if (mWordIndexOn)
+  {
+    GenHtmlTableLine(Os, "<b>Index trees</b>", mWordIndexTrees, 3);
+    GenHtmlTableLine(Os, "<b>Index checks</b>", mWordIndexChecks, 3);
+  }
   GenHtmlTableLine(Os, "<b>Cache dictionary</b>", mCacheDictionary, 3);
+  GenHtmlTableLine(Os, "<b>Cache word labels</b>", mCacheWordLabels, 3);
   GenHtmlTableLine(Os, "<b>Log</b>", mGenColorClassifierLog, 3);
   GenHtmlTableFooter(Os);
 
+  // Filled in once the features have been populated
+  if (!mFeatureStageStats.empty())
+  {
+    Os << "<h3>Feature pipeline</h3>\n";
+    GenHtmlTableHeader(Os, 1, 3, 2);
+    for (unsigned s = 0; s < mFeatureStageStats.size(); s++)
+    {
+      const SFeatureStageStats& Stats = mFeatureStageStats[s];
+      const string Name = "<b>" + Stats.mName;
+
+      GenHtmlTableLine(Os, Name + " threads</b>", Stats.mThreads, 3);
+      GenHtmlTableLine(Os, Name + " entries</b>", Stats.mItems, 3);
+      GenHtmlTableLine(Os, Name + " busy (ms)</b>", Stats.mBusyMs, 3);
+      GenHtmlTableLine(Os, Name + " occupancy</b>", Stats.mOccupancy, 3);
+      GenHtmlTableLine(Os, Name + " input stall (ms)</b>", Stats.mStallInMs, 3);
+      GenHtmlTableLine(Os, Name + " output stall (ms)</b>", Stats.mStallOutMs, 3);
+      if (Stats.mQueueCapacity > 0)
+      {
+        GenHtmlTableLine(Os, Name + " output queue capacity</b>", Stats.mQueueCapacity, 3);
+        GenHtmlTableLine(Os, Name + " output queue mean</b>", Stats.mMeanQueue, 3);
+        GenHtmlTableLine(Os, Name + " output queue max</b>", Stats.mMaxQueue, 3);
+      }
+    }
+    GenHtmlTableFooter(Os);
+  }
+
+  // Filled in once the dictionary has been built with restarts
+  if (!mRestartCompactness.empty())
+  {
+    unsigned Best = 0;
+    for (unsigned r = 1; r < mRestartCompactness.size(); r++)
+    {
+      if (mRestartCompactness[r] < mRestartCompactness[Best]) Best = r;
+    }
+
+    Os << "<h3>K-means restarts</h3>\n";
+    GenHtmlTableHeader(Os, 1, 3, 2);
+    for (unsigned r = 0; r < mRestartCompactness.size(); r++)
+    {
+      stringstream Name;
+      Name << "<b>Restart " << r << " (seed " << mKMeansParams.mSeed + r << ")";
+      if (r == Best) Name << " kept";
+      Name << "</b>";
+      GenHtmlTableLine(Os, Name.str(), mRestartCompactness[r], 3);
+    }
+    GenHtmlTableFooter(Os);
+  }
+
   // Word classifier example
   //<classifier type="svm" input="words">
   //  <type       value="C_SVC"/>
@@ -2573,8 +5042,22 @@ void CRecognitionDb::GenFeatureLogImage(
 {
   const int flags = DrawMatchesFlags::DRAW_OVER_OUTIMG|DrawMatchesFlags::DRAW_RICH_KEYPOINTS;
 
+  // The key points are in full size coordinates, Image may have been shrunk
+  vector<KeyPoint> KeyPoints = Entry.GetKeyPoints();
+  if ((Entry.GetImageWidth() > 0) && (Entry.GetImageWidth() != Image.cols))
+  {
+    const float ScaleX = (float)Image.cols/(float)Entry.GetImageWidth();
+    const float ScaleY = (float)Image.rows/(float)Entry.GetImageHeight();
+    for (unsigned i = 0; i < KeyPoints.size(); i++)
+    {
+      KeyPoints[i].pt.x *= ScaleX;
+      KeyPoints[i].pt.y *= ScaleY;
+      KeyPoints[i].size *= 0.5f*(ScaleX + ScaleY);
+    }
+  }
+
   Mat LogImage(Image);
-  drawKeypoints(Image, Entry.GetKeyPoints(), LogImage, Scalar(1.0, 1.0, 1.0), flags);
+  drawKeypoints(Image, KeyPoints, LogImage, Scalar(1.0, 1.0, 1.0), flags);
 
   wxFileName LogImageName = mDbDirs.mLogDir;
   LogImageName.SetName(Entry.GetName() + ".Features");
@@ -2622,7 +5105,8 @@ void CRecognitionDb::GenFeatureLogHtml(const CRecognitionEntry& Entry, wxTimeSpa
 
   // Print the size that only the descriptors take up
   const unsigned DescriptorLength = Entry.GetDescriptors().cols;
-  unsigned SizeInBytes = Entry.GetKeyPointCount()*DescriptorLength*sizeof(float);
+  const unsigned ElementSize = Entry.GetDescriptors().elemSize();
+  unsigned SizeInBytes = Entry.GetKeyPointCount()*DescriptorLength*ElementSize;
   GenHtmlTableLine(Os, "<b>Size (Bytes)</b>", SizeInBytes, 3);
 
   string GenTimeString = GenTime.Format("%M:%S:%l").ToStdString();
@@ -2863,6 +5347,17 @@ void CRecognitionDb::ReadHistogramsElement(TiXmlElement* pHistograms)
 
   DictionaryType = ReadTypeAttribute(pHistograms);
 
+  double Scale = mHistogramScale;
+  ReadScaleAttribute(pHistograms, &Scale);
+  if ((Scale > 0.0) && (Scale <= 1.0))
+  {
+    mHistogramScale = Scale;
+  }
+  else
+  {
+    cout << "WARNING: Histogram scale must be in (0, 1], using full size\n";
+  }
+
   // Right now this is the only method supported
   if (DictionaryType == "color")
   {
@@ -2913,12 +5408,45 @@ void CRecognitionDb::ReadDictionaryElement(TiXmlElement* pDictionary)
 
   DictionaryType = ReadTypeAttribute(pDictionary);
 
-  // Right now this is the only method supported
-  if (DictionaryType == "kmeans")
+  if ((DictionaryType == "kmeans") || (DictionaryType == "vocabtree") ||
+      (DictionaryType == "minibatch") || (DictionaryType == "streaming") ||
+      (DictionaryType == "hamerly"))
   {
+    if (DictionaryType == "vocabtree")
+    {
+      mDictionaryType = eVocabTree;
+    }
+    else if (DictionaryType == "minibatch")
+    {
+      mDictionaryType = eMiniBatch;
+    }
+    else if (DictionaryType == "streaming")
+    {
+      mDictionaryType = eStreaming;
+    }
+    else if (DictionaryType == "hamerly")
+    {
+      mDictionaryType = eHamerly;
+    }
+    else
+    {
+      mDictionaryType = eKMeans;
+    }
+
     // Set to the defaults in case there is a read failure
     int Words = mWordCount;
     int Iterations = mWordKMeansIter;
+    int Branching = mVocabTreeBranching;
+    int Depth = mVocabTreeDepth;
+    int IndexTrees = mWordIndexTrees;
+    int IndexChecks = mWordIndexChecks;
+    int BatchSize = mKMeansParams.mBatchSize;
+    double Tolerance = mKMeansParams.mTolerance;
+    double Epsilon = mKMeansParams.mEpsilon;
+    int Restarts = mKMeansParams.mRestarts;
+    int Seed = (int)mKMeansParams.mSeed;
+    int SampleSize = mKMeansParams.mSampleSize;
+    int Passes = mKMeansParams.mPasses;
 
     for (
       TiXmlElement* pElement = pDictionary->FirstChildElement();
@@ -2952,6 +5480,151 @@ void CRecognitionDb::ReadDictionaryElement(TiXmlElement* pDictionary)
           cout << "WARNING: Word count is invalid, using default value\n";
         }
       }
+      else if (Param == "branching")
+      {
+        ReadIntValueAttribute(pElement, &Branching);
+        if ((Branching >= 2) && (Branching <= 1000))
+        {
+          mVocabTreeBranching = Branching;
+        }
+        else
+        {
+          cout << "WARNING: Tree branching factor is invalid, using default value\n";
+        }
+      }
+      else if (Param == "depth")
+      {
+        ReadIntValueAttribute(pElement, &Depth);
+        if ((Depth > 0) && (Depth <= 20))
+        {
+          mVocabTreeDepth = Depth;
+        }
+        else
+        {
+          cout << "WARNING: Tree depth is invalid, using default value\n";
+        }
+      }
+      else if (Param == "index")
+      {
+        ReadBoolValueAttribute(pElement, &mWordIndexOn);
+      }
+      else if (Param == "indexTrees")
+      {
+        ReadIntValueAttribute(pElement, &IndexTrees);
+        if ((IndexTrees > 0) && (IndexTrees <= 64))
+        {
+          mWordIndexTrees = IndexTrees;
+        }
+        else
+        {
+          cout << "WARNING: Index tree count is invalid, using default value\n";
+        }
+      }
+      else if (Param == "indexChecks")
+      {
+        ReadIntValueAttribute(pElement, &IndexChecks);
+        if (IndexChecks > 0)
+        {
+          mWordIndexChecks = IndexChecks;
+        }
+        else
+        {
+          cout << "WARNING: Index check count is invalid, using default value\n";
+        }
+      }
+      else if (Param == "batchSize")
+      {
+        ReadIntValueAttribute(pElement, &BatchSize);
+        if (BatchSize > 0)
+        {
+          mKMeansParams.mBatchSize = BatchSize;
+        }
+        else
+        {
+          cout << "WARNING: Batch size is invalid, using default value\n";
+        }
+      }
+      else if (Param == "tolerance")
+      {
+        ReadDoubleValueAttribute(pElement, &Tolerance);
+        if (Tolerance >= 0)
+        {
+          mKMeansParams.mTolerance = Tolerance;
+        }
+        else
+        {
+          cout << "WARNING: Tolerance is invalid, using default value\n";
+        }
+      }
+      else if (Param == "epsilon")
+      {
+        ReadDoubleValueAttribute(pElement, &Epsilon);
+        if (Epsilon >= 0)
+        {
+          mKMeansParams.mEpsilon = Epsilon;
+        }
+        else
+        {
+          cout << "WARNING: Epsilon is invalid, using default value\n";
+        }
+      }
+      else if (Param == "restarts")
+      {
+        ReadIntValueAttribute(pElement, &Restarts);
+        if ((Restarts > 0) && (Restarts <= 64))
+        {
+          mKMeansParams.mRestarts = Restarts;
+        }
+        else
+        {
+          cout << "WARNING: Restart count is invalid, using default value\n";
+        }
+      }
+      else if (Param == "sampleSize")
+      {
+        ReadIntValueAttribute(pElement, &SampleSize);
+        if (SampleSize > 0)
+        {
+          mKMeansParams.mSampleSize = SampleSize;
+        }
+        else
+        {
+          cout << "WARNING: Sample size is invalid, using default value\n";
+        }
+      }
+      else if (Param == "passes")
+      {
+        ReadIntValueAttribute(pElement, &Passes);
+        if (Passes >= 0)
+        {
+          mKMeansParams.mPasses = Passes;
+        }
+        else
+        {
+          cout << "WARNING: Pass count is invalid, using default value\n";
+        }
+      }
+      else if (Param == "seed")
+      {
+        ReadIntValueAttribute(pElement, &Seed);
+        mKMeansParams.mSeed = (uint64_t)Seed;
+      }
+      else if (Param == "init")
+      {
+        string Init = ReadValueAttribute(pElement);
+        if (Init == "kmeans++")
+        {
+          mKMeansParams.mInit = SKMeansParams::eInitKMeansPP;
+        }
+        else if (Init == "kmeans||")
+        {
+          mKMeansParams.mInit = SKMeansParams::eInitKMeansParallel;
+        }
+        else
+        {
+          cout << "WARNING: Unknown k-means initialization " << Init << ", using default\n";
+        }
+      }
       else if (Param == "log")
       {
         ReadBoolValueAttribute(pElement, &mGenWordLog);
@@ -2960,6 +5633,35 @@ void CRecognitionDb::ReadDictionaryElement(TiXmlElement* pDictionary)
       {
         ReadBoolValueAttribute(pElement, &mCacheDictionary);
       }
+      else if (Param == "cacheLabels")
+      {
+        ReadBoolValueAttribute(pElement, &mCacheWordLabels);
+      }
+      else if (Param == "incremental")
+      {
+        ReadBoolValueAttribute(pElement, &mIncrementalDictionary);
+      }
+    }
+
+    if (mWordIndexOn && (mDictionaryType == eVocabTree))
+    {
+      cout << "WARNING: Approximate index is not used with a vocabulary tree\n";
+      mWordIndexOn = false;
+    }
+
+    // The word count of a vocabulary tree is set by its shape
+    if (mDictionaryType == eVocabTree)
+    {
+      double TreeWords = pow((double)mVocabTreeBranching, (double)mVocabTreeDepth);
+
+      if (TreeWords > 1000000)
+      {
+        cout << "WARNING: Vocabulary tree has too many words, using default shape\n";
+        mVocabTreeBranching = 10;
+        mVocabTreeDepth = 4;
+        TreeWords = 10000;
+      }
+      mWordCount = (unsigned)(TreeWords + 0.5);
     }
   }
   else
@@ -3230,6 +5932,27 @@ string CRecognitionDb::ReadValueAttribute(TiXmlElement* pElement)
   return string("");
 }
 
+//=================================================================================================
+//=================================================================================================
+void CRecognitionDb::ReadScaleAttribute(TiXmlElement* pElement, double* pVal)
+{
+  for (
+    TiXmlAttribute* pAttrib = pElement->FirstAttribute();
+    pAttrib != 0;
+    pAttrib = pAttrib->Next())
+  {
+    string Name = pAttrib->Name();
+
+    if (Name == "scale")
+    {
+      if (pAttrib->QueryDoubleValue(pVal) == TiXmlAttribute::TIXML_NO_ERROR)
+      {
+        return;
+      }
+    }
+  }
+}
+
 //=================================================================================================
 //=================================================================================================
 void CRecognitionDb::ReadIntValueAttribute(TiXmlElement* pElement, int* pVal)
@@ -3300,30 +6023,50 @@ void CRecognitionDb::ReadBoolValueAttribute(TiXmlElement* pElement, bool* pVal)
 }
 
 //=================================================================================================
+// Description:
+//  Fails when the file is from another version, truncated, corrupt or has the wrong word count
+//  or word type, so the dictionary gets rebuilt.
 //=================================================================================================
 bool CRecognitionDb::LoadDictionary(ifstream& Is)
 {
+  // Binary words are stored as raw bytes
+  const int Type = (mFeatureType == eORB) ? CV_8U : CV_32F;
+
+  Mat Words;
+  if (!CBinaryIo::ReadHeader(Is, DictionaryFileTag, DictionaryFileVersion) ||
+      !CBinaryIo::ReadMat(Is, Words, Type) ||
+      (Words.rows != mWordCount) ||
+      (Words.cols <= 0))
+  {
+    return false;
+  }
 
-  int Rows = 0;
-  int Cols = 0;
+  if (mpDictionary != 0) delete(mpDictionary);
+  mpDictionary = new Mat(Words);
 
-  Is.read(reinterpret_cast<char*>(&Rows), sizeof(Rows));
-  Is.read(reinterpret_cast<char*>(&Cols), sizeof(Cols));
+  if (Type == CV_8U) return UpdateWordQuantizer();
 
-  if ((Rows != mWordCount) || (Cols <= 0)) return false;
+  // Use the stored approximate index if there is one, otherwise it gets rebuilt
+  if (mWordIndexOn && (mDictionaryType != eVocabTree) && LoadWordIndex(Is)) return true;
 
-  if (mpDictionary != 0) delete(mpDictionary);
+  return UpdateWordQuantizer();
+}
 
-  mpDictionary = new Mat(Rows, Cols, CV_32F, Scalar(0));
+//=================================================================================================
+//=================================================================================================
+bool CRecognitionDb::SaveDictionary(ofstream& Os)
+{
+  if (mpDictionary == 0) return false;
 
-  for (unsigned i=0; i < (unsigned)Rows; i++)
+  if (!CBinaryIo::WriteHeader(Os, DictionaryFileTag, DictionaryFileVersion) ||
+      !CBinaryIo::WriteMat(Os, *mpDictionary))
   {
-    for (unsigned j = 0; j < (unsigned)Cols; j++)
-    {
-      float Val;
-      Is.read(reinterpret_cast<char*>(&(Val)), sizeof(Val));
-      mpDictionary->at<float>(i,j) = Val;
-    }
+    return false;
+  }
+
+  if ((mpDictionary->type() != CV_8U) && (mpWordQuantizer != 0) && mpWordQuantizer->HasIndex())
+  {
+    return SaveWordIndex(Os);
   }
 
   return true;
@@ -3331,24 +6074,111 @@ bool CRecognitionDb::LoadDictionary(ifstream& Is)
 
 //=================================================================================================
 //=================================================================================================
-bool CRecognitionDb::SaveDictionary(ofstream& Os)
+bool CRecognitionDb::LoadVocabularyTree(ifstream& Is)
 {
-  if (mpDictionary == 0) return false;
+  CVocabularyTree* pTree = new CVocabularyTree();
+
+  // Make sure the cached tree has the requested shape
+  if (!pTree->Load(Is) ||
+      (pTree->GetBranching() != (int)mVocabTreeBranching) ||
+      (pTree->GetDepth() != (int)mVocabTreeDepth))
+  {
+    delete pTree;
+    return false;
+  }
+
+  delete mpVocabularyTree;
+  mpVocabularyTree = pTree;
+
+  if (mpDictionary != 0) delete(mpDictionary);
+
+  mpDictionary = new Mat();
+  mpVocabularyTree->GetWords(*mpDictionary);
+
+  return UpdateWordQuantizer();
+}
 
-  int& Rows = mpDictionary->rows;
-  int& Cols = mpDictionary->cols;
+//=================================================================================================
+//=================================================================================================
+bool CRecognitionDb::SaveVocabularyTree(ofstream& Os)
+{
+  if (mpVocabularyTree == 0) return false;
 
-  Os.write(reinterpret_cast<char*>(&Rows), sizeof(Rows));
-  Os.write(reinterpret_cast<char*>(&Cols), sizeof(Cols));
+  return mpVocabularyTree->Save(Os);
+}
 
-  for (unsigned i = 0; i < (unsigned)Rows; i++)
+//=================================================================================================
+// Description:
+//  The index is stored as a section with the tree count followed by a section with the
+//  serialized index. FLANN can only serialize through a file so the index goes through a
+//  temporary file (<database>.ann) in the database directory.
+//=================================================================================================
+bool CRecognitionDb::LoadWordIndex(ifstream& Is)
+{
+  int32_t Trees = 0;
+  vector<char> Index;
+
+  // Dictionaries saved without an index end here and an index with a different tree count is
+  // stale
+  if (!CBinaryIo::ReadSection(Is, &Trees, sizeof(Trees)) ||
+      (Trees != (int)mWordIndexTrees) ||
+      !CBinaryIo::ReadSection(Is, Index) ||
+      Index.empty())
   {
-    for (unsigned j = 0; j < (unsigned)Cols; j++)
-    {
-      float Val = mpDictionary->at<float>(i,j);
-      Os.write(reinterpret_cast<char*>(&(Val)), sizeof(Val));
-    }
+    return false;
   }
 
-  return true;
-}
\ No newline at end of file
+  const int Bytes = (int)Index.size();
+
+  wxFileName IndexFileName = mDbDirs.mDatabaseDir;
+  IndexFileName.SetName(mDbName);
+  IndexFileName.SetExt("ann");
+  const string IndexPath = IndexFileName.GetFullPath().c_str();
+
+  ofstream IndexOs(IndexPath.c_str(), ios::out|ios::binary);
+  if (!IndexOs) return false;
+  IndexOs.write(&Index[0], Bytes);
+  IndexOs.close();
+
+  if (mpWordQuantizer == 0) mpWordQuantizer = new CWordQuantizer();
+
+  const bool Loaded =
+    mpWordQuantizer->SetDictionary(*mpDictionary) &&
+    mpWordQuantizer->LoadIndex(IndexPath, mWordIndexTrees, mWordIndexChecks);
+
+  wxRemoveFile(IndexFileName.GetFullPath());
+
+  return Loaded;
+}
+
+//=================================================================================================
+//=================================================================================================
+bool CRecognitionDb::SaveWordIndex(ofstream& Os)
+{
+  if ((mpWordQuantizer == 0) || !mpWordQuantizer->HasIndex()) return false;
+
+  wxFileName IndexFileName = mDbDirs.mDatabaseDir;
+  IndexFileName.SetName(mDbName);
+  IndexFileName.SetExt("ann");
+  const string IndexPath = IndexFileName.GetFullPath().c_str();
+
+  if (!mpWordQuantizer->SaveIndex(IndexPath)) return false;
+
+  ifstream IndexIs(IndexPath.c_str(), ios::in|ios::binary|ios::ate);
+  int Bytes = IndexIs ? (int)IndexIs.tellg() : 0;
+  vector<char> Index(max(Bytes, 1));
+
+  IndexIs.seekg(0, ios::beg);
+  IndexIs.read(&Index[0], Bytes);
+  IndexIs.close();
+
+  wxRemoveFile(IndexFileName.GetFullPath());
+
+  if (Bytes <= 0) return false;
+
+  const int32_t Trees = mpWordQuantizer->GetIndexTrees();
+
+  return
+    CBinaryIo::WriteSection(Os, &Trees, sizeof(Trees)) &&
+    CBinaryIo::WriteSection(Os, &Index[0], Bytes);
+}
@@ -1,14 +1,40 @@
 #include "RecognitionEntry.h"
+#include "DescriptorCodec.h"
+#include "BinaryIo.h"
 #include <iostream>
 #include <istream>
 #include <ostream>
 #include <fstream>
+#include <algorithm>
 
 #include <opencv2/nonfree/nonfree.hpp>
 
 using namespace cv;
 using namespace std;
 
+// Tags and versions of the feature (.key), color histogram (.col) and word label (.wrd) files
+static const char FeatureFileTag[4] = {'L', 'D', 'K', 'Y'};
+static const char ColorFileTag[4] = {'L', 'D', 'C', 'H'};
+static const char WordLabelFileTag[4] = {'L', 'D', 'W', 'D'};
+const uint32_t FeatureFileVersion = 2;
+const uint32_t ColorFileVersion = 2;
+const uint32_t WordLabelFileVersion = 2;
+
+//=================================================================================================
+// Description:
+//  Key point as stored in a feature file
+//=================================================================================================
+struct SStoredKeyPoint
+{
+  float mX;
+  float mY;
+  float mSize;
+  float mAngle;
+  float mResponse;
+  int32_t mOctave;
+  int32_t mClassId;
+};
+
 //=================================================================================================
 //=================================================================================================
 CRecognitionEntry::CRecognitionEntry(string UniqueName, unsigned LabelId, string Comment)
@@ -68,7 +94,7 @@ void CRecognitionEntry::GenerateFeatures(
 
 //=================================================================================================
 //=================================================================================================
-bool CRecognitionEntry::GenerateFeaturesSurfAdjuster(
+bool CRecognitionEntry::DetectSurfAdjuster(
   const Mat& Image,
   unsigned AdjusterMin,
   unsigned AdjusterMax,
@@ -76,13 +102,10 @@ bool CRecognitionEntry::GenerateFeaturesSurfAdjuster(
   double AdjusterLearnRate,
   double& Threshold,
   const CvSURFParams* mpSurfParams,
-  const DescriptorExtractor& DescriptorExtractor)
+  vector<KeyPoint>& KeyPoints)
 {
   bool ReturnStatus = false;
 
-  mImageHeight = Image.rows;
-  mImageWidth = Image.cols;
-
   double Alpha = AdjusterLearnRate;
   double PreviousThreshold;
   int    PreviousPoints;
@@ -96,20 +119,20 @@ bool CRecognitionEntry::GenerateFeaturesSurfAdjuster(
   {
       SurfFeatureDetector FeatDet =
       SurfFeatureDetector(Threshold, mpSurfParams->nOctaves, mpSurfParams->nOctaveLayers);
-    mKeyPoints.clear();
-    FeatDet.detect(Image, mKeyPoints);
+    KeyPoints.clear();
+    FeatDet.detect(Image, KeyPoints);
 
-    //cout << i << " Thresh: " << Threshold << " size: " << mKeyPoints.size() << "\n";
+    //cout << i << " Thresh: " << Threshold << " size: " << KeyPoints.size() << "\n";
 
     // Check to see if in range
-    if (InRangeInclusive(AdjusterMin, AdjusterMax, mKeyPoints.size()))
+    if (InRangeInclusive(AdjusterMin, AdjusterMax, KeyPoints.size()))
     {
       // Break out early if in range
       ReturnStatus = true;
       break;
     }
 
-    if ((i > 0) && (mKeyPoints.size() < AdjusterMin) && (PreviousPoints > (int)AdjusterMax))
+    if ((i > 0) && (KeyPoints.size() < AdjusterMin) && (PreviousPoints > (int)AdjusterMax))
     {
       // Detect overshooting condition (too many points -> too few points)
       //cout << "OVERSHOT: TOO MANY POINTS -> TOO FEW POINTS\n";
@@ -123,7 +146,7 @@ bool CRecognitionEntry::GenerateFeaturesSurfAdjuster(
       // Back off on the learning rate
       AdjusterLearnRate = AdjusterLearnRate/2.0;
     }
-    else if ((i > 0) && (mKeyPoints.size() > AdjusterMax) && (PreviousPoints < (int)AdjusterMin))
+    else if ((i > 0) && (KeyPoints.size() > AdjusterMax) && (PreviousPoints < (int)AdjusterMin))
     {
       // Detect overshooting condition (Too few points -> too many points)
       //cout << "OVERSHOT: TOO FEW POINTS -> TOO MANY POINTS\n";
@@ -144,14 +167,14 @@ bool CRecognitionEntry::GenerateFeaturesSurfAdjuster(
 
       PreviousThreshold = Threshold;
 
-      const double DeltaPoints = (double)mKeyPoints.size()-(double)Mid;
+      const double DeltaPoints = (double)KeyPoints.size()-(double)Mid;
 
       Threshold = Threshold + Alpha*DeltaPoints;
       if (Threshold < MinAllowableThreshold) Threshold = MinAllowableThreshold;
       if (Threshold > MaxAllowableThreshold) Threshold = MaxAllowableThreshold;
     }
 
-    PreviousPoints = mKeyPoints.size();
+    PreviousPoints = KeyPoints.size();
   }
 
   if (ReturnStatus)
@@ -163,19 +186,294 @@ bool CRecognitionEntry::GenerateFeaturesSurfAdjuster(
     //cout << "MIIIIIIIIIIIIIIISSSSSSS!\n";
   }
 
+  return ReturnStatus;
+
+  //This does not seem to work!
+  //FeatureDetector* pDynamicFD;
+  //pDynamicFD = new DynamicAdaptedFeatureDetector(new SurfAdjuster(), 400, 500, 50);
+}
+
+//=================================================================================================
+//=================================================================================================
+bool CRecognitionEntry::GenerateFeaturesSurfAdjuster(
+  const Mat& Image,
+  unsigned AdjusterMin,
+  unsigned AdjusterMax,
+  unsigned AdjusterIter,
+  double AdjusterLearnRate,
+  double& Threshold,
+  const CvSURFParams* mpSurfParams,
+  const DescriptorExtractor& DescriptorExtractor)
+{
+  mImageHeight = Image.rows;
+  mImageWidth = Image.cols;
+
+  const bool ReturnStatus = DetectSurfAdjuster(
+    Image, AdjusterMin, AdjusterMax, AdjusterIter, AdjusterLearnRate,
+    Threshold, mpSurfParams, mKeyPoints);
+
   mThreshold = Threshold;
 
   // Compute the descriptors
   DescriptorExtractor.compute(Image, mKeyPoints, mDescriptors);
 
   return ReturnStatus;
+}
 
-  //This does not seem to work!
-  //FeatureDetector* pDynamicFD;
-  //pDynamicFD = new DynamicAdaptedFeatureDetector(new SurfAdjuster(), 400, 500, 50);
+//=================================================================================================
+// Strongest key point first
+//=================================================================================================
+static bool CompareResponse(const KeyPoint& A, const KeyPoint& B)
+{
+  return A.response > B.response;
 }
 
 //=================================================================================================
+// Description:
+//  SURF keeps a candidate when its Hessian determinant is above the threshold and stores that
+//  determinant as the response, so thresholding the responses of one low threshold detection
+//  gives the key points of any higher threshold. The previous Threshold is kept when it already
+//  gives a count in range (as the adjuster would on its first iteration); otherwise the
+//  strongest (AdjusterMin + AdjusterMax)/2 key points are kept and Threshold becomes the
+//  response of the weakest one.
+//=================================================================================================
+bool CRecognitionEntry::DetectSurfSelect(
+  const Mat& Image,
+  unsigned AdjusterMin,
+  unsigned AdjusterMax,
+  unsigned AdjusterIter,
+  double& Threshold,
+  const CvSURFParams* mpSurfParams,
+  vector<KeyPoint>& KeyPoints)
+{
+  const double MaxAllowableThreshold = 15000;
+  const double MinAllowableThreshold = 1;
+  const unsigned Mid = AdjusterMin + (AdjusterMax-AdjusterMin)/2;
+
+  Threshold = min(max(Threshold, MinAllowableThreshold), MaxAllowableThreshold);
+
+  // The floor has to be low enough to find AdjusterMin key points
+  double Floor = max(MinAllowableThreshold, Threshold/4.0);
+  vector<KeyPoint> Candidates;
+
+  for (unsigned i = 0; i < max(1u, AdjusterIter); i++)
+  {
+    SurfFeatureDetector FeatDet =
+      SurfFeatureDetector(Floor, mpSurfParams->nOctaves, mpSurfParams->nOctaveLayers);
+    Candidates.clear();
+    FeatDet.detect(Image, Candidates);
+
+    if ((Candidates.size() >= AdjusterMin) || (Floor <= MinAllowableThreshold)) break;
+
+    Floor = max(MinAllowableThreshold, Floor/16.0);
+  }
+
+  // Equal responses keep the detector order so the selection is deterministic
+  stable_sort(Candidates.begin(), Candidates.end(), CompareResponse);
+
+  unsigned Keep = 0;
+  while ((Keep < Candidates.size()) && (Candidates[Keep].response > Threshold))
+  {
+    Keep++;
+  }
+
+  if (!InRangeInclusive(AdjusterMin, AdjusterMax, Keep))
+  {
+    Keep = min((unsigned)Candidates.size(), Mid);
+
+    // The threshold that reproduces this selection (floored like the adjuster's)
+    Threshold = (Keep > 0) ? (double)Candidates[Keep - 1].response : Floor;
+    Threshold = min(max(Threshold, MinAllowableThreshold), MaxAllowableThreshold);
+  }
+
+  KeyPoints.assign(Candidates.begin(), Candidates.begin() + Keep);
+
+  return InRangeInclusive(AdjusterMin, AdjusterMax, Keep);
+}
+
+//=================================================================================================
+//=================================================================================================
+bool CRecognitionEntry::GenerateFeaturesSurfSelect(
+  const Mat& Image,
+  unsigned AdjusterMin,
+  unsigned AdjusterMax,
+  unsigned AdjusterIter,
+  double& Threshold,
+  const CvSURFParams* mpSurfParams,
+  const DescriptorExtractor& DescriptorExtractor)
+{
+  mImageHeight = Image.rows;
+  mImageWidth = Image.cols;
+
+  const bool ReturnStatus = DetectSurfSelect(
+    Image, AdjusterMin, AdjusterMax, AdjusterIter, Threshold, mpSurfParams, mKeyPoints);
+
+  mThreshold = Threshold;
+
+  // Compute the descriptors of the survivors only
+  DescriptorExtractor.compute(Image, mKeyPoints, mDescriptors);
+
+  return ReturnStatus;
+}
+
+//=================================================================================================
+// Detects the key points of a range of grid cells (each cell starts from the same threshold)
+//=================================================================================================
+class CGridDetectBody : public ParallelLoopBody
+{
+  public:
+    CGridDetectBody(
+      const Mat& Image,
+      const vector<Rect>& Cells,
+      unsigned AdjusterMin,
+      unsigned AdjusterMax,
+      unsigned AdjusterIter,
+      double AdjusterLearnRate,
+      double StartThreshold,
+      const CvSURFParams* pSurfParams,
+      bool AdjusterSelect,
+      vector<vector<KeyPoint> >& CellKeyPoints,
+      vector<double>& CellThresholds,
+      vector<unsigned char>& CellInRange)
+     : mImage(Image),
+       mCells(Cells),
+       mAdjusterMin(AdjusterMin),
+       mAdjusterMax(AdjusterMax),
+       mAdjusterIter(AdjusterIter),
+       mAdjusterLearnRate(AdjusterLearnRate),
+       mStartThreshold(StartThreshold),
+       mpSurfParams(pSurfParams),
+       mAdjusterSelect(AdjusterSelect),
+       mCellKeyPoints(CellKeyPoints),
+       mCellThresholds(CellThresholds),
+       mCellInRange(CellInRange)
+    {
+    }
+
+    void operator()(const Range& Cells) const
+    {
+      for (int c = Cells.start; c < Cells.end; c++)
+      {
+        const Mat Roi(mImage, mCells[c]);
+        double Threshold = mStartThreshold;
+        bool InRange;
+
+        if (mAdjusterSelect)
+        {
+          InRange = CRecognitionEntry::DetectSurfSelect(
+            Roi, mAdjusterMin, mAdjusterMax, mAdjusterIter,
+            Threshold, mpSurfParams, mCellKeyPoints[c]);
+        }
+        else
+        {
+          InRange = CRecognitionEntry::DetectSurfAdjuster(
+            Roi, mAdjusterMin, mAdjusterMax, mAdjusterIter, mAdjusterLearnRate,
+            Threshold, mpSurfParams, mCellKeyPoints[c]);
+        }
+
+        mCellThresholds[c] = Threshold;
+        mCellInRange[c] = InRange ? 1 : 0;
+      }
+    }
+
+  private:
+    const Mat& mImage;
+    const vector<Rect>& mCells;
+    unsigned mAdjusterMin;
+    unsigned mAdjusterMax;
+    unsigned mAdjusterIter;
+    double mAdjusterLearnRate;
+    double mStartThreshold;
+    const CvSURFParams* mpSurfParams;
+    bool mAdjusterSelect;
+    vector<vector<KeyPoint> >& mCellKeyPoints;
+    vector<double>& mCellThresholds;
+    vector<unsigned char>& mCellInRange;
+};
+
+//=================================================================================================
+// Computes the descriptors of a range of grid cells into their rows of Descriptors and copies
+// the key points (in image coordinates) into their slots of KeyPoints
+//=================================================================================================
+class CGridDescribeBody : public ParallelLoopBody
+{
+  public:
+    CGridDescribeBody(
+      const Mat& Image,
+      const vector<Rect>& Cells,
+      const vector<int>& CellOffsets,
+      const DescriptorExtractor& Extractor,
+      vector<vector<KeyPoint> >& CellKeyPoints,
+      vector<Mat>& CellDescriptors,
+      Mat& Descriptors,
+      vector<KeyPoint>& KeyPoints)
+     : mImage(Image),
+       mCells(Cells),
+       mCellOffsets(CellOffsets),
+       mExtractor(Extractor),
+       mCellKeyPoints(CellKeyPoints),
+       mCellDescriptors(CellDescriptors),
+       mDescriptors(Descriptors),
+       mKeyPoints(KeyPoints)
+    {
+    }
+
+    void operator()(const Range& Cells) const
+    {
+      for (int c = Cells.start; c < Cells.end; c++)
+      {
+        vector<KeyPoint>& CellKeyPoints = mCellKeyPoints[c];
+        const int Begin = mCellOffsets[c];
+        const int Count = mCellOffsets[c + 1] - Begin;
+
+        if (Count == 0) continue;
+
+        // Same size and type so compute writes straight into the slice (no allocation)
+        Mat Slice = mDescriptors.rowRange(Begin, Begin + Count);
+        Mat Des = Slice;
+        mExtractor.compute(Mat(mImage, mCells[c]), CellKeyPoints, Des);
+
+        // The extractor dropped key points: keep this cell aside, the caller compacts
+        if ((Des.data != Slice.data) || ((int)CellKeyPoints.size() != Count))
+        {
+          mCellDescriptors[c] = Des;
+          continue;
+        }
+
+        const float ShiftX = (float)mCells[c].x;
+        const float ShiftY = (float)mCells[c].y;
+        for (int k = 0; k < Count; k++)
+        {
+          KeyPoint& Point = mKeyPoints[Begin + k];
+          Point = CellKeyPoints[k];
+          Point.pt.x += ShiftX;
+          Point.pt.y += ShiftY;
+        }
+      }
+    }
+
+  private:
+    const Mat& mImage;
+    const vector<Rect>& mCells;
+    const vector<int>& mCellOffsets;
+    const DescriptorExtractor& mExtractor;
+    vector<vector<KeyPoint> >& mCellKeyPoints;
+    vector<Mat>& mCellDescriptors;
+    Mat& mDescriptors;
+    vector<KeyPoint>& mKeyPoints;
+};
+
+//=================================================================================================
+// Description:
+//  The image is split into GridStep x GridStep cells (partial cells at the right and bottom
+//  edges are skipped) and each cell gets its own SURF adjuster run. The center cell is adjusted
+//  first, starting from Threshold; its threshold then warm starts every other cell and those
+//  are detected in parallel. Once the key point count of every cell is known the key points
+//  and descriptors are allocated once and every cell computes its descriptors straight into its
+//  own row range. The result does not depend on the number of threads.
+//
+//  Threshold receives the median of the cell thresholds (the start point for the next image).
+//  Returns true when every cell ended up in range.
 //=================================================================================================
 bool CRecognitionEntry::GenerateFeaturesGrid(
   const Mat& Image,
@@ -186,74 +484,123 @@ bool CRecognitionEntry::GenerateFeaturesGrid(
   double& Threshold,
   const CvSURFParams* pSurfParams,
   int GridStep,
-  const DescriptorExtractor& DescriptorExtractor)
+  const DescriptorExtractor& DescriptorExtractor,
+  bool AdjusterSelect)
 {
-  vector<CRecognitionEntry> Entries;
   mImageHeight = Image.rows;
   mImageWidth = Image.cols;
 
-  // The dimensions of the sliding window
-  const int WindowHeight = GridStep;
-  const int WindowWidth = GridStep;
+  const int DesCols = DescriptorExtractor.descriptorSize();
+  const int DesType = DescriptorExtractor.descriptorType();
 
-  int DesCount = 0;
-  int KeyPointCount = 0;
+  mKeyPoints.clear();
+  mDescriptors.release();
+  mDescriptorScale.release();
 
-  for (int i = WindowHeight; i <= mImageHeight; i+=WindowHeight)
+  if (GridStep <= 0) return false;
+
+  // Row major cells
+  vector<Rect> Cells;
+  for (int y = 0; y + GridStep <= mImageHeight; y += GridStep)
   {
-    for (int j = WindowWidth; j <= mImageWidth; j+=WindowWidth)
+    for (int x = 0; x + GridStep <= mImageWidth; x += GridStep)
     {
-      const int MinX = i-WindowHeight;
-      const int MaxX = i;
-      const int MinY = j-WindowWidth;
-      const int MaxY = j;
+      Cells.push_back(Rect(x, y, GridStep, GridStep));
+    }
+  }
 
-      CRecognitionEntry Entry = CRecognitionEntry("Entry", 0);
+  if (Cells.empty()) return false;
 
-      //cout << "MinX: " << MinX << " MinY: " << MinY << " MaxX " << MaxX << " MaxY " << MaxY << "\n";
-      Mat Roi = Mat(Image, Rect(Point(MinX, MinY), Point(MaxX, MaxY)));
-      //cout << "ROI rows: " << Roi.rows << " ROI cols: " << Roi.cols << "\n";
+  const int CellCount = Cells.size();
+  const int Seed = CellCount/2;
 
-      Entry.GenerateFeaturesSurfAdjuster(
-        Roi, AdjusterMin, AdjusterMax, AdjusterIter,
-        AdjusterLearnRate, Threshold, pSurfParams, DescriptorExtractor);
+  vector<vector<KeyPoint> > CellKeyPoints(CellCount);
+  vector<double> CellThresholds(CellCount, Threshold);
+  vector<unsigned char> CellInRange(CellCount, 0);
 
-      Entry.ShiftKeyPoints((double)MinX, (double)MinY);
-      Entries.push_back(Entry);
-      DesCount += Entry.GetDescriptors().rows;
-      KeyPointCount += Entry.GetKeyPointCount();
-    }
+  // Adjust the seed cell on its own, then warm start the others from its threshold
+  CGridDetectBody(
+    Image, Cells, AdjusterMin, AdjusterMax, AdjusterIter, AdjusterLearnRate, Threshold,
+    pSurfParams, AdjusterSelect, CellKeyPoints, CellThresholds, CellInRange)(
+      Range(Seed, Seed + 1));
+
+  CGridDetectBody DetectBody(
+    Image, Cells, AdjusterMin, AdjusterMax, AdjusterIter, AdjusterLearnRate,
+    CellThresholds[Seed], pSurfParams, AdjusterSelect, CellKeyPoints, CellThresholds,
+    CellInRange);
+  parallel_for_(Range(0, Seed), DetectBody);
+  parallel_for_(Range(Seed + 1, CellCount), DetectBody);
+
+  // Every cell gets a contiguous slice of the key points and descriptors
+  vector<int> CellOffsets(CellCount + 1, 0);
+  for (int c = 0; c < CellCount; c++)
+  {
+    CellOffsets[c + 1] = CellOffsets[c] + CellKeyPoints[c].size();
   }
 
-  int DesIdx = 0;
-  int KeyIdx = 0;
-  mDescriptors = Mat(DesCount, Entries.at(0).GetDescriptors().cols, CV_32F);
-  mKeyPoints.resize(KeyPointCount);
+  mKeyPoints.resize(CellOffsets[CellCount]);
+  mDescriptors.create(CellOffsets[CellCount], DesCols, DesType);
 
-  for (int i = 0; i < (int)Entries.size(); i++)
+  vector<Mat> CellDescriptors(CellCount);
+  parallel_for_(
+    Range(0, CellCount),
+    CGridDescribeBody(
+      Image, Cells, CellOffsets, DescriptorExtractor, CellKeyPoints, CellDescriptors,
+      mDescriptors, mKeyPoints));
+
+  // Only when the extractor removed key points from a cell (never for SURF inside the image)
+  bool Compact = false;
+  for (int c = 0; c < CellCount; c++)
   {
-    // Copy all of the keypoints over to this entry
-    const vector<KeyPoint>& KeyPoints = Entries.at(i).GetKeyPoints();
-    for (int j = 0; j < (int)KeyPoints.size(); j++)
-    {
-      mKeyPoints[KeyIdx] = KeyPoints[j];
-      KeyIdx++;
-    }
+    if (CellDescriptors[c].data != 0) Compact = true;
+  }
 
-    // Copy all of the descriptors over to the this entry
-    const Mat& Des = Entries.at(i).GetDescriptors();
-    for (int j = 0; j < Des.rows; j++)
+  if (Compact)
+  {
+    vector<KeyPoint> KeyPoints;
+    Mat Descriptors;
+
+    for (int c = 0; c < CellCount; c++)
     {
-      for (int k = 0; k < mDescriptors.cols; k++)
+      const int Begin = CellOffsets[c];
+      const int Count = CellOffsets[c + 1] - Begin;
+
+      if (CellDescriptors[c].data != 0)
       {
-        mDescriptors.at<float>(DesIdx,k) = Des.at<float>(j,k);
+        for (unsigned k = 0; k < CellKeyPoints[c].size(); k++)
+        {
+          KeyPoint Point = CellKeyPoints[c][k];
+          Point.pt.x += (float)Cells[c].x;
+          Point.pt.y += (float)Cells[c].y;
+          KeyPoints.push_back(Point);
+        }
+        Descriptors.push_back(CellDescriptors[c]);
+      }
+      else if (Count > 0)
+      {
+        KeyPoints.insert(
+          KeyPoints.end(), mKeyPoints.begin() + Begin, mKeyPoints.begin() + Begin + Count);
+        Descriptors.push_back(mDescriptors.rowRange(Begin, Begin + Count));
       }
-      DesIdx++;
-
-      //cout << mDescriptors.row(j) << "\n";
     }
+
+    mKeyPoints.swap(KeyPoints);
+    mDescriptors = Descriptors;
   }
 
+  // Median cell threshold
+  vector<double> SortedThresholds(CellThresholds);
+  nth_element(
+    SortedThresholds.begin(),
+    SortedThresholds.begin() + CellCount/2,
+    SortedThresholds.end());
+  Threshold = SortedThresholds[CellCount/2];
+  mThreshold = Threshold;
+
+  for (int c = 0; c < CellCount; c++)
+  {
+    if (!CellInRange[c]) return false;
+  }
   return true;
 }
 
@@ -268,6 +615,26 @@ void CRecognitionEntry::ShiftKeyPoints(double ShiftX, double ShiftY)
   }
 }
 
+//=================================================================================================
+//=================================================================================================
+void CRecognitionEntry::MapToImageSize(int Height, int Width)
+{
+  if ((mImageHeight <= 0) || (mImageWidth <= 0)) return;
+
+  const float ScaleX = (float)Width/(float)mImageWidth;
+  const float ScaleY = (float)Height/(float)mImageHeight;
+
+  for (int i = 0; i < (int)mKeyPoints.size(); i++)
+  {
+    mKeyPoints[i].pt.x *= ScaleX;
+    mKeyPoints[i].pt.y *= ScaleY;
+    mKeyPoints[i].size *= 0.5f*(ScaleX + ScaleY);
+  }
+
+  mImageHeight = Height;
+  mImageWidth = Width;
+}
+
 //=================================================================================================
 //=================================================================================================
 const vector<KeyPoint>& CRecognitionEntry::GetKeyPoints() const
@@ -281,6 +648,32 @@ const Mat& CRecognitionEntry::GetDescriptors() const
 {
   return (const Mat&)mDescriptors;
 }
+
+//=================================================================================================
+//=================================================================================================
+void CRecognitionEntry::SetDescriptors(const Mat& Des)
+{
+  mDescriptors = Des;
+}
+
+//=================================================================================================
+//=================================================================================================
+void CRecognitionEntry::SetFeatures(
+  vector<KeyPoint>& KeyPoints,
+  const Mat& Des,
+  const Mat& Scale,
+  int ImageHeight,
+  int ImageWidth)
+{
+  mKeyPoints.swap(KeyPoints);
+  KeyPoints.clear();
+
+  mDescriptors = Des;
+  mDescriptorScale = Scale;
+  mImageHeight = ImageHeight;
+  mImageWidth = ImageWidth;
+}
+
 //=================================================================================================
 //=================================================================================================
 unsigned CRecognitionEntry::GetLabelId() const
@@ -356,7 +749,84 @@ const Mat& CRecognitionEntry::GetColorHist() const
 
 //=================================================================================================
 //=================================================================================================
-void CRecognitionEntry::GenerateColorHist(const Mat& ImageBGR, unsigned Bins)
+const Mat& CRecognitionEntry::GetDescriptorScale() const
+{
+  return mDescriptorScale;
+}
+
+//=================================================================================================
+//=================================================================================================
+void CRecognitionEntry::GetDescriptorsFloat(Mat& Des) const
+{
+  CDescriptorCodec::Decode(mDescriptors, mDescriptorScale, Des);
+}
+
+//=================================================================================================
+//=================================================================================================
+int CRecognitionEntry::GetDescriptorType(EDescriptorStorage Storage)
+{
+  switch (Storage)
+  {
+    case eFloat16: return CV_16U;
+    case eInt8:    return CV_8S;
+    case eBinary:  return CV_8U;
+    default:       return CV_32F;
+  }
+}
+
+//=================================================================================================
+//=================================================================================================
+CRecognitionEntry::EDescriptorStorage CRecognitionEntry::GetDescriptorStorage() const
+{
+  switch (mDescriptors.type())
+  {
+    case CV_16U: return eFloat16;
+    case CV_8S:  return eInt8;
+    case CV_8U:  return eBinary;
+    default:     return eFloat32;
+  }
+}
+
+//=================================================================================================
+//=================================================================================================
+void CRecognitionEntry::SetDescriptorStorage(EDescriptorStorage Storage)
+{
+  if ((mDescriptors.data == 0) || (Storage == GetDescriptorStorage())) return;
+
+  // Bit strings have no float representation to convert through
+  if ((Storage == eBinary) || (GetDescriptorStorage() == eBinary)) return;
+
+  Mat Des32;
+  GetDescriptorsFloat(Des32);
+
+  Mat Des;
+  Mat Scale;
+  if (CDescriptorCodec::Encode(Des32, GetDescriptorType(Storage), Des, Scale))
+  {
+    mDescriptors = Des;
+    mDescriptorScale = Scale;
+  }
+}
+
+//=================================================================================================
+//=================================================================================================
+const vector<int>& CRecognitionEntry::GetWordLabels() const
+{
+  return mWordLabels;
+}
+
+//=================================================================================================
+// Takes ownership of the contents of Labels (Labels is left empty)
+//=================================================================================================
+void CRecognitionEntry::SetWordLabels(vector<int>& Labels)
+{
+  mWordLabels.swap(Labels);
+  Labels.clear();
+}
+
+//=================================================================================================
+//=================================================================================================
+void CRecognitionEntry::GenerateColorHist(const Mat& ImageBGR, unsigned Bins, double CountScale)
 {
   // Initialize histogram settings
   int HistSize[] = {static_cast<int>(Bins)};
@@ -389,111 +859,112 @@ void CRecognitionEntry::GenerateColorHist(const Mat& ImageBGR, unsigned Bins)
 
   for (unsigned i = 0; i < Bins; i++)
   {
-    mColorHist.at<float>(0,i) = HistB.at<float>(i,0);
-    mColorHist.at<float>(0,i+Bins) = HistG.at<float>(i,0);
-    mColorHist.at<float>(0,i+2*Bins) = HistR.at<float>(i,0);
+    mColorHist.at<float>(0,i) = (float)(CountScale*HistB.at<float>(i,0));
+    mColorHist.at<float>(0,i+Bins) = (float)(CountScale*HistG.at<float>(i,0));
+    mColorHist.at<float>(0,i+2*Bins) = (float)(CountScale*HistR.at<float>(i,0));
   }
 }
 
 //=================================================================================================
 // Description:
-//  Reads the entry from a binary file.
+//  Reads the entry from a binary file written by SaveFeatures. Fails when the file is from
+//  another version, truncated or corrupt (the entry is left without features).
 //  IMPORTANT: make sure the input file stream is opened with the ios::binary flag
 //=================================================================================================
-bool CRecognitionEntry::LoadFeatures(ifstream& Is)
+bool CRecognitionEntry::LoadFeatures(ifstream& Is, EDescriptorStorage Storage)
 {
-  int Rows = 0;
-  int Cols = 0;
+  mKeyPoints.clear();
+  mDescriptors.release();
+  mDescriptorScale.release();
+
+  int32_t Info[3] = {0, 0, 0};
 
-  Is.read(reinterpret_cast<char*>(&Rows), sizeof(Rows));
-  Is.read(reinterpret_cast<char*>(&Cols), sizeof(Cols));
+  if (!CBinaryIo::ReadHeader(Is, FeatureFileTag, FeatureFileVersion) ||
+      !CBinaryIo::ReadSection(Is, Info, sizeof(Info)) ||
+      (Info[0] < 0))
+  {
+    return false;
+  }
 
-  Is.read(reinterpret_cast<char*>(&mImageHeight), sizeof(mImageHeight));
-  Is.read(reinterpret_cast<char*>(&mImageWidth), sizeof(mImageWidth));
+  const int Rows = Info[0];
 
-  mKeyPoints.clear();
-  mKeyPoints.resize(Rows);
+  vector<SStoredKeyPoint> Stored(Rows);
+  if (!CBinaryIo::ReadSection(
+        Is, Stored.empty() ? 0 : &Stored[0], Rows*sizeof(SStoredKeyPoint)))
+  {
+    return false;
+  }
 
-  mDescriptors = Mat(Rows, Cols, CV_32F);
+  Mat Descriptors;
+  Mat Scale;
 
-  for (unsigned i=0; i < mKeyPoints.size(); i++)
+  // int8 descriptors are preceded by their per dimension scale
+  if ((Storage == eInt8) && !CBinaryIo::ReadMat(Is, Scale, CV_32F)) return false;
+
+  if (!CBinaryIo::ReadMat(Is, Descriptors, GetDescriptorType(Storage)) ||
+      (Descriptors.rows != Rows) ||
+      (Descriptors.cols <= 0) ||
+      ((Storage == eInt8) && ((Scale.rows != 1) || (Scale.cols != Descriptors.cols))))
   {
-    //Assign shorter names for readability
-    float& Angle    = mKeyPoints.at(i).angle;
-    int& ClassId    = mKeyPoints.at(i).class_id;
-    int& Octave     = mKeyPoints.at(i).octave;
-    float& X        = mKeyPoints.at(i).pt.x;
-    float& Y        = mKeyPoints.at(i).pt.y;
-    float& Response = mKeyPoints.at(i).response;
-    float& Size     = mKeyPoints.at(i).size;
-
-    //Type& Value
-    Is.read(reinterpret_cast<char*>(&Angle),       sizeof(Angle));
-    Is.read(reinterpret_cast<char*>(&ClassId),     sizeof(ClassId));
-    Is.read(reinterpret_cast<char*>(&Octave),      sizeof(Octave));
-    Is.read(reinterpret_cast<char*>(&X),           sizeof(X));
-    Is.read(reinterpret_cast<char*>(&Y),           sizeof(Y));
-    Is.read(reinterpret_cast<char*>(&Response),    sizeof(Response));
-    Is.read(reinterpret_cast<char*>(&Size),        sizeof(Size));
-
-    for (int j = 0; j < mDescriptors.cols; j++)
-    {
-      float Val;
-      Is.read(reinterpret_cast<char*>(&(Val)), sizeof(Val));
-      mDescriptors.at<float>(i,j) = Val;
-    }
+    return false;
   }
+
+  mKeyPoints.resize(Rows);
+  for (int i = 0; i < Rows; i++)
+  {
+    const SStoredKeyPoint& Point = Stored[i];
+    mKeyPoints[i] = KeyPoint(
+      Point.mX, Point.mY, Point.mSize, Point.mAngle, Point.mResponse, Point.mOctave,
+      Point.mClassId);
+  }
+
+  mDescriptors = Descriptors;
+  mDescriptorScale = Scale;
+  mImageHeight = Info[1];
+  mImageWidth = Info[2];
+
   return true;
 }
 
 //=================================================================================================
 // Description:
-//  Writes the entry to a binary file.
+//  Writes the entry to a binary file: header, key point count and image size, the key points,
+//  the descriptor scale (int8 only) and the descriptors, each as one checksummed section.
 //  IMPORTANT: make sure the output file stream is created with the ios::binary flag
 //=================================================================================================
 bool CRecognitionEntry::SaveFeatures(ofstream& Os)
 {
   if (!mKeyPoints.size()) return false;
 
-  int& Rows = mDescriptors.rows;
-  int& Cols = mDescriptors.cols;
+  const int Rows = mDescriptors.rows;
+  const int32_t Info[3] = {Rows, mImageHeight, mImageWidth};
 
-  int& ImageHeight = mImageHeight;
-  int& ImageWidth = mImageWidth;
-
-  Os.write(reinterpret_cast<char*>(&Rows), sizeof(Rows));
-  Os.write(reinterpret_cast<char*>(&Cols), sizeof(Cols));
+  vector<SStoredKeyPoint> Stored(Rows);
+  for (int i = 0; i < Rows; i++)
+  {
+    const KeyPoint& Point = mKeyPoints.at(i);
+    SStoredKeyPoint& Out = Stored[i];
+
+    Out.mX = Point.pt.x;
+    Out.mY = Point.pt.y;
+    Out.mSize = Point.size;
+    Out.mAngle = Point.angle;
+    Out.mResponse = Point.response;
+    Out.mOctave = Point.octave;
+    Out.mClassId = Point.class_id;
+  }
 
-  Os.write(reinterpret_cast<char*>(&ImageHeight), sizeof(ImageHeight));
-  Os.write(reinterpret_cast<char*>(&ImageWidth), sizeof(ImageWidth));
+  bool Written =
+    CBinaryIo::WriteHeader(Os, FeatureFileTag, FeatureFileVersion) &&
+    CBinaryIo::WriteSection(Os, Info, sizeof(Info)) &&
+    CBinaryIo::WriteSection(Os, Stored.empty() ? 0 : &Stored[0], Rows*sizeof(SStoredKeyPoint));
 
-  for (unsigned i = 0; i < mKeyPoints.size(); i++)
+  if (Written && (GetDescriptorStorage() == eInt8))
   {
-    //Assign shorter names for readability
-    float& Angle    = mKeyPoints.at(i).angle;
-    int& ClassId    = mKeyPoints.at(i).class_id;
-    int& Octave     = mKeyPoints.at(i).octave;
-    float& X        = mKeyPoints.at(i).pt.x;
-    float& Y        = mKeyPoints.at(i).pt.y;
-    float& Response = mKeyPoints.at(i).response;
-    float& Size     = mKeyPoints.at(i).size;
-
-    //Type& Value
-    Os.write(reinterpret_cast<char*>(&Angle),       sizeof(Angle));
-    Os.write(reinterpret_cast<char*>(&ClassId),     sizeof(ClassId));
-    Os.write(reinterpret_cast<char*>(&Octave),      sizeof(Octave));
-    Os.write(reinterpret_cast<char*>(&X),           sizeof(X));
-    Os.write(reinterpret_cast<char*>(&Y),           sizeof(Y));
-    Os.write(reinterpret_cast<char*>(&Response),    sizeof(Response));
-    Os.write(reinterpret_cast<char*>(&Size),        sizeof(Size));
-
-    for (int j = 0; j < mDescriptors.cols; j++)
-    {
-      float Val = mDescriptors.at<float>(i,j);
-      Os.write(reinterpret_cast<char*>(&(Val)), sizeof(Val));
-    }
+    Written = CBinaryIo::WriteMat(Os, mDescriptorScale);
   }
-  return true;
+
+  return Written && CBinaryIo::WriteMat(Os, mDescriptors);
 }
 
 //=================================================================================================
@@ -505,38 +976,76 @@ bool CRecognitionEntry::SaveColorHistogram(ofstream& Os)
 {
   if (!mColorHist.cols) return false;
 
-  int& Cols = mColorHist.cols;
+  return
+    CBinaryIo::WriteHeader(Os, ColorFileTag, ColorFileVersion) &&
+    CBinaryIo::WriteMat(Os, mColorHist);
+}
 
-  Os.write(reinterpret_cast<char*>(&Cols), sizeof(Cols));
+//=================================================================================================
+// Description:
+//  Reads the entry from a binary file. Fails when the file is from another version, truncated,
+//  corrupt or does not have ExpectedCols bins.
+//  IMPORTANT: make sure the input file stream is opened with the ios::binary flag
+//=================================================================================================
+bool CRecognitionEntry::LoadColorHistogram(ifstream& Is, int ExpectedCols)
+{
+  Mat Hist;
 
-  for (int i = 0; i < (int)mColorHist.cols; i++)
+  if (!CBinaryIo::ReadHeader(Is, ColorFileTag, ColorFileVersion) ||
+      !CBinaryIo::ReadMat(Is, Hist, CV_32F, ExpectedCols) ||
+      (Hist.rows != 1))
   {
-    float Val = mColorHist.at<float>(0,i);
-    Os.write(reinterpret_cast<char*>(&(Val)), sizeof(Val));
+    return false;
   }
+
+  mColorHist = Hist;
   return true;
 }
 
 //=================================================================================================
 // Description:
-//  Reads the entry from a binary file.
-//  IMPORTANT: make sure the input file stream is opened with the ios::binary flag
+//  Writes the word labels to a binary file: header, fingerprint of the dictionary and features
+//  and the labels, each as one checksummed section.
+//  IMPORTANT: make sure the output file stream is created with the ios::binary flag
 //=================================================================================================
-bool CRecognitionEntry::LoadColorHistogram(ifstream& Is, int ExpectedCols)
+bool CRecognitionEntry::SaveWordLabels(ofstream& Os, uint64_t Fingerprint)
 {
-  int Cols = 0;
+  const int Count = (int)mWordLabels.size();
 
-  Is.read(reinterpret_cast<char*>(&Cols), sizeof(Cols));
+  if (Count != (int)mKeyPoints.size()) return false;
 
-  if (Cols != ExpectedCols) return false;
+  return
+    CBinaryIo::WriteHeader(Os, WordLabelFileTag, WordLabelFileVersion) &&
+    CBinaryIo::WriteSection(Os, &Fingerprint, sizeof(Fingerprint)) &&
+    CBinaryIo::WriteSection(Os, Count ? &mWordLabels[0] : 0, Count*sizeof(int));
+}
 
-  mColorHist = Mat(1, Cols, CV_32F);
+//=================================================================================================
+// Description:
+//  Reads the word labels from a binary file. Fails if the file is from another version,
+//  truncated or corrupt, if the labels were produced by a different dictionary or do not match
+//  the key points of this entry.
+//  IMPORTANT: make sure the input file stream is opened with the ios::binary flag
+//=================================================================================================
+bool CRecognitionEntry::LoadWordLabels(ifstream& Is, uint64_t ExpectedFingerprint, int WordCount)
+{
+  uint64_t Fingerprint = 0;
+  const int Count = (int)mKeyPoints.size();
+  vector<int> Labels(Count);
+
+  if (!CBinaryIo::ReadHeader(Is, WordLabelFileTag, WordLabelFileVersion) ||
+      !CBinaryIo::ReadSection(Is, &Fingerprint, sizeof(Fingerprint)) ||
+      (Fingerprint != ExpectedFingerprint) ||
+      !CBinaryIo::ReadSection(Is, Count ? &Labels[0] : 0, Count*sizeof(int)))
+  {
+    return false;
+  }
 
-  for (int i=0; i < mColorHist.cols; i++)
+  for (int i = 0; i < Count; i++)
   {
-    float Val;
-    Is.read(reinterpret_cast<char*>(&(Val)), sizeof(Val));
-    mColorHist.at<float>(0,i) = Val;
+    if ((Labels[i] < 0) || (Labels[i] >= WordCount)) return false;
   }
+
+  mWordLabels.swap(Labels);
   return true;
 }
@@ -0,0 +1,308 @@
+#include "VocabularyTree.h"
+#include "WordQuantizer.h"
+#include "BinaryIo.h"
+
+#include <cstring>
+
+using namespace cv;
+using namespace std;
+
+// Tag and version of the vocabulary tree files (.voc)
+static const char TreeFileTag[4] = {'L', 'V', 'O', 'C'};
+const uint32_t TreeFileVersion = 2;
+
+//=================================================================================================
+//=================================================================================================
+CVocabularyTree::CVocabularyTree()
+ : mBranching(0),
+   mDepth(0),
+   mWordCount(0),
+   mDescriptorLength(0),
+   mFirstLeaf(0)
+{
+}
+
+//=================================================================================================
+//=================================================================================================
+CVocabularyTree::~CVocabularyTree()
+{
+}
+
+//=================================================================================================
+// Description:
+//  The tree is built one level at a time. Members holds the indices of the descriptors assigned
+//  to each node of the current level; k-means on those descriptors gives the centroids of the
+//  node's children and the assignment of the descriptors to the next level.
+//=================================================================================================
+bool CVocabularyTree::Build(const Mat& Descriptors, int Branching, int Depth, int Iterations)
+{
+  if ((Descriptors.type() != CV_32F) || (Descriptors.rows == 0) ||
+      (Branching < 2) || (Depth < 1) || (Iterations < 1))
+  {
+    return false;
+  }
+
+  mBranching = Branching;
+  mDepth = Depth;
+  mDescriptorLength = Descriptors.cols;
+
+  mWordCount = 1;
+  for (int l = 0; l < mDepth; l++)
+  {
+    mWordCount *= mBranching;
+  }
+  mFirstLeaf = (mWordCount - 1)/(mBranching - 1);
+
+  const int NodeCount = GetNodeCount();
+  const size_t RowSize = mDescriptorLength*sizeof(float);
+
+  mCentroids = Mat(NodeCount, mDescriptorLength, CV_32F, Scalar(0));
+  mValid.assign(NodeCount, 0);
+
+  // The root is the mean of all descriptors
+  float* pRoot = mCentroids.ptr<float>(0);
+  for (int i = 0; i < Descriptors.rows; i++)
+  {
+    const float* pDes = Descriptors.ptr<float>(i);
+    for (int k = 0; k < mDescriptorLength; k++)
+    {
+      pRoot[k] += pDes[k];
+    }
+  }
+  for (int k = 0; k < mDescriptorLength; k++)
+  {
+    pRoot[k] /= (float)Descriptors.rows;
+  }
+  mValid[0] = 1;
+
+  vector<vector<int> > Members(1, vector<int>(Descriptors.rows));
+  for (int i = 0; i < Descriptors.rows; i++)
+  {
+    Members[0][i] = i;
+  }
+
+  TermCriteria TermCrit = TermCriteria(TermCriteria::MAX_ITER, Iterations, 0.0f);
+
+  int FirstNode = 0;
+  int LevelCount = 1;
+
+  for (int l = 0; l < mDepth; l++)
+  {
+    vector<vector<int> > ChildMembers(LevelCount*mBranching);
+
+    for (int n = 0; n < LevelCount; n++)
+    {
+      const int Node = FirstNode + n;
+      const int FirstChild = Node*mBranching + 1;
+
+      if (!mValid[Node]) continue;
+
+      vector<int>& NodeMembers = Members[n];
+
+      if ((int)NodeMembers.size() < mBranching)
+      {
+        // Too few descriptors to split, pass this node straight down to its first child
+        memcpy(mCentroids.ptr<float>(FirstChild), mCentroids.ptr<float>(Node), RowSize);
+        mValid[FirstChild] = 1;
+        ChildMembers[n*mBranching].swap(NodeMembers);
+        continue;
+      }
+
+      Mat Subset((int)NodeMembers.size(), mDescriptorLength, CV_32F);
+      for (int i = 0; i < Subset.rows; i++)
+      {
+        memcpy(Subset.ptr<float>(i), Descriptors.ptr<float>(NodeMembers[i]), RowSize);
+      }
+
+      Mat Labels;
+      Mat Centers;
+
+      cv::kmeans(Subset, mBranching, Labels, TermCrit, 1, KMEANS_PP_CENTERS, Centers);
+
+      for (int c = 0; c < mBranching; c++)
+      {
+        memcpy(mCentroids.ptr<float>(FirstChild + c), Centers.ptr<float>(c), RowSize);
+        mValid[FirstChild + c] = 1;
+      }
+
+      for (int i = 0; i < Subset.rows; i++)
+      {
+        ChildMembers[n*mBranching + Labels.at<int>(i,0)].push_back(NodeMembers[i]);
+      }
+
+      vector<int>().swap(NodeMembers);
+    }
+
+    Members.swap(ChildMembers);
+    FirstNode = FirstNode*mBranching + 1;
+    LevelCount *= mBranching;
+  }
+
+  return true;
+}
+
+//=================================================================================================
+//=================================================================================================
+int CVocabularyTree::GetBranching() const
+{
+  return mBranching;
+}
+
+//=================================================================================================
+//=================================================================================================
+int CVocabularyTree::GetDepth() const
+{
+  return mDepth;
+}
+
+//=================================================================================================
+//=================================================================================================
+int CVocabularyTree::GetWordCount() const
+{
+  return mWordCount;
+}
+
+//=================================================================================================
+//=================================================================================================
+int CVocabularyTree::GetDescriptorLength() const
+{
+  return mDescriptorLength;
+}
+
+//=================================================================================================
+//=================================================================================================
+int CVocabularyTree::GetNodeCount() const
+{
+  return mFirstLeaf + mWordCount;
+}
+
+//=================================================================================================
+//=================================================================================================
+int CVocabularyTree::FindNearestWord(const float* pDes) const
+{
+  int Node = 0;
+
+  for (int l = 0; l < mDepth; l++)
+  {
+    const int FirstChild = Node*mBranching + 1;
+    float SmallestNorm = FLT_MAX;
+    int SmallestNormIndex = FirstChild;
+
+    for (int c = FirstChild; c < FirstChild + mBranching; c++)
+    {
+      if (!mValid[c]) continue;
+
+      const float Norm =
+        CWordQuantizer::SquaredDistance(pDes, mCentroids.ptr<float>(c), mDescriptorLength);
+
+      if (Norm < SmallestNorm)
+      {
+        SmallestNorm = Norm;
+        SmallestNormIndex = c;
+      }
+    }
+    Node = SmallestNormIndex;
+  }
+
+  return Node - mFirstLeaf;
+}
+
+//=================================================================================================
+//=================================================================================================
+void CVocabularyTree::GetWords(Mat& Words) const
+{
+  Words = Mat(mWordCount, mDescriptorLength, CV_32F);
+
+  for (int i = 0; i < mWordCount; i++)
+  {
+    int Node = mFirstLeaf + i;
+    while (!mValid[Node])
+    {
+      Node = (Node - 1)/mBranching;
+    }
+    memcpy(Words.ptr<float>(i), mCentroids.ptr<float>(Node), mDescriptorLength*sizeof(float));
+  }
+}
+
+//=================================================================================================
+//=================================================================================================
+uint64_t CVocabularyTree::GetFingerprint() const
+{
+  const int NodeCount = GetNodeCount();
+
+  uint64_t Hash = CWordQuantizer::HashBytes(&mBranching, sizeof(mBranching));
+  Hash = CWordQuantizer::HashBytes(&mDepth, sizeof(mDepth), Hash);
+  Hash = CWordQuantizer::HashBytes(&mDescriptorLength, sizeof(mDescriptorLength), Hash);
+
+  if (NodeCount > 0)
+  {
+    Hash = CWordQuantizer::HashBytes(&mValid[0], NodeCount, Hash);
+    Hash = CWordQuantizer::HashBytes(
+      mCentroids.ptr<float>(0), NodeCount*mDescriptorLength*sizeof(float), Hash);
+  }
+  return Hash;
+}
+
+//=================================================================================================
+// Description:
+//  Fails when the file is from another version, truncated or corrupt
+//=================================================================================================
+bool CVocabularyTree::Load(ifstream& Is)
+{
+  int32_t Shape[3] = {0, 0, 0};
+
+  if (!CBinaryIo::ReadHeader(Is, TreeFileTag, TreeFileVersion) ||
+      !CBinaryIo::ReadSection(Is, Shape, sizeof(Shape)))
+  {
+    return false;
+  }
+
+  const int Branching = Shape[0];
+  const int Depth = Shape[1];
+  const int Cols = Shape[2];
+
+  if ((Branching < 2) || (Depth < 1) || (Cols <= 0)) return false;
+
+  int WordCount = 1;
+  for (int l = 0; l < Depth; l++)
+  {
+    WordCount *= Branching;
+  }
+  const int NodeCount = (WordCount*Branching - 1)/(Branching - 1);
+
+  vector<unsigned char> Valid(NodeCount);
+  Mat Centroids;
+
+  if (!CBinaryIo::ReadSection(Is, &Valid[0], NodeCount) ||
+      !CBinaryIo::ReadMat(Is, Centroids, CV_32F, Cols) ||
+      (Centroids.rows != NodeCount))
+  {
+    return false;
+  }
+
+  mBranching = Branching;
+  mDepth = Depth;
+  mDescriptorLength = Cols;
+  mWordCount = WordCount;
+  mFirstLeaf = (mWordCount - 1)/(mBranching - 1);
+
+  mValid.swap(Valid);
+  mCentroids = Centroids;
+
+  return true;
+}
+
+//=================================================================================================
+//=================================================================================================
+bool CVocabularyTree::Save(ofstream& Os) const
+{
+  if (mWordCount == 0) return false;
+
+  const int32_t Shape[3] = {mBranching, mDepth, mDescriptorLength};
+
+  return
+    CBinaryIo::WriteHeader(Os, TreeFileTag, TreeFileVersion) &&
+    CBinaryIo::WriteSection(Os, Shape, sizeof(Shape)) &&
+    CBinaryIo::WriteSection(Os, &mValid[0], GetNodeCount()) &&
+    CBinaryIo::WriteMat(Os, mCentroids);
+}
@@ -0,0 +1,982 @@
+#include "WordQuantizer.h"
+#include "VocabularyTree.h"
+#include "DescriptorCodec.h"
+#include "DistanceKernels.h"
+
+#include <opencv2/flann/flann.hpp>
+
+#include <algorithm>
+#include <climits>
+#include <cstring>
+
+using namespace cv;
+using namespace std;
+
+// Chosen once at startup. A file built for AVX2 already has the AVX2 kernels inline.
+#if defined(__AVX2__)
+static const bool UseAvx2Kernels = false;
+#else
+static const bool UseAvx2Kernels = CAvx2Kernels::IsAvailable();
+#endif
+
+//=================================================================================================
+// Exact nearest word with the fastest kernels the processor supports
+//=================================================================================================
+static int FindNearestExact(
+  const float* pDes,
+  const SWordSearch& Search,
+  int Hint,
+  uint64_t& DimsEvaluated)
+{
+  if (UseAvx2Kernels) return CAvx2Kernels::FindNearestWord(pDes, Search, Hint, DimsEvaluated);
+
+  return FindNearestPrunedKernel(pDes, Search, Hint, DimsEvaluated);
+}
+
+//=================================================================================================
+//=================================================================================================
+static void QuantizePruned(
+  const Mat& Des,
+  const Mat& Scale,
+  const SWordSearch& Search,
+  vector<int>& Labels,
+  uint64_t& DimsEvaluated)
+{
+  int Hint = -1;
+  vector<float> Buffer(Des.cols);
+
+  for (int i = 0; i < Des.rows; i++)
+  {
+    const float* pDes = CDescriptorCodec::GetRow(Des, Scale, i, &Buffer[0]);
+    Labels[i] = FindNearestExact(pDes, Search, Hint, DimsEvaluated);
+    Hint = Labels[i];
+  }
+}
+
+//=================================================================================================
+//=================================================================================================
+static SWordSearch GetWordSearch(const Mat& Words, const Mat& PairDist, const Mat& HalfMinDist)
+{
+  SWordSearch Search;
+  Search.mpWords = Words.ptr<float>(0);
+  Search.mWordCount = Words.rows;
+  Search.mLength = Words.cols;
+  Search.mpPairDist = PairDist.empty() ? 0 : PairDist.ptr<float>(0);
+  Search.mpHalfMinDist = HalfMinDist.empty() ? 0 : HalfMinDist.ptr<float>(0);
+  return Search;
+}
+
+//=================================================================================================
+// Description:
+//  Returns the Rows descriptors starting at global row Start of the descriptor list as fp32.
+//  The block is a view when all rows come from one CV_32F matrix, otherwise the rows are copied
+//  (and decoded) into Gathered. SourceMat/SourceRow receive the matrix and row of each block row.
+//=================================================================================================
+static Mat GatherBlock(
+  const vector<const Mat*>& DesList,
+  const vector<const Mat*>& ScaleList,
+  const vector<int>& Offsets,
+  int Start,
+  int Rows,
+  Mat& Gathered,
+  vector<int>& SourceMat,
+  vector<int>& SourceRow)
+{
+  // Find the descriptor matrix that holds the first row of this block
+  int m = (int)(upper_bound(Offsets.begin(), Offsets.end(), Start) - Offsets.begin()) - 1;
+  int Row = Start - Offsets[m];
+
+  for (int i = 0; i < Rows; i++)
+  {
+    while (Row >= DesList[m]->rows)
+    {
+      m++;
+      Row = 0;
+    }
+    SourceMat[i] = m;
+    SourceRow[i] = Row;
+    Row++;
+  }
+
+  if ((SourceMat[0] == SourceMat[Rows-1]) && (DesList[SourceMat[0]]->type() == CV_32F))
+  {
+    // The whole block lives in one matrix so use it in place
+    return DesList[SourceMat[0]]->rowRange(SourceRow[0], SourceRow[0] + Rows);
+  }
+
+  for (int i = 0; i < Rows; i++)
+  {
+    CDescriptorCodec::DecodeRow(*DesList[SourceMat[i]], *ScaleList[SourceMat[i]],
+      SourceRow[i], Gathered.ptr<float>(i));
+  }
+  return Gathered.rowRange(0, Rows);
+}
+
+//=================================================================================================
+// Description:
+//  Parallel body for batch assignment. Each block of descriptors (gathered from one or more
+//  descriptor matrices) is multiplied against the dictionary in one gemm call and the nearest
+//  word is the one minimizing ||c||^2 - 2*d.c (||d||^2 is constant for a given descriptor).
+//=================================================================================================
+class CBatchQuantizeBody : public ParallelLoopBody
+{
+  public:
+    CBatchQuantizeBody(
+      const vector<const Mat*>& DesList,
+      const vector<const Mat*>& ScaleList,
+      const vector<int>& Offsets,
+      int BlockRows,
+      const Mat& Words,
+      const Mat& WordNorms,
+      vector<vector<int> >& Labels)
+     : mDesList(DesList),
+       mScaleList(ScaleList),
+       mOffsets(Offsets),
+       mBlockRows(BlockRows),
+       mWords(Words),
+       mWordNorms(WordNorms),
+       mLabels(Labels)
+    {
+    }
+
+    void operator()(const Range& Blocks) const
+    {
+      const int Length = mWords.cols;
+      const int WordCount = mWords.rows;
+      const int TotalRows = mOffsets.back();
+      const float* pNorms = mWordNorms.ptr<float>(0);
+
+      Mat Gathered(mBlockRows, Length, CV_32F);
+      Mat Cross;
+      vector<int> SourceMat(mBlockRows);
+      vector<int> SourceRow(mBlockRows);
+
+      for (int b = Blocks.start; b < Blocks.end; b++)
+      {
+        const int Start = b*mBlockRows;
+        const int Rows = min(mBlockRows, TotalRows - Start);
+
+        Mat Block = GatherBlock(
+          mDesList, mScaleList, mOffsets, Start, Rows, Gathered, SourceMat, SourceRow);
+
+        // Cross = -2 * Block * Words^T
+        gemm(Block, mWords, -2.0, Mat(), 0.0, Cross, GEMM_2_T);
+
+        for (int i = 0; i < Rows; i++)
+        {
+          const float* pCross = Cross.ptr<float>(i);
+          float SmallestNorm = FLT_MAX;
+          int SmallestNormIndex = 0;
+
+          for (int j = 0; j < WordCount; j++)
+          {
+            const float Norm = pCross[j] + pNorms[j];
+            if (Norm < SmallestNorm)
+            {
+              SmallestNorm = Norm;
+              SmallestNormIndex = j;
+            }
+          }
+          mLabels[SourceMat[i]][SourceRow[i]] = SmallestNormIndex;
+        }
+      }
+    }
+
+  private:
+    const vector<const Mat*>& mDesList;
+    const vector<const Mat*>& mScaleList;
+    const vector<int>& mOffsets;
+    const int mBlockRows;
+    const Mat& mWords;
+    const Mat& mWordNorms;
+    vector<vector<int> >& mLabels;
+};
+
+//=================================================================================================
+// Description:
+//  Parallel body for batch assignment with a vocabulary tree. Blocks cover the same global rows
+//  as CBatchQuantizeBody but every descriptor simply walks down the tree.
+//=================================================================================================
+class CTreeQuantizeBody : public ParallelLoopBody
+{
+  public:
+    CTreeQuantizeBody(
+      const vector<const Mat*>& DesList,
+      const vector<const Mat*>& ScaleList,
+      const vector<int>& Offsets,
+      int BlockRows,
+      const CVocabularyTree& Tree,
+      vector<vector<int> >& Labels)
+     : mDesList(DesList),
+       mScaleList(ScaleList),
+       mOffsets(Offsets),
+       mBlockRows(BlockRows),
+       mTree(Tree),
+       mLabels(Labels)
+    {
+    }
+
+    void operator()(const Range& Blocks) const
+    {
+      const int TotalRows = mOffsets.back();
+      vector<float> Buffer(mTree.GetDescriptorLength());
+
+      for (int b = Blocks.start; b < Blocks.end; b++)
+      {
+        const int Start = b*mBlockRows;
+        const int Rows = min(mBlockRows, TotalRows - Start);
+
+        int m = (int)(upper_bound(mOffsets.begin(), mOffsets.end(), Start) - mOffsets.begin()) - 1;
+        int Row = Start - mOffsets[m];
+
+        for (int i = 0; i < Rows; i++)
+        {
+          while (Row >= mDesList[m]->rows)
+          {
+            m++;
+            Row = 0;
+          }
+          const float* pDes =
+            CDescriptorCodec::GetRow(*mDesList[m], *mScaleList[m], Row, &Buffer[0]);
+          mLabels[m][Row] = mTree.FindNearestWord(pDes);
+          Row++;
+        }
+      }
+    }
+
+  private:
+    const vector<const Mat*>& mDesList;
+    const vector<const Mat*>& mScaleList;
+    const vector<int>& mOffsets;
+    const int mBlockRows;
+    const CVocabularyTree& mTree;
+    vector<vector<int> >& mLabels;
+};
+
+//=================================================================================================
+// Description:
+//  Parallel body for batch assignment with the approximate nearest word index. Each block is
+//  searched with a single knnSearch call.
+//=================================================================================================
+class CIndexQuantizeBody : public ParallelLoopBody
+{
+  public:
+    CIndexQuantizeBody(
+      const vector<const Mat*>& DesList,
+      const vector<const Mat*>& ScaleList,
+      const vector<int>& Offsets,
+      int BlockRows,
+      int Length,
+      flann::Index& Index,
+      int Checks,
+      vector<vector<int> >& Labels)
+     : mDesList(DesList),
+       mScaleList(ScaleList),
+       mOffsets(Offsets),
+       mBlockRows(BlockRows),
+       mLength(Length),
+       mIndex(Index),
+       mChecks(Checks),
+       mLabels(Labels)
+    {
+    }
+
+    void operator()(const Range& Blocks) const
+    {
+      const int TotalRows = mOffsets.back();
+
+      Mat Gathered(mBlockRows, mLength, CV_32F);
+      Mat Indices;
+      Mat Dists;
+      vector<int> SourceMat(mBlockRows);
+      vector<int> SourceRow(mBlockRows);
+
+      for (int b = Blocks.start; b < Blocks.end; b++)
+      {
+        const int Start = b*mBlockRows;
+        const int Rows = min(mBlockRows, TotalRows - Start);
+
+        Mat Block = GatherBlock(
+          mDesList, mScaleList, mOffsets, Start, Rows, Gathered, SourceMat, SourceRow);
+
+        mIndex.knnSearch(Block, Indices, Dists, 1, flann::SearchParams(mChecks));
+
+        for (int i = 0; i < Rows; i++)
+        {
+          mLabels[SourceMat[i]][SourceRow[i]] = Indices.at<int>(i,0);
+        }
+      }
+    }
+
+  private:
+    const vector<const Mat*>& mDesList;
+    const vector<const Mat*>& mScaleList;
+    const vector<int>& mOffsets;
+    const int mBlockRows;
+    const int mLength;
+    flann::Index& mIndex;
+    const int mChecks;
+    vector<vector<int> >& mLabels;
+};
+
+//=================================================================================================
+// Description:
+//  Linear scan of binary words (rows of Words) for the one closest to pDes in Hamming distance
+//  (the first one on ties)
+//=================================================================================================
+static int FindNearestHamming(const Mat& Words, const unsigned char* pDes)
+{
+  const int Bytes = Words.cols;
+  int BestDist = INT_MAX;
+  int Best = 0;
+
+  for (int j = 0; (j < Words.rows) && (BestDist > 0); j++)
+  {
+    const int Dist = CWordQuantizer::HammingDistance(pDes, Words.ptr<unsigned char>(j), Bytes);
+    if (Dist < BestDist)
+    {
+      BestDist = Dist;
+      Best = j;
+    }
+  }
+  return Best;
+}
+
+//=================================================================================================
+// Description:
+//  Parallel body for batch assignment of binary descriptors. Blocks cover the same global rows
+//  as CBatchQuantizeBody and every descriptor is scanned against the binary words.
+//=================================================================================================
+class CBinaryQuantizeBody : public ParallelLoopBody
+{
+  public:
+    CBinaryQuantizeBody(
+      const vector<const Mat*>& DesList,
+      const vector<int>& Offsets,
+      int BlockRows,
+      const Mat& Words,
+      vector<vector<int> >& Labels)
+     : mDesList(DesList),
+       mOffsets(Offsets),
+       mBlockRows(BlockRows),
+       mWords(Words),
+       mLabels(Labels)
+    {
+    }
+
+    void operator()(const Range& Blocks) const
+    {
+      const int TotalRows = mOffsets.back();
+
+      for (int b = Blocks.start; b < Blocks.end; b++)
+      {
+        const int Start = b*mBlockRows;
+        const int Rows = min(mBlockRows, TotalRows - Start);
+
+        int m = (int)(upper_bound(mOffsets.begin(), mOffsets.end(), Start) - mOffsets.begin()) - 1;
+        int Row = Start - mOffsets[m];
+
+        for (int i = 0; i < Rows; i++)
+        {
+          while (Row >= mDesList[m]->rows)
+          {
+            m++;
+            Row = 0;
+          }
+          mLabels[m][Row] = FindNearestHamming(mWords, mDesList[m]->ptr<unsigned char>(Row));
+          Row++;
+        }
+      }
+    }
+
+  private:
+    const vector<const Mat*>& mDesList;
+    const vector<int>& mOffsets;
+    const int mBlockRows;
+    const Mat& mWords;
+    vector<vector<int> >& mLabels;
+};
+
+//=================================================================================================
+// Description:
+//  Parallel body for the squared distances between word i and the words after it (j > i),
+//  computed directly with the distance kernel
+//=================================================================================================
+class CPairDistBody : public ParallelLoopBody
+{
+  public:
+    CPairDistBody(const Mat& Words, Mat& PairDist)
+     : mWords(Words),
+       mPairDist(PairDist)
+    {
+    }
+
+    void operator()(const Range& Rows) const
+    {
+      const int Length = mWords.cols;
+
+      for (int i = Rows.start; i < Rows.end; i++)
+      {
+        float* pRow = mPairDist.ptr<float>(i);
+        for (int j = i + 1; j < mWords.rows; j++)
+        {
+          pRow[j] = CWordQuantizer::SquaredDistance(
+            mWords.ptr<float>(i), mWords.ptr<float>(j), Length);
+        }
+      }
+    }
+
+  private:
+    const Mat& mWords;
+    Mat& mPairDist;
+};
+
+//=================================================================================================
+//=================================================================================================
+CWordQuantizer::CWordQuantizer()
+ : mpTree(0),
+   mpIndex(0),
+   mIndexTrees(0),
+   mIndexChecks(32),
+   mDictionaryFingerprint(0),
+   mDimsEvaluated(0),
+   mDimsTotal(0),
+   mWordCount(0),
+   mDescriptorLength(0),
+   mBinary(false)
+{
+}
+
+//=================================================================================================
+//=================================================================================================
+CWordQuantizer::~CWordQuantizer()
+{
+  delete mpIndex;
+}
+
+//=================================================================================================
+//=================================================================================================
+bool CWordQuantizer::SetDictionary(const Mat& Dictionary)
+{
+  if (((Dictionary.type() != CV_32F) && (Dictionary.type() != CV_8U)) ||
+      (Dictionary.rows <= 0) || (Dictionary.cols <= 0))
+  {
+    return false;
+  }
+
+  mpTree = 0;
+  ReleaseIndex();
+
+  // Clone so that the words are guaranteed to be continuous and owned by the quantizer
+  mWords = Dictionary.clone();
+  mWordCount = mWords.rows;
+  mDescriptorLength = mWords.cols;
+  mBinary = (mWords.type() == CV_8U);
+
+  uint64_t Hash = HashBytes(&mWordCount, sizeof(mWordCount));
+  Hash = HashBytes(&mDescriptorLength, sizeof(mDescriptorLength), Hash);
+  Hash = HashBytes(&mBinary, sizeof(mBinary), Hash);
+  mDictionaryFingerprint =
+    HashBytes(mWords.ptr(0), mWordCount*mDescriptorLength*mWords.elemSize(), Hash);
+
+  if (mBinary)
+  {
+    // Norms and pruning tables only apply to Euclidean distances
+    mWordNorms.release();
+    mPairDist.release();
+    mHalfMinDist.release();
+    return true;
+  }
+
+  // Precompute the squared norm of each word for batch assignment
+  mWordNorms = Mat(1, mWordCount, CV_32F);
+  for (int j = 0; j < mWordCount; j++)
+  {
+    const float* pWord = mWords.ptr<float>(j);
+    float Norm = 0;
+    for (int k = 0; k < mDescriptorLength; k++)
+    {
+      Norm += pWord[k]*pWord[k];
+    }
+    mWordNorms.at<float>(0,j) = Norm;
+  }
+
+  UpdateCentroidTables();
+
+  return true;
+}
+
+//=================================================================================================
+//=================================================================================================
+bool CWordQuantizer::SetVocabularyTree(const CVocabularyTree* pTree)
+{
+  if ((pTree == 0) || (pTree->GetWordCount() == 0)) return false;
+
+  // The words are only needed for linear scans
+  ReleaseIndex();
+  mWords.release();
+  mWordNorms.release();
+  mPairDist.release();
+  mHalfMinDist.release();
+
+  mpTree = pTree;
+  mBinary = false;
+  mWordCount = mpTree->GetWordCount();
+  mDescriptorLength = mpTree->GetDescriptorLength();
+  mDictionaryFingerprint = mpTree->GetFingerprint();
+
+  return true;
+}
+
+//=================================================================================================
+//=================================================================================================
+int CWordQuantizer::GetWordCount() const
+{
+  return mWordCount;
+}
+
+//=================================================================================================
+//=================================================================================================
+int CWordQuantizer::GetDescriptorLength() const
+{
+  return mDescriptorLength;
+}
+
+//=================================================================================================
+//=================================================================================================
+bool CWordQuantizer::IsBinary() const
+{
+  return mBinary;
+}
+
+//=================================================================================================
+//=================================================================================================
+float CWordQuantizer::SquaredDistance(const float* pA, const float* pB, int Length)
+{
+  if (UseAvx2Kernels) return CAvx2Kernels::SquaredDistance(pA, pB, Length);
+
+  return SquaredDistanceKernel(pA, pB, Length);
+}
+
+//=================================================================================================
+// Popcount of the XOR, 8 bytes at a time (memcpy keeps the loads legal for unaligned rows)
+//=================================================================================================
+int CWordQuantizer::HammingDistance(const unsigned char* pA, const unsigned char* pB, int Bytes)
+{
+  int Dist = 0;
+  int k = 0;
+
+  for (; k + 8 <= Bytes; k += 8)
+  {
+    uint64_t A;
+    uint64_t B;
+    memcpy(&A, pA + k, sizeof(A));
+    memcpy(&B, pB + k, sizeof(B));
+    Dist += __builtin_popcountll(A ^ B);
+  }
+  for (; k < Bytes; k++)
+  {
+    Dist += __builtin_popcount((unsigned)(pA[k] ^ pB[k]));
+  }
+  return Dist;
+}
+
+//=================================================================================================
+//=================================================================================================
+int CWordQuantizer::FindNearestWordBinary(const unsigned char* pDes) const
+{
+  if (!mBinary) return -1;
+
+  return FindNearestHamming(mWords, pDes);
+}
+
+//=================================================================================================
+//=================================================================================================
+int CWordQuantizer::FindNearestWord(const float* pDes, int Hint) const
+{
+  if (mpTree) return mpTree->FindNearestWord(pDes);
+
+  if (mpIndex)
+  {
+    Mat Query(1, mDescriptorLength, CV_32F, const_cast<float*>(pDes));
+    Mat Indices;
+    Mat Dists;
+    mpIndex->knnSearch(Query, Indices, Dists, 1, flann::SearchParams(mIndexChecks));
+    return Indices.at<int>(0,0);
+  }
+
+  const SWordSearch Search = GetWordSearch(mWords, mPairDist, mHalfMinDist);
+  uint64_t DimsEvaluated = 0;
+  const int Word = FindNearestExact(pDes, Search, Hint, DimsEvaluated);
+
+  mDimsEvaluated += DimsEvaluated;
+  mDimsTotal += (uint64_t)mWordCount*mDescriptorLength;
+
+  return Word;
+}
+
+//=================================================================================================
+//=================================================================================================
+bool CWordQuantizer::Quantize(const Mat& Des, vector<int>& Labels) const
+{
+  return Quantize(Des, Mat(), Labels);
+}
+
+//=================================================================================================
+//=================================================================================================
+bool CWordQuantizer::Quantize(const Mat& Des, const Mat& Scale, vector<int>& Labels) const
+{
+  Labels.clear();
+
+  // Nothing to assign
+  if (Des.rows == 0) return (mWordCount != 0);
+
+  if (mBinary)
+  {
+    if ((Des.type() != CV_8U) || (Des.cols != mDescriptorLength)) return false;
+
+    Labels.resize(Des.rows);
+    for (int i = 0; i < Des.rows; i++)
+    {
+      Labels[i] = FindNearestHamming(mWords, Des.ptr<unsigned char>(i));
+    }
+    return true;
+  }
+
+  if ((mWordCount == 0) || !CDescriptorCodec::IsSupported(Des, Scale) ||
+      (Des.cols != mDescriptorLength))
+  {
+    return false;
+  }
+
+  Labels.resize(Des.rows);
+
+  if (mpTree)
+  {
+    vector<float> Buffer(mDescriptorLength);
+    for (int i = 0; i < Des.rows; i++)
+    {
+      Labels[i] = mpTree->FindNearestWord(CDescriptorCodec::GetRow(Des, Scale, i, &Buffer[0]));
+    }
+    return true;
+  }
+
+  if (mpIndex)
+  {
+    Mat Des32;
+    Mat Indices;
+    Mat Dists;
+    CDescriptorCodec::Decode(Des, Scale, Des32);
+    mpIndex->knnSearch(Des32, Indices, Dists, 1, flann::SearchParams(mIndexChecks));
+
+    for (int i = 0; i < Des.rows; i++)
+    {
+      Labels[i] = Indices.at<int>(i,0);
+    }
+    return true;
+  }
+
+  const SWordSearch Search = GetWordSearch(mWords, mPairDist, mHalfMinDist);
+  uint64_t DimsEvaluated = 0;
+  QuantizePruned(Des, Scale, Search, Labels, DimsEvaluated);
+
+  mDimsEvaluated += DimsEvaluated;
+  mDimsTotal += (uint64_t)Des.rows*mWordCount*mDescriptorLength;
+
+  return true;
+}
+
+//=================================================================================================
+// Keep the block of cross terms (rows x words) at roughly 4 MB so it stays cache friendly
+//=================================================================================================
+int CWordQuantizer::GetBatchBlockRows() const
+{
+  const int MaxCrossTerms = 1 << 20;
+  return max(64, min(4096, MaxCrossTerms/max(mWordCount, 1)));
+}
+
+//=================================================================================================
+//=================================================================================================
+bool CWordQuantizer::QuantizeBatch(const Mat& Des, vector<int>& Labels) const
+{
+  vector<const Mat*> DesList(1, &Des);
+  vector<vector<int> > LabelsList;
+
+  if (!QuantizeBatch(DesList, LabelsList)) return false;
+
+  Labels.swap(LabelsList[0]);
+  return true;
+}
+
+//=================================================================================================
+//=================================================================================================
+bool CWordQuantizer::QuantizeBatch(
+  const vector<const Mat*>& DesList,
+  vector<vector<int> >& Labels) const
+{
+  return QuantizeBatch(DesList, vector<const Mat*>(), Labels);
+}
+
+//=================================================================================================
+//=================================================================================================
+bool CWordQuantizer::QuantizeBatch(
+  const vector<const Mat*>& DesList,
+  const vector<const Mat*>& ScaleList,
+  vector<vector<int> >& Labels) const
+{
+  if (mWordCount == 0) return false;
+
+  if (!ScaleList.empty() && (ScaleList.size() != DesList.size())) return false;
+
+  // fp32 descriptors have no scale
+  const Mat NoScale;
+  const vector<const Mat*> Scales = ScaleList.empty() ?
+    vector<const Mat*>(DesList.size(), &NoScale) : ScaleList;
+
+  // Global row offset of each descriptor matrix (the last element is the total row count)
+  vector<int> Offsets(DesList.size() + 1, 0);
+
+  Labels.resize(DesList.size());
+
+  for (unsigned i = 0; i < DesList.size(); i++)
+  {
+    const Mat& Des = *DesList[i];
+
+    if ((Des.rows > 0) && mBinary && ((Des.type() != CV_8U) || (Des.cols != mDescriptorLength)))
+    {
+      return false;
+    }
+
+    if ((Des.rows > 0) && !mBinary &&
+        (!CDescriptorCodec::IsSupported(Des, *Scales[i]) || (Des.cols != mDescriptorLength)))
+    {
+      return false;
+    }
+
+    Labels[i].assign(Des.rows, 0);
+    Offsets[i+1] = Offsets[i] + Des.rows;
+  }
+
+  const int TotalRows = Offsets.back();
+  if (TotalRows == 0) return true;
+
+  const int BlockRows = GetBatchBlockRows();
+  const int BlockCount = (TotalRows + BlockRows - 1)/BlockRows;
+
+  if (mBinary)
+  {
+    parallel_for_(
+      Range(0, BlockCount), CBinaryQuantizeBody(DesList, Offsets, BlockRows, mWords, Labels));
+    return true;
+  }
+
+  if (mpTree)
+  {
+    parallel_for_(
+      Range(0, BlockCount),
+      CTreeQuantizeBody(DesList, Scales, Offsets, BlockRows, *mpTree, Labels));
+    return true;
+  }
+
+  if (mpIndex)
+  {
+    parallel_for_(
+      Range(0, BlockCount),
+      CIndexQuantizeBody(
+        DesList, Scales, Offsets, BlockRows, mDescriptorLength, *mpIndex, mIndexChecks,
+        Labels));
+    return true;
+  }
+
+  parallel_for_(
+    Range(0, BlockCount),
+    CBatchQuantizeBody(DesList, Scales, Offsets, BlockRows, mWords, mWordNorms, Labels));
+
+  return true;
+}
+
+//=================================================================================================
+// Build a randomized KD-forest over the words
+//=================================================================================================
+bool CWordQuantizer::BuildIndex(int Trees, int Checks)
+{
+  if ((mWords.rows == 0) || mBinary || (Trees <= 0) || (Checks <= 0)) return false;
+
+  ReleaseIndex();
+
+  mpIndex = new flann::Index(mWords, flann::KDTreeIndexParams(Trees));
+  mIndexTrees = Trees;
+  mIndexChecks = Checks;
+
+  return true;
+}
+
+//=================================================================================================
+// Load an index previously written by SaveIndex (built over the same words)
+//=================================================================================================
+bool CWordQuantizer::LoadIndex(const string& FileName, int Trees, int Checks)
+{
+  if ((mWords.rows == 0) || mBinary || (Trees <= 0) || (Checks <= 0)) return false;
+
+  ReleaseIndex();
+
+  mpIndex = new flann::Index();
+  if (!mpIndex->load(mWords, FileName))
+  {
+    ReleaseIndex();
+    return false;
+  }
+  mIndexTrees = Trees;
+  mIndexChecks = Checks;
+
+  return true;
+}
+
+//=================================================================================================
+//=================================================================================================
+bool CWordQuantizer::SaveIndex(const string& FileName) const
+{
+  if (mpIndex == 0) return false;
+
+  mpIndex->save(FileName);
+  return true;
+}
+
+//=================================================================================================
+//=================================================================================================
+void CWordQuantizer::ReleaseIndex()
+{
+  delete mpIndex;
+  mpIndex = 0;
+  mIndexTrees = 0;
+}
+
+//=================================================================================================
+//=================================================================================================
+bool CWordQuantizer::HasIndex() const
+{
+  return (mpIndex != 0);
+}
+
+//=================================================================================================
+//=================================================================================================
+bool CWordQuantizer::HasCentroidTables() const
+{
+  return !mPairDist.empty();
+}
+
+//=================================================================================================
+//=================================================================================================
+int CWordQuantizer::GetIndexTrees() const
+{
+  return mIndexTrees;
+}
+
+//=================================================================================================
+// Fraction of descriptors (rows of Des) for which the index returns the exact nearest word
+//=================================================================================================
+double CWordQuantizer::MeasureIndexRecall(const Mat& Des) const
+{
+  if ((mpIndex == 0) || (Des.rows == 0)) return 1.0;
+
+  vector<int> Labels;
+  if (!Quantize(Des, Labels)) return 0.0;
+
+  const SWordSearch Search = GetWordSearch(mWords, mPairDist, mHalfMinDist);
+  uint64_t DimsEvaluated = 0;
+
+  int Matches = 0;
+  for (int i = 0; i < Des.rows; i++)
+  {
+    const int Exact = FindNearestExact(Des.ptr<float>(i), Search, Labels[i], DimsEvaluated);
+    if (Labels[i] == Exact) Matches++;
+  }
+
+  return (double)Matches/(double)Des.rows;
+}
+
+//=================================================================================================
+//=================================================================================================
+uint64_t CWordQuantizer::GetFingerprint() const
+{
+  if (mpIndex == 0) return mDictionaryFingerprint;
+
+  // Approximate lookups depend on the index settings as well
+  uint64_t Hash = HashBytes(&mIndexTrees, sizeof(mIndexTrees), mDictionaryFingerprint);
+  return HashBytes(&mIndexChecks, sizeof(mIndexChecks), Hash);
+}
+
+//=================================================================================================
+//=================================================================================================
+uint64_t CWordQuantizer::HashBytes(const void* pData, size_t Bytes, uint64_t Hash)
+{
+  const unsigned char* pBytes = static_cast<const unsigned char*>(pData);
+
+  for (size_t i = 0; i < Bytes; i++)
+  {
+    Hash ^= pBytes[i];
+    Hash *= 1099511628211ULL;
+  }
+  return Hash;
+}
+
+//=================================================================================================
+//=================================================================================================
+void CWordQuantizer::GetPruningStats(uint64_t& DimsEvaluated, uint64_t& DimsTotal) const
+{
+  DimsEvaluated = mDimsEvaluated;
+  DimsTotal = mDimsTotal;
+}
+
+//=================================================================================================
+//=================================================================================================
+void CWordQuantizer::ResetPruningStats()
+{
+  mDimsEvaluated = 0;
+  mDimsTotal = 0;
+}
+
+//=================================================================================================
+// Description:
+//  Squared distances between all pairs of words and, for every word, the squared half distance
+//  to its closest other word. The distances are computed directly rather than in the expanded
+//  form ||a||^2 + ||b||^2 - 2*a.b, whose cancellation error is large for close words and would
+//  make the pruning tests unsafe. Only done for dictionaries of up to MaxCentroidTableWords
+//  words (the table grows with the square of the word count).
+//=================================================================================================
+void CWordQuantizer::UpdateCentroidTables()
+{
+  const int MaxCentroidTableWords = 5000;
+
+  mPairDist.release();
+  mHalfMinDist.release();
+
+  if ((mWordCount < 2) || (mWordCount > MaxCentroidTableWords)) return;
+
+  mPairDist = Mat(mWordCount, mWordCount, CV_32F);
+  parallel_for_(Range(0, mWordCount), CPairDistBody(mWords, mPairDist));
+
+  mHalfMinDist = Mat(1, mWordCount, CV_32F);
+  float* pHalfMin = mHalfMinDist.ptr<float>(0);
+
+  for (int i = 0; i < mWordCount; i++)
+  {
+    float* pRow = mPairDist.ptr<float>(i);
+    float MinDist = FLT_MAX;
+
+    // The lower triangle mirrors the rows above
+    for (int j = 0; j < i; j++)
+    {
+      pRow[j] = mPairDist.at<float>(j,i);
+    }
+    pRow[i] = 0;
+
+    for (int j = 0; j < mWordCount; j++)
+    {
+      if ((j != i) && (pRow[j] < MinDist)) MinDist = pRow[j];
+    }
+
+    // (d/2)^2 = d^2/4
+    pHalfMin[i] = 0.25f*MinDist;
+  }
+}
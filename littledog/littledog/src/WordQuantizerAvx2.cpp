@@ -0,0 +1,37 @@
+#include "DistanceKernels.h"
+
+// This file is built with -mavx2 -mfma (see the project's per file compiler flags), so the
+// kernels of DistanceKernels.h compile to their AVX2 versions. Built without them the kernels
+// are the baseline ones and IsAvailable reports false. Only DistanceKernels.h may be included
+// (see there).
+
+//=================================================================================================
+//=================================================================================================
+bool CAvx2Kernels::IsAvailable()
+{
+#if defined(__AVX2__) && defined(__FMA__)
+  static const bool Available =
+    __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+  return Available;
+#else
+  return false;
+#endif
+}
+
+//=================================================================================================
+//=================================================================================================
+float CAvx2Kernels::SquaredDistance(const float* pA, const float* pB, int Length)
+{
+  return SquaredDistanceKernel(pA, pB, Length);
+}
+
+//=================================================================================================
+//=================================================================================================
+int CAvx2Kernels::FindNearestWord(
+  const float* pDes,
+  const SWordSearch& Search,
+  int Hint,
+  uint64_t& DimsEvaluated)
+{
+  return FindNearestPrunedKernel(pDes, Search, Hint, DimsEvaluated);
+}
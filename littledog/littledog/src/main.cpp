@@ -90,6 +90,46 @@ void GenTimingSummaryCsv(
   Os << TestDb.GetEntryCount()                         << "\n";
 }
 
+//=================================================================================================
+// Output one line of the vocabulary sweep timing log. Every time is the incremental cost of this
+// word count (features are only generated for the first one).
+//=================================================================================================
+void GenSweepTimingSummaryCsv(
+  ofstream& Os,
+  const string& TrainDbName,  // Setup file of this word count (TrainDb keeps the first name)
+  const CRecognitionDb& TrainDb,
+  const CRecognitionDb& TestDb,
+  wxTimeSpan FeaturesTime,    // Time it takes to generate features (first word count only)
+  wxTimeSpan DictionaryTime,  // Time it takes to resize the dictionary to this word count
+  wxTimeSpan WordHistTime,    // Time it takes to generate the bag of visual word histograms
+  wxTimeSpan TrainWordTime,   // Time it takes to train the bag of visual words classifier
+  wxTimeSpan WordVerifyTime,  // Time it takes to perform verification using visual words
+  bool WriteHeader)
+{
+  if (WriteHeader)
+  {
+    Os << "Test Database Name, Train Database Name, Word Count, Feature Creation Time (ms),";
+    Os << "Dictionary Creation Time (ms), BOVW Histogram Creation Time (ms),";
+    Os << "BOVW Classifier Training Time (ms), Word Verification Time (ms),";
+    Os << "Total Time (ms), Number of Train Db Entries, Number of Test Db Entries\n";
+  }
+
+  wxTimeSpan TotalTime = FeaturesTime + DictionaryTime + WordHistTime;
+  TotalTime += TrainWordTime + WordVerifyTime;
+
+  Os << TestDb.GetName()                               << ",";
+  Os << TrainDbName                                    << ",";
+  Os << TrainDb.GetWordCount()                         << ",";
+  Os << FeaturesTime.GetMilliseconds().ToString()      << ",";
+  Os << DictionaryTime.GetMilliseconds().ToString()    << ",";
+  Os << WordHistTime.GetMilliseconds().ToString()      << ",";
+  Os << TrainWordTime.GetMilliseconds().ToString()     << ",";
+  Os << WordVerifyTime.GetMilliseconds().ToString()    << ",";
+  Os << TotalTime.GetMilliseconds().ToString()         << ",";
+  Os << TrainDb.GetEntryCount()                        << ",";
+  Os << TestDb.GetEntryCount()                         << "\n";
+}
+
 //=================================================================================================
 // Train three databases using different visual word counts and verify each classifier on a test
 // database
@@ -194,10 +234,124 @@ void WordTest()
 }
 
 //=================================================================================================
+// Same sweep as WordTest with a single training database: features are populated once and each
+// word count is warm-started from the dictionary of the previous one. The word counts are read
+// from the WordTest setup files (the first one also configures the training database).
+//=================================================================================================
+void WordSweepTest()
+{
+  cout << "======================WORD SWEEP TEST=======================\n";
+
+  vector<string> WordTrainSetupFiles;
+  WordTrainSetupFiles.push_back("HomogeneousLittleDogSmallTrain.Words05.xml");
+  WordTrainSetupFiles.push_back("HomogeneousLittleDogSmallTrain.Words10.xml");
+  WordTrainSetupFiles.push_back("HomogeneousLittleDogSmallTrain.Words15.xml");
+  WordTrainSetupFiles.push_back("HomogeneousLittleDogSmallTrain.Words20.xml");
+  WordTrainSetupFiles.push_back("HomogeneousLittleDogSmallTrain.Words25.xml");
+  WordTrainSetupFiles.push_back("HomogeneousLittleDogSmallTrain.Words30.xml");
+
+  ofstream VerifySummaryOs;
+  ofstream TimingSummaryOs;
+  string VerifySummaryLogName = "WordSweepTest.Verify.csv";
+  string TimingSummaryLogName = "WordSweepTest.Timing.csv";
+
+  VerifySummaryOs.open(VerifySummaryLogName.c_str());
+  TimingSummaryOs.open(TimingSummaryLogName.c_str());
+
+  struct CRecognitionDb::SDirs Dirs;
+  Dirs.mDatabaseDir = wxFileName("database/");
+  Dirs.mImageDir    = wxFileName("images/");
+  Dirs.mLogDir      = wxFileName("logs/");
+  Dirs.mSetupDir    = wxFileName("setup/");
+
+  // Word count of each setup file (read straight from the XML, only TrainDb is initialized)
+  vector<unsigned> WordCounts;
+  for (unsigned i = 0; i < WordTrainSetupFiles.size(); i++)
+  {
+    unsigned WordCount;
+    if (!CRecognitionDb::ReadSetupWordCount(Dirs.mSetupDir, WordTrainSetupFiles[i], WordCount))
+    {
+      return;
+    }
+    WordCounts.push_back(WordCount);
+  }
+
+  //Prepare the test dataset (only one)
+  CRecognitionDb TestDb;
+  TestDb.OnInit(Dirs, "HomogeneousLittleDogSmallTest.xml");
+  TestDb.PopulateFeatures();
+
+  CRecognitionDb TrainDb;
+  TrainDb.OnInit(Dirs, WordTrainSetupFiles[0]);
+
+  wxTimeSpan FeaturesTime(0);
+
+  cout << "DATABASE: " << TrainDb.GetName() << " Started\n";
+  cout << "    Populating features...........";
+  TrainDb.PopulateFeatures(FeaturesTime);
+  cout << "Time: " << FeaturesTime.Format("%M:%S:%l") << "\n";
+
+  for (unsigned i = 0; i < WordCounts.size(); i++)
+  {
+    // Time variables (the cost of this word count only)
+    wxTimeSpan DictionaryTime(0);
+    wxTimeSpan WordHistTime(0);
+    wxTimeSpan TrainWordTime(0);
+    wxTimeSpan WordVerifyTime(0);
+
+    cout << "    Resizing dictionary to " << WordCounts[i] << " words..";
+    if (!TrainDb.ResizeDictionary(WordCounts[i], DictionaryTime, WordHistTime)) break;
+    cout << "Time: " << DictionaryTime.Format("%M:%S:%l") << " ";
+    cout << WordHistTime.Format("%M:%S:%l") << "\n";
+
+    cout << "    Training word classifier......";
+    TrainDb.TrainWordClassifier(TrainWordTime);
+    cout << "Time: " << TrainWordTime.Format("%M:%S:%l") << "\n";
+
+    // Classification result variables
+    vector<string> Classify;
+    vector<string> Truth;
+    map<string, unsigned> MatchCount;
+    map<string, unsigned> TruthCount;
+
+    // Self verification (test the trained classifier against itself)
+    TrainDb.ClassifyDbWords(TrainDb, Classify, Truth, MatchCount, TruthCount, TrainWordTime, true);
+
+    // Test verification (test the trained classifier against new images)
+    TrainDb.ClassifyDbWords(TestDb, Classify, Truth, MatchCount, TruthCount, WordVerifyTime, true);
+    TrainDb.GenClassifyDbSummaryCsv(
+      VerifySummaryOs, WordTrainSetupFiles[i], MatchCount, TruthCount, i == 0);
+
+    GenSweepTimingSummaryCsv(
+      TimingSummaryOs, WordTrainSetupFiles[i], TrainDb, TestDb,
+      (i == 0) ? FeaturesTime : wxTimeSpan(0),
+      DictionaryTime,
+      WordHistTime,
+      TrainWordTime,
+      WordVerifyTime, i == 0);
+  }
+  cout << "DATABASE: " << TrainDb.GetName() << " Finished!\n";
+
+  // Clean up
+  TimingSummaryOs.close();
+  VerifySummaryOs.close();
+
+  cout << "============================================================\n";
+}
+
+//=================================================================================================
+// Pass --sweep to build every word count from one set of features (see WordSweepTest)
 //=================================================================================================
-int main(void)
+int main(int argc, char** argv)
 {
-  WordTest();
+  if ((argc > 1) && (strcmp(argv[1], "--sweep") == 0))
+  {
+    WordSweepTest();
+  }
+  else
+  {
+    WordTest();
+  }
 
   // Used to stop windows console from closing
   int SomeUserInput;